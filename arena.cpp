@@ -0,0 +1,85 @@
+#include <new>
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+namespace {
+  // Block contents start this far into the block, which keeps them as
+  // aligned as the block itself
+  const size_t header_size = Arena::max_alignment;
+}
+
+void* Arena::allocate(size_t size, size_t alignment) {
+  assert(alignment <= max_alignment && (alignment & (alignment - 1)) == 0);
+  Block *b = blocks;
+  size_t start = 0;
+  if (b) {
+    start = (b->used + alignment - 1) & ~(alignment - 1);
+    if (start + size > b->size)
+      b = 0;
+  }
+  if (!b) {
+    size_t const capacity = size > block_size ? size : block_size;
+    void *memory;
+    if (posix_memalign(&memory, max_alignment, header_size + capacity) != 0)
+      throw std::bad_alloc();
+    b = static_cast<Block*>(memory);
+    b->size = capacity;
+    b->used = 0;
+    start = 0;
+    if (blocks && size > block_size) {
+      // Keep filling the current block after an oversized one
+      b->next = blocks->next;
+      blocks->next = b;
+    }
+    else {
+      b->next = blocks;
+      blocks = b;
+    }
+  }
+  b->used = start + size;
+  total += size;
+  return reinterpret_cast<char*>(b) + header_size + start;
+}
+
+void Arena::clear() {
+  while (cleanups) {
+    Cleanup *c = cleanups;
+    cleanups = c->next;
+    c->destroy(c->object);
+  }
+  while (blocks) {
+    Block *b = blocks;
+    blocks = b->next;
+    free(b);
+  }
+  total = 0;
+}
+
+void Arena::take(Arena &other) {
+  if (other.cleanups) {
+    Cleanup *last = other.cleanups;
+    while (last->next)
+      last = last->next;
+    last->next = cleanups;
+    cleanups = other.cleanups;
+  }
+  if (other.blocks) {
+    // The current block stays current
+    if (blocks) {
+      Block *last = blocks;
+      while (last->next)
+	last = last->next;
+      last->next = other.blocks;
+    }
+    else {
+      blocks = other.blocks;
+    }
+  }
+  total += other.total;
+  other.cleanups = 0;
+  other.blocks = 0;
+  other.total = 0;
+}
@@ -0,0 +1,130 @@
+#ifndef PATHTRACE_ARENA_H
+#define PATHTRACE_ARENA_H
+
+#include <new>
+#include <cstddef>
+
+/* Memory for the many small objects of a scene: shapes, the children of
+ * constructive solid geometry and materials. Objects are placed one
+ * after another in large blocks, so that objects made together lie
+ * together in memory, and they are all destroyed and freed together with
+ * the arena, a block at a time instead of an object at a time.
+ *
+ * make() and copy() construct objects in the arena, and the arena runs
+ * their destructors when it is cleared, newest first. Objects with
+ * trivial destructors, like plain structs, cost nothing to clear. Objects in an arena
+ * must never be deleted. An arena isn't locked, so only one thread may
+ * add to it at a time. */
+class Arena {
+private:
+  struct Block {
+    Block *next;
+    size_t size;
+    size_t used;
+  };
+
+  /* A destructor to run when the arena is cleared */
+  struct Cleanup {
+    Cleanup *next;
+    void (*destroy)(void *object);
+    void *object;
+  };
+
+  Block *blocks;
+  Cleanup *cleanups;
+  size_t total;
+
+  Arena(Arena const &);
+  Arena& operator=(Arena const &);
+
+  template <class T>
+  static void destroy(void *object) {
+    static_cast<T*>(object)->~T();
+  }
+
+  template <class T>
+  T* manage(T *object) {
+    // Objects without a destructor of their own are only freed
+    if (__has_trivial_destructor(T))
+      return object;
+    Cleanup *c = static_cast<Cleanup*>(allocate(sizeof(Cleanup),
+						__alignof__(Cleanup)));
+    c->next = cleanups;
+    c->destroy = &Arena::destroy<T>;
+    c->object = object;
+    cleanups = c;
+    return object;
+  }
+
+  template <class T>
+  void* place() {
+    return allocate(sizeof(T), __alignof__(T));
+  }
+
+public:
+  // Objects larger than this get a block of their own
+  const static size_t block_size = 64 * 1024;
+  // The largest alignment allocate() can give, enough for AVX vectors
+  const static size_t max_alignment = 32;
+
+  Arena()
+    : blocks(0), cleanups(0), total(0)
+  { }
+
+  ~Arena() {
+    clear();
+  }
+
+  /* Uninitialized memory, which lasts until the arena is cleared. The
+   * alignment must be a power of two up to max_alignment. */
+  void* allocate(size_t size, size_t alignment);
+
+  /* Destroys the objects and frees all the memory */
+  void clear();
+
+  /* Moves everything in other into this arena, leaving other empty. The
+   * objects stay where they are. */
+  void take(Arena &other);
+
+  /* Bytes handed out, including the records of destructors to run */
+  size_t used() const {
+    return total;
+  }
+
+  template <class T>
+  T* copy(T const &original) {
+    return manage(new (place<T>()) T(original));
+  }
+
+  template <class T>
+  T* make() {
+    return manage(new (place<T>()) T());
+  }
+
+  template <class T, class A>
+  T* make(A const &a) {
+    return manage(new (place<T>()) T(a));
+  }
+
+  template <class T, class A, class B>
+  T* make(A const &a, B const &b) {
+    return manage(new (place<T>()) T(a, b));
+  }
+
+  template <class T, class A, class B, class C>
+  T* make(A const &a, B const &b, C const &c) {
+    return manage(new (place<T>()) T(a, b, c));
+  }
+
+  template <class T, class A, class B, class C, class D>
+  T* make(A const &a, B const &b, C const &c, D const &d) {
+    return manage(new (place<T>()) T(a, b, c, d));
+  }
+};
+
+/*
+Local Variables:
+mode:c++
+End:
+*/
+#endif /* PATHTRACE_ARENA_H */
@@ -0,0 +1,804 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "scene.h"
+#include "shapes.h"
+#include "material.h"
+#include "linalg.h"
+#include "random.h"
+#include "packet.h"
+#include "camera.h"
+#include "demo.h"
+#include "mesh.h"
+#include "image.h"
+#include "tracer.h"
+#include "renderer.h"
+#include "denoise.h"
+#include "simd.h"
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static Random rng;
+// Most threads used by the benchmarks that use many
+static int max_threads = 1;
+
+/* One measurement, kept for the machine-readable output */
+struct Result {
+  std::string benchmark, name, metric, unit;
+  double value;
+};
+
+static std::vector<Result> results;
+
+static void record(const char *benchmark, std::string const &name,
+		   const char *metric, double value, const char *unit) {
+  Result r;
+  r.benchmark = benchmark;
+  r.name = name;
+  r.metric = metric;
+  r.unit = unit;
+  r.value = value;
+  results.push_back(r);
+}
+
+static std::string format(const char *fmt, double value) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), fmt, value);
+  return buf;
+}
+
+/* Times rounds runs of work, which does count things, and returns the
+ * median of the rates in things per second. The median keeps a run
+ * disturbed by something else on the machine from showing. */
+template <class Work>
+static double median_rate(Work &work, double count, int rounds = 5) {
+  std::vector<double> rates;
+  for (int r = 0 ; r < rounds ; ++r) {
+    double const start = now();
+    work();
+    rates.push_back(count / (now() - start));
+  }
+  std::sort(rates.begin(), rates.end());
+  return rates[rates.size() / 2];
+}
+
+static double uniform(double min, double max) {
+  return min + (max - min) * rng.uniform();
+}
+
+/* Spheres scattered in a cube whose size grows with the sphere count, so
+ * that the density and thus the typical ray length stays about the
+ * same */
+static void random_spheres(Scene &s, int count) {
+  double const size = cbrt(count) * 2.0;
+  for (int i = 0 ; i < count ; ++i) {
+    Vector3 center(uniform(-size, size), uniform(-size, size),
+		   uniform(-size, size));
+    s.add(Sphere(center, uniform(0.1, 0.5)), Material(Colour(0.5, 0.5, 0.5)));
+  }
+}
+
+static std::vector<Ray> random_rays(int sphere_count, int count) {
+  double const size = cbrt(sphere_count) * 2.0;
+  std::vector<Ray> rays;
+  rays.reserve(count);
+  for (int i = 0 ; i < count ; ++i) {
+    Vector3 origin(uniform(-size, size), uniform(-size, size),
+		   uniform(-size, size));
+    rays.push_back(Ray(origin, Vector3::uniform_random(rng)));
+  }
+  return rays;
+}
+
+static Object const* linear_intersect(Scene const &s, Ray const &ray,
+				      HitRecord &hit) {
+  Object const *hitobj = 0;
+  for (std::vector<Object>::const_iterator i = s.objects.begin() ;
+       i != s.objects.end() ; ++i) {
+    if ((*i).shape->closest(ray, hitobj ? hit.distance : INFINITY, hit))
+      hitobj = &(*i);
+  }
+  return hitobj;
+}
+
+/* Rays per second through the whole scene, with and without the
+ * hierarchy. The linear scan is only timed on a subset of the rays for
+ * large scenes. Both must agree on the number of hits. */
+static void bench_intersect(int sphere_count) {
+  rng.seed(sphere_count, 0);
+  Scene s;
+  random_spheres(s, sphere_count);
+
+  double start = now();
+  s.build();
+  double build_time = now() - start;
+
+  int const ray_count = 200000;
+  std::vector<Ray> rays = random_rays(sphere_count, ray_count);
+
+  int bvh_hits = 0;
+  start = now();
+  for (int i = 0 ; i < ray_count ; ++i) {
+    HitRecord hit;
+    if (s.closest(rays[i], hit)) bvh_hits++;
+  }
+  double bvh_time = now() - start;
+
+  int const linear_count = sphere_count > 100 ? 20000000 / sphere_count :
+    ray_count;
+  int linear_hits = 0, subset_hits = 0;
+  start = now();
+  for (int i = 0 ; i < linear_count ; ++i) {
+    HitRecord hit;
+    if (linear_intersect(s, rays[i], hit)) linear_hits++;
+  }
+  double linear_time = now() - start;
+  for (int i = 0 ; i < linear_count ; ++i) {
+    HitRecord hit;
+    if (s.closest(rays[i], hit)) subset_hits++;
+  }
+
+  printf("%8d %10.1f %14.0f %14.0f %s\n", sphere_count, build_time * 1000,
+	 ray_count / bvh_time, linear_count / linear_time,
+	 linear_hits == subset_hits ? "ok" : "MISMATCH");
+  std::string const name = format("%.0f spheres", sphere_count);
+  record("spheres", name, "build", build_time * 1000, "ms");
+  record("spheres", name, "bvh", ray_count / bvh_time, "rays/s");
+  record("spheres", name, "linear", linear_count / linear_time, "rays/s");
+}
+
+static void bench_spheres() {
+  printf("%8s %10s %14s %14s\n", "spheres", "build ms", "bvh rays/s",
+	 "linear rays/s");
+  bench_intersect(10);
+  bench_intersect(1000);
+  bench_intersect(100000);
+}
+
+/* Camera rays of the demo scene in packets of 2x2 pixels, or 4x2 in the
+ * float build, compared with the same rays one at a time. Both must find
+ * the same objects. */
+static void bench_packets() {
+  Scene s;
+  demo_scene(s);
+  s.build();
+  Camera cam = demo_camera();
+
+  unsigned int const width = 640, height = 480;
+  std::vector<Ray> rays;
+  unsigned int const block_width = RayPacket::size / 2;
+  for (unsigned int y = 0 ; y < height ; y += 2) {
+    for (unsigned int x = 0 ; x < width ; x += block_width) {
+      for (unsigned int i = 0 ; i < RayPacket::size ; ++i) {
+	rays.push_back(cam.get_ray((x + i % block_width + 0.5) / width,
+				   (y + i / block_width + 0.5) / height));
+      }
+    }
+  }
+
+  std::vector<Object const*> single(rays.size()), packed(rays.size());
+  int const rounds = 10;
+  double start = now();
+  for (int r = 0 ; r < rounds ; ++r) {
+    for (unsigned int i = 0 ; i < rays.size() ; ++i) {
+      HitRecord hit;
+      single[i] = s.closest(rays[i], hit);
+    }
+  }
+  double single_time = now() - start;
+
+  start = now();
+  for (int r = 0 ; r < rounds ; ++r) {
+    for (unsigned int i = 0 ; i < rays.size() ; i += RayPacket::size) {
+      RayPacket packet(&rays[i], RayPacket::size);
+      HitRecord hits[RayPacket::size];
+      s.closest(packet, &rays[i], &packed[i], hits);
+    }
+  }
+  double packet_time = now() - start;
+
+  int mismatches = 0;
+  for (unsigned int i = 0 ; i < rays.size() ; ++i) {
+    if (single[i] != packed[i]) mismatches++;
+  }
+  printf("\n%-14s %14s %14s\n", "camera rays", "single rays/s",
+	 "packet rays/s");
+  printf("%-14s %14.0f %14.0f %s\n", "demo scene",
+	 rounds * rays.size() / single_time,
+	 rounds * rays.size() / packet_time,
+	 mismatches == 0 ? "ok" : "MISMATCH");
+  record("packets", "demo scene", "single", rounds * rays.size() / single_time,
+	 "rays/s");
+  record("packets", "demo scene", "packet", rounds * rays.size() / packet_time,
+	 "rays/s");
+}
+
+/* A unit sphere of about two million triangles, written as a binary PLY
+ * file and loaded back, timing the loading and random rays shot at the
+ * sphere from around it. Every ray aimed at the middle must hit. */
+static void bench_mesh() {
+  unsigned int const rings = 1000, segments = 1000;
+  char name[64];
+  snprintf(name, sizeof(name), "/tmp/pathtrace-bench-%d.ply", getpid());
+  FILE *f = fopen(name, "wb");
+  if (!f) {
+    perror(name);
+    return;
+  }
+  unsigned int const vertex_count = (rings + 1) * segments;
+  unsigned int const face_count = rings * segments;
+  fprintf(f, "ply\nformat binary_little_endian 1.0\n"
+	  "element vertex %u\nproperty float x\nproperty float y\n"
+	  "property float z\nelement face %u\n"
+	  "property list uchar int vertex_indices\nend_header\n",
+	  vertex_count, face_count);
+  for (unsigned int r = 0 ; r <= rings ; ++r) {
+    double const theta = M_PI * r / rings;
+    for (unsigned int s = 0 ; s < segments ; ++s) {
+      double const phi = 2 * M_PI * s / segments;
+      float const v[3] = { (float)(sin(theta) * cos(phi)),
+			   (float)(sin(theta) * sin(phi)), (float)cos(theta) };
+      fwrite(v, sizeof(float), 3, f);
+    }
+  }
+  for (unsigned int r = 0 ; r < rings ; ++r) {
+    for (unsigned int s = 0 ; s < segments ; ++s) {
+      int const quad[4] = {
+	(int)(r * segments + s), (int)((r + 1) * segments + s),
+	(int)((r + 1) * segments + (s + 1) % segments),
+	(int)(r * segments + (s + 1) % segments)
+      };
+      fputc(4, f);
+      fwrite(quad, sizeof(int), 4, f);
+    }
+  }
+  fclose(f);
+
+  TriangleMesh mesh;
+  double start = now();
+  bool const ok = mesh.load(name);
+  double const load_time = now() - start;
+  unlink(name);
+  if (!ok) return;
+
+  rng.seed(1, 0);
+  int const ray_count = 200000;
+  std::vector<Ray> rays;
+  rays.reserve(ray_count);
+  for (int i = 0 ; i < ray_count ; ++i) {
+    Vector3 const origin = Vector3::uniform_random(rng) * 3.0;
+    Vector3 direction = Vector3::uniform_random(rng) * 0.5 - origin;
+    direction.normalize();
+    rays.push_back(Ray(origin, direction));
+  }
+  int hits = 0;
+  start = now();
+  for (int i = 0 ; i < ray_count ; ++i) {
+    if (mesh.intersect(rays[i]).is_hit()) hits++;
+  }
+  double const ray_time = now() - start;
+
+  printf("\n%-14s %10s %14s\n", "mesh", "load ms", "rays/s");
+  printf("%-14u %10.1f %14.0f %s\n", mesh.triangle_count(), load_time * 1000,
+	 ray_count / ray_time, hits == ray_count ? "ok" : "MISSED");
+  std::string const mesh_name = format("%.0f triangles",
+				       mesh.triangle_count());
+  record("mesh", mesh_name, "load", load_time * 1000, "ms");
+  record("mesh", mesh_name, "intersect", ray_count / ray_time, "rays/s");
+}
+
+/* The demo scene rendered with a fixed seed, timed and saved as a
+ * checkpoint named after the scalar type of this build (see linalg.h).
+ * If the other build has left its render there, the two are compared
+ * pixel by pixel: the squared difference of the mean luminances over the
+ * sum of their variances averages about one when the builds differ only
+ * by noise, and more if float is biased somewhere. The relative rms
+ * difference alone is mostly the noise of this few passes. */
+static void bench_precision() {
+  Scene s;
+  demo_scene(s);
+  s.build();
+  unsigned int const width = 160, height = 120, passes = 32;
+  Image img(width, height);
+  Tracer tracer(s, demo_camera(), 0);
+  double start = now();
+  for (unsigned int i = 0 ; i < passes ; ++i)
+    tracer.traceImage(img);
+  double const render_time = now() - start;
+
+  bool const is_float = sizeof(real) == sizeof(float);
+  char name[64], other_name[64];
+  snprintf(name, sizeof(name), "/tmp/pathtrace-bench-%s.checkpoint",
+	   is_float ? "float" : "double");
+  snprintf(other_name, sizeof(other_name),
+	   "/tmp/pathtrace-bench-%s.checkpoint",
+	   is_float ? "double" : "float");
+  std::vector<uint64_t> seeds(1, 0);
+  img.write_checkpoint(name, seeds);
+
+  printf("\n%-14s %14s %14s %10s %10s\n", "render", "samples/s",
+	 "compared to", "rms diff", "mean z^2");
+  printf("%-14s %14.0f", is_float ? "float" : "double",
+	 (double)width * height * passes / render_time);
+  record("precision", "demo scene", "render",
+	 (double)width * height * passes / render_time, "samples/s");
+  Image *other = 0;
+  if (access(other_name, R_OK) == 0)
+    other = Image::read_checkpoint(other_name, seeds);
+  if (!other || other->width != width || other->height != height) {
+    printf(" %14s\n", "-");
+    delete other;
+    return;
+  }
+  double diff2 = 0, level2 = 0, z2 = 0;
+  unsigned int pixels = 0;
+  for (unsigned int y = 0 ; y < height ; ++y) {
+    for (unsigned int x = 0 ; x < width ; ++x) {
+      double const a = img.mean(x, y).luminance();
+      double const b = other->mean(x, y).luminance();
+      diff2 += (a - b) * (a - b);
+      level2 += (a + b) * (a + b) / 4;
+      // Differences within the rounding of float are no differences,
+      // even where there is no noise, like on the lights
+      double const rounding = FLT_EPSILON * (a + b);
+      double const v = img.variance(x, y) + other->variance(x, y) +
+	rounding * rounding;
+      if (v > 0 && v != INFINITY) {
+	z2 += (a - b) * (a - b) / v;
+	pixels++;
+      }
+    }
+  }
+  printf(" %14s %10.4f %10.3f\n", is_float ? "double" : "float",
+	 sqrt(diff2 / level2), pixels ? z2 / pixels : 0.0);
+  record("precision", is_float ? "against double" : "against float",
+	 "mean z^2", pixels ? z2 / pixels : 0.0, "");
+  delete other;
+}
+
+/* Converting a 4K image for display: exp and pow for every channel the
+ * way it used to be done, and the tone curve table on one thread and on
+ * every processor. All must give the same bytes but for the rare
+ * rounding onto the other side of a step. */
+static void bench_tonemap() {
+  unsigned int const width = 3840, height = 2160;
+  Image img(width, height);
+  rng.seed(2, 0);
+  for (unsigned int y = 0 ; y < height ; ++y) {
+    for (unsigned int x = 0 ; x < width ; ++x) {
+      img.add(x, y, Colour(rng.uniform(), rng.uniform(), rng.uniform()));
+      img.add(x, y, Colour(rng.uniform(), rng.uniform(), rng.uniform()));
+    }
+  }
+  double const exposure = 1.5;
+  std::vector<unsigned char> scalar(width * height * 3);
+  std::vector<unsigned char> table(scalar.size());
+
+  double start = now();
+  for (unsigned int y = 0 ; y < height ; ++y) {
+    for (unsigned int x = 0 ; x < width ; ++x) {
+      Colourd const col =
+	img.mean(x, y).expose(exposure).to_srgb().to_byte();
+      unsigned char *p = &scalar[(y * width + x) * 3];
+      p[0] = col.r();
+      p[1] = col.g();
+      p[2] = col.b();
+    }
+  }
+  double const scalar_time = now() - start;
+
+  int const rounds = 10;
+  start = now();
+  for (int r = 0 ; r < rounds ; ++r)
+    img.blit_to(&table[0], width * 3, exposure, 1);
+  double const single_time = (now() - start) / rounds;
+
+  int const threads = max_threads;
+  start = now();
+  for (int r = 0 ; r < rounds ; ++r)
+    img.blit_to(&table[0], width * 3, exposure, threads);
+  double const threaded_time = (now() - start) / rounds;
+
+  unsigned int off_by_one = 0, worse = 0;
+  for (unsigned int i = 0 ; i < scalar.size() ; ++i) {
+    int const diff = abs(scalar[i] - table[i]);
+    if (diff == 1) off_by_one++;
+    if (diff > 1) worse++;
+  }
+
+  printf("\n%-14s %10s %10s %10s\n", "tone mapping", "exp ms", "table ms",
+	 "threads ms");
+  printf("%-14s %10.1f %10.1f %10.1f (%d) %s\n", "3840x2160",
+	 scalar_time * 1000, single_time * 1000, threaded_time * 1000,
+	 threads, worse == 0 && off_by_one < scalar.size() / 10000 ?
+	 "ok" : "MISMATCH");
+  record("tonemap", "3840x2160", "exp", scalar_time * 1000, "ms");
+  record("tonemap", "3840x2160", "table", single_time * 1000, "ms");
+  record("tonemap", "3840x2160", "threads", threaded_time * 1000, "ms");
+}
+
+/* Denoising a noisy full HD image of stripes of different depths and
+ * normals, on one thread and on -t threads */
+static void bench_denoise() {
+  unsigned int const width = 1920, height = 1080;
+  Image img(width, height), out(width, height);
+  rng.seed(3, 0);
+  for (unsigned int y = 0 ; y < height ; ++y) {
+    for (unsigned int x = 0 ; x < width ; ++x) {
+      unsigned int const stripe = x / 64;
+      Features f;
+      f.albedo = Colourd(0.2 + 0.1 * (stripe % 7), 0.5, 0.7);
+      f.normal = stripe % 2 ? Vector3d(0, 0, -1) : Vector3d(0, -0.6, -0.8);
+      f.depth = 1 + stripe % 5;
+      for (int i = 0 ; i < 4 ; ++i)
+	img.add(x, y, Colour(rng.uniform(), rng.uniform(), rng.uniform()), f);
+    }
+  }
+
+  Denoiser denoiser;
+  int const rounds = 3;
+  double start = now();
+  for (int r = 0 ; r < rounds ; ++r)
+    denoiser.run(img, out, 1);
+  double const single_time = (now() - start) / rounds;
+
+  int const threads = max_threads;
+  start = now();
+  for (int r = 0 ; r < rounds ; ++r)
+    denoiser.run(img, out, threads);
+  double const threaded_time = (now() - start) / rounds;
+
+  printf("\n%-14s %10s %10s\n", "denoising", "single ms", "threads ms");
+  printf("%-14s %10.1f %10.1f (%d)\n", "1920x1080", single_time * 1000,
+	 threaded_time * 1000, threads);
+  record("denoise", "1920x1080", "single", single_time * 1000, "ms");
+  record("denoise", "1920x1080", "threads", threaded_time * 1000, "ms");
+}
+
+/* Rays from around the origin towards random points near it, for
+ * timing single shapes and materials */
+static std::vector<Ray> rays_at_origin(unsigned int count) {
+  std::vector<Ray> rays;
+  for (unsigned int i = 0 ; i < count ; ++i) {
+    Vector3 const from = Vector3::uniform_random(rng) * 3;
+    Vector3 direction = Vector3::uniform_random(rng) * 0.5 - from;
+    direction.normalize();
+    rays.push_back(Ray(from, direction));
+  }
+  return rays;
+}
+
+struct ShapeWork {
+  Shape const &shape;
+  std::vector<Ray> const &rays;
+  unsigned int hits;
+
+  ShapeWork(Shape const &shape, std::vector<Ray> const &rays)
+    : shape(shape), rays(rays), hits(0)
+  { }
+
+  void operator()() {
+    hits = 0;
+    for (unsigned int i = 0 ; i < rays.size() ; ++i) {
+      if (shape.intersect(rays[i]).is_hit())
+	hits++;
+    }
+  }
+};
+
+/* Intersecting one shape of each kind, without the BVH in the way */
+static void bench_shapes() {
+  rng.seed(3, 0);
+  std::vector<Ray> const rays = rays_at_origin(100000);
+  Sphere const sphere(Vector3(0, 0, 0), 0.5);
+  Plane const plane(Vector3(0, 0, 0), Vector3(0, 0.6, 0.8));
+  Difference const difference(sphere, Sphere(Vector3(0.3, 0.2, 0.1), 0.4));
+  struct {
+    const char *name;
+    Shape const &shape;
+  } const shapes[] = {
+    { "sphere", sphere },
+    { "plane", plane },
+    { "difference", difference },
+  };
+
+  printf("\n%-14s %14s %10s\n", "shape", "rays/s", "hits %");
+  for (unsigned int i = 0 ; i < sizeof(shapes) / sizeof(shapes[0]) ; ++i) {
+    ShapeWork work(shapes[i].shape, rays);
+    double const rate = median_rate(work, rays.size());
+    printf("%-14s %14.0f %10.1f\n", shapes[i].name, rate,
+	   100.0 * work.hits / rays.size());
+    record("shapes", shapes[i].name, "intersect", rate, "rays/s");
+  }
+}
+
+struct BounceWork {
+  Material const &material;
+  std::vector<Ray> const &rays;
+  Vector3 const normal;
+  RandomSampler sampler;
+  double sum;
+
+  BounceWork(Material const &material, std::vector<Ray> const &rays)
+    : material(material), rays(rays), normal(0, 0, 1), sum(0)
+  { }
+
+  void operator()() {
+    sum = 0;
+    for (unsigned int i = 0 ; i < rays.size() ; ++i) {
+      Ray const out = material.bounce(rays[i], normal, 1.0, sampler);
+      sum += out.direction.z;
+    }
+  }
+};
+
+/* Bounces off each kind of material, from directions that hit the
+ * surface from above. Glass and films go with and without their
+ * tables. */
+static void bench_materials() {
+  rng.seed(4, 0);
+  std::vector<Ray> rays;
+  for (unsigned int i = 0 ; i < 100000 ; ++i) {
+    Vector3 d = Vector3::uniform_random(rng);
+    if (d.z > 0) d.z = -d.z;
+    d.normalize();
+    rays.push_back(Ray(-d, d));
+  }
+  Material const diffuse(Colour(0.8, 0.8, 0.8));
+  Chrome const chrome(Colour(0.9, 0.9, 0.9));
+  Glass const glass_exact(Colour(1.0, 1.0, 1.0), 1.5, 0.0);
+  Film const film_exact(400e-9, 1.33, 0.01);
+  // With the tables a scene makes when it is built
+  Glass glass(glass_exact);
+  Film film(film_exact);
+  glass.compile();
+  film.compile();
+  struct {
+    const char *name;
+    Material const &material;
+  } const materials[] = {
+    { "diffuse", diffuse },
+    { "chrome", chrome },
+    { "glass", glass },
+    { "glass exact", glass_exact },
+    { "film", film },
+    { "film exact", film_exact },
+  };
+
+  printf("\n%-14s %14s\n", "material", "bounces/s");
+  for (unsigned int i = 0 ; i < sizeof(materials) / sizeof(materials[0]) ;
+       ++i) {
+    BounceWork work(materials[i].material, rays);
+    double const rate = median_rate(work, rays.size());
+    printf("%-14s %14.0f\n", materials[i].name, rate);
+    record("materials", materials[i].name, "bounce", rate, "bounces/s");
+  }
+}
+
+struct TraceWork {
+  Tracer &tracer;
+  std::vector<Ray> const &rays;
+  Colourd sum;
+
+  TraceWork(Tracer &tracer, std::vector<Ray> const &rays)
+    : tracer(tracer), rays(rays)
+  { }
+
+  void operator()() {
+    for (unsigned int i = 0 ; i < rays.size() ; ++i)
+      sum += tracer.trace(rays[i]);
+  }
+};
+
+/* Whole paths through the demo scene on one thread, from camera rays
+ * spread over the image, with red, green and blue light and with light
+ * at sampled wavelengths */
+static void bench_trace() {
+  Scene s;
+  demo_scene(s);
+  s.build();
+  Camera cam = demo_camera();
+  unsigned int const width = 160, height = 120;
+  std::vector<Ray> rays;
+  for (unsigned int y = 0 ; y < height ; ++y) {
+    for (unsigned int x = 0 ; x < width ; ++x)
+      rays.push_back(cam.get_ray((x + 0.5) / width, (y + 0.5) / height));
+  }
+
+  printf("\n%-14s %14s\n", "paths", "paths/s");
+  for (int spectral = 0 ; spectral < 2 ; ++spectral) {
+    Tracer tracer(s, cam, 0);
+    tracer.set_spectral(spectral);
+    TraceWork work(tracer, rays);
+    double const rate = median_rate(work, rays.size());
+    const char *name = spectral ? "demo spectral" : "demo scene";
+    printf("%-14s %14.0f\n", name, rate);
+    record("trace", name, "paths", rate, "paths/s");
+  }
+}
+
+/* The renderer on the demo scene with one thread, two, four and so on
+ * up to max_threads. On a machine with fewer processors than threads,
+ * the speedup shows the cost of the extra threads instead. */
+static void bench_scaling() {
+  Scene s;
+  demo_scene(s);
+  s.build();
+  unsigned int const width = 320, height = 240;
+  int const passes = 4;
+  Tracer tracer(s, demo_camera(), 0);
+
+  printf("\n%-14s %14s %10s\n", "threads", "samples/s", "speedup");
+  double single = 0;
+  for (int threads = 1 ; ; threads *= 2) {
+    if (threads > max_threads)
+      threads = max_threads;
+    Renderer renderer(tracer, width, height, threads, passes);
+    double const start = now();
+    renderer.start();
+    renderer.wait();
+    double const rate = (double)width * height * passes / (now() - start);
+    if (threads == 1)
+      single = rate;
+    printf("%-14d %14.0f %10.2f\n", threads, rate, rate / single);
+    std::string const name = format("%.0f threads", threads);
+    record("scaling", name, "render", rate, "samples/s");
+    record("scaling", name, "speedup", rate / single, "");
+    if (threads == max_threads)
+      break;
+  }
+}
+
+static const struct {
+  const char *name;
+  void (*run)();
+  const char *description;
+} benchmarks[] = {
+  { "spheres", bench_spheres, "BVH and linear search over random spheres" },
+  { "packets", bench_packets, "single rays and packets of camera rays" },
+  { "mesh", bench_mesh, "loading and intersecting a large PLY mesh" },
+  { "shapes", bench_shapes, "sphere, plane and difference intersections" },
+  { "materials", bench_materials, "bounces off each kind of material" },
+  { "trace", bench_trace, "whole paths through the demo scene" },
+  { "scaling", bench_scaling, "renderer speedup from 1 to -t threads" },
+  { "precision", bench_precision, "render speed and float/double difference" },
+  { "tonemap", bench_tonemap, "tone mapping a 4K image" },
+  { "denoise", bench_denoise, "denoising a full HD image" },
+};
+
+static const unsigned int benchmark_count =
+  sizeof(benchmarks) / sizeof(benchmarks[0]);
+
+/* The string quoted for JSON. The names are plain ASCII, but the
+ * compiler version might have anything. */
+static std::string json_string(std::string const &s) {
+  std::string quoted = "\"";
+  for (unsigned int i = 0 ; i < s.size() ; ++i) {
+    unsigned char const c = s[i];
+    if (c == '"' || c == '\\') {
+      quoted += '\\';
+      quoted += c;
+    }
+    else if (c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      quoted += buf;
+    }
+    else
+      quoted += c;
+  }
+  return quoted + "\"";
+}
+
+static bool write_json(const char *filename) {
+  FILE *f = fopen(filename, "w");
+  if (!f)
+    return false;
+  fprintf(f, "{\n  \"precision\": %s,\n  \"simd\": %s,\n"
+	  "  \"compiler\": %s,\n  \"threads\": %d,\n  \"results\": [",
+	  sizeof(real) == sizeof(float) ? "\"float\"" : "\"double\"",
+	  json_string(Double4::name()).c_str(),
+	  json_string(__VERSION__).c_str(), max_threads);
+  for (unsigned int i = 0 ; i < results.size() ; ++i) {
+    Result const &r = results[i];
+    // %.17g would be exact, but nobody needs a rate to 17 digits
+    fprintf(f, "%s\n    {\"benchmark\": %s, \"name\": %s, \"metric\": %s, "
+	    "\"value\": %.6g, \"unit\": %s}", i ? "," : "",
+	    json_string(r.benchmark).c_str(), json_string(r.name).c_str(),
+	    json_string(r.metric).c_str(), r.value,
+	    json_string(r.unit).c_str());
+  }
+  fprintf(f, "\n  ]\n}\n");
+  return fclose(f) == 0;
+}
+
+static bool write_csv(const char *filename) {
+  FILE *f = fopen(filename, "w");
+  if (!f)
+    return false;
+  // None of the fields has a comma or a quote in it
+  fprintf(f, "benchmark,name,metric,value,unit\n");
+  for (unsigned int i = 0 ; i < results.size() ; ++i) {
+    Result const &r = results[i];
+    fprintf(f, "%s,%s,%s,%.6g,%s\n", r.benchmark.c_str(), r.name.c_str(),
+	    r.metric.c_str(), r.value, r.unit.c_str());
+  }
+  return fclose(f) == 0;
+}
+
+static void usage(const char *program) {
+  fprintf(stderr, "Usage: %s [-j results.json] [-c results.csv] "
+	  "[-t threads] [benchmark...]\n\n"
+	  "Runs the named benchmarks, or all of them:\n", program);
+  for (unsigned int i = 0 ; i < benchmark_count ; ++i)
+    fprintf(stderr, "  %-12s %s\n", benchmarks[i].name,
+	    benchmarks[i].description);
+}
+
+int main(int argc, char **argv) {
+  const char *json = 0, *csv = 0;
+  max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+  while ((opt = getopt(argc, argv, "j:c:t:h")) != -1) {
+    switch (opt) {
+    case 'j':
+      json = optarg;
+      break;
+    case 'c':
+      csv = optarg;
+      break;
+    case 't':
+      max_threads = atoi(optarg);
+      if (max_threads < 1) {
+	fprintf(stderr, "%s: bad thread count\n", optarg);
+	return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (max_threads < 1)
+    max_threads = 1;
+
+  std::vector<bool> run(benchmark_count, optind == argc);
+  for (int i = optind ; i < argc ; ++i) {
+    unsigned int b = 0;
+    while (b < benchmark_count && strcmp(argv[i], benchmarks[b].name) != 0)
+      ++b;
+    if (b == benchmark_count) {
+      fprintf(stderr, "%s: no such benchmark\n", argv[i]);
+      usage(argv[0]);
+      return 1;
+    }
+    run[b] = true;
+  }
+
+  for (unsigned int i = 0 ; i < benchmark_count ; ++i) {
+    if (run[i])
+      benchmarks[i].run();
+  }
+
+  if (json && !write_json(json)) {
+    perror(json);
+    return 1;
+  }
+  if (csv && !write_csv(csv)) {
+    perror(csv);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,230 @@
+#include <vector>
+#include <algorithm>
+
+#include <assert.h>
+
+#include "bvh.h"
+#include "linalg.h"
+
+namespace {
+  const int bin_count = 16;
+  const unsigned int max_leaf_size = 4;
+  // Cost of visiting a node relative to one primitive intersection
+  const double traversal_cost = 1.0;
+
+  struct Bin {
+    Box box;
+    unsigned int count;
+
+    Bin()
+      : box(), count(0)
+    { }
+  };
+
+  struct InBin {
+    std::vector<Vector3> const &centroids;
+    int axis, split;
+    double min, scale;
+
+    InBin(std::vector<Vector3> const &centroids, int axis, int split,
+	  double min, double scale)
+      : centroids(centroids), axis(axis), split(split), min(min),
+	scale(scale)
+    { }
+
+    bool operator()(unsigned int index) const {
+      int bin = (int)((centroids[index][axis] - min) * scale);
+      if (bin >= bin_count) bin = bin_count - 1;
+      return bin < split;
+    }
+  };
+
+  struct ByCentroid {
+    std::vector<Vector3> const &centroids;
+    int axis;
+
+    ByCentroid(std::vector<Vector3> const &centroids, int axis)
+      : centroids(centroids), axis(axis)
+    { }
+
+    bool operator()(unsigned int a, unsigned int b) const {
+      return centroids[a][axis] < centroids[b][axis];
+    }
+  };
+
+  // Halving takes any number of primitives down to one in this many levels
+  const int median_levels = 32;
+}
+
+void Bvh::build(std::vector<Box> const &boxes) {
+  nodes.clear();
+  indices.resize(boxes.size());
+  if (boxes.empty()) return;
+
+  std::vector<Vector3> centroids(boxes.size());
+  for (unsigned int i = 0 ; i < boxes.size() ; ++i) {
+    indices[i] = i;
+    centroids[i] = boxes[i].centroid();
+  }
+  nodes.reserve(2 * boxes.size());
+  build_node(boxes, centroids, 0, boxes.size(), 0);
+}
+
+unsigned int Bvh::build_node(std::vector<Box> const &boxes,
+			     std::vector<Vector3> const &centroids,
+			     unsigned int begin, unsigned int end,
+			     int depth) {
+  unsigned int const index = nodes.size();
+  nodes.push_back(BvhNode());
+
+  Box box, centroid_box;
+  for (unsigned int i = begin ; i < end ; ++i) {
+    box.extend(boxes[indices[i]]);
+    centroid_box.extend(centroids[indices[i]]);
+  }
+  nodes[index].box = box;
+  nodes[index].offset = begin;
+  nodes[index].count = end - begin;
+  nodes[index].axis = 0;
+
+  unsigned int const count = end - begin;
+  if (count <= 1)
+    return index;
+
+  // Deep down, skewed splits could take the hierarchy past what the
+  // traversal stack holds. Halving from here stays within it, as inner
+  // nodes may be at most max_depth - 2 deep, like fits() checks.
+  if (depth >= max_depth - 1 - median_levels) {
+    if (count <= max_leaf_size)
+      return index;
+    int axis = 0;
+    Vector3 const extent = centroid_box.max - centroid_box.min;
+    if (extent[1] > extent[axis]) axis = 1;
+    if (extent[2] > extent[axis]) axis = 2;
+    unsigned int const middle = begin + count / 2;
+    std::nth_element(indices.begin() + begin, indices.begin() + middle,
+		     indices.begin() + end, ByCentroid(centroids, axis));
+    build_node(boxes, centroids, begin, middle, depth + 1);
+    unsigned int const second =
+      build_node(boxes, centroids, middle, end, depth + 1);
+    nodes[index].offset = second;
+    nodes[index].count = 0;
+    nodes[index].axis = axis;
+    return index;
+  }
+
+  // Find the cheapest split between bins along any axis
+  int best_axis = -1, best_split = 0;
+  double best_cost = INFINITY;
+  for (int axis = 0 ; axis < 3 ; ++axis) {
+    double const min = centroid_box.min[axis];
+    double const extent = centroid_box.max[axis] - min;
+    if (extent <= 0.0) continue;
+    double const scale = bin_count / extent;
+
+    Bin bins[bin_count];
+    for (unsigned int i = begin ; i < end ; ++i) {
+      int bin = (int)((centroids[indices[i]][axis] - min) * scale);
+      if (bin >= bin_count) bin = bin_count - 1;
+      bins[bin].count++;
+      bins[bin].box.extend(boxes[indices[i]]);
+    }
+
+    // Sweep from the right to get the cost of each right side
+    double right_area[bin_count];
+    unsigned int right_count[bin_count];
+    Box right;
+    unsigned int right_n = 0;
+    for (int i = bin_count - 1 ; i > 0 ; --i) {
+      right.extend(bins[i].box);
+      right_n += bins[i].count;
+      right_area[i] = right.surface_area();
+      right_count[i] = right_n;
+    }
+
+    Box left;
+    unsigned int left_n = 0;
+    for (int split = 1 ; split < bin_count ; ++split) {
+      left.extend(bins[split - 1].box);
+      left_n += bins[split - 1].count;
+      if (left_n == 0 || right_count[split] == 0) continue;
+      double cost = left.surface_area() * left_n +
+	right_area[split] * right_count[split];
+      if (cost < best_cost) {
+	best_cost = cost;
+	best_axis = axis;
+	best_split = split;
+      }
+    }
+  }
+
+  unsigned int middle;
+  if (best_axis < 0) {
+    // All centroids coincide. Split by count if the leaf would be too big.
+    if (count <= max_leaf_size && count <= 0xffff)
+      return index;
+    middle = begin + count / 2;
+    best_axis = 0;
+  }
+  else {
+    double const area = box.surface_area();
+    double const split_cost = traversal_cost +
+      (area > 0.0 ? best_cost / area : 0.0);
+    if (count <= max_leaf_size && split_cost >= count)
+      return index;
+
+    double const min = centroid_box.min[best_axis];
+    double const scale =
+      bin_count / (centroid_box.max[best_axis] - min);
+    middle = std::partition(indices.begin() + begin, indices.begin() + end,
+			    InBin(centroids, best_axis, best_split,
+				  min, scale)) - indices.begin();
+    if (middle == begin || middle == end)
+      middle = begin + count / 2;
+  }
+
+  build_node(boxes, centroids, begin, middle, depth + 1);
+  unsigned int const second =
+    build_node(boxes, centroids, middle, end, depth + 1);
+  nodes[index].offset = second;
+  nodes[index].count = 0;
+  nodes[index].axis = best_axis;
+  return index;
+}
+
+bool Bvh::fits(unsigned int count) const {
+  if (indices.size() != count)
+    return false;
+  for (unsigned int i = 0 ; i < count ; ++i) {
+    if (indices[i] >= count)
+      return false;
+  }
+  if (nodes.empty())
+    return count == 0;
+
+  // Children come after their parents, so one pass in order can check
+  // that every node is reached exactly once and not too deep for the
+  // traversal stack. Depths are stored plus one, zero is unreached.
+  std::vector<unsigned char> depth(nodes.size(), 0);
+  depth[0] = 1;
+  for (unsigned int i = 0 ; i < nodes.size() ; ++i) {
+    BvhNode const &node = nodes[i];
+    if (depth[i] == 0)
+      return false;
+    if (node.count > 0) {
+      if (node.offset > count || node.count > count - node.offset)
+	return false;
+      continue;
+    }
+    unsigned int const children[2] = { i + 1, node.offset };
+    if (node.axis > 2 || depth[i] >= max_depth)
+      return false;
+    for (int k = 0 ; k < 2 ; ++k) {
+      unsigned int const c = children[k];
+      if (c <= i || c >= nodes.size() || depth[c] != 0)
+	return false;
+      depth[c] = depth[i] + 1;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,146 @@
+#ifndef PATHTRACE_BVH_H
+#define PATHTRACE_BVH_H
+
+#include <vector>
+#include <assert.h>
+
+#include "linalg.h"
+#include "simd.h"
+#include "packet.h"
+
+/* One node of a flattened bounding volume hierarchy. Nodes are stored
+ * depth first, so the first child of an inner node is always the node
+ * right after it. The padding makes a node exactly one cache line, or
+ * half of one when the box is float. */
+struct BvhNode {
+  Box box;
+  // Leaf: index of the first primitive in Bvh::indices.
+  // Inner node: index of the second child.
+  unsigned int offset;
+  // Number of primitives in a leaf, zero for inner nodes
+  unsigned short count;
+  // Split axis of an inner node, used to visit the nearer child first
+  unsigned short axis;
+#ifndef PATHTRACE_FLOAT
+  char padding[8];
+#endif
+};
+
+class Bvh {
+private:
+  unsigned int build_node(std::vector<Box> const &boxes,
+			  std::vector<Vector3> const &centroids,
+			  unsigned int begin, unsigned int end, int depth);
+
+public:
+  const static int max_depth = 128;
+
+  std::vector<BvhNode> nodes;
+  // Primitive indices, in the order the leaves refer to them
+  std::vector<unsigned int> indices;
+
+  /* Builds the hierarchy using the surface area heuristic. The primitive
+   * indices used later are the indices of the boxes given here. */
+  void build(std::vector<Box> const &boxes);
+
+  bool empty() const {
+    return nodes.empty();
+  }
+
+  /* Whether the nodes and indices make a hierarchy over count primitives
+   * that can be traversed safely. For checking hierarchies read from
+   * files instead of built. */
+  bool fits(unsigned int count) const;
+
+  /* Calls isect.leaf(first, count) for every leaf whose box is hit by
+   * the ray closer than isect.max_distance(). The leaf holds primitives
+   * indices[first] to indices[first + count - 1]. The intersector is
+   * expected to lower its max_distance() as it finds hits, and leaf()
+   * may return true to end the traversal early. */
+  template <class Intersector>
+  void traverse(Ray const &ray, Intersector &isect) const {
+    if (nodes.empty()) return;
+    // The boxes are tested in real, which in the float build moves the
+    // ray by the rounding of its origin. Primitives are still tested with
+    // the ray as it is.
+    Vector3 const origin(ray.origin);
+    Vector3 const inv_dir(1 / ray.direction.x, 1 / ray.direction.y,
+			  1 / ray.direction.z);
+    bool const negative[3] = { inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0 };
+
+    unsigned int stack[max_depth];
+    int top = 0;
+    unsigned int current = 0;
+    for (;;) {
+      BvhNode const &node = nodes[current];
+      if (node.box.hit(origin, inv_dir, isect.max_distance())) {
+	if (node.count > 0) {
+	  if (isect.leaf(node.offset, node.count))
+	    return;
+	}
+	else {
+	  assert(top < max_depth);
+	  if (negative[node.axis]) {
+	    stack[top++] = current + 1;
+	    current = node.offset;
+	  }
+	  else {
+	    stack[top++] = node.offset;
+	    current = current + 1;
+	  }
+	  continue;
+	}
+      }
+      if (top == 0) break;
+      current = stack[--top];
+    }
+  }
+
+  /* Packet version of traverse(): visits the leaves hit by any ray of the
+   * packet, and isect.max_distance() gives the limit for each lane. The
+   * nearer child is chosen by the direction of the first active ray. */
+  template <class Intersector>
+  void traverse(RayPacket const &packet, Intersector &isect) const {
+    if (nodes.empty() || !packet.active) return;
+    int const first = packet.active & -packet.active;
+    bool const negative[3] = {
+      (RealLanes::bits(packet.dx < RealLanes(0.0)) & first) != 0,
+      (RealLanes::bits(packet.dy < RealLanes(0.0)) & first) != 0,
+      (RealLanes::bits(packet.dz < RealLanes(0.0)) & first) != 0
+    };
+
+    unsigned int stack[max_depth];
+    int top = 0;
+    unsigned int current = 0;
+    for (;;) {
+      BvhNode const &node = nodes[current];
+      if (packet.hits(node.box, isect.max_distance())) {
+	if (node.count > 0) {
+	  if (isect.leaf(node.offset, node.count))
+	    return;
+	}
+	else {
+	  assert(top < max_depth);
+	  if (negative[node.axis]) {
+	    stack[top++] = current + 1;
+	    current = node.offset;
+	  }
+	  else {
+	    stack[top++] = node.offset;
+	    current = current + 1;
+	  }
+	  continue;
+	}
+      }
+      if (top == 0) break;
+      current = stack[--top];
+    }
+  }
+};
+
+/*
+Local Variables:
+mode:c++
+End:
+*/
+#endif /* PATHTRACE_BVH_H */
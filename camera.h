@@ -7,9 +7,10 @@ class Camera {
 private:
   Vector3 origin, topleft, topright, bottomleft;
   Vector3 xd, yd;
-  Vector3 dof_origin;
-  double plane_x, plane_y;
   double focus, aperture;
+  // How far a point on the image plane moves with the lens position to
+  // stay in focus, as a fraction of the lens position
+  double focus_shift;
 
 public:
   Camera(Vector3 const &origin, Vector3 const &topleft,
@@ -19,10 +20,23 @@ public:
       topright(topright), bottomleft(bottomleft),
       xd(topright - topleft), yd(bottomleft - topleft),
       focus(focus), aperture(aperture)
-  { }
+  {
+    double const plane_dist =
+      ((topleft + xd * 0.5 + yd * 0.5) - origin).length();
+    focus_shift = focus != 0 ? (focus - plane_dist) / focus : 0;
+  }
 
-  Ray get_ray(double x, double y);
-  void paint_start();
+  Vector3 const& get_origin() const { return origin; }
+  Vector3 const& get_topleft() const { return topleft; }
+  Vector3 const& get_topright() const { return topright; }
+  Vector3 const& get_bottomleft() const { return bottomleft; }
+  double get_focus() const { return focus; }
+  double get_aperture() const { return aperture; }
+
+  /* The ray through the point (x, y) of the image, both from 0 to 1,
+   * starting from the point (lens_u, lens_v) of the lens, also from 0
+   * to 1. The lens position (0, 0) is its center. */
+  Ray get_ray(double x, double y, double lens_u = 0, double lens_v = 0) const;
 };
 
 
@@ -0,0 +1,46 @@
+#include "demo.h"
+#include "tracer.h"
+#include "shapes.h"
+#include "material.h"
+#include "camera.h"
+
+void demo_scene(Scene &s) {
+  //s.add(Sphere(Vector3(1.0, 1.6, 0.0), 0.5),
+  //	Glass(Colour(0.5, 0.9, 0.99), 1.52, 0.01));
+  s.add(Sphere(Vector3(1.0, 1.6, 0.0), 0.5),
+	Film(400e-9, 1.33, 0.01));
+  s.add(Difference(Sphere(Vector3(-1.1, 2.8, 0.0), 0.5),
+		   Sphere(Vector3(-0.8, 2.6, 0.1), 0.5)),
+	Material(Colour(0.8, 0.8, 0.8), 0.01));
+  for (int i = 0 ; i < 4 ; ++i) {
+    s.add(Sphere(Vector3(-1.1 + i * 0.7, 1.4 + i * 0.5, -0.25), 0.25),
+	  Material(Colour(0.96, 0.65, 0.55), 0.04));
+  }
+  s.add(Sphere(Vector3(0.4, 0.6, -0.40), 0.10),
+	Material(Colour(0.96, 0.65, 0.55), 0.04));
+
+  s.add(Plane(Vector3(0.0, 3.5, -0.5), Vector3(0, 0, 1)),
+	Material(Colour(0.9, 0.9, 0.9)));
+  s.add(Plane(Vector3(0.0, 4.5, 0.0), Vector3(0, -1, 0)),
+	Material(Colour(0.9, 0.9, 0.9))); //takaseinä
+  s.add(Plane(Vector3(-1.9, 3.5, 0.0), Vector3(1, 0, 0)),
+	Material(Colour(0.9, 0.5, 0.5)));
+  s.add(Plane(Vector3(1.9, 3.5, 0.0), Vector3(-1, 0, 0)),
+	Material(Colour(0.5, 0.5, 0.9)));
+  s.add(Plane(Vector3(0.0, 0.0, 2.5), Vector3(0, 0, -1)),
+	Material(Colour(0.0, 0.0, 0.0),
+		 Colour(126, 116, 102) * 0.25));
+  s.add(Plane(Vector3(0.0, -2.5, 0.0), Vector3(0, 1, 0)),
+	Material(Colour(0.9, 0.9, 0.9)));
+
+  //s.mean_free_path = 10.0;
+}
+
+Camera demo_camera() {
+  Camera cam(Vector3(0.0, -0.5, 0.0),
+	     Vector3(-1.3, 1.0, 1.0),
+	     Vector3(1.3, 1.0, 1.0),
+	     Vector3(-1.3, 1.0, -1.0),
+	     4.0, 0.015);
+  return cam;
+}
@@ -0,0 +1,17 @@
+#ifndef PATHTRACE_DEMO_H
+#define PATHTRACE_DEMO_H
+
+#include "tracer.h"
+#include "camera.h"
+
+/* The example scene: a box with an emissive ceiling, a thin-film bubble,
+ * a few spheres and a sphere with a bite taken out of it */
+void demo_scene(Scene &s);
+Camera demo_camera();
+
+/*
+Local Variables:
+mode:c++
+End:
+*/
+#endif /* PATHTRACE_DEMO_H */
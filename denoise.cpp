@@ -0,0 +1,302 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+
+#include <assert.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "denoise.h"
+#include "image.h"
+#include "linalg.h"
+
+namespace {
+  // How much brighter or darker than its noise a tap may be before it is
+  // weighted down, in standard errors of the pixel
+  const float sigma_luminance = 4;
+  // How much deeper, in how fast the depth changes around the pixel
+  const float sigma_depth = 1;
+  // The weight of a normal is its cosine to the pixel's normal to the
+  // power of 2^normal_squarings
+  const int normal_squarings = 5;
+  // Albedo darker than this isn't divided out
+  const float min_albedo = 1e-3;
+  // Stands in for the infinite variance of pixels of one sample
+  const float unknown_variance = 1e20;
+  // Weights below this count for nothing. Smaller ones, and their
+  // squares, would be denormal numbers, which are very slow to work with.
+  const float min_weight = 1e-15;
+
+  // The B3 spline kernel of the a-trous transform
+  const float kernel[5] = { 1 / 16.0, 1 / 4.0, 3 / 8.0, 1 / 4.0, 1 / 16.0 };
+
+  /* e^x for -30 <= x <= 0, accurate to about 1e-4, and e^-30 below.
+   * Plain arithmetic instead of a call to exp(), so that loops over it
+   * can be vectorized. */
+  inline float exp_negative(float x) {
+    x = x > -30 ? x : -30;
+    float const t = x * 1.44269504f;
+    float const whole = floorf(t);
+    float const f = t - whole;
+    // The Taylor series of 2^f
+    float const p = 1 + f * (0.693147181f + f * (0.240226507f +
+	f * (0.0555041087f + f * (0.00961812911f + f * 0.00133335581f))));
+    int32_t const bits = ((int32_t)whole + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+  }
+
+  inline float luminance(float r, float g, float b) {
+    return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+  }
+
+  // The planes of a row that filtering reads
+  enum Plane { red, green, blue, var, nx, ny, nz, z, valid, planes };
+
+  /* Adds the taps at one offset, of weight k and distance pixels away,
+   * to the sums of the pixels x0 to x1 of a row. pixel and tap point to
+   * the planes at the start of the row and at its first tap, and scale
+   * and gradient to the row's. The sums are written nowhere else, which
+   * spares the vectorized loop from checking them for overlap with
+   * everything it reads. */
+  void add_taps(int x0, int x1, float k, float distance,
+		float const *const *pixel, float const *const *tap,
+		float const *scale, float const *gradient,
+		float *__restrict__ sum_w, float *__restrict__ sum_r,
+		float *__restrict__ sum_g, float *__restrict__ sum_b,
+		float *__restrict__ sum_v) {
+    float const *r = pixel[red], *g = pixel[green], *b = pixel[blue];
+    float const *px = pixel[nx], *py = pixel[ny], *pz = pixel[nz];
+    float const *depth = pixel[z];
+    float const *tr = tap[red], *tg = tap[green], *tb = tap[blue];
+    float const *tx = tap[nx], *ty = tap[ny], *tz = tap[nz];
+    float const *tdepth = tap[z], *tvar = tap[var], *tvalid = tap[valid];
+    for (int x = x0 ; x < x1 ; ++x) {
+      float cosine = px[x] * tx[x] + py[x] * ty[x] + pz[x] * tz[x];
+      // Normals more than 60 degrees apart would only give weights too
+      // small to count
+      cosine = cosine > 0.5f ? cosine : 0;
+      for (int s = 0 ; s < normal_squarings ; ++s)
+	cosine *= cosine;
+      float const depth_term = fabsf(depth[x] - tdepth[x]) /
+	(sigma_depth * gradient[x] * distance + 1e-3f * depth[x] + 1e-6f);
+      float const luminance_term =
+	fabsf(luminance(r[x], g[x], b[x]) -
+	      luminance(tr[x], tg[x], tb[x])) * scale[x];
+      float weight = k * tvalid[x] * cosine *
+	exp_negative(-(depth_term + luminance_term));
+      weight = weight > min_weight ? weight : 0;
+      sum_w[x] += weight;
+      sum_r[x] += weight * tr[x];
+      sum_g[x] += weight * tg[x];
+      sum_b[x] += weight * tb[x];
+      sum_v[x] += weight * weight * tvar[x];
+    }
+  }
+}
+
+/* Filters a band of rows, on a thread of its own or on the caller's */
+struct Denoiser::Band {
+  // Fewer pixels than this per thread aren't worth starting a thread for
+  const static unsigned int min_pixels = 16384;
+
+  Denoiser *denoiser;
+  unsigned int step;
+  unsigned int y0, y1;
+  pthread_t thread;
+
+  static void* run_thread(void *band_void) {
+    Band *b = static_cast<Band*>(band_void);
+    b->denoiser->filter_rows(b->step, b->y0, b->y1);
+    return 0;
+  }
+};
+
+void Denoiser::load(Image const &img) {
+  if (width != img.width || height != img.height) {
+    width = img.width;
+    height = img.height;
+    unsigned int const pixels = width * height;
+    for (int c = 0 ; c < 3 ; ++c) {
+      colour[c].resize(pixels);
+      next_colour[c].resize(pixels);
+      albedo[c].resize(pixels);
+      normal[c].resize(pixels);
+    }
+    variance.resize(pixels);
+    next_variance.resize(pixels);
+    depth.resize(pixels);
+    gradient.resize(pixels);
+    valid.resize(pixels);
+  }
+
+  for (unsigned int y = 0 ; y < height ; ++y) {
+    for (unsigned int x = 0 ; x < width ; ++x) {
+      unsigned int const i = y * width + x;
+      Colourd const mean = img.mean(x, y);
+      Features const f = img.mean_features(x, y);
+      double a[3] = { f.albedo.r(), f.albedo.g(), f.albedo.b() };
+      for (int c = 0 ; c < 3 ; ++c) {
+	if (a[c] < min_albedo)
+	  a[c] = 1;
+	albedo[c][i] = a[c];
+      }
+      colour[0][i] = mean.r() / a[0];
+      colour[1][i] = mean.g() / a[1];
+      colour[2][i] = mean.b() / a[2];
+      // The luminance of the colour is divided by roughly this much
+      double const a_luminance = luminance(a[0], a[1], a[2]);
+      double const v = img.variance(x, y) / (a_luminance * a_luminance);
+      variance[i] = v < unknown_variance ? v : unknown_variance;
+
+      // Samples that hit different surfaces average to a shorter normal
+      Vector3d n = f.normal;
+      double const length = n.length();
+      if (length > 0)
+	n /= length;
+      normal[0][i] = n.x;
+      normal[1][i] = n.y;
+      normal[2][i] = n.z;
+      depth[i] = f.depth;
+      valid[i] = img.sample_count(x, y) > 0 ? 1 : 0;
+    }
+  }
+
+  // The smaller difference to the neighbours on each axis, so that the
+  // depth of a surface doesn't seem to change fast at its edges
+  for (unsigned int y = 0 ; y < height ; ++y) {
+    for (unsigned int x = 0 ; x < width ; ++x) {
+      unsigned int const i = y * width + x;
+      float const z = depth[i];
+      float dx = INFINITY, dy = INFINITY;
+      if (x > 0) dx = fabsf(z - depth[i - 1]);
+      if (x + 1 < width) dx = fminf(dx, fabsf(depth[i + 1] - z));
+      if (y > 0) dy = fabsf(z - depth[i - width]);
+      if (y + 1 < height) dy = fminf(dy, fabsf(depth[i + width] - z));
+      if (dx == INFINITY) dx = 0;
+      if (dy == INFINITY) dy = 0;
+      gradient[i] = fmaxf(dx, dy);
+    }
+  }
+}
+
+void Denoiser::filter_rows(unsigned int step, unsigned int y0,
+			   unsigned int y1) {
+  int const w = width, h = height;
+  std::vector<float> scale(w), sum_w(w), sum_c[3], sum_v(w);
+  for (int c = 0 ; c < 3 ; ++c)
+    sum_c[c].resize(w);
+
+  for (int y = y0 ; y < (int)y1 ; ++y) {
+    int const row = y * w;
+    // The noise of each pixel, from its variance blurred a little since
+    // few samples give a poor estimate of it
+    for (int x = 0 ; x < w ; ++x) {
+      float v = 0, total = 0;
+      for (int dy = -1 ; dy <= 1 ; ++dy) {
+	if (y + dy < 0 || y + dy >= h) continue;
+	for (int dx = -1 ; dx <= 1 ; ++dx) {
+	  if (x + dx < 0 || x + dx >= w) continue;
+	  float const k = (dx ? 0.5f : 1.0f) * (dy ? 0.5f : 1.0f);
+	  v += k * variance[row + dy * w + x + dx];
+	  total += k;
+	}
+      }
+      scale[x] = 1 / (sigma_luminance * sqrtf(v / total) + 1e-6f);
+    }
+    std::fill(sum_w.begin(), sum_w.end(), 0.0f);
+    std::fill(sum_v.begin(), sum_v.end(), 0.0f);
+    for (int c = 0 ; c < 3 ; ++c)
+      std::fill(sum_c[c].begin(), sum_c[c].end(), 0.0f);
+
+    float const *pixel[planes] = {
+      &colour[0][row], &colour[1][row], &colour[2][row], &variance[row],
+      &normal[0][row], &normal[1][row], &normal[2][row], &depth[row],
+      &valid[row]
+    };
+    for (int j = -2 ; j <= 2 ; ++j) {
+      int const ty = y + j * (int)step;
+      if (ty < 0 || ty >= h) continue;
+      for (int i = -2 ; i <= 2 ; ++i) {
+	int const ox = i * (int)step;
+	// The pixels whose tap is inside the image
+	int const x0 = ox < 0 ? -ox : 0;
+	int const x1 = ox > 0 ? w - ox : w;
+	if (x0 >= x1) continue;
+	int const trow = ty * w + ox;
+	float const *tap[planes] = {
+	  &colour[0][trow], &colour[1][trow], &colour[2][trow],
+	  &variance[trow], &normal[0][trow], &normal[1][trow],
+	  &normal[2][trow], &depth[trow], &valid[trow]
+	};
+	add_taps(x0, x1, kernel[i + 2] * kernel[j + 2],
+		 (float)step * (abs(i) + abs(j)), pixel, tap, &scale[0],
+		 &gradient[row], &sum_w[0], &sum_c[0][0], &sum_c[1][0],
+		 &sum_c[2][0], &sum_v[0]);
+      }
+    }
+
+    for (int x = 0 ; x < w ; ++x) {
+      float const total = sum_w[x];
+      float const inverse = total > 0 ? 1 / total : 0;
+      next_colour[0][row + x] = sum_c[0][x] * inverse;
+      next_colour[1][row + x] = sum_c[1][x] * inverse;
+      next_colour[2][row + x] = sum_c[2][x] * inverse;
+      next_variance[row + x] = total > 0 ?
+	sum_v[x] * inverse * inverse : unknown_variance;
+    }
+  }
+}
+
+void Denoiser::run(Image const &in, Image &out, int threads) {
+  assert(in.width == out.width && in.height == out.height);
+  load(in);
+
+  unsigned int const pixel_count = width * height;
+  unsigned int count = threads > 1 ? threads : 1;
+  if (count > pixel_count / Band::min_pixels)
+    count = pixel_count / Band::min_pixels > 1 ?
+      pixel_count / Band::min_pixels : 1;
+  std::vector<Band> bands(count);
+  std::vector<bool> started(count, false);
+  for (unsigned int i = 0 ; i < count ; ++i) {
+    bands[i].denoiser = this;
+    bands[i].y0 = height * i / count;
+    bands[i].y1 = height * (i + 1) / count;
+  }
+
+  for (int iteration = 0 ; iteration < iterations ; ++iteration) {
+    for (unsigned int i = 0 ; i < count ; ++i)
+      bands[i].step = 1 << iteration;
+    // The first band is done here, and those whose threads can't be
+    // started too
+    for (unsigned int i = 1 ; i < count ; ++i)
+      started[i] = pthread_create(&bands[i].thread, 0, Band::run_thread,
+				  &bands[i]) == 0;
+    for (unsigned int i = 0 ; i < count ; ++i) {
+      if (!started[i])
+	filter_rows(bands[i].step, bands[i].y0, bands[i].y1);
+    }
+    for (unsigned int i = 1 ; i < count ; ++i) {
+      if (started[i])
+	pthread_join(bands[i].thread, 0);
+    }
+    for (int c = 0 ; c < 3 ; ++c)
+      colour[c].swap(next_colour[c]);
+    variance.swap(next_variance);
+  }
+
+  out.copy_from(in);
+  for (unsigned int y = 0 ; y < height ; ++y) {
+    for (unsigned int x = 0 ; x < width ; ++x) {
+      unsigned int const i = y * width + x;
+      unsigned int const n = in.sample_count(x, y);
+      out(x, y) = Colourd(colour[0][i] * albedo[0][i],
+			  colour[1][i] * albedo[1][i],
+			  colour[2][i] * albedo[2][i]) * n;
+    }
+  }
+}
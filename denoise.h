@@ -0,0 +1,70 @@
+#ifndef PATHTRACE_DENOISE_H
+#define PATHTRACE_DENOISE_H
+
+#include <vector>
+
+#include "image.h"
+
+/* Removes most of the noise of a render that stopped early, with the
+ * edge-avoiding a-trous wavelet filter of Dammertz et al. ("Edge-Avoiding
+ * A-Trous Wavelet Transform for fast Global Illumination Filtering",
+ * 2010) guided the way SVGF (Schied et al., 2017) guides it.
+ *
+ * Every iteration blurs the image with a 5x5 kernel whose taps are
+ * spread twice as far apart as in the one before, so that five
+ * iterations reach 64 pixels across with 25 taps each. A tap is weighted
+ * down where its normal or depth differs from the pixel's, which keeps
+ * the edges of objects sharp, and where its brightness differs from the
+ * pixel's by more than the pixel's own noise explains, which keeps
+ * shadows and highlights. The colour of the surfaces is divided out
+ * before filtering and multiplied back in after, so that it isn't
+ * blurred either.
+ *
+ * The pixels are kept in planes of floats, a row of one quantity after
+ * another, so that the compiler can vectorize the loops over a row.
+ * Bands of rows are filtered on up to the given number of threads. A
+ * Denoiser keeps its buffers from one image to the next. */
+class Denoiser {
+private:
+  struct Band;
+
+  unsigned int width, height;
+  int iterations;
+  // Colour with the albedo divided out, and the variance of its
+  // luminance, as read and as written by the current iteration
+  std::vector<float> colour[3], variance;
+  std::vector<float> next_colour[3], next_variance;
+  // What the colour was divided by, one where the albedo is black
+  std::vector<float> albedo[3];
+  std::vector<float> normal[3];
+  std::vector<float> depth;
+  // How fast the depth changes from one pixel to the next
+  std::vector<float> gradient;
+  // One for pixels with samples, zero for those without
+  std::vector<float> valid;
+
+  Denoiser(Denoiser const &);
+  Denoiser& operator=(Denoiser const &);
+
+  void load(Image const &img);
+  void filter_rows(unsigned int step, unsigned int y0, unsigned int y1);
+
+public:
+  const static int default_iterations = 5;
+
+  Denoiser(int iterations = default_iterations)
+    : width(0), height(0), iterations(iterations)
+  { }
+
+  /* Makes out, which must be of the same size as in, a denoised copy of
+   * in. The sample counts, noise estimates and features stay those of
+   * in, and pixels without samples stay black. */
+  void run(Image const &in, Image &out, int threads = 1);
+};
+
+/*
+Local Variables:
+mode:c++
+End:
+*/
+#endif /* PATHTRACE_DENOISE_H */
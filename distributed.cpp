@@ -0,0 +1,560 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <stdint.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "distributed.h"
+#include "mappedfile.h"
+#include "renderer.h"
+#include "tracer.h"
+#include "image.h"
+
+/* The messages:
+ *
+ *   worker:      hello magic, version, byte order mark, sizeof(real),
+ *                scene fingerprint
+ *   coordinator: welcome magic, width, height, roulette depth, light
+ *                sampling, seed
+ *   worker:      any number of images, each the size of a checkpoint
+ *                and the checkpoint
+ *
+ * The coordinator closes its side when it has enough, and the worker
+ * then sends its last image and closes its side. A coordinator that
+ * won't have the worker closes the connection without a welcome.
+ */
+namespace {
+  const char hello_magic[8] = { 'p', 't', 'w', 'o', 'r', 'k', 'e', 'r' };
+  const char welcome_magic[8] = { 'p', 't', 'c', 'o', 'o', 'r', 'd', '\n' };
+  const uint32_t protocol_version = 3;
+  const uint32_t byte_order = 0x01020304;
+
+  struct Hello {
+    char magic[8];
+    uint32_t version, byte_order, real_size;
+    uint64_t fingerprint;
+  };
+
+  struct Welcome {
+    char magic[8];
+    uint32_t width, height, roulette_depth, light_sampling, sampler, spectral;
+    uint64_t seed;
+  };
+
+  double now() {
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+  }
+
+  /* Reads exactly size bytes. False on the end of the stream, an error
+   * or a timeout. */
+  bool read_all(int fd, void *data, size_t size) {
+    char *p = static_cast<char*>(data);
+    while (size > 0) {
+      ssize_t const got = read(fd, p, size);
+      if (got < 0 && errno == EINTR)
+	continue;
+      if (got <= 0)
+	return false;
+      p += got;
+      size -= got;
+    }
+    return true;
+  }
+
+  bool write_all(int fd, void const *data, size_t size) {
+    const char *p = static_cast<const char*>(data);
+    while (size > 0) {
+      // Without MSG_NOSIGNAL, writing to a closed connection would kill
+      // the process with SIGPIPE
+      ssize_t const sent = send(fd, p, size, MSG_NOSIGNAL);
+      if (sent < 0 && errno == EINTR)
+	continue;
+      if (sent <= 0)
+	return false;
+      p += sent;
+      size -= sent;
+    }
+    return true;
+  }
+
+  /* Sends the image as a checkpoint, preceded by its size */
+  bool send_image(int fd, Image const &img,
+		  std::vector<uint64_t> const &seeds) {
+    char *buffer = 0;
+    size_t size = 0;
+    FILE *f = open_memstream(&buffer, &size);
+    if (!f)
+      return false;
+    bool ok = img.write_checkpoint(f, seeds);
+    ok = fclose(f) == 0 && ok;
+    uint64_t const length = size;
+    ok = ok && write_all(fd, &length, sizeof(length)) &&
+      write_all(fd, buffer, size);
+    free(buffer);
+    return ok;
+  }
+
+  /* Fills in a socket address for a Unix domain socket path, or looks
+   * up a host and port. passive is for listening, where an empty host
+   * means any. Returns the addresses to try, or 0 after printing what
+   * went wrong. */
+  struct addrinfo* resolve(const char *address, bool passive,
+			   struct sockaddr_un &unix_address) {
+    if (strchr(address, '/')) {
+      if (strlen(address) >= sizeof(unix_address.sun_path)) {
+	fprintf(stderr, "%s: socket path too long\n", address);
+	return 0;
+      }
+      memset(&unix_address, 0, sizeof(unix_address));
+      unix_address.sun_family = AF_UNIX;
+      strcpy(unix_address.sun_path, address);
+      struct addrinfo *info =
+	static_cast<struct addrinfo*>(calloc(1, sizeof(struct addrinfo)));
+      info->ai_family = AF_UNIX;
+      info->ai_socktype = SOCK_STREAM;
+      info->ai_addr = reinterpret_cast<struct sockaddr*>(&unix_address);
+      info->ai_addrlen = sizeof(unix_address);
+      return info;
+    }
+
+    const char *colon = strrchr(address, ':');
+    if (!colon || colon[1] == '\0') {
+      fprintf(stderr, "%s: expected host:port or the path of a socket\n",
+	      address);
+      return 0;
+    }
+    std::string const host(address, colon);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (passive)
+      hints.ai_flags = AI_PASSIVE;
+    struct addrinfo *info = 0;
+    int const ret = getaddrinfo(host.empty() ? 0 : host.c_str(), colon + 1,
+				&hints, &info);
+    if (ret != 0) {
+      fprintf(stderr, "%s: %s\n", address, gai_strerror(ret));
+      return 0;
+    }
+    return info;
+  }
+
+  void release(struct addrinfo *info) {
+    if (info->ai_family == AF_UNIX)
+      free(info);
+    else
+      freeaddrinfo(info);
+  }
+
+  int connect_to(const char *address) {
+    struct sockaddr_un unix_address;
+    struct addrinfo *info = resolve(address, false, unix_address);
+    if (!info)
+      return -1;
+    int fd = -1;
+    int error = 0;
+    for (struct addrinfo *i = info ; i && fd < 0 ; i = i->ai_next) {
+      fd = socket(i->ai_family, i->ai_socktype, i->ai_protocol);
+      if (fd >= 0 && connect(fd, i->ai_addr, i->ai_addrlen) != 0) {
+	error = errno;
+	close(fd);
+	fd = -1;
+      }
+      else if (fd < 0) {
+	error = errno;
+      }
+    }
+    release(info);
+    if (fd < 0) {
+      errno = error;
+      perror(address);
+    }
+    return fd;
+  }
+
+  void set_timeout(int fd, int seconds) {
+    struct timeval tv;
+    tv.tv_sec = seconds;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  }
+}
+
+bool scene_fingerprint(const char *filename, uint64_t &fingerprint) {
+  // FNV-1a, over the bytes of the file or the name of the built-in scene
+  static const char built_in[] = "built-in example scene";
+  MappedFile file;
+  const char *p = built_in, *end = built_in + sizeof(built_in) - 1;
+  if (filename) {
+    if (!file.open(filename)) {
+      perror(filename);
+      return false;
+    }
+    p = file.data();
+    end = file.end();
+  }
+  uint64_t hash = 14695981039346656037ULL;
+  for ( ; p < end ; ++p) {
+    hash ^= (unsigned char)*p;
+    hash *= 1099511628211ULL;
+  }
+  fingerprint = hash;
+  return true;
+}
+
+Coordinator::Coordinator(unsigned int width, unsigned int height,
+			 uint64_t fingerprint, uint64_t first_seed,
+			 int roulette_depth, bool light_sampling,
+			 Sampler::Kind sampler, bool spectral)
+  : width(width), height(height), fingerprint(fingerprint),
+    roulette_depth(roulette_depth), light_sampling(light_sampling),
+    sampler(sampler), spectral(spectral),
+    base(width, height), next_seed(first_seed), listen_fd(-1),
+    accepting(false), generation(1), snapshot_generation(0)
+{
+  pthread_mutex_init(&mutex, 0);
+}
+
+Coordinator::~Coordinator() {
+  stop();
+  for (unsigned int i = 0 ; i < connections.size() ; ++i) {
+    delete connections[i]->latest;
+    delete connections[i];
+  }
+  pthread_mutex_destroy(&mutex);
+}
+
+void Coordinator::add(Image const &img, std::vector<uint64_t> const &seeds) {
+  base.add(img);
+  this->seeds.insert(this->seeds.end(), seeds.begin(), seeds.end());
+  generation++;
+}
+
+bool Coordinator::listen(const char *address) {
+  struct sockaddr_un unix_address;
+  struct addrinfo *info = resolve(address, true, unix_address);
+  if (!info)
+    return false;
+  int error = 0;
+  for (struct addrinfo *i = info ; i && listen_fd < 0 ; i = i->ai_next) {
+    int fd = socket(i->ai_family, i->ai_socktype, i->ai_protocol);
+    if (fd < 0) {
+      error = errno;
+      continue;
+    }
+    if (i->ai_family == AF_UNIX) {
+      // A socket left behind by an earlier coordinator
+      struct stat st;
+      if (stat(address, &st) == 0 && S_ISSOCK(st.st_mode))
+	unlink(address);
+    }
+    else {
+      int const on = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    }
+    if (bind(fd, i->ai_addr, i->ai_addrlen) != 0 || ::listen(fd, 16) != 0) {
+      error = errno;
+      close(fd);
+      continue;
+    }
+    listen_fd = fd;
+    if (i->ai_family == AF_UNIX)
+      socket_path = address;
+  }
+  release(info);
+  if (listen_fd < 0) {
+    errno = error;
+    perror(address);
+    return false;
+  }
+  return true;
+}
+
+void Coordinator::start() {
+  if (listen_fd < 0 || accepting)
+    return;
+  int const ret = pthread_create(&accept_thread, 0, run_accept,
+				 static_cast<void*>(this));
+  if (ret != 0) {
+    errno = ret;
+    perror("Failed to create thread");
+    return;
+  }
+  accepting = true;
+}
+
+void* Coordinator::run_accept(void *coordinator_void) {
+  Coordinator *co = static_cast<Coordinator*>(coordinator_void);
+  for (;;) {
+    int const fd = accept(co->listen_fd, 0, 0);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+	continue;
+      // stop() shuts the socket down
+      break;
+    }
+    set_timeout(fd, timeout);
+    Connection *c = new Connection;
+    c->coordinator = co;
+    c->fd = fd;
+    c->seed = 0;
+    c->latest = 0;
+    c->connected = true;
+    pthread_mutex_lock(&co->mutex);
+    c->number = co->connections.size() + 1;
+    int const ret = pthread_create(&c->thread, 0, run_connection,
+				   static_cast<void*>(c));
+    if (ret == 0) {
+      co->connections.push_back(c);
+    }
+    else {
+      errno = ret;
+      perror("Failed to create thread");
+      close(fd);
+      delete c;
+    }
+    pthread_mutex_unlock(&co->mutex);
+  }
+  return 0;
+}
+
+void* Coordinator::run_connection(void *connection_void) {
+  Connection *c = static_cast<Connection*>(connection_void);
+  Coordinator *co = c->coordinator;
+  if (co->handshake(*c))
+    co->receive(*c);
+  // Under the lock, so that stop() doesn't shut down the descriptor
+  // after it has been closed and maybe reused
+  pthread_mutex_lock(&co->mutex);
+  close(c->fd);
+  c->connected = false;
+  pthread_mutex_unlock(&co->mutex);
+  return 0;
+}
+
+bool Coordinator::handshake(Connection &c) {
+  Hello hello;
+  if (!read_all(c.fd, &hello, sizeof(hello)))
+    return false;
+  if (memcmp(hello.magic, hello_magic, sizeof(hello_magic)) != 0 ||
+      hello.version != protocol_version || hello.byte_order != byte_order) {
+    fprintf(stderr, "worker %u: not a worker of this version on this kind "
+	    "of machine\n", c.number);
+    return false;
+  }
+  if (hello.real_size != sizeof(real) || hello.fingerprint != fingerprint) {
+    fprintf(stderr, "worker %u: rendering another scene or with another "
+	    "precision\n", c.number);
+    return false;
+  }
+
+  pthread_mutex_lock(&mutex);
+  while (std::find(seeds.begin(), seeds.end(), next_seed) != seeds.end())
+    next_seed++;
+  c.seed = next_seed++;
+  seeds.push_back(c.seed);
+  pthread_mutex_unlock(&mutex);
+
+  Welcome welcome;
+  memcpy(welcome.magic, welcome_magic, sizeof(welcome_magic));
+  welcome.width = width;
+  welcome.height = height;
+  welcome.roulette_depth = roulette_depth;
+  welcome.light_sampling = light_sampling;
+  welcome.sampler = sampler;
+  welcome.spectral = spectral;
+  welcome.seed = c.seed;
+  if (!write_all(c.fd, &welcome, sizeof(welcome)))
+    return false;
+  fprintf(stderr, "worker %u joined, seed %llu\n", c.number,
+	  (unsigned long long)c.seed);
+  return true;
+}
+
+void Coordinator::receive(Connection &c) {
+  // A checkpoint of the image with one seed can't be larger than this,
+  // which keeps garbage from allocating all memory
+  uint64_t const max_length = 4096 + (uint64_t)width * height *
+    (sizeof(Colourd) + sizeof(unsigned int) + sizeof(double) +
+     sizeof(Features));
+  char name[32];
+  snprintf(name, sizeof(name), "worker %u", c.number);
+  std::vector<char> buffer;
+  uint64_t length;
+  while (read_all(c.fd, &length, sizeof(length))) {
+    if (length == 0 || length > max_length) {
+      fprintf(stderr, "%s: bad image size\n", name);
+      break;
+    }
+    buffer.resize(length);
+    if (!read_all(c.fd, &buffer[0], length))
+      break;
+    std::vector<uint64_t> image_seeds;
+    Image *img = Image::read_checkpoint(name, &buffer[0], length,
+					image_seeds);
+    if (!img)
+      break;
+    if (img->width != width || img->height != height ||
+	image_seeds.size() != 1 || image_seeds[0] != c.seed) {
+      fprintf(stderr, "%s: image of another render\n", name);
+      delete img;
+      break;
+    }
+    pthread_mutex_lock(&mutex);
+    delete c.latest;
+    c.latest = img;
+    generation++;
+    pthread_mutex_unlock(&mutex);
+  }
+  pthread_mutex_lock(&mutex);
+  int const passes = c.latest ? c.latest->get_paints_started() : 0;
+  pthread_mutex_unlock(&mutex);
+  fprintf(stderr, "worker %u left after %d passes\n", c.number, passes);
+}
+
+void Coordinator::stop() {
+  if (accepting) {
+    // Wakes up accept() in the accepting thread
+    shutdown(listen_fd, SHUT_RDWR);
+    pthread_join(accept_thread, 0);
+    accepting = false;
+  }
+  if (listen_fd >= 0) {
+    close(listen_fd);
+    listen_fd = -1;
+    if (!socket_path.empty())
+      unlink(socket_path.c_str());
+  }
+  // No more connections are added now
+  for (unsigned int i = 0 ; i < connections.size() ; ++i) {
+    Connection *c = connections[i];
+    if (c->fd < 0)
+      continue;
+    pthread_mutex_lock(&mutex);
+    if (c->connected)
+      shutdown(c->fd, SHUT_WR);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(c->thread, 0);
+    c->fd = -1;
+  }
+}
+
+int Coordinator::get_passes() {
+  pthread_mutex_lock(&mutex);
+  int passes = base.get_paints_started();
+  for (unsigned int i = 0 ; i < connections.size() ; ++i) {
+    if (connections[i]->latest)
+      passes += connections[i]->latest->get_paints_started();
+  }
+  pthread_mutex_unlock(&mutex);
+  return passes;
+}
+
+int Coordinator::get_workers() {
+  pthread_mutex_lock(&mutex);
+  int workers = 0;
+  for (unsigned int i = 0 ; i < connections.size() ; ++i) {
+    if (connections[i]->connected)
+      workers++;
+  }
+  pthread_mutex_unlock(&mutex);
+  return workers;
+}
+
+bool Coordinator::snapshot(Image &dest, std::vector<uint64_t> &seeds) {
+  bool changed = false;
+  pthread_mutex_lock(&mutex);
+  if (generation != snapshot_generation) {
+    dest.copy_from(base);
+    for (unsigned int i = 0 ; i < connections.size() ; ++i) {
+      if (connections[i]->latest)
+	dest.add(*connections[i]->latest);
+    }
+    seeds = this->seeds;
+    snapshot_generation = generation;
+    changed = true;
+  }
+  pthread_mutex_unlock(&mutex);
+  return changed;
+}
+
+bool Worker::run(const char *address, Scene &scene, Camera const &camera,
+		 uint64_t fingerprint, int threads,
+		 volatile sig_atomic_t const *interrupted) {
+  int const fd = connect_to(address);
+  if (fd < 0)
+    return false;
+  set_timeout(fd, Coordinator::timeout);
+
+  Hello hello;
+  memcpy(hello.magic, hello_magic, sizeof(hello_magic));
+  hello.version = protocol_version;
+  hello.byte_order = byte_order;
+  hello.real_size = sizeof(real);
+  hello.fingerprint = fingerprint;
+  Welcome welcome;
+  if (!write_all(fd, &hello, sizeof(hello)) ||
+      !read_all(fd, &welcome, sizeof(welcome)) ||
+      memcmp(welcome.magic, welcome_magic, sizeof(welcome_magic)) != 0 ||
+      welcome.width == 0 || welcome.height == 0 ||
+      welcome.sampler >= Sampler::sampler_kinds) {
+    fprintf(stderr, "%s: the coordinator refused this worker\n", address);
+    close(fd);
+    return false;
+  }
+  fprintf(stderr, "%s: rendering %ux%u with seed %llu\n", address,
+	  welcome.width, welcome.height, (unsigned long long)welcome.seed);
+
+  Tracer tracer(scene, camera, welcome.seed);
+  tracer.set_depth(welcome.roulette_depth, Tracer::default_max_bounces);
+  tracer.set_light_sampling(welcome.light_sampling);
+  tracer.set_sampler((Sampler::Kind)welcome.sampler);
+  tracer.set_spectral(welcome.spectral);
+  Renderer renderer(tracer, welcome.width, welcome.height, threads);
+  std::vector<uint64_t> const seeds(1, welcome.seed);
+  Image snapshot(welcome.width, welcome.height);
+
+  renderer.start();
+  double next_send = now() + send_interval;
+  bool ok = true;
+  while (!*interrupted) {
+    // The coordinator never sends anything after the welcome, so the
+    // connection turning readable means that it has closed its side
+    struct pollfd p;
+    p.fd = fd;
+    p.events = POLLIN;
+    if (poll(&p, 1, 100) > 0)
+      break;
+    if (now() >= next_send) {
+      if (renderer.snapshot(snapshot) && !send_image(fd, snapshot, seeds)) {
+	ok = false;
+	break;
+      }
+      next_send = now() + send_interval;
+    }
+  }
+  renderer.stop();
+  if (ok && renderer.snapshot(snapshot))
+    ok = send_image(fd, snapshot, seeds);
+  if (!ok)
+    fprintf(stderr, "%s: lost the coordinator\n", address);
+  close(fd);
+  return ok;
+}
@@ -0,0 +1,136 @@
+#ifndef PATHTRACE_DISTRIBUTED_H
+#define PATHTRACE_DISTRIBUTED_H
+
+#include <string>
+#include <vector>
+#include <csignal>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "image.h"
+#include "scene.h"
+#include "camera.h"
+#include "sampler.h"
+
+/* Rendering one scene with many processes, on one machine or on many.
+ *
+ * Workers load the scene themselves and render it with seeds handed out
+ * by a coordinator, and every Worker::send_interval seconds send it all
+ * they have rendered so far as a checkpoint (see Image). The coordinator
+ * keeps the latest image of every worker, and its render is the sum of
+ * them, which is what merging checkpoints does. Workers may join at any
+ * time, and one that leaves or dies leaves its last image in the sum.
+ *
+ * Addresses are "host:port" for TCP, or the path of a Unix domain socket,
+ * which needs a slash in it (e.g. "./render.sock"). A coordinator
+ * listening on ":port" takes workers from any host.
+ *
+ * The messages are in the native byte order, and a worker tells the
+ * coordinator the byte order, the precision and a fingerprint of its
+ * scene, so that only workers rendering the same scene the same way are
+ * let in. */
+
+/* A fingerprint of the scene file's contents, or of the built-in scene
+ * if filename is 0. Mesh files used by the scene aren't included.
+ * Returns false if the file can't be read. */
+bool scene_fingerprint(const char *filename, uint64_t &fingerprint);
+
+class Coordinator {
+private:
+  struct Connection {
+    Coordinator *coordinator;
+    int fd;
+    unsigned int number;
+    uint64_t seed;
+    pthread_t thread;
+    // The latest image received, 0 until the first one arrives
+    Image *latest;
+    bool connected;
+  };
+
+  unsigned int width, height;
+  uint64_t fingerprint;
+  int roulette_depth;
+  bool light_sampling;
+  Sampler::Kind sampler;
+  bool spectral;
+  // Renders added before start(), such as a resumed checkpoint
+  Image base;
+  std::vector<uint64_t> seeds;
+  uint64_t next_seed;
+  std::string socket_path;
+  int listen_fd;
+  pthread_t accept_thread;
+  bool accepting;
+  std::vector<Connection*> connections;
+  unsigned int generation;
+  unsigned int snapshot_generation;
+  pthread_mutex_t mutex;
+
+  Coordinator(Coordinator const &);
+  Coordinator& operator=(Coordinator const &);
+
+  static void* run_accept(void *coordinator_void);
+  static void* run_connection(void *connection_void);
+  bool handshake(Connection &c);
+  void receive(Connection &c);
+
+public:
+  // Seconds a worker may go without sending anything before it is given
+  // up as hung
+  const static int timeout = 60;
+
+  /* Workers get the first seed not in an added render, starting from
+   * first_seed, and are told the depth, light sampling, sampler and
+   * spectral settings of the Tracer */
+  Coordinator(unsigned int width, unsigned int height, uint64_t fingerprint,
+	      uint64_t first_seed, int roulette_depth, bool light_sampling,
+	      Sampler::Kind sampler, bool spectral);
+  ~Coordinator();
+
+  /* Adds a render of the same size and its seeds to the sum. Call
+   * before start(). */
+  void add(Image const &img, std::vector<uint64_t> const &seeds);
+
+  /* Opens the address for workers to connect to. Prints what went wrong
+   * and returns false on failure. */
+  bool listen(const char *address);
+  /* Starts taking workers in on a thread of its own */
+  void start();
+  /* Stops taking workers in, asks the workers to send their last image,
+   * and waits for them to do so and leave */
+  void stop();
+
+  /* Passes in the sum */
+  int get_passes();
+  /* Workers connected now */
+  int get_workers();
+
+  /* Copies the sum into dest if it has changed since the last snapshot,
+   * and the seeds that went into it into seeds. Returns true if they
+   * were updated. */
+  bool snapshot(Image &dest, std::vector<uint64_t> &seeds);
+};
+
+class Worker {
+public:
+  // Seconds between images sent to the coordinator
+  const static int send_interval = 2;
+
+  /* Connects to the coordinator at the address and renders the scene on
+   * the given number of threads, until the coordinator has enough or
+   * interrupted is set. Sends the coordinator what was rendered before
+   * leaving. Prints what went wrong and returns false if the coordinator
+   * can't be reached, won't have the worker or goes away. */
+  static bool run(const char *address, Scene &scene, Camera const &camera,
+		  uint64_t fingerprint, int threads,
+		  volatile sig_atomic_t const *interrupted);
+};
+
+/*
+Local Variables:
+mode:c++
+End:
+*/
+#endif /* PATHTRACE_DISTRIBUTED_H */
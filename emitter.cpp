@@ -0,0 +1,134 @@
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "emitter.h"
+#include "linalg.h"
+#include "sampler.h"
+
+const double Emitter::plane_extent = 1000.0;
+
+Emitter Emitter::make_sphere(unsigned int object, Vector3 const &center,
+			     double radius) {
+  Emitter e;
+  e.kind = sphere;
+  e.object = object;
+  e.center = center;
+  e.radius = radius;
+  e.area = 4 * M_PI * radius * radius;
+  return e;
+}
+
+bool Emitter::make_plane(unsigned int object, Vector3 const &point,
+			 Vector3 const &plane_normal,
+			 std::vector<Vector3> const &clip_points,
+			 std::vector<Vector3> const &clip_normals,
+			 Emitter &e) {
+  e.kind = polygon;
+  e.object = object;
+  e.normal = plane_normal;
+  e.normal.normalize();
+
+  Vector3 tangent = e.normal.generate_normal();
+  tangent.normalize();
+  Vector3 bitangent = e.normal.cross(tangent);
+  std::vector<Vector3> poly;
+  poly.push_back(point + (tangent + bitangent) * plane_extent);
+  poly.push_back(point + (-tangent + bitangent) * plane_extent);
+  poly.push_back(point + (-tangent - bitangent) * plane_extent);
+  poly.push_back(point + (tangent - bitangent) * plane_extent);
+  if ((poly[1] - poly[0]).cross(poly[2] - poly[0]).dot(e.normal) < 0) {
+    std::swap(poly[1], poly[3]);
+  }
+
+  // Sutherland-Hodgman, keeping the front side of each clip plane
+  for (unsigned int c = 0 ; c < clip_points.size() && poly.size() >= 3 ; ++c) {
+    std::vector<Vector3> clipped;
+    for (unsigned int i = 0 ; i < poly.size() ; ++i) {
+      Vector3 const &a = poly[i];
+      Vector3 const &b = poly[(i + 1) % poly.size()];
+      double const da = clip_normals[c].dot(a - clip_points[c]);
+      double const db = clip_normals[c].dot(b - clip_points[c]);
+      if (da >= 0)
+	clipped.push_back(a);
+      if ((da < 0 && db > 0) || (da > 0 && db < 0))
+	clipped.push_back(a + (b - a) * (da / (da - db)));
+    }
+    poly.swap(clipped);
+  }
+  if (poly.size() < 3)
+    return false;
+
+  e.corners = poly;
+  e.cumulative_area.clear();
+  e.area = 0;
+  for (unsigned int i = 1 ; i + 1 < poly.size() ; ++i) {
+    e.area += (poly[i] - poly[0]).cross(poly[i + 1] - poly[0]).length() / 2;
+    e.cumulative_area.push_back(e.area);
+  }
+  return e.area > 0;
+}
+
+bool Emitter::inside(Vector3 const &p) const {
+  for (unsigned int i = 0 ; i < corners.size() ; ++i) {
+    Vector3 const &a = corners[i];
+    Vector3 const &b = corners[(i + 1) % corners.size()];
+    if ((b - a).cross(p - a).dot(normal) < 0)
+      return false;
+  }
+  return true;
+}
+
+bool Emitter::sample(Vector3d const &from, Sampler &rng,
+		     EmitterSample &s) const {
+  Vector3 point, n;
+  if (kind == sphere) {
+    n = Vector3::uniform_random(rng);
+    point = center + n * radius;
+  }
+  else {
+    double const pick = rng.uniform() * area;
+    unsigned int t = 0;
+    while (t + 1 < cumulative_area.size() && cumulative_area[t] < pick)
+      ++t;
+    // Uniformly within the triangle
+    double u, v;
+    rng.uniform2(u, v);
+    u = sqrt(u);
+    Vector3 const &a = corners[0];
+    Vector3 const &b = corners[t + 1];
+    Vector3 const &c = corners[t + 2];
+    point = a * (1 - u) + b * (u * (1 - v)) + c * (u * v);
+    n = normal;
+  }
+
+  Vector3d const to = Vector3d(point) - from;
+  double const dist2 = to.dot(to);
+  if (dist2 <= 0)
+    return false;
+  s.distance = sqrt(dist2);
+  s.direction = Vector3(to / s.distance);
+  double const cos_light = -s.direction.dot(n);
+  if (cos_light <= 0)
+    return false;
+  s.pdf = dist2 / (cos_light * area);
+  return true;
+}
+
+double Emitter::pdf(Vector3d const &from, Vector3 const &direction,
+		    double distance) const {
+  Vector3 const point(from + Vector3d(direction) * distance);
+  Vector3 n;
+  if (kind == sphere) {
+    n = (point - center) / radius;
+  }
+  else {
+    if (!inside(point))
+      return 0;
+    n = normal;
+  }
+  double const cos_light = -direction.dot(n);
+  if (cos_light <= 0)
+    return 0;
+  return distance * distance / (cos_light * area);
+}
@@ -0,0 +1,77 @@
+#ifndef PATHTRACE_EMITTER_H
+#define PATHTRACE_EMITTER_H
+
+#include <vector>
+
+#include "linalg.h"
+#include "sampler.h"
+
+/* A point picked on an emitter, as seen from the point being lit */
+struct EmitterSample {
+  // Unit vector from the lit point towards the emitter
+  Vector3 direction;
+  double distance;
+  // Probability density of the direction, per unit solid angle
+  double pdf;
+};
+
+/* The part of an emissive object that lights can be sampled from. Spheres
+ * are sampled over their whole surface. Planes are infinite, so they are
+ * cut down to the convex polygon left after clipping them with the other
+ * planes of the scene, which is all of the plane that is visible from
+ * inside a room made of planes. Both sample() and pdf() only count the
+ * side of the emitter facing the lit point. */
+class Emitter {
+private:
+  enum Kind { sphere, polygon };
+
+  Kind kind;
+  Vector3 center;
+  double radius;
+  Vector3 normal;
+  // Corners of the polygon, counterclockwise as seen from the front
+  std::vector<Vector3> corners;
+  // Areas of the triangles fanning out from the first corner, summed
+  std::vector<double> cumulative_area;
+  double area;
+
+  bool inside(Vector3 const &point) const;
+
+public:
+  // Index of the object in Scene::objects
+  unsigned int object;
+
+  /* Half the side of the square the plane is clipped from, which is
+   * what is sampled of a plane that the other planes don't bound. This
+   * is a guess at the size of a scene, as the example scene is a few
+   * units across. Clipping with the other planes assumes that they are
+   * opaque, like the walls of a room. Neither makes the render wrong:
+   * pdf() is zero for the parts of a plane left out, so light from
+   * there is found by bouncing alone, just with more noise. */
+  const static double plane_extent;
+
+  static Emitter make_sphere(unsigned int object, Vector3 const &center,
+			     double radius);
+  /* The plane through point with the given normal, clipped to the front
+   * sides of the clip planes. Returns false if nothing is left of it. */
+  static bool make_plane(unsigned int object, Vector3 const &point,
+			 Vector3 const &normal,
+			 std::vector<Vector3> const &clip_points,
+			 std::vector<Vector3> const &clip_normals,
+			 Emitter &emitter);
+
+  /* Picks a point on the emitter for lighting from. Returns false if the
+   * point picked faces away from from. */
+  bool sample(Vector3d const &from, Sampler &rng, EmitterSample &s) const;
+  /* Density of sample() picking the point the ray from from in the
+   * direction hits at the distance, per unit solid angle */
+  double pdf(Vector3d const &from, Vector3 const &direction,
+	     double distance) const;
+};
+
+/*
+Local Variables:
+mode:c++
+End:
+*/
+#endif /* PATHTRACE_EMITTER_H */
@@ -1,90 +1,120 @@
 #include <cstdio>
 #include <ctime>
-#include <pthread.h>
-#include <errno.h>
+#include <assert.h>
 
 #include <gtkmm.h>
 
 #include "tracer.h"
+#include "renderer.h"
 #include "shapes.h"
 #include "material.h"
+#include "demo.h"
+#include "scenefile.h"
+#include "denoise.h"
 
-class Workhandler {
+class Workhandler : public Renderer {
 private:
-  Image buf;
-  pthread_t *thread;
-  Tracer &tracer;
   Glib::RefPtr<Gdk::Pixbuf> disp;
+  // The display is converted from this copy of the image, so that the
+  // render threads never wait for tone mapping
+  Image shown;
+  // The copy denoised, when denoising is on
+  Image denoised;
+  Denoiser denoiser;
   double exposure;
-  int thread_count;
-  bool running;
-  pthread_mutex_t buf_mutex;
-  
-public:
-  sigc::signal<void> signal_frame;
+  bool show_noise;
+  bool denoise;
+  // Threads used for converting and denoising the image, the same as
+  // for rendering
+  int blit_threads;
+
+  void update_denoised() {
+    if (denoise)
+      denoiser.run(shown, denoised, blit_threads);
+  }
 
-  Workhandler(Tracer &tr, Glib::RefPtr<Gdk::Pixbuf> &disp, int threads = 2)
-    : buf(disp->get_width(), disp->get_height()), tracer(tr), disp(disp),
-      exposure(1.0), thread_count(threads), running(true)
+public:
+  Workhandler(Tracer &tr, Glib::RefPtr<Gdk::Pixbuf> &disp, int threads = 2,
+	      double noise_threshold = 0)
+    : Renderer(tr, disp->get_width(), disp->get_height(), threads),
+      disp(disp), shown(disp->get_width(), disp->get_height()),
+      denoised(disp->get_width(), disp->get_height()), exposure(1.0),
+      show_noise(false), denoise(false), blit_threads(threads)
   {
-    pthread_mutex_init(&buf_mutex, 0);
-    thread = new pthread_t[thread_count];
-    for (int i = 0 ; i < thread_count ; ++i) {
-      int ret = pthread_create(thread + i, 0, run_renderer,
-			       static_cast<void*>(this));
-      if (ret != 0) {
-	errno = ret;
-	perror("Failed to create thread");
-      }
-    }
+    set_noise_threshold(noise_threshold);
+    start();
   }
 
-  ~Workhandler() {
-    stop();
-    delete [] thread;
+  void post_step() {
+    lock();
+    get_tracer().traceImage(image());
+    touch();
+    unlock();
+    present();
   }
 
-  void stop() {
-    running = false;
-    for (int i = 0 ; i < thread_count ; ++i) {
-      errno = pthread_join(thread[i], 0);
-      if (errno != 0)
-	perror("Failed to join thread");
-    }
-    thread_count = 0;
+  /* Updates the display if the image has changed. Returns true if it
+   * did. */
+  bool present() {
+    if (!snapshot(shown))
+      return false;
+    update_denoised();
+    blit();
+    return true;
   }
 
-  static void* run_renderer(void *wh_void) {
-    Workhandler *wh = static_cast<Workhandler*>(wh_void);
-    Image buf(wh->disp->get_width(), wh->disp->get_height());
-    Tracer tracer(wh->tracer);
-    while (wh->running) {
-      tracer.traceImage(buf);
-      pthread_mutex_lock(&wh->buf_mutex);
-      wh->buf.add(buf);
-      wh->buf.blit_to(wh->disp, wh->exposure);
-      pthread_mutex_unlock(&wh->buf_mutex);
-      wh->signal_frame.emit();
-    }
-    pthread_exit(0);
-    return 0;
+  void change_exposure(double new_val) {
+    exposure = new_val;
+    blit();
   }
 
-  void post_step() {
-    tracer.traceImage(buf);
-    buf.blit_to(disp, exposure);
-    //buf.blit_variance(disp);
+  /* Switches between showing the image and the estimated noise of each
+   * pixel. Returns true if the noise is shown. */
+  bool toggle_noise() {
+    show_noise = !show_noise;
+    blit();
+    return show_noise;
   }
 
-  void change_exposure(double new_val) {
-    exposure = new_val;
-    buf.blit_to(disp, exposure);
+  /* Switches sampling lights directly on and off. Returns true if it is
+   * on. */
+  bool toggle_light_sampling() {
+    bool const enabled = !get_tracer().get_light_sampling();
+    set_light_sampling(enabled);
+    return enabled;
+  }
+
+  /* Switches between showing the image as rendered and denoised.
+   * Returns true if it is denoised. */
+  bool toggle_denoise() {
+    denoise = !denoise;
+    update_denoised();
+    blit();
+    return denoise;
+  }
+
+  void blit() {
+    assert(shown.width == (unsigned)disp->get_width());
+    assert(shown.height == (unsigned)disp->get_height());
+    if (show_noise)
+      shown.blit_variance(disp->get_pixels(), disp->get_rowstride(), exposure,
+			  blit_threads);
+    else
+      (denoise ? denoised : shown).blit_to(disp->get_pixels(),
+					   disp->get_rowstride(), exposure,
+					   blit_threads);
+  }
+
+  int get_steps() const {
+    return shown.get_paints_started();
   }
 };
 Workhandler *wh;
 
 class ImageWindow : public Gtk::Window {
 private:
+  const static unsigned int present_interval = 1000 / 30;
+
   Glib::RefPtr<Gdk::Pixbuf> image_pb;
   Workhandler *workhandler;
 
@@ -96,8 +126,9 @@ private:
   Gtk::HBox hsplit;
   Gtk::Image image_w;
   Gtk::VBox tools;
-  Gtk::Button pause, step, redraw, quit;
+  Gtk::Button pause, step, redraw, lights, noise, denoise, quit;
   Gtk::Label steps_l;
+  Gtk::Label stats_l;
   Gtk::Adjustment exposure_adj;
   Gtk::HScale exposure;
 
@@ -125,21 +156,52 @@ public:
     image_w.queue_draw();
   }
 
+  void on_lights() {
+    if (workhandler->toggle_light_sampling())
+      lights.set_label("Bounce only");
+    else
+      lights.set_label("Lights");
+  }
+
+  void on_noise() {
+    if (workhandler->toggle_noise())
+      noise.set_label("Image");
+    else
+      noise.set_label("Noise");
+    image_w.queue_draw();
+  }
+
+  void on_denoise() {
+    if (workhandler->toggle_denoise())
+      denoise.set_label("Raw");
+    else
+      denoise.set_label("Denoise");
+    image_w.queue_draw();
+  }
+
   void on_step() {
     workhandler->post_step();
     on_frame();
   }
 
+  /* Refreshes the display from the render at most every
+   * present_interval milliseconds */
+  bool on_present() {
+    if (workhandler->present())
+      on_frame();
+    return running;
+  }
+
   void on_frame() {
-    gdk_threads_enter();
     image_w.queue_draw();
-    steps++;
+    steps = workhandler->get_steps();
     static char label[64];
     time_t total_time = elapsed_time;
     if (!paused) total_time += time(0) - start_time;
-    snprintf(label, 64, "%d steps\n%ld seconds", steps, total_time);
+    snprintf(label, 64, "%d steps\n%ld seconds%s", steps, total_time,
+	     workhandler->is_converged() ? "\nconverged" : "");
     steps_l.set_text(label);
-    gdk_threads_leave();
+    stats_l.set_text(workhandler->get_stats().summary(total_time).c_str());
   }
 
   void on_pause() {
@@ -164,7 +226,10 @@ public:
     : image_pb(pb), workhandler(wh), steps(0), running(true), paused(false),
       start_time(time(0)), elapsed_time(0),
       pause(paused ? "Start" : "Pause"),
-      step("Step"), redraw("Redraw"), quit("Quit"), steps_l("No steps run\n"),
+      step("Step"), redraw("Redraw"),
+      lights(wh->get_tracer().get_light_sampling() ? "Bounce only" : "Lights"),
+      noise("Noise"), denoise("Denoise"), quit("Quit"), steps_l("No steps run\n"),
+      stats_l(""),
       exposure_adj(1.0, 0.0, 4.0, 0.01, 0.1, 0.0), exposure(exposure_adj)      
   {
     set_border_width(10);
@@ -181,6 +246,9 @@ public:
     tools.pack_start(steps_l, false, true);
     steps_l.show();
 
+    tools.pack_start(stats_l, false, true);
+    stats_l.show();
+
     exposure_adj.signal_value_changed().connect(sigc::mem_fun(*this, &ImageWindow::on_change_exposure));
     exposure.set_size_request(200, 50);
     tools.pack_start(exposure, false, true);
@@ -190,6 +258,18 @@ public:
     tools.pack_end(quit, false, true);
     quit.show();
     
+    denoise.signal_clicked().connect(sigc::mem_fun(*this, &ImageWindow::on_denoise));
+    tools.pack_end(denoise, false, true);
+    denoise.show();
+
+    noise.signal_clicked().connect(sigc::mem_fun(*this, &ImageWindow::on_noise));
+    tools.pack_end(noise, false, true);
+    noise.show();
+
+    lights.signal_clicked().connect(sigc::mem_fun(*this, &ImageWindow::on_lights));
+    tools.pack_end(lights, false, true);
+    lights.show();
+
     redraw.signal_clicked().connect(sigc::mem_fun(*this, &ImageWindow::on_redraw));
     tools.pack_end(redraw, false, true);
     redraw.show();
@@ -207,7 +287,8 @@ public:
     tools.show();
     hsplit.show();
     show();
-    workhandler->signal_frame.connect(sigc::mem_fun(*this, &ImageWindow::on_frame));
+    Glib::signal_timeout().connect(sigc::mem_fun(*this, &ImageWindow::on_present),
+				   present_interval);
   }
 
   virtual ~ImageWindow() {
@@ -229,9 +310,17 @@ void stop_work() {
 
 static void print_help(const char* name) {
   fprintf(stderr,
-	  "Usage: %s [-t COUNT] [-s WIDTHxHEIGHT]\n"
+	  "Usage: %s [-t COUNT] [-s WIDTHxHEIGHT] [-a THRESHOLD] [-c] [-L]\n"
+	  "          [SCENE]\n"
 	  "    -t: set thread count\n"
-	  "    -s: set screen size (e.g. 640x480)",
+	  "    -s: set screen size (e.g. 640x480)\n"
+	  "    -a: sample adaptively until the relative error of every pixel\n"
+	  "        is below this (e.g. 0.02)\n"
+	  "    -c: keep the built scene in SCENE.cache for the next run\n"
+	  "    -L: start with sampling lights directly as well as finding\n"
+	  "        them by bouncing\n"
+	  "SCENE is a scene description file; without one, the built-in\n"
+	  "example scene is shown.\n",
 	  name);
 }
 
@@ -243,8 +332,11 @@ int main(int argc, char **argv) {
   int height = 480;
 
   int threads = 1;
+  double threshold = 0;
+  bool use_cache = false;
+  bool light_sampling = false;
   int opt;
-  while ((opt = getopt(argc, argv, "t:s:")) != -1) {
+  while ((opt = getopt(argc, argv, "t:s:a:cL")) != -1) {
     switch (opt) {
     case 's': {
       int r = sscanf(optarg, "%dx%d", &width, &height);
@@ -260,6 +352,19 @@ int main(int argc, char **argv) {
       print_help(argv[0]);
       exit(EXIT_FAILURE);
     }
+    case 'a': {
+      int r = sscanf(optarg, "%lf", &threshold);
+      if (r == 1 && threshold > 0)
+        break;
+      print_help(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    case 'c':
+      use_cache = true;
+      break;
+    case 'L':
+      light_sampling = true;
+      break;
     case 'h':
     case '?':
       print_help(argv[0]);
@@ -270,48 +375,27 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (optind < argc - 1 || (use_cache && optind == argc)) {
+    print_help(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
   Scene s;
-  //s.add(Object(Sphere(Vector3(1.0, 1.6, 0.0), 0.5),
-  //	       Glass(Colour(0.5, 0.9, 0.99), 1.52, 0.01)));
-  s.add(Object(Sphere(Vector3(1.0, 1.6, 0.0), 0.5),
-	       Film(400e-9, 1.33, 0.01)));
-  s.add(Object(Difference(Sphere(Vector3(-1.1, 2.8, 0.0), 0.5),
-			  Sphere(Vector3(-0.8, 2.6, 0.1), 0.5)),
-	       Material(Colour(0.8, 0.8, 0.8), 0.01)));
-  for (int i = 0 ; i < 4 ; ++i) {
-    s.add(Object(Sphere(Vector3(-1.1 + i * 0.7, 1.4 + i * 0.5, -0.25), 0.25),
-		 Material(Colour(0.96, 0.65, 0.55), 0.04)));
+  Camera cam = demo_camera();
+  if (optind < argc) {
+    if (!SceneFile::load(argv[optind], s, cam, use_cache))
+      exit(EXIT_FAILURE);
   }
-  s.add(Object(Sphere(Vector3(0.4, 0.6, -0.40), 0.10),
-	       Material(Colour(0.96, 0.65, 0.55), 0.04)));
-
-  s.add(Object(Plane(Vector3(0.0, 3.5, -0.5), Vector3(0, 0, 1)),
-	       Material(Colour(0.9, 0.9, 0.9))));
-  s.add(Object(Plane(Vector3(0.0, 4.5, 0.0), Vector3(0, -1, 0)),
-	       Material(Colour(0.9, 0.9, 0.9)))); //takaseinä
-  s.add(Object(Plane(Vector3(-1.9, 3.5, 0.0), Vector3(1, 0, 0)),
-	       Material(Colour(0.9, 0.5, 0.5))));
-  s.add(Object(Plane(Vector3(1.9, 3.5, 0.0), Vector3(-1, 0, 0)),
-	       Material(Colour(0.5, 0.5, 0.9))));
-  s.add(Object(Plane(Vector3(0.0, 0.0, 2.5), Vector3(0, 0, -1)),
-	       Material(Colour(0.0, 0.0, 0.0),
-			Colour(126, 116, 102) * 0.25)));
-  s.add(Object(Plane(Vector3(0.0, -2.5, 0.0), Vector3(0, 1, 0)),
-	       Material(Colour(0.9, 0.9, 0.9))));
-
-  //s.mean_free_path = 10.0;
-
-  Camera cam(Vector3(0.0, -0.5, 0.0),
-	     Vector3(-1.3, 1.0, 1.0),
-	     Vector3(1.3, 1.0, 1.0),
-	     Vector3(-1.3, 1.0, -1.0),
-	     4.0, 0.015);
-  
+  else {
+    demo_scene(s);
+  }
+
   Tracer tr(s, cam);
+  tr.set_light_sampling(light_sampling);
 
   Glib::RefPtr<Gdk::Pixbuf> buf = 
     Gdk::Pixbuf::create(Gdk::COLORSPACE_RGB, false, 8, width, height);
-  wh = new Workhandler(tr, buf, threads);
+  wh = new Workhandler(tr, buf, threads, threshold);
   atexit(stop_work);
   ImageWindow window(buf, wh);
   
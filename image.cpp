@@ -0,0 +1,272 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+
+#include <assert.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "image.h"
+#include "linalg.h"
+#include "mappedfile.h"
+#include "tonemap.h"
+
+const double Image::dark_level = 0.01;
+
+/* Converts a band of rows of the image, on a thread of its own or on
+ * the caller's */
+struct Image::Blit {
+  // Fewer pixels than this per thread aren't worth starting a thread for
+  const static unsigned int min_pixels = 65536;
+
+  Image const *image;
+  unsigned char *pixels;
+  int rowstride;
+  double exposure;
+  bool variance;
+  unsigned int y0, y1;
+  pthread_t thread;
+
+  /* Works a row at a time. The image goes through the vectorized loops
+   * of ToneCurve::map_means(), and the standard errors through the
+   * products of a row and map(). */
+  void run() const {
+    ToneCurve const &curve = ToneCurve::get();
+    unsigned int const width = image->width;
+    std::vector<float> products(variance ? width * 3 : 0);
+    for (unsigned int y = y0 ; y < y1 ; ++y) {
+      unsigned int const row = y * width;
+      unsigned int const *samples = image->samples + row;
+      unsigned char *out = pixels + (size_t)y * rowstride;
+      if (!variance) {
+	curve.map_means(image->data + row, samples, exposure, out, width);
+	continue;
+      }
+      float *p = &products[0];
+      double const *m2 = image->m2 + row;
+      for (unsigned int x = 0 ; x < width ; ++x, p += 3) {
+	unsigned int const n = samples[x];
+	double const e = n < 2 ? INFINITY : sqrt(m2[x] / (n - 1) / n);
+	p[0] = p[1] = p[2] = e * exposure;
+      }
+      curve.map(&products[0], out, width * 3);
+    }
+  }
+
+  static void* run_thread(void *blit_void) {
+    static_cast<Blit*>(blit_void)->run();
+    return 0;
+  }
+
+  /* Splits the image into bands for at most the given number of
+   * threads, runs them and waits for them to finish */
+  static void run_all(Image const &image, unsigned char *pixels,
+		      int rowstride, double exposure, bool variance,
+		      int threads) {
+    unsigned int const pixel_count = image.width * image.height;
+    unsigned int count = threads > 1 ? threads : 1;
+    if (count > pixel_count / min_pixels)
+      count = pixel_count / min_pixels > 1 ? pixel_count / min_pixels : 1;
+
+    std::vector<Blit> bands(count);
+    std::vector<bool> started(count, false);
+    for (unsigned int i = 0 ; i < count ; ++i) {
+      Blit &b = bands[i];
+      b.image = &image;
+      b.pixels = pixels;
+      b.rowstride = rowstride;
+      b.exposure = exposure;
+      b.variance = variance;
+      b.y0 = image.height * i / count;
+      b.y1 = image.height * (i + 1) / count;
+    }
+    // The first band is done here, and those whose threads can't be
+    // started too
+    for (unsigned int i = 1 ; i < count ; ++i)
+      started[i] = pthread_create(&bands[i].thread, 0, run_thread,
+				  &bands[i]) == 0;
+    for (unsigned int i = 0 ; i < count ; ++i) {
+      if (!started[i])
+	bands[i].run();
+    }
+    for (unsigned int i = 1 ; i < count ; ++i) {
+      if (started[i])
+	pthread_join(bands[i].thread, 0);
+    }
+  }
+};
+
+void Image::blit_to(unsigned char *pixels, int rowstride, double exposure,
+		    int threads) const {
+  Blit::run_all(*this, pixels, rowstride, exposure, false, threads);
+}
+
+void Image::blit_variance(unsigned char *pixels, int rowstride,
+			  double exposure, int threads) const {
+  Blit::run_all(*this, pixels, rowstride, exposure, true, threads);
+}
+
+bool Image::write_pfm(const char *filename) const {
+  FILE *f = fopen(filename, "wb");
+  if (!f) return false;
+  // Negative scale marks little-endian data. Rows go from bottom to top.
+  fprintf(f, "PF\n%u %u\n-1.0\n", width, height);
+  float *row = new float[width * 3];
+  for (unsigned int y = height ; y-- > 0 ; ) {
+    for (unsigned int x = 0 ; x < width ; ++x) {
+      Colourd const col = mean(x, y);
+      row[x * 3] = col.r();
+      row[x * 3 + 1] = col.g();
+      row[x * 3 + 2] = col.b();
+    }
+    fwrite(row, sizeof(float), width * 3, f);
+  }
+  delete [] row;
+  return fclose(f) == 0;
+}
+
+bool Image::write_ppm(const char *filename, double exposure) const {
+  FILE *f = fopen(filename, "wb");
+  if (!f) return false;
+  fprintf(f, "P6\n%u %u\n255\n", width, height);
+  unsigned char *pixels = new unsigned char[width * height * 3];
+  blit_to(pixels, width * 3, exposure);
+  fwrite(pixels, 1, width * height * 3, f);
+  delete [] pixels;
+  return fclose(f) == 0;
+}
+
+/* Checkpoints are written in the native byte order and layout, with a
+ * header to reject those from another kind of machine:
+ *
+ *   magic, version, byte order mark, sizeof(Colourd)
+ *   width, height, passes
+ *   seed count and the seeds
+ *   sums, sample counts, m2 and feature sums of the pixels, each
+ *   starting at a multiple of 16 bytes from the start of the file
+ */
+namespace {
+  const char checkpoint_magic[8] = { 'p', 't', 'c', 'h', 'e', 'c', 'k', '\n' };
+  const uint32_t checkpoint_version = 2;
+  const uint32_t byte_order = 0x01020304;
+  const size_t alignment = 16;
+
+  bool put(FILE *f, size_t &position, void const *data, size_t size) {
+    position += size;
+    return size == 0 || fwrite(data, size, 1, f) == 1;
+  }
+
+  bool align(FILE *f, size_t &position) {
+    static const char zeros[alignment] = { 0 };
+    return put(f, position, zeros,
+	       (alignment - position % alignment) % alignment);
+  }
+
+  bool get(const char *&p, const char *end, void *data, size_t size) {
+    if (size > (size_t)(end - p))
+      return false;
+    memcpy(data, p, size);
+    p += size;
+    return true;
+  }
+
+  void align(const char *start, const char *&p, const char *end) {
+    size_t const pad = (alignment - (p - start) % alignment) % alignment;
+    p = pad < (size_t)(end - p) ? p + pad : end;
+  }
+}
+
+bool Image::write_checkpoint(FILE *f,
+			     std::vector<uint64_t> const &seeds) const {
+  uint32_t const header[] = {
+    checkpoint_version, byte_order, sizeof(Colourd), width, height,
+    (uint32_t)paints_started, (uint32_t)seeds.size()
+  };
+  unsigned int const pixels = width * height;
+  size_t position = 0;
+  return put(f, position, checkpoint_magic, sizeof(checkpoint_magic)) &&
+    put(f, position, header, sizeof(header)) &&
+    put(f, position, seeds.empty() ? 0 : &seeds[0],
+	seeds.size() * sizeof(uint64_t)) &&
+    align(f, position) && put(f, position, data, pixels * sizeof(Colourd)) &&
+    align(f, position) &&
+    put(f, position, samples, pixels * sizeof(unsigned int)) &&
+    align(f, position) && put(f, position, m2, pixels * sizeof(double)) &&
+    align(f, position) &&
+    put(f, position, features, pixels * sizeof(Features));
+}
+
+bool Image::write_checkpoint(const char *filename,
+			     std::vector<uint64_t> const &seeds) const {
+  std::string const temp = std::string(filename) + ".tmp";
+  FILE *f = fopen(temp.c_str(), "wb");
+  if (!f) return false;
+
+  bool ok = write_checkpoint(f, seeds);
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(temp.c_str(), filename) != 0) {
+    int const saved = errno;
+    remove(temp.c_str());
+    errno = saved;
+    return false;
+  }
+  return true;
+}
+
+Image* Image::read_checkpoint(const char *filename,
+			      std::vector<uint64_t> &seeds) {
+  MappedFile file;
+  if (!file.open(filename)) {
+    perror(filename);
+    return 0;
+  }
+  return read_checkpoint(filename, file.data(), file.size(), seeds);
+}
+
+Image* Image::read_checkpoint(const char *name, const char *start,
+			      size_t size, std::vector<uint64_t> &seeds) {
+  const char *p = start, *end = start + size;
+  char magic[sizeof(checkpoint_magic)];
+  uint32_t header[7];
+  if (!get(p, end, magic, sizeof(magic)) ||
+      memcmp(magic, checkpoint_magic, sizeof(magic)) != 0 ||
+      !get(p, end, header, sizeof(header)) ||
+      header[0] != checkpoint_version || header[1] != byte_order ||
+      header[2] != sizeof(Colourd)) {
+    fprintf(stderr, "%s: not a checkpoint from this version on this kind "
+	    "of machine\n", name);
+    return 0;
+  }
+
+  unsigned int const width = header[3], height = header[4];
+  size_t const pixels = (size_t)width * height;
+  size_t const count = header[6];
+  if (pixels == 0 || count > (size_t)(end - p) / sizeof(uint64_t) ||
+      pixels > (size_t)(end - p) / (sizeof(Colourd) + sizeof(unsigned int) +
+				    sizeof(double) + sizeof(Features))) {
+    fprintf(stderr, "%s: truncated checkpoint\n", name);
+    return 0;
+  }
+  seeds.resize(count);
+  Image *img = new Image(width, height);
+  img->paints_started = header[5];
+  bool ok = get(p, end, count ? &seeds[0] : 0,
+		count * sizeof(uint64_t));
+  align(start, p, end);
+  ok = ok && get(p, end, img->data, pixels * sizeof(Colourd));
+  align(start, p, end);
+  ok = ok && get(p, end, img->samples,
+		 pixels * sizeof(unsigned int));
+  align(start, p, end);
+  ok = ok && get(p, end, img->m2, pixels * sizeof(double));
+  align(start, p, end);
+  ok = ok && get(p, end, img->features, pixels * sizeof(Features));
+  if (!ok || p != end) {
+    fprintf(stderr, "%s: truncated checkpoint\n", name);
+    delete img;
+    return 0;
+  }
+  return img;
+}
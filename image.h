@@ -0,0 +1,279 @@
+#ifndef PATHTRACE_IMAGE_H
+#define PATHTRACE_IMAGE_H
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+
+#include "linalg.h"
+
+/* A rectangular part of an image, from (x0, y0) up to but not including
+ * (x1, y1) */
+struct Tile {
+  unsigned int x0, y0, x1, y1;
+
+  Tile()
+    : x0(0), y0(0), x1(0), y1(0)
+  { }
+
+  Tile(unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1)
+    : x0(x0), y0(y0), x1(x1), y1(y1)
+  { }
+
+  unsigned int width() const { return x1 - x0; }
+  unsigned int height() const { return y1 - y0; }
+  unsigned int size() const { return width() * height(); }
+};
+
+/* What the camera ray of a sample hit first: the colour of the
+ * material, the normal turned towards the ray and the distance. A ray
+ * that hits nothing has a black albedo, a zero distance and the reverse
+ * of its direction as the normal. Pixels sum the features of their
+ * samples, which the denoiser uses to tell edges from noise. */
+struct Features {
+  Colourd albedo;
+  Vector3d normal;
+  double depth;
+
+  Features()
+    : albedo(), normal(), depth(0)
+  { }
+
+  Features& operator+=(Features const &other) {
+    albedo += other.albedo;
+    normal += other.normal;
+    depth += other.depth;
+    return *this;
+  }
+};
+
+/* Samples of one pixel taken in one go: their sum and count, the sum of
+ * squared deviations of their luminance from its mean, kept with
+ * Welford's method for estimating the noise of the pixel, and the sum of
+ * their features */
+struct PixelSamples {
+  Colourd sum;
+  unsigned int count;
+  double m2;
+  Features features;
+
+  PixelSamples()
+    : sum(), count(0), m2(0), features()
+  { }
+
+  void add(Colour const &col, Features const &f = Features()) {
+    double const y = col.luminance();
+    double const old_mean = count > 0 ? sum.luminance() / count : 0;
+    sum += col;
+    count++;
+    m2 += (y - old_mean) * (y - sum.luminance() / count);
+    features += f;
+  }
+};
+
+/* Accumulation buffer. Each pixel holds the sum of its samples and the
+ * number of samples, so that parts of the image can be rendered at
+ * different times. The sums are double even in a float build, as a
+ * float sum stops growing long before a render is done. */
+class Image {
+private:
+  Colourd *data;
+  unsigned int *samples;
+  // Sum of squared deviations of the luminance of the samples from
+  // their mean
+  double *m2;
+  Features *features;
+  int paints_started;
+
+  /* Adds count samples, with the given sum, m2 and features, to pixel
+   * i. Combines the deviations of the two sets of samples the way Chan
+   * et al. do for parallel variance. */
+  void merge(unsigned int i, Colourd const &sum, unsigned int count,
+	     double sum_m2, Features const &sum_features) {
+    if (count == 0) return;
+    features[i] += sum_features;
+    unsigned int const n = samples[i];
+    if (n > 0) {
+      double const delta = sum.luminance() / count -
+	data[i].luminance() / n;
+      m2[i] += sum_m2 + delta * delta * ((double)n * count / (n + count));
+    }
+    else {
+      m2[i] = sum_m2;
+    }
+    data[i] += sum;
+    samples[i] += count;
+  }
+
+  Image(Image const &);
+  Image& operator=(Image const &);
+
+  struct Blit;
+
+public:
+  const static double dark_level;
+
+  unsigned int width, height;
+
+  /* Converts the image to 8-bit sRGB, three bytes per pixel, into a
+   * buffer with the given row stride (e.g. the pixels of a Gdk::Pixbuf).
+   * Large images are split into bands of rows converted on up to the
+   * given number of threads. */
+  void blit_to(unsigned char *pixels, int rowstride, double exposure,
+	       int threads = 1) const;
+  /* Shows the standard error of each pixel (the square root of
+   * variance()) the same way blit_to() shows the pixel. Pixels with too
+   * few samples to tell are white. */
+  void blit_variance(unsigned char *pixels, int rowstride,
+		     double exposure, int threads = 1) const;
+
+  /* Portable float map: linear, unexposed radiance */
+  bool write_pfm(const char *filename) const;
+  /* Binary portable pixmap: exposed and sRGB-encoded */
+  bool write_ppm(const char *filename, double exposure) const;
+
+  /* Checkpoints hold the whole accumulation buffer, features included,
+   * so that a render can be resumed or merged with others later,
+   * together with the seeds of the renders that went into it. A new
+   * checkpoint is written next to the old one and renamed over it, so
+   * that a crash while writing leaves the previous one intact. */
+  bool write_checkpoint(const char *filename,
+			std::vector<uint64_t> const &seeds) const;
+  /* Reads a checkpoint into a new image of its size. Prints what went
+   * wrong and returns 0 on failure. */
+  static Image* read_checkpoint(const char *filename,
+				std::vector<uint64_t> &seeds);
+  /* The same for any stream, such as a socket or a buffer in memory,
+   * and for a checkpoint already in memory. The name is for messages. */
+  bool write_checkpoint(FILE *f, std::vector<uint64_t> const &seeds) const;
+  static Image* read_checkpoint(const char *name, const char *data,
+				size_t size, std::vector<uint64_t> &seeds);
+
+  Image(unsigned int width, unsigned int height)
+    : paints_started(0), width(width), height(height)
+  {
+    data = new Colourd[width * height];
+    samples = new unsigned int[width * height];
+    m2 = new double[width * height];
+    features = new Features[width * height];
+    for (unsigned int i = 0 ; i < width * height ; ++i) {
+      samples[i] = 0;
+      m2[i] = 0;
+    }
+  }
+
+  ~Image() {
+    delete [] data;
+    delete [] samples;
+    delete [] m2;
+    delete [] features;
+  }
+
+  const Colourd& operator()(unsigned int x, unsigned int y) const {
+    assert(x < width && y < height);
+    return data[y * width + x];
+  }
+
+  Colourd& operator()(unsigned int x, unsigned int y) {
+    assert(x < width && y < height);
+    return data[y * width + x];
+  }
+
+  /* The mean of the samples of a pixel */
+  const Colourd mean(unsigned int x, unsigned int y) const {
+    unsigned int const n = samples[y * width + x];
+    if (n == 0) return Colourd();
+    return data[y * width + x] / n;
+  }
+
+  unsigned int sample_count(unsigned int x, unsigned int y) const {
+    return samples[y * width + x];
+  }
+
+  /* The mean of the features of the samples of a pixel */
+  const Features mean_features(unsigned int x, unsigned int y) const {
+    unsigned int const n = samples[y * width + x];
+    Features f;
+    if (n == 0) return f;
+    Features const &sum = features[y * width + x];
+    f.albedo = sum.albedo / n;
+    f.normal = sum.normal / n;
+    f.depth = sum.depth / n;
+    return f;
+  }
+
+  void add(unsigned int x, unsigned int y, Colour const &col,
+	   Features const &f = Features()) {
+    assert(x < width && y < height);
+    merge(y * width + x, Colourd(col), 1, 0.0, f);
+  }
+
+  /* Adds the samples taken for the pixels of the tile. tile_data holds
+   * them row by row, tile.width() per row. */
+  void add(Tile const &tile, PixelSamples const *tile_data) {
+    assert(tile.x1 <= width && tile.y1 <= height);
+    for (unsigned int y = tile.y0 ; y < tile.y1 ; ++y) {
+      unsigned int const row = y * width;
+      for (unsigned int x = tile.x0 ; x < tile.x1 ; ++x) {
+	merge(row + x, tile_data->sum, tile_data->count, tile_data->m2,
+	      tile_data->features);
+	tile_data++;
+      }
+    }
+  }
+
+  /* Makes this a copy of an image of the same size */
+  void copy_from(Image const &other) {
+    assert(width == other.width && height == other.height);
+    std::copy(other.data, other.data + width * height, data);
+    std::copy(other.samples, other.samples + width * height, samples);
+    std::copy(other.m2, other.m2 + width * height, m2);
+    std::copy(other.features, other.features + width * height, features);
+    paints_started = other.paints_started;
+  }
+
+  void add(Image const &other) {
+    assert(width == other.width && height == other.height);
+    for (unsigned int i = 0 ; i < width * height ; ++i)
+      merge(i, other.data[i], other.samples[i], other.m2[i],
+	    other.features[i]);
+    paints_started += other.paints_started;
+  }
+
+  /* Estimated variance of the mean luminance of a pixel, INFINITY if
+   * there are fewer than two samples */
+  double variance(unsigned int x, unsigned int y) const {
+    unsigned int const i = y * width + x;
+    if (samples[i] < 2) return INFINITY;
+    return m2[i] / (samples[i] - 1) / samples[i];
+  }
+
+  /* Standard error of the mean luminance of a pixel relative to the
+   * mean. Pixels darker than dark_level are measured against it
+   * instead, so that black pixels can converge too. */
+  double relative_error(unsigned int x, unsigned int y) const {
+    double const v = variance(x, y);
+    if (v == INFINITY) return INFINITY;
+    double const level = mean(x, y).luminance();
+    return sqrt(v) / (level > dark_level ? level : dark_level);
+  }
+
+  /* Counts full passes over the image */
+  void paint_start() {
+    paints_started++;
+  }
+
+  int get_paints_started() const {
+    return paints_started;
+  }
+};
+
+/*
+Local Variables:
+mode:c++
+End:
+*/
+#endif /* PATHTRACE_IMAGE_H */
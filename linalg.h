@@ -2,133 +2,169 @@
 #define PATHTRACE_LINALG_H
 
 #include <cmath>
-#include <cstdlib>
+#include <cfloat>
+#include <limits>
+
+#include "random.h"
+
+/* The scalar type of the hot path: vectors, colours, shapes and meshes,
+ * the box tests of the hierarchies and packets of rays. Building with
+ * -DPATHTRACE_FLOAT makes it float, which halves the size of meshes and
+ * bounding volume hierarchies and doubles the width of packets. What
+ * needs the precision stays double either way: ray origins, which may be
+ * far from the origin of the scene, the solving of spheres and triangles
+ * for single rays and the sums of the image. */
+#ifdef PATHTRACE_FLOAT
+typedef float real;
+#else
+typedef double real;
+#endif
+
+template <class T> struct BasicVector3;
+
+/* What vectors of T are made from implicitly: double ones from float
+ * ones, so that float vectors can be used where double ones are
+ * expected. Narrowing has to be asked for. */
+template <class T> struct Widening {
+  struct Nothing { };
+  typedef Nothing From;
+};
+
+template <> struct Widening<double> {
+  typedef BasicVector3<float> From;
+};
 
-struct Vector3 {
-  double x, y, z;
+template <class T>
+struct BasicVector3 {
+  T x, y, z;
 
-  Vector3()
+  BasicVector3()
     : x(0.0), y(0.0), z(0.0) { }
-  Vector3(double const x, double const y, double const z)
+  BasicVector3(T const x, T const y, T const z)
     : x(x), y(y), z(z) { }
+  BasicVector3(typename Widening<T>::From const &other)
+    : x(other.x), y(other.y), z(other.z) { }
+  template <class U>
+  explicit BasicVector3(BasicVector3<U> const &other)
+    : x(other.x), y(other.y), z(other.z) { }
 
-  double length() const {
+  T length() const {
     return sqrt(x * x + y * y + z * z);
   }
 
   void normalize() {
-    double length = sqrt(x * x + y * y + z * z);
+    T length = sqrt(x * x + y * y + z * z);
     x /= length;
     y /= length;
     z /= length;
   }
 
-  void set(double const x, double const y, double const z) {
+  void set(T const x, T const y, T const z) {
     this->x = x;
     this->y = y;
     this->z = z;
   }
 
-  const Vector3 operator- () const {
-    Vector3 res(-x, -y, -z);
+  const BasicVector3 operator- () const {
+    BasicVector3 res(-x, -y, -z);
     return res;
   }
 
-  const Vector3 operator- (Vector3 const &other) const {
-    Vector3 res;
+  const BasicVector3 operator- (BasicVector3 const &other) const {
+    BasicVector3 res;
     res.x = x - other.x;
     res.y = y - other.y;
     res.z = z - other.z;
     return res;
   }
 
-  Vector3 operator-= (Vector3 const &other) {
+  BasicVector3 operator-= (BasicVector3 const &other) {
     x -= other.x;
     y -= other.y;
     z -= other.z;
     return *this;
   }
 
-  const Vector3 operator+ (Vector3 const &other) const {
-    Vector3 res;
+  const BasicVector3 operator+ (BasicVector3 const &other) const {
+    BasicVector3 res;
     res.x = x + other.x;
     res.y = y + other.y;
     res.z = z + other.z;
     return res;
   }
 
-  Vector3 operator+= (Vector3 const &other) {
+  BasicVector3 operator+= (BasicVector3 const &other) {
     x += other.x;
     y += other.y;
     z += other.z;
     return *this;
   }
 
-  const Vector3 operator* (double const f) const {
-    Vector3 res(x * f, y * f, z * f);
+  const BasicVector3 operator* (T const f) const {
+    BasicVector3 res(x * f, y * f, z * f);
     return res;
   }
 
-  Vector3 operator*= (double const f) {
+  BasicVector3 operator*= (T const f) {
     this->x *= f;
     this->y *= f;
     this->z *= f;
     return *this;
   }
 
-  Vector3 operator*= (Vector3 const &other) {
+  BasicVector3 operator*= (BasicVector3 const &other) {
     this->x *= other.x;
     this->y *= other.y;
     this->z *= other.z;
     return *this;
   }
 
-  const Vector3 operator/ (double const f) const {
-    Vector3 res(x / f, y / f, z / f);
+  const BasicVector3 operator/ (T const f) const {
+    BasicVector3 res(x / f, y / f, z / f);
     return res;
   }
 
-  const Vector3 operator/ (Vector3 const other) const {
-    Vector3 res(x / other.x, y / other.y, z / other.z);
+  const BasicVector3 operator/ (BasicVector3 const other) const {
+    BasicVector3 res(x / other.x, y / other.y, z / other.z);
     return res;
   }
 
-  Vector3 operator/= (double const f) {
+  BasicVector3 operator/= (T const f) {
     this->x /= f;
     this->y /= f;
     this->z /= f;
     return *this;
   }
 
-  Vector3 operator/= (Vector3 const &other) {
+  BasicVector3 operator/= (BasicVector3 const &other) {
     this->x /= other.x;
     this->y /= other.y;
     this->z /= other.z;
     return *this;
   }
 
-  double dot(Vector3 const &other) const {
+  T dot(BasicVector3 const &other) const {
     return x * other.x + y * other.y + z * other.z;
   }
 
-  const Vector3 cross(Vector3 const &other) const {
-    Vector3 res;
+  const BasicVector3 cross(BasicVector3 const &other) const {
+    BasicVector3 res;
     res.x = y * other.z - z * other.y;
     res.y = z * other.x - x * other.z;
     res.z = x * other.y - y * other.x;
     return res;
   }
 
-  const Vector3 at_length(double const new_length) const {
-    double const factor = new_length / length();
-    Vector3 res = *this * factor;
+  const BasicVector3 at_length(T const new_length) const {
+    T const factor = new_length / length();
+    BasicVector3 res = *this * factor;
     return res;
   }
 
-  const Vector3 generate_normal() const {
-    Vector3 rand1(1.0, 0.0, 0.0);
-    Vector3 rand2(0.0, 1.0, 0.0);
-    Vector3 normal;
+  const BasicVector3 generate_normal() const {
+    BasicVector3 rand1(1.0, 0.0, 0.0);
+    BasicVector3 rand2(0.0, 1.0, 0.0);
+    BasicVector3 normal;
     if (fabs(this->dot(rand1)) < fabs(this->dot(rand2))) {
       normal = this->cross(rand1);
     }
@@ -142,44 +178,57 @@ struct Vector3 {
     return x == 0.0 && y == 0.0 && z == 0.0;
   }
 
-  const Vector3 static gaussian(double mean, double variance) {
+  T operator[](int const axis) const {
+    return axis == 0 ? x : (axis == 1 ? y : z);
+  }
+
+  /* A direction tilted from the z axis by a gaussian angle. The
+   * generator is a Random or a Sampler. */
+  template <class Generator>
+  const BasicVector3 static gaussian(Generator &rng, double mean,
+				     double variance) {
     /* 1: (sin(rot1), 0, cos(rot1))
      * 2: (sin(rot1) * cos(rot2), sin(rot1) * sin(rot2), cos(rot1)) */
-    double u1 = (double)random() / RAND_MAX;
-    double u2 = (double)random() / RAND_MAX;
+    double u1, u2;
+    rng.uniform2(u1, u2);
+    u1 = 1 - u1;
     // Box-Muller transform
     double nat1 = sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
     //double nat2 = sqrt(-2 * log(u1)) * sin(2 * M_PI * u2);
     double rot1 = variance * nat1 + mean;
-    double rot2 = (double)random() / RAND_MAX * 2 * M_PI;/*var1 * nat1 + mean;*/
-    Vector3 ret(sin(rot1) * cos(rot2), sin(rot1) * sin(rot2), cos(rot1));
+    double rot2 = rng.uniform() * 2 * M_PI;/*var1 * nat1 + mean;*/
+    BasicVector3 ret(sin(rot1) * cos(rot2), sin(rot1) * sin(rot2), cos(rot1));
     return ret;
   }
 
-  const Vector3 static uniform_random() {
-    double rot1 = acos((double)random() / RAND_MAX * 2 - 1);
-    double rot2 = (double)random() / RAND_MAX * 2 * M_PI;
-    Vector3 ret(sin(rot1) * cos(rot2), sin(rot1) * sin(rot2), cos(rot1));
+  template <class Generator>
+  const BasicVector3 static uniform_random(Generator &rng) {
+    double u, v;
+    rng.uniform2(u, v);
+    double rot1 = acos(u * 2 - 1);
+    double rot2 = v * 2 * M_PI;
+    BasicVector3 ret(sin(rot1) * cos(rot2), sin(rot1) * sin(rot2), cos(rot1));
     return ret;
   }
 };
 
-struct Colour : public Vector3 {
+template <class T>
+struct BasicColour : public BasicVector3<T> {
 private:
-  static double expose(double const val, double const exposure) {
+  static T expose(T const val, T const exposure) {
     return 1.0 - exp(val * -exposure);
   }
 
-  static double to_srgb(double val) {
-    double a = 0.055;
-    double gamma = 2.4;
+  static T to_srgb(T val) {
+    T a = 0.055;
+    T gamma = 2.4;
     if (val < 0.0031308)
       return 12.92 * val;
     else
       return (1 + a) * pow(val, 1.0 / gamma) - a;
   }
 
-  static double to_byte(double val) {
+  static T to_byte(T val) {
     val *= 255;
     val = round(val);
     if (val < 0) val = 0;
@@ -188,69 +237,90 @@ private:
   }
 
 public:
-  Colour()
-    : Vector3()
+  BasicColour()
+    : BasicVector3<T>()
   { }
 
-  Colour(double r, double g, double b)
-    : Vector3(r, g, b)
+  BasicColour(T r, T g, T b)
+    : BasicVector3<T>(r, g, b)
   { }
 
-  Colour(Vector3 const &v)
-    : Vector3(v)
+  BasicColour(BasicVector3<T> const &v)
+    : BasicVector3<T>(v)
   { }
 
-  double r() const { return x; }
-  double g() const { return y; }
-  double b() const { return z; }
+  template <class U>
+  explicit BasicColour(BasicColour<U> const &other)
+    : BasicVector3<T>(other)
+  { }
+
+  T r() const { return this->x; }
+  T g() const { return this->y; }
+  T b() const { return this->z; }
 
-  const Colour expose(double exposure) const {
-    Colour ret(expose(x, exposure), expose(y, exposure), expose(z, exposure));
+  const BasicColour expose(T exposure) const {
+    BasicColour ret(expose(this->x, exposure), expose(this->y, exposure),
+		    expose(this->z, exposure));
     return ret;
   }
 
-  const Colour to_srgb() const {
-    Colour ret(to_srgb(x), to_srgb(y), to_srgb(z));
+  const BasicColour to_srgb() const {
+    BasicColour ret(to_srgb(this->x), to_srgb(this->y), to_srgb(this->z));
     return ret;
   }
 
-  const Colour to_byte() const {
-    Colour ret(to_byte(x), to_byte(y), to_byte(z));
+  const BasicColour to_byte() const {
+    BasicColour ret(to_byte(this->x), to_byte(this->y), to_byte(this->z));
     return ret;
   }
+
+  /* Relative luminance of linear sRGB */
+  T luminance() const {
+    return 0.2126 * this->x + 0.7152 * this->y + 0.0722 * this->z;
+  }
 };
 
+
+typedef BasicVector3<real> Vector3;
+typedef BasicVector3<double> Vector3d;
+typedef BasicColour<real> Colour;
+typedef BasicColour<double> Colourd;
+
+/* The origin of a ray is double even in a float build, so that rays
+ * leaving surfaces far from the origin of the scene start close to them */
 struct Ray {
-  Vector3 origin;
+  Vector3d origin;
   Vector3 direction;
   double ior;
   Colour opacity;
-  Colour filter;
   bool valid;
 
-  Ray(Vector3 const &origin, Vector3 const &direction)
-    : origin(origin), direction(direction), ior(1.0), opacity(),
-      filter(1.0, 1.0, 1.0), valid(true)
+  Ray(Vector3d const &origin, Vector3 const &direction)
+    : origin(origin), direction(direction), ior(1.0), opacity(), valid(true)
   { }
 
-  Ray(Vector3 const &origin, Vector3 const &direction,
+  Ray(Vector3d const &origin, Vector3 const &direction,
       double const ior, Colour const &opacity)
     : origin(origin), direction(direction), ior(ior), opacity(opacity),
-      filter(1.0, 1.0, 1.0), valid(true)
+      valid(true)
   { }
 
   Ray(Ray const &other, double const distance, Vector3 const &direction)
-    : origin(other.origin + other.direction * distance), direction(direction),
-      ior(other.ior), opacity(other.opacity), filter(other.filter),
-      valid(other.valid)
+    : origin(other.at(distance)), direction(direction),
+      ior(other.ior), opacity(other.opacity), valid(other.valid)
   { }
 
   Ray(Ray const &other, double const distance, Vector3 const &direction,
       double const ior, Colour const &opacity)
-    : origin(other.origin + other.direction * distance), direction(direction),
-      ior(ior), opacity(opacity), filter(other.filter), valid(other.valid)
+    : origin(other.at(distance)), direction(direction),
+      ior(ior), opacity(opacity), valid(other.valid)
   { }
 
+  /* The point at distance along the ray */
+  const Vector3d at(double const distance) const {
+    return origin + Vector3d(direction) * distance;
+  }
+
   static Ray InvalidRay() {
     Ray ret(Vector3(0, 0, 0), Vector3(0, 0, 0));
     ret.valid = false;
@@ -258,6 +328,83 @@ struct Ray {
   }
 };
 
+/* Axis-aligned bounding box */
+struct Box {
+private:
+  // Plain comparisons instead of fmin/fmax, which don't get inlined
+  // with -Os and are far too slow for the inner loops here
+  static real min_of(real const a, real const b) {
+    return a < b ? a : b;
+  }
+
+  static real max_of(real const a, real const b) {
+    return a > b ? a : b;
+  }
+
+public:
+  Vector3 min, max;
+
+  /* The far distance of a hit is scaled up by this to make up for
+   * rounding, so that rays through the shared edge of two flat boxes hit
+   * at least one of them (Ize, Robust BVH Ray Traversal) */
+  static real robust_scale() {
+    return 1 + 3 * std::numeric_limits<real>::epsilon();
+  }
+
+  Box()
+    : min(INFINITY, INFINITY, INFINITY), max(-INFINITY, -INFINITY, -INFINITY)
+  { }
+
+  Box(Vector3 const &min, Vector3 const &max)
+    : min(min), max(max)
+  { }
+
+  bool is_empty() const {
+    return min.x > max.x || min.y > max.y || min.z > max.z;
+  }
+
+  void extend(Vector3 const &p) {
+    min.set(min_of(min.x, p.x), min_of(min.y, p.y), min_of(min.z, p.z));
+    max.set(max_of(max.x, p.x), max_of(max.y, p.y), max_of(max.z, p.z));
+  }
+
+  void extend(Box const &other) {
+    min.set(min_of(min.x, other.min.x), min_of(min.y, other.min.y),
+	    min_of(min.z, other.min.z));
+    max.set(max_of(max.x, other.max.x), max_of(max.y, other.max.y),
+	    max_of(max.z, other.max.z));
+  }
+
+  const Vector3 centroid() const {
+    return (min + max) * 0.5;
+  }
+
+  double surface_area() const {
+    if (is_empty()) return 0.0;
+    Vector3 d = max - min;
+    return 2.0 * (d.x * d.y + d.y * d.z + d.z * d.x);
+  }
+
+  /* Slab test. inv_dir is the componentwise inverse of the ray direction,
+   * so that axis-parallel rays get infinities instead of divisions by
+   * zero. The operand order makes a NaN from 0 * inf drop out. */
+  bool hit(Vector3 const &origin, Vector3 const &inv_dir,
+	   real const max_distance) const {
+    real t0 = (min.x - origin.x) * inv_dir.x;
+    real t1 = (max.x - origin.x) * inv_dir.x;
+    real tmin = min_of(t0, t1), tmax = max_of(t0, t1);
+    t0 = (min.y - origin.y) * inv_dir.y;
+    t1 = (max.y - origin.y) * inv_dir.y;
+    tmin = max_of(min_of(t0, t1), tmin);
+    tmax = min_of(max_of(t0, t1), tmax);
+    t0 = (min.z - origin.z) * inv_dir.z;
+    t1 = (max.z - origin.z) * inv_dir.z;
+    tmin = max_of(min_of(t0, t1), tmin);
+    tmax = min_of(max_of(t0, t1), tmax);
+    return tmax * robust_scale() >= max_of(tmin, 0) && tmin <= max_distance;
+  }
+};
+
 struct Vertex {
   Vector3 loc;
   Vector3 normal;
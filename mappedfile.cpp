@@ -0,0 +1,39 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mappedfile.h"
+
+bool MappedFile::open(const char *filename) {
+  close();
+  int fd = ::open(filename, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    return false;
+  }
+  // An empty file can't be mapped, but it is still a valid file
+  if (st.st_size > 0) {
+    void *p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      ::close(fd);
+      return false;
+    }
+    addr = p;
+    length = st.st_size;
+    // The parsers read the files from start to end
+    madvise(addr, length, MADV_SEQUENTIAL);
+  }
+  ::close(fd);
+  return true;
+}
+
+void MappedFile::close() {
+  if (addr)
+    munmap(addr, length);
+  addr = 0;
+  length = 0;
+}
@@ -0,0 +1,47 @@
+#ifndef PATHTRACE_MAPPEDFILE_H
+#define PATHTRACE_MAPPEDFILE_H
+
+#include <cstddef>
+
+/* A file mapped read-only into memory, so that parsers can work on its
+ * contents in place instead of reading them into buffers first */
+class MappedFile {
+private:
+  void *addr;
+  size_t length;
+
+  MappedFile(MappedFile const &);
+  MappedFile& operator=(MappedFile const &);
+
+public:
+  MappedFile()
+    : addr(0), length(0)
+  { }
+
+  ~MappedFile() {
+    close();
+  }
+
+  /* Returns false and leaves errno set if the file can't be mapped */
+  bool open(const char *filename);
+  void close();
+
+  const char* data() const {
+    return static_cast<const char*>(addr);
+  }
+
+  const char* end() const {
+    return data() + length;
+  }
+
+  size_t size() const {
+    return length;
+  }
+};
+
+/*
+Local Variables:
+mode:c++
+End:
+*/
+#endif /* PATHTRACE_MAPPEDFILE_H */
@@ -1,13 +1,16 @@
 #include <cmath>
-#include <cstdlib>
 
 #include "material.h"
 #include "linalg.h"
+#include "sampler.h"
 
-Ray Material::bounce(Ray const &ray, Vector3 const &normal, double const distance) const {
+const double Material::default_roughness = 1.0;
+
+Ray Material::bounce(Ray const &ray, Vector3 const &normal, double const distance,
+		     Sampler &rng) const {
   Vector3 tangent = normal.generate_normal();
   Vector3 bitangent = normal.cross(tangent);
-  Vector3 g = Vector3::gaussian(0, roughness);
+  Vector3 g = Vector3::gaussian(rng, 0, roughness);
   //if (g.z < 0) g = -g;
   Vector3 my_n = tangent * g.x + bitangent * g.y + normal * g.z;
   if (ray.direction.dot(my_n) * ray.direction.dot(normal) < 0) {
@@ -24,45 +27,157 @@ Ray Material::bounce(Ray const &ray, Vector3 const &normal, double const distanc
   return ret;
 }
 
-Ray Glass::bounce(Ray const &ray, Vector3 const &smooth_normal, double const distance) const {
+double Material::pdf(Ray const &ray, Vector3 const &normal,
+		     Vector3 const &direction) const {
+  Vector3 d = ray.direction;
+  d.normalize();
+  // The microfacet normal that reflects d to direction, on the side
+  // bounce() accepts
+  Vector3 h = direction - d;
+  double const len = h.length();
+  if (len == 0 || roughness <= 0)
+    return 0;
+  h /= len;
+  if (d.dot(normal) > 0)
+    h = -h;
+
+  // bounce() tilts the normal by a gaussian angle in a random plane, so
+  // the angle from the normal is the tilt folded into [0, pi]
+  double cos_theta = h.dot(normal);
+  if (cos_theta > 1) cos_theta = 1;
+  if (cos_theta < -1) cos_theta = -1;
+  double const theta = acos(cos_theta);
+  // Beyond 38 standard deviations the terms are below double precision
+  double angle_pdf = 0;
+  for (int k = -1 ; k <= 1 ; ++k) {
+    double const a = (theta + 2 * M_PI * k) / roughness;
+    if (fabs(a) < 38)
+      angle_pdf += 2 * exp(-a * a / 2);
+  }
+  if (angle_pdf == 0)
+    return 0;
+  angle_pdf /= roughness * sqrt(2 * M_PI);
+
+  double sin_theta = sqrt(1 - cos_theta * cos_theta);
+  if (sin_theta < 1e-12) sin_theta = 1e-12;
+  double const normal_pdf = angle_pdf / (2 * M_PI * sin_theta);
+  // Jacobian of the reflection
+  return normal_pdf / (4 * fabs(d.dot(h)));
+}
+
+/* The normal of the microfacet the ray hits, on the same side of the
+ * surface as smooth_normal */
+static Vector3 facet_normal(Ray const &ray, Vector3 const &smooth_normal,
+			    double roughness, Sampler &rng) {
   Vector3 tangent = smooth_normal.generate_normal();
   Vector3 bitangent = smooth_normal.cross(tangent);
-  Vector3 g = Vector3::gaussian(0, roughness);
+  Vector3 g = Vector3::gaussian(rng, 0, roughness);
   Vector3 normal = tangent * g.x + bitangent * g.y + smooth_normal * g.z;
   if (ray.direction.dot(normal) * ray.direction.dot(smooth_normal) < 0) {
     normal = -normal;
   }
+  return normal;
+}
+
+/* Reflectance of unpolarized light going from index_before to
+ * index_after at cosine theta1 to the normal, with the cosine of the
+ * refracted ray in theta2. Total internal reflection reflects all. */
+static double fresnel(double index_before, double index_after, double theta1,
+		      double &theta2) {
+  double eta = index_before / index_after;
+  // Snell's Law
+  double theta2sq = 1.0 - eta * eta * (1.0 - theta1 * theta1);
+  if (theta2sq <= 0) {
+    theta2 = 0;
+    return 1.0;
+  }
+  theta2 = sqrt(theta2sq);
+  // Fresnel Equations
+  double rs = (index_before * fabs(theta1) - index_after * theta2) /
+    (index_before * fabs(theta1) + index_after * theta2);
+  double rp = (index_after * fabs(theta1) - index_before * theta2) /
+    (index_after * fabs(theta1) + index_before * theta2);
+  return (rs * rs + rp * rp) / 2;
+}
+
+double Glass::ior_at(double wavelength) const {
+  if (abbe <= 0)
+    return ior;
+  // The Fraunhofer lines the Abbe number is defined with: helium d,
+  // hydrogen F and C
+  double const d = 587.6e-9, f = 486.1e-9, c = 656.3e-9;
+  double const b = (ior - 1) / (abbe * (1 / (f * f) - 1 / (c * c)));
+  return ior + b * (1 / (wavelength * wavelength) - 1 / (d * d));
+}
+
+/* Linear interpolation in a table of values at steps + 1 cosines spread
+ * evenly from 0 to 1 */
+static double lookup(std::vector<double> const &table, int steps,
+		     double cosine) {
+  double const x = cosine * steps;
+  int i = (int)x;
+  if (i > steps - 1) i = steps - 1;
+  if (i < 0) i = 0;
+  double const f = x - i;
+  return table[i] + (table[i + 1] - table[i]) * f;
+}
+
+double Glass::reflectance(double outside_cosine) const {
+  if (reflectance_table.empty()) {
+    double theta2;
+    return fresnel(1.0, ior, outside_cosine, theta2);
+  }
+  return lookup(reflectance_table, table_steps, outside_cosine);
+}
+
+void Glass::compile() {
+  reflectance_table.clear();
+  std::vector<double> table(table_steps + 1);
+  for (int i = 0 ; i <= table_steps ; ++i)
+    table[i] = reflectance((double)i / table_steps);
+  reflectance_table.swap(table);
+}
 
+Ray Glass::scatter(Ray const &ray, Vector3 const &normal, double const distance,
+		   Sampler &rng, double ior, bool &refracted) const {
   double theta1 = -ray.direction.dot(normal);
   double index_before = 1.0;
   double index_after = ior;
-  Colour internal_opacity(-log(colour.r()), -log(colour.g()), -log(colour.b()));
 
   if (theta1 < 0.0) {
     index_before = ior;
     index_after = 1.0;
-    internal_opacity.set(0.0, 0.0, 0.0);
   }
 
   double eta = index_before / index_after;
-
   // Snell's Law
   double theta2sq = 1.0 - eta * eta * (1.0 - theta1 * theta1);
-  double theta2 = sqrt(theta2sq);
-  // Fresnel Equations
-  double rs = (index_before * fabs(theta1) - index_after * theta2) /
-    (index_before * fabs(theta1) + index_after * theta2);
-  double rp = (index_after * fabs(theta1) - index_before * theta2) /
-    (index_after * fabs(theta1) + index_before * theta2);
-  double reflectance = (rs * rs + rp * rp) / 2;
+  double theta2 = 0;
+  // The reflectance goes by the cosine outside: the ray's going in, and
+  // the refracted ray's going out
+  double refl = 1.0;
+  if (theta2sq > 0) {
+    if (theta1 < 0.0)
+      theta2 = sqrt(theta2sq);
+    double const outside = theta1 < 0.0 ? theta2 : theta1;
+    double inside;
+    refl = ior == this->ior ? reflectance(outside) :
+      fresnel(1.0, ior, outside, inside);
+  }
 
-  if (theta2sq <= 0 || (double)random() / RAND_MAX < reflectance) {
+  refracted = false;
+  if (refl >= 1.0 || rng.uniform() < refl) {
     Vector3 vec = ray.direction + normal * theta1 * 2.0;
     vec.normalize();
     Ray ret(ray, distance, vec);
     return ret;
   } else {
-    if (theta2sq <= 0) return Ray::InvalidRay();
+    Colour internal_opacity(0.0, 0.0, 0.0);
+    if (theta1 >= 0.0) {
+      theta2 = sqrt(theta2sq);
+      internal_opacity.set(-log(colour.r()), -log(colour.g()),
+			   -log(colour.b()));
+    }
     Vector3 vec;
     if (theta1 > 0)
       vec = ray.direction * eta + normal * (eta * theta1 - theta2);
@@ -70,8 +185,46 @@ Ray Glass::bounce(Ray const &ray, Vector3 const &smooth_normal, double const dis
       vec = ray.direction * eta + normal * (eta * theta1 + theta2);
     vec.normalize();
     Ray ret(ray, distance, vec, index_after, internal_opacity);
+    refracted = true;
+    return ret;
+  }
+}
+
+Ray Glass::bounce(Ray const &ray, Vector3 const &smooth_normal, double const distance,
+		  Sampler &rng) const {
+  Vector3 const normal = facet_normal(ray, smooth_normal, roughness, rng);
+  bool refracted;
+  return scatter(ray, normal, distance, rng, ior, refracted);
+}
+
+Ray Glass::bounce(Ray const &ray, Vector3 const &smooth_normal, double const distance,
+		  Sampler &rng, Wavelengths &w, Double4 &filter) const {
+  if (abbe <= 0 || !w.is_spectral())
+    return bounce(ray, smooth_normal, distance, rng);
+
+  Vector3 const normal = facet_normal(ray, smooth_normal, roughness, rng);
+  double lambda[Wavelengths::lanes];
+  w.get().store(lambda);
+  bool refracted;
+  Ray const ret = scatter(ray, normal, distance, rng, ior_at(lambda[0]),
+			  refracted);
+  if (refracted) {
+    filter = filter * w.terminate_secondary();
     return ret;
   }
+
+  // All the lanes reflect the same way, only more or less likely than
+  // the hero that was picked to
+  double const theta1 = -ray.direction.dot(normal);
+  double r[Wavelengths::lanes];
+  for (int i = 0 ; i < Wavelengths::lanes ; ++i) {
+    double const n = ior_at(lambda[i]);
+    double theta2;
+    r[i] = theta1 < 0 ? fresnel(n, 1.0, theta1, theta2) :
+      fresnel(1.0, n, theta1, theta2);
+  }
+  filter = filter * Double4(1.0, r[1] / r[0], r[2] / r[0], r[3] / r[0]);
+  return ret;
 }
 
 static double refracted_angle(double index_before, double index_after, double theta1) {
@@ -80,7 +233,8 @@ static double refracted_angle(double index_before, double index_after, double th
   return sqrt(1.0 - eta * eta * (1.0 - theta1 * theta1));
 }
 
-static double reflectance(double index_before, double index_after, double theta1) {
+static double film_reflectance(double index_before, double index_after,
+			       double theta1) {
   double extra_refl = 0.2;
   double eta = index_before / index_after;
   // Snell's Law
@@ -103,11 +257,87 @@ static double lerp(double a, double b, double pos) {
   return a * (1 - pos) + b * pos;
 }
 
-Ray Film::bounce(Ray const &ray, Vector3 const &smooth_normal, double const distance) const {
+namespace {
+  /* interference() over one wavelength of path difference, which it
+   * repeats after */
+  struct Fringes {
+    const static int steps = 1024;
+    double table[steps + 1];
+
+    Fringes() {
+      for (int i = 0 ; i <= steps ; ++i)
+	table[i] = interference(1.0, (double)i / steps);
+    }
+
+    double operator() (double waves) const {
+      double const x = (waves - floor(waves)) * steps;
+      int j = (int)x;
+      if (j > steps - 1) j = steps - 1;
+      return table[j] + (table[j + 1] - table[j]) * (x - j);
+    }
+  };
+
+  const Fringes fringes;
+}
+
+/* How much of the light of each lane gets through a film whose two
+ * surfaces reflect amount of it, with a path difference of distance
+ * between them */
+static Double4 interference(Wavelengths const &w, double distance,
+			    double amount) {
+  double waves[Wavelengths::lanes], f[Wavelengths::lanes];
+  (Double4(distance) / w.get()).store(waves);
+  for (int i = 0 ; i < Wavelengths::lanes ; ++i)
+    f[i] = lerp(1.0, fringes(waves[i]), amount);
+  return Double4(f[0], f[1], f[2], f[3]);
+}
+
+Film::Layers Film::exact_layers(double cosine) const {
+  Layers l;
+  double const refl_outside = film_reflectance(1.0, ior, cosine);
+  l.reflect = 2 * refl_outside / (1 + refl_outside);
+  l.cosine = refracted_angle(1.0, ior, cosine);
+  l.inside = film_reflectance(ior, 1.0, l.cosine);
+  l.distance = 2.0 * thickness / l.cosine;
+  return l;
+}
+
+Film::Layers Film::layers(double cosine) const {
+  if (table.empty())
+    return exact_layers(cosine);
+  double const x = cosine * table_steps;
+  int i = (int)x;
+  if (i > table_steps - 1) i = table_steps - 1;
+  if (i < 0) i = 0;
+  double const f = x - i;
+  Layers const &a = table[i], &b = table[i + 1];
+  Layers l;
+  l.reflect = a.reflect + (b.reflect - a.reflect) * f;
+  l.inside = a.inside + (b.inside - a.inside) * f;
+  l.cosine = a.cosine + (b.cosine - a.cosine) * f;
+  l.distance = a.distance + (b.distance - a.distance) * f;
+  return l;
+}
+
+void Film::compile() {
+  table.resize(table_steps + 1);
+  for (int i = 0 ; i <= table_steps ; ++i)
+    table[i] = exact_layers((double)i / table_steps);
+}
+
+Ray Film::bounce(Ray const &ray, Vector3 const &smooth_normal, double const distance,
+		 Sampler &rng) const {
+  Wavelengths w;
+  Double4 filter(1.0);
+  return bounce(ray, smooth_normal, distance, rng, w, filter);
+}
+
+Ray Film::bounce(Ray const &ray, Vector3 const &smooth_normal, double const distance,
+		 Sampler &rng, Wavelengths &w, Double4 &filter) const {
   /*
   Vector3 tangent = smooth_normal.generate_normal();
   Vector3 bitangent = smooth_normal.cross(tangent);
-  Vector3 g = Vector3::gaussian(0, roughness);
+  Vector3 g = Vector3::gaussian(rng, 0, roughness);
   Vector3 normal = tangent * g.x + bitangent * g.y + smooth_normal * g.z;
   if (ray.direction.dot(normal) * ray.direction.dot(smooth_normal) < 0) {
     normal = -normal;
@@ -119,18 +349,14 @@ Ray Film::bounce(Ray const &ray, Vector3 const &smooth_normal, double const dist
   double index_before = 1.0;
   double index_after = ior;
 
-  double refl_outside = reflectance(index_before, index_after, theta1);
-  double theta2 = refracted_angle(index_before, index_after, fabs(theta1));
-  double refl_inside = reflectance(index_after, index_before, theta2);
-  double d = 2.0 * thickness / fabs(theta2);
+  Layers const l = layers(fabs(theta1));
+  double theta2 = l.cosine;
 
-  if ((double)random() / RAND_MAX < 2 * refl_outside / (1 + refl_outside)) {
+  if (rng.uniform() < l.reflect) {
     Vector3 vec = ray.direction + normal * theta1 * 2.0;
     vec.normalize();
     Ray ret(ray, distance, vec);
-    ret.filter = Colour(lerp(1.0, interference(640e-9, d), refl_inside),
-			lerp(1.0, interference(540e-9, d), refl_inside),
-			lerp(1.0, interference(450e-9, d), refl_inside));
+    filter = filter * interference(w, l.distance, l.inside);
     return ret;
   } else {
     double eta = index_before / index_after;
@@ -140,7 +366,8 @@ Ray Film::bounce(Ray const &ray, Vector3 const &smooth_normal, double const dist
     else
       vec = ray.direction * eta + normal * (eta * theta1 + theta2);
     vec.normalize();
-    double theta3 = refracted_angle(index_after, index_before, fabs(theta2));
+    // Snell's Law on the way out gives back the angle on the way in
+    double theta3 = fabs(theta1);
     Vector3 vec2;
     if (theta2 > 0)
       vec2 = vec / eta + normal * (theta2 / eta - theta3);
@@ -148,10 +375,8 @@ Ray Film::bounce(Ray const &ray, Vector3 const &smooth_normal, double const dist
       vec2 = vec / eta + normal * (theta2 / eta + theta3);
 
     Ray ret(ray, distance, vec2);
-    double r_in = refl_inside * refl_inside;
-    ret.filter = Colour(lerp(1.0, interference(640e-9, d), r_in),
-			lerp(1.0, interference(540e-9, d), r_in),
-			lerp(1.0, interference(450e-9, d), r_in));
+    double r_in = l.inside * l.inside;
+    filter = filter * interference(w, l.distance, r_in);
     return ret;
   }
 }
@@ -165,3 +390,13 @@ Material* Glass::clone() const {
 Material* Film::clone() const {
   return new Film(*this);
 }
+
+Material* Material::clone(Arena &arena) const {
+  return arena.copy(*this);
+}
+Material* Glass::clone(Arena &arena) const {
+  return arena.copy(*this);
+}
+Material* Film::clone(Arena &arena) const {
+  return arena.copy(*this);
+}
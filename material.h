@@ -1,12 +1,17 @@
 #ifndef PATHTRACE_MATERIAL_H
 #define PATHTRACE_MATERIAL_H
 
+#include <vector>
+
 #include "linalg.h"
+#include "sampler.h"
+#include "arena.h"
+#include "spectrum.h"
 
 class Material {
-private:
-  const static double default_roughness = 1.0;
 public:
+  const static double default_roughness;
+
   Colour colour;
   Colour emission;
   double roughness;
@@ -28,24 +33,111 @@ public:
     : colour(colour), emission(emission), roughness(roughness), opaque(true)
   { }
 
-  virtual Ray bounce(Ray const &ray, Vector3 const &normal, double const distance) const;
+  virtual ~Material() { }
+
+  virtual Ray bounce(Ray const &ray, Vector3 const &normal, double const distance,
+		     Sampler &rng) const;
+  /* bounce() for light carried in the lanes of w. Multiplies filter by
+   * how much of the light of each lane the bounce lets through, apart
+   * from the colour of the material. */
+  virtual Ray bounce(Ray const &ray, Vector3 const &normal, double const distance,
+		     Sampler &rng, Wavelengths &/* w */,
+		     Double4 &/* filter */) const {
+    return bounce(ray, normal, distance, rng);
+  }
+  /* Density of bounce() sending the ray off in direction, per unit solid
+   * angle. Light that bounce() loses counts as never being sent
+   * anywhere, so that colour * pdf() is the reflectance of the surface
+   * times the cosine term. */
+  virtual double pdf(Ray const &ray, Vector3 const &normal,
+		     Vector3 const &direction) const;
+  /* Whether lights can't be sampled for the material, because pdf()
+   * isn't known. Paths through such materials find lights only by
+   * bouncing into them. */
+  virtual bool is_specular() const {
+    return false;
+  }
+  /* Makes the tables bounce() looks things up in. Scene::build() calls
+   * it for the materials of the scene; call it again after changing the
+   * fields of a compiled material. Without tables, bounce() works
+   * everything out each time. */
+  virtual void compile() { }
   virtual Material* clone() const;
+  /* A copy living in the arena */
+  virtual Material* clone(Arena &arena) const;
 };
 
 class Glass : public Material {
+private:
+  // The reflectance at table_steps + 1 cosines spread evenly from 0 to 1,
+  // made by compile()
+  std::vector<double> reflectance_table;
+
+  Ray scatter(Ray const &ray, Vector3 const &normal, double const distance,
+	      Sampler &rng, double ior, bool &refracted) const;
+
 public:
+  // Steps of the tables of compile(), which keep them within 1e-5 of
+  // what they tabulate
+  const static int table_steps = 1024;
+
   double ior;
+  // The Abbe number of the glass, for the index to depend on the
+  // wavelength in spectral mode. Zero for none.
+  double abbe;
 
-  Glass(Colour const &col, double ior, double roughness)
-    : Material(col, roughness), ior(ior)
+  Glass(Colour const &col, double ior, double roughness, double abbe = 0)
+    : Material(col, roughness), ior(ior), abbe(abbe)
   {
     this->opaque = false;
   }
-  virtual Ray bounce(Ray const &ray, Vector3 const &normal, double const distance) const;
+
+  /* The index of refraction at the wavelength, in metres. ior is the
+   * index at the yellow helium line of 587.6 nm, and the index changes
+   * with the wavelength by Cauchy's equation, as much as the Abbe number
+   * says. */
+  double ior_at(double wavelength) const;
+
+  /* The Fresnel reflectance of the surface for unpolarized light, by the
+   * cosine of the angle to the normal on the side outside the glass. It
+   * is the same whichever way the light goes through. */
+  double reflectance(double outside_cosine) const;
+
+  virtual Ray bounce(Ray const &ray, Vector3 const &normal, double const distance,
+		     Sampler &rng) const;
+  /* A dispersive glass refracts each wavelength its own way. Only the
+   * hero wavelength goes on after refraction, standing in for all the
+   * lanes. */
+  virtual Ray bounce(Ray const &ray, Vector3 const &normal, double const distance,
+		     Sampler &rng, Wavelengths &w, Double4 &filter) const;
+  virtual bool is_specular() const {
+    return true;
+  }
+  virtual void compile();
   virtual Material* clone() const;
+  virtual Material* clone(Arena &arena) const;
 };
 
 class Film : public Glass {
+public:
+  /* What happens at a film, by the cosine of the angle of the light to
+   * its normal */
+  struct Layers {
+    // The chance of reflecting, and how much of the light the inner
+    // surfaces reflect
+    double reflect, inside;
+    // The cosine of the angle inside the film, and the difference in
+    // length between the paths through the film once and three times
+    double cosine, distance;
+  };
+
+private:
+  // Layers at table_steps + 1 cosines spread evenly from 0 to 1, made by
+  // compile()
+  std::vector<Layers> table;
+
+  Layers exact_layers(double cosine) const;
+
 public:
   double thickness;
 
@@ -53,8 +145,18 @@ public:
     : Glass(Colour(1.0, 1.0, 1.0), ior, roughness), thickness(thickness)
   { }
 
-  virtual Ray bounce(Ray const &ray, Vector3 const &normal, double const distance) const;
+  /* The layers at the cosine, from the table once compiled */
+  Layers layers(double cosine) const;
+
+  /* The colour the film reflects or lets through at the wavelengths of
+   * the lanes goes to filter. Without the lanes, it is lost. */
+  virtual Ray bounce(Ray const &ray, Vector3 const &normal, double const distance,
+		     Sampler &rng) const;
+  virtual Ray bounce(Ray const &ray, Vector3 const &normal, double const distance,
+		     Sampler &rng, Wavelengths &w, Double4 &filter) const;
+  virtual void compile();
   virtual Material* clone() const;
+  virtual Material* clone(Arena &arena) const;
 };
 
 class Chrome : public Material {
@@ -62,7 +164,7 @@ public:
   Chrome(Colour col)
     : Material(col, 0.1)
   { }
-  //virtual Vector3 bounce(Ray const &ray, Vector3 const &normal) const;
+  //virtual Vector3 bounce(Ray const &ray, Vector3 const &normal, Random &rng) const;
   //virtual Material* clone() const;
 };
 
@@ -0,0 +1,293 @@
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdio>
+#include <cctype>
+#include <cmath>
+
+#include "mesh.h"
+#include "linalg.h"
+#include "shapes.h"
+#include "bvh.h"
+
+namespace {
+  // Hits closer than this are taken to be the surface the ray left from
+  const double min_distance = 1e-9;
+
+  /* A ray transformed for the watertight test: the axis where the
+   * direction is largest becomes z, and the other two are sheared so
+   * that the ray points straight along z. */
+  struct WatertightRay {
+    Vector3d origin;
+    int kx, ky, kz;
+    double sx, sy, sz;
+
+    WatertightRay(Ray const &ray)
+      : origin(ray.origin)
+    {
+      Vector3d const d(ray.direction);
+      kz = 0;
+      if (fabs(d.y) > fabs(d[kz])) kz = 1;
+      if (fabs(d.z) > fabs(d[kz])) kz = 2;
+      kx = (kz + 1) % 3;
+      ky = (kx + 1) % 3;
+      // Keep the winding of the triangles
+      if (d[kz] < 0) std::swap(kx, ky);
+      sx = d[kx] / d[kz];
+      sy = d[ky] / d[kz];
+      sz = 1.0 / d[kz];
+    }
+
+    /* Distance to the triangle abc, or -1 if the ray misses it. On a hit,
+     * sets u, v and w to the barycentric coordinates of the hit, the
+     * weights of a, b and c. */
+    double intersect(Vector3 const &a, Vector3 const &b, Vector3 const &c,
+		     double &u, double &v, double &w) const {
+      Vector3d const A = Vector3d(a) - origin, B = Vector3d(b) - origin;
+      Vector3d const C = Vector3d(c) - origin;
+      double const ax = A[kx] - sx * A[kz], ay = A[ky] - sy * A[kz];
+      double const bx = B[kx] - sx * B[kz], by = B[ky] - sy * B[kz];
+      double const cx = C[kx] - sx * C[kz], cy = C[ky] - sy * C[kz];
+
+      // Edge functions. A point on an edge gets a zero, which counts as
+      // inside for both triangles sharing the edge. The neighbour computes
+      // the exact negation of the shared edge's value only as long as the
+      // products are not fused, hence -ffp-contract=off in the Makefile.
+      u = cx * by - cy * bx;
+      v = ax * cy - ay * cx;
+      w = bx * ay - by * ax;
+      if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+	return -1;
+      double const det = u + v + w;
+      if (det == 0)
+	return -1;
+
+      double const t = (u * sz * A[kz] + v * sz * B[kz] + w * sz * C[kz]) /
+	det;
+      if (!(t > min_distance))
+	return -1;
+      u /= det;
+      v /= det;
+      w /= det;
+      return t;
+    }
+  };
+}
+
+struct TriangleMesh::ClosestHit {
+  Data const &data;
+  WatertightRay const &ray;
+  double distance;
+  unsigned int triangle;
+
+  ClosestHit(Data const &data, WatertightRay const &ray, double max_distance)
+    : data(data), ray(ray), distance(max_distance), triangle(0)
+  { }
+
+  double max_distance() const {
+    return distance;
+  }
+
+  bool leaf(unsigned int const first, unsigned int const count) {
+    std::vector<Vertex> const &vert = data.vertices;
+    unsigned int const *tri = &data.triangles[3 * first];
+    for (unsigned int i = first ; i < first + count ; ++i, tri += 3) {
+      double u, v, w;
+      double const t = ray.intersect(vert[tri[0]].loc, vert[tri[1]].loc,
+				     vert[tri[2]].loc, u, v, w);
+      if (t > 0 && t < distance) {
+	distance = t;
+	triangle = i;
+      }
+    }
+    return false;
+  }
+};
+
+struct TriangleMesh::AnyHit {
+  Data const &data;
+  WatertightRay const &ray;
+  double distance;
+  bool hit;
+
+  AnyHit(Data const &data, WatertightRay const &ray, double max_distance)
+    : data(data), ray(ray), distance(max_distance), hit(false)
+  { }
+
+  double max_distance() const {
+    return distance;
+  }
+
+  bool leaf(unsigned int const first, unsigned int const count) {
+    std::vector<Vertex> const &vert = data.vertices;
+    unsigned int const *tri = &data.triangles[3 * first];
+    for (unsigned int i = 0 ; i < count ; ++i, tri += 3) {
+      double u, v, w;
+      double const t = ray.intersect(vert[tri[0]].loc, vert[tri[1]].loc,
+				     vert[tri[2]].loc, u, v, w);
+      if (t > 0 && t < distance) {
+	hit = true;
+	return true;
+      }
+    }
+    return false;
+  }
+};
+
+TriangleMesh& TriangleMesh::operator=(TriangleMesh const &other) {
+  if (other.data != data) {
+    release();
+    data = other.data;
+    data->references++;
+  }
+  return *this;
+}
+
+TriangleMesh::~TriangleMesh() {
+  release();
+}
+
+void TriangleMesh::release() {
+  if (--data->references == 0)
+    delete data;
+  data = 0;
+}
+
+bool TriangleMesh::assign(std::vector<Vertex> &vertices,
+			  std::vector<unsigned int> &triangles, bool smooth) {
+  unsigned int const count = triangles.size() / 3;
+  for (unsigned int i = 0 ; i < count * 3 ; ++i) {
+    if (triangles[i] >= vertices.size())
+      return false;
+  }
+
+  // Other copies keep the old mesh
+  release();
+  data = new Data();
+  data->vertices.swap(vertices);
+  data->smooth = smooth;
+  triangles.resize(count * 3);
+
+  std::vector<Box> boxes(count);
+  for (unsigned int i = 0 ; i < count ; ++i) {
+    for (int k = 0 ; k < 3 ; ++k)
+      boxes[i].extend(data->vertices[triangles[3 * i + k]].loc);
+    data->box.extend(boxes[i]);
+  }
+  data->bvh.build(boxes);
+
+  // Put the triangles in leaf order, so that each leaf is a run of them
+  std::vector<unsigned int> &indices = data->bvh.indices;
+  data->triangles.resize(count * 3);
+  for (unsigned int i = 0 ; i < count ; ++i) {
+    for (int k = 0 ; k < 3 ; ++k)
+      data->triangles[3 * i + k] = triangles[3 * indices[i] + k];
+    indices[i] = i;
+  }
+  std::vector<unsigned int>().swap(triangles);
+  return true;
+}
+
+bool TriangleMesh::assign_built(std::vector<Vertex> &vertices,
+				std::vector<unsigned int> &triangles,
+				bool smooth, std::vector<BvhNode> &nodes) {
+  unsigned int const count = triangles.size() / 3;
+  if (triangles.size() != count * 3)
+    return false;
+  for (unsigned int i = 0 ; i < count * 3 ; ++i) {
+    if (triangles[i] >= vertices.size())
+      return false;
+  }
+  Bvh bvh;
+  bvh.nodes.swap(nodes);
+  bvh.indices.resize(count);
+  for (unsigned int i = 0 ; i < count ; ++i)
+    bvh.indices[i] = i;
+  if (!bvh.fits(count)) {
+    bvh.nodes.swap(nodes);
+    return false;
+  }
+
+  release();
+  data = new Data();
+  data->vertices.swap(vertices);
+  data->triangles.swap(triangles);
+  data->smooth = smooth;
+  data->bvh.nodes.swap(bvh.nodes);
+  data->bvh.indices.swap(bvh.indices);
+  if (!data->bvh.empty())
+    data->box = data->bvh.nodes[0].box;
+  return true;
+}
+
+bool TriangleMesh::load(const char *filename) {
+  std::string const name(filename);
+  std::string::size_type const dot = name.rfind('.');
+  std::string ext = dot == std::string::npos ? "" : name.substr(dot + 1);
+  for (unsigned int i = 0 ; i < ext.size() ; ++i)
+    ext[i] = tolower(ext[i]);
+  if (ext == "obj")
+    return load_obj(filename);
+  if (ext == "ply")
+    return load_ply(filename);
+  fprintf(stderr, "%s: unknown mesh format, expected .obj or .ply\n",
+	  filename);
+  return false;
+}
+
+Hit TriangleMesh::intersect(Ray const &ray) const {
+  HitRecord record;
+  if (!closest(ray, INFINITY, record))
+    return Hit();
+  return Hit(record.distance, normal_at(ray, record));
+}
+
+bool TriangleMesh::closest(Ray const &ray, double max_distance,
+			   HitRecord &record) const {
+  WatertightRay const wray(ray);
+  ClosestHit closest(*data, wray, max_distance);
+  data->bvh.traverse(ray, closest);
+  if (!(closest.distance < max_distance))
+    return false;
+  record = HitRecord(closest.distance, closest.triangle);
+  return true;
+}
+
+Vector3 TriangleMesh::normal_at(Ray const &ray,
+				HitRecord const &record) const {
+  unsigned int const *tri = &data->triangles[3 * record.primitive];
+  Vertex const &a = data->vertices[tri[0]];
+  Vertex const &b = data->vertices[tri[1]];
+  Vertex const &c = data->vertices[tri[2]];
+  Vector3 normal;
+  if (data->smooth) {
+    // The weights of the vertices are found again for just this triangle
+    double u, v, w;
+    WatertightRay(ray).intersect(a.loc, b.loc, c.loc, u, v, w);
+    normal = a.normal * u + b.normal * v + c.normal * w;
+  }
+  if (normal.is_zero())
+    normal = (b.loc - a.loc).cross(c.loc - a.loc);
+  normal.normalize();
+  return normal;
+}
+
+bool TriangleMesh::occludes(Ray const &ray, double max_distance) const {
+  WatertightRay const wray(ray);
+  AnyHit any(*data, wray, max_distance);
+  data->bvh.traverse(ray, any);
+  return any.hit;
+}
+
+TriangleMesh* TriangleMesh::clone() const {
+  return new TriangleMesh(*this);
+}
+
+TriangleMesh* TriangleMesh::clone(Arena &arena) const {
+  return arena.copy(*this);
+}
+
+bool TriangleMesh::bounds(Box &box) const {
+  box = data->box;
+  return !data->triangles.empty();
+}
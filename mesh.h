@@ -0,0 +1,121 @@
+#ifndef PATHTRACE_MESH_H
+#define PATHTRACE_MESH_H
+
+#include <vector>
+
+#include "linalg.h"
+#include "shapes.h"
+#include "bvh.h"
+
+/* A mesh of triangles, stored as one array of vertices and one array of
+ * vertex indices, three per triangle. The triangles are kept in the order
+ * of the leaves of the mesh's own bounding volume hierarchy. Copies of a
+ * mesh share the arrays, so that a mesh of millions of triangles can be
+ * put into a Scene, which clones its shapes.
+ *
+ * Triangles go counterclockwise when seen from the outside, which sets
+ * the direction of their normals. Rays are intersected with the
+ * watertight test of Woop, Benthin and Wald, so that rays never slip
+ * through the shared edges and vertices of neighbouring triangles. */
+class TriangleMesh : public Shape {
+private:
+  struct Data {
+    std::vector<Vertex> vertices;
+    std::vector<unsigned int> triangles;
+    Bvh bvh;
+    Box box;
+    // Whether to interpolate the normals of the vertices
+    bool smooth;
+    int references;
+
+    Data()
+      : smooth(false), references(1)
+    { }
+  };
+
+  struct ClosestHit;
+  struct AnyHit;
+
+  Data *data;
+
+  void release();
+
+public:
+  TriangleMesh()
+    : data(new Data())
+  { }
+
+  TriangleMesh(TriangleMesh const &other)
+    : Shape(), data(other.data)
+  {
+    data->references++;
+  }
+
+  TriangleMesh& operator=(TriangleMesh const &other);
+  virtual ~TriangleMesh();
+
+  /* Replaces the mesh, taking over the contents of the vectors, which
+   * are left empty. The normals of the vertices are used if smooth is
+   * set. Otherwise the triangles are flat and the normals are ignored.
+   * Returns false if an index is out of range. */
+  bool assign(std::vector<Vertex> &vertices,
+	      std::vector<unsigned int> &triangles, bool smooth);
+
+  /* Replaces the mesh with one taken apart with the accessors below, so
+   * that the hierarchy doesn't need to be built again. The triangles
+   * must be in the order of the leaves. Takes over the contents of the
+   * vectors like assign(), and returns false if they don't fit
+   * together. */
+  bool assign_built(std::vector<Vertex> &vertices,
+		    std::vector<unsigned int> &triangles, bool smooth,
+		    std::vector<BvhNode> &nodes);
+
+  /* Loads a Wavefront OBJ or a binary little-endian PLY file, chosen by
+   * the extension of the name. Polygons are split into triangles. Prints
+   * what went wrong and returns false on failure. */
+  bool load(const char *filename);
+  bool load_obj(const char *filename);
+  bool load_ply(const char *filename);
+
+  unsigned int vertex_count() const {
+    return data->vertices.size();
+  }
+
+  unsigned int triangle_count() const {
+    return data->triangles.size() / 3;
+  }
+
+  std::vector<Vertex> const& get_vertices() const {
+    return data->vertices;
+  }
+
+  /* Vertex indices, three per triangle, in the order of the leaves */
+  std::vector<unsigned int> const& get_triangles() const {
+    return data->triangles;
+  }
+
+  std::vector<BvhNode> const& get_nodes() const {
+    return data->bvh.nodes;
+  }
+
+  bool is_smooth() const {
+    return data->smooth;
+  }
+
+  virtual Hit intersect(Ray const &ray) const;
+  using Shape::intersect;
+  virtual TriangleMesh* clone() const;
+  virtual TriangleMesh* clone(Arena &arena) const;
+  virtual bool bounds(Box &box) const;
+  virtual bool occludes(Ray const &ray, double max_distance) const;
+  virtual bool closest(Ray const &ray, double max_distance,
+		       HitRecord &record) const;
+  virtual Vector3 normal_at(Ray const &ray, HitRecord const &record) const;
+};
+
+/*
+Local Variables:
+mode:c++
+End:
+*/
+#endif /* PATHTRACE_MESH_H */
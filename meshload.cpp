@@ -0,0 +1,452 @@
+#include <vector>
+#include <string>
+#include <map>
+#include <utility>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+
+#include <stdint.h>
+
+#include "mesh.h"
+#include "mappedfile.h"
+#include "linalg.h"
+
+/* The loaders parse the mapped files in place. Numbers are copied into a
+ * small buffer for strtod, as the mapping isn't nul-terminated. */
+
+namespace {
+  bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+  }
+
+  void skip_space(const char *&p, const char *end) {
+    while (p < end && is_space(*p)) ++p;
+  }
+
+  void skip_line(const char *&p, const char *end) {
+    while (p < end && *p != '\n') ++p;
+    if (p < end) ++p;
+  }
+
+  /* Whether the word at p is kw. If it is, moves p past it. */
+  bool keyword(const char *&p, const char *end, const char *kw) {
+    size_t const n = strlen(kw);
+    if ((size_t)(end - p) < n || memcmp(p, kw, n) != 0)
+      return false;
+    if (p + n < end && !is_space(p[n]) && p[n] != '\n')
+      return false;
+    p += n;
+    return true;
+  }
+
+  /* Reads the word at p, moving p past it */
+  std::string word(const char *&p, const char *end) {
+    skip_space(p, end);
+    const char *start = p;
+    while (p < end && !is_space(*p) && *p != '\n') ++p;
+    return std::string(start, p);
+  }
+
+  bool parse_double(const char *&p, const char *end, double &value) {
+    skip_space(p, end);
+    char buf[64];
+    unsigned int n = 0;
+    while (p + n < end && n < sizeof(buf) - 1 &&
+	   (isdigit(p[n]) || strchr("+-.eE", p[n]) || isalpha(p[n])))
+      buf[n] = p[n], ++n;
+    buf[n] = '\0';
+    char *stop;
+    value = strtod(buf, &stop);
+    if (stop == buf)
+      return false;
+    p += stop - buf;
+    return true;
+  }
+
+  bool parse_long(const char *&p, const char *end, long &value) {
+    if (p == end || !(isdigit(*p) || *p == '-' || *p == '+'))
+      return false;
+    bool negative = *p == '-';
+    if (*p == '-' || *p == '+') ++p;
+    if (p == end || !isdigit(*p))
+      return false;
+    value = 0;
+    while (p < end && isdigit(*p))
+      value = value * 10 + (*p++ - '0');
+    if (negative) value = -value;
+    return true;
+  }
+
+  /* One index of an OBJ face: 1-based, or negative counting back from
+   * the last one read. Returns -1 if it's invalid. */
+  long obj_index(long i, unsigned int count) {
+    if (i > 0 && (unsigned long)i <= count) return i - 1;
+    if (i < 0 && (unsigned long)-i <= count) return count + i;
+    return -1;
+  }
+}
+
+bool TriangleMesh::load_obj(const char *filename) {
+  MappedFile file;
+  if (!file.open(filename)) {
+    perror(filename);
+    return false;
+  }
+
+  std::vector<Vector3> positions, normals;
+  // OBJ gives each corner of a face its own normal, so there is a vertex
+  // for every pair of position and normal that the faces use
+  std::map<std::pair<long, long>, unsigned int> corner_vertex;
+  std::vector<Vertex> vertices;
+  std::vector<unsigned int> triangles;
+  std::vector<unsigned int> face;
+  bool smooth = true;
+  const char *p = file.data(), *end = file.end();
+  for (unsigned int line = 1 ; p < end ; ++line, skip_line(p, end)) {
+    skip_space(p, end);
+    if (p == end || *p == '\n' || *p == '#')
+      continue;
+    bool const is_normal = keyword(p, end, "vn");
+    if (is_normal || keyword(p, end, "v")) {
+      double c[3];
+      for (int i = 0 ; i < 3 ; ++i) {
+	if (!parse_double(p, end, c[i])) {
+	  fprintf(stderr, "%s:%u: expected a number\n", filename, line);
+	  return false;
+	}
+      }
+      if (!is_normal)
+	positions.push_back(Vector3(c[0], c[1], c[2]));
+      else
+	normals.push_back(Vector3(c[0], c[1], c[2]));
+    }
+    else if (keyword(p, end, "f")) {
+      // Each corner is v, v/vt, v//vn or v/vt/vn
+      face.clear();
+      for (;;) {
+	skip_space(p, end);
+	if (p == end || *p == '\n' || *p == '#')
+	  break;
+	long v, texture, vn = -1;
+	bool has_normal = false;
+	bool ok = parse_long(p, end, v);
+	if (ok && p < end && *p == '/') {
+	  ++p;
+	  if (p < end && *p != '/')
+	    ok = parse_long(p, end, texture);
+	  if (ok && p < end && *p == '/') {
+	    ++p;
+	    ok = parse_long(p, end, vn);
+	    has_normal = true;
+	  }
+	}
+	if (ok) {
+	  v = obj_index(v, positions.size());
+	  if (has_normal)
+	    vn = obj_index(vn, normals.size());
+	}
+	if (!ok || v < 0 || (has_normal && vn < 0)) {
+	  fprintf(stderr, "%s:%u: invalid face\n", filename, line);
+	  return false;
+	}
+	if (!has_normal)
+	  smooth = false;
+	std::pair<long, long> const key(v, vn);
+	std::map<std::pair<long, long>, unsigned int>::iterator const found =
+	  corner_vertex.find(key);
+	if (found != corner_vertex.end()) {
+	  face.push_back(found->second);
+	  continue;
+	}
+	corner_vertex[key] = vertices.size();
+	face.push_back(vertices.size());
+	vertices.push_back(Vertex(positions[v], has_normal ? normals[vn] :
+				  Vector3()));
+      }
+      for (unsigned int i = 2 ; i < face.size() ; ++i) {
+	triangles.push_back(face[0]);
+	triangles.push_back(face[i - 1]);
+	triangles.push_back(face[i]);
+      }
+    }
+    // Texture coordinates, groups and materials aren't used
+  }
+
+  if (triangles.empty())
+    smooth = false;
+  // Indices were checked while parsing
+  return assign(vertices, triangles, smooth);
+}
+
+namespace {
+  enum PlyType {
+    ply_none, ply_int8, ply_uint8, ply_int16, ply_uint16, ply_int32,
+    ply_uint32, ply_float32, ply_float64
+  };
+
+  PlyType ply_type(std::string const &name) {
+    static const char *names[][2] = {
+      { "char", "int8" }, { "uchar", "uint8" },
+      { "short", "int16" }, { "ushort", "uint16" },
+      { "int", "int32" }, { "uint", "uint32" },
+      { "float", "float32" }, { "double", "float64" }
+    };
+    for (int i = 0 ; i < 8 ; ++i) {
+      if (name == names[i][0] || name == names[i][1])
+	return PlyType(ply_int8 + i);
+    }
+    return ply_none;
+  }
+
+  unsigned long ply_size(PlyType type) {
+    static const unsigned long sizes[] = { 0, 1, 1, 2, 2, 4, 4, 4, 8 };
+    return sizes[type];
+  }
+
+  struct PlyProperty {
+    std::string name;
+    PlyType type;
+    // For lists, the type of the count before the items
+    PlyType count_type;
+  };
+
+  struct PlyElement {
+    std::string name;
+    unsigned long count;
+    std::vector<PlyProperty> properties;
+  };
+
+  /* Reads a little-endian value of the given type */
+  double ply_value(const char *p, PlyType type) {
+    unsigned char const *b = reinterpret_cast<unsigned char const*>(p);
+    unsigned long const size = ply_size(type);
+    uint64_t bits = 0;
+    for (unsigned long i = size ; i-- > 0 ; )
+      bits = (bits << 8) | b[i];
+    switch (type) {
+    case ply_float32: {
+      uint32_t const u = bits;
+      float f;
+      memcpy(&f, &u, sizeof(f));
+      return f;
+    }
+    case ply_float64: {
+      double d;
+      memcpy(&d, &bits, sizeof(d));
+      return d;
+    }
+    case ply_uint8:
+    case ply_uint16:
+    case ply_uint32:
+      return bits;
+    default: {
+      // Sign-extend
+      int const shift = 64 - 8 * size;
+      return (double)((int64_t)(bits << shift) >> shift);
+    }
+    }
+  }
+
+  /* Reads a vertex index of a face. Returns false if it is negative or
+   * too large for an index. */
+  bool ply_index(const char *p, PlyType type, unsigned int &index) {
+    double const value = ply_value(p, type);
+    if (!(value >= 0 && value <= UINT_MAX))
+      return false;
+    index = (unsigned int)value;
+    return true;
+  }
+
+  /* The smallest number of bytes a record of the element can take */
+  unsigned long ply_record_size(PlyElement const &el) {
+    unsigned long size = 0;
+    for (unsigned int i = 0 ; i < el.properties.size() ; ++i) {
+      PlyProperty const &prop = el.properties[i];
+      size += ply_size(prop.count_type == ply_none ? prop.type :
+		       prop.count_type);
+    }
+    return size;
+  }
+
+  /* Reads the records of an element, keeping the vertices and the faces
+   * split into triangles. role[i] tells which of x, y, z, nx, ny and nz
+   * property i of a vertex is. Returns an error message, or 0 if the
+   * element was read. */
+  const char *read_ply_element(PlyElement const &el, std::vector<int> const &role,
+			const char *&p, const char *end,
+			std::vector<Vertex> &vertices,
+			std::vector<unsigned int> &triangles) {
+    std::vector<PlyProperty> const &props = el.properties;
+    bool const is_vertex = el.name == "vertex";
+    bool const is_face = el.name == "face";
+    const char *const truncated = "file is truncated";
+    const char *const invalid = "face has an invalid vertex index";
+    for (unsigned long n = 0 ; n < el.count ; ++n) {
+      double c[6] = { 0, 0, 0, 0, 0, 0 };
+      for (unsigned int i = 0 ; i < props.size() ; ++i) {
+	PlyProperty const &prop = props[i];
+	unsigned long const size = ply_size(prop.type);
+	if (prop.count_type == ply_none) {
+	  if ((unsigned long)(end - p) < size) return truncated;
+	  if (role[i] >= 0)
+	    c[role[i]] = ply_value(p, prop.type);
+	  p += size;
+	  continue;
+	}
+
+	unsigned long const count_size = ply_size(prop.count_type);
+	if ((unsigned long)(end - p) < count_size) return truncated;
+	unsigned long const items = ply_value(p, prop.count_type);
+	p += count_size;
+	if (size > 0 && (unsigned long)(end - p) / size < items)
+	  return truncated;
+	if (is_face &&
+	    (prop.name == "vertex_indices" || prop.name == "vertex_index")) {
+	  unsigned int first, previous, index;
+	  if (items > 0 && !ply_index(p, prop.type, first))
+	    return invalid;
+	  for (unsigned long k = 1 ; k < items ; ++k) {
+	    if (!ply_index(p + k * size, prop.type, index))
+	      return invalid;
+	    if (k >= 2) {
+	      triangles.push_back(first);
+	      triangles.push_back(previous);
+	      triangles.push_back(index);
+	    }
+	    previous = index;
+	  }
+	}
+	p += items * size;
+      }
+      if (is_vertex) {
+	vertices.push_back(Vertex(Vector3(c[0], c[1], c[2]),
+				  Vector3(c[3], c[4], c[5])));
+      }
+    }
+    return 0;
+  }
+}
+
+bool TriangleMesh::load_ply(const char *filename) {
+  MappedFile file;
+  if (!file.open(filename)) {
+    perror(filename);
+    return false;
+  }
+  const char *p = file.data(), *end = file.end();
+
+  if (word(p, end) != "ply") {
+    fprintf(stderr, "%s: not a PLY file\n", filename);
+    return false;
+  }
+  std::vector<PlyElement> elements;
+  for (;;) {
+    skip_line(p, end);
+    if (p == end) {
+      fprintf(stderr, "%s: no end_header\n", filename);
+      return false;
+    }
+    std::string const keyword = word(p, end);
+    if (keyword == "end_header") {
+      skip_line(p, end);
+      break;
+    }
+    else if (keyword == "format") {
+      if (word(p, end) != "binary_little_endian") {
+	fprintf(stderr, "%s: only binary little-endian PLY is supported\n",
+		filename);
+	return false;
+      }
+    }
+    else if (keyword == "element") {
+      PlyElement e;
+      e.name = word(p, end);
+      e.count = strtoul(word(p, end).c_str(), 0, 10);
+      elements.push_back(e);
+    }
+    else if (keyword == "property") {
+      if (elements.empty()) {
+	fprintf(stderr, "%s: property outside an element\n", filename);
+	return false;
+      }
+      PlyProperty prop;
+      std::string type = word(p, end);
+      prop.count_type = ply_none;
+      if (type == "list") {
+	std::string const count_type = word(p, end);
+	prop.count_type = ply_type(count_type);
+	if (prop.count_type == ply_none) {
+	  fprintf(stderr, "%s: unknown type %s\n", filename,
+		  count_type.c_str());
+	  return false;
+	}
+	type = word(p, end);
+      }
+      prop.type = ply_type(type);
+      if (prop.type == ply_none) {
+	fprintf(stderr, "%s: unknown type %s\n", filename, type.c_str());
+	return false;
+      }
+      prop.name = word(p, end);
+      elements.back().properties.push_back(prop);
+    }
+    // comment and obj_info lines are skipped
+  }
+
+  std::vector<Vertex> vertices;
+  std::vector<unsigned int> triangles;
+  bool smooth = false;
+  for (unsigned int e = 0 ; e < elements.size() ; ++e) {
+    PlyElement const &el = elements[e];
+    std::vector<PlyProperty> const &props = el.properties;
+    bool const is_vertex = el.name == "vertex";
+    bool const is_face = el.name == "face";
+    // Which coordinate each property is: x y z nx ny nz, or -1
+    std::vector<int> role(props.size(), -1);
+    if (is_vertex) {
+      static const char *names[6] = { "x", "y", "z", "nx", "ny", "nz" };
+      int found = 0;
+      for (unsigned int i = 0 ; i < props.size() ; ++i) {
+	for (int k = 0 ; k < 6 ; ++k) {
+	  if (props[i].name == names[k] && props[i].count_type == ply_none) {
+	    role[i] = k;
+	    found |= 1 << k;
+	  }
+	}
+      }
+      if ((found & 7) != 7) {
+	fprintf(stderr, "%s: vertices have no x, y and z\n", filename);
+	return false;
+      }
+      smooth = (found & 0x38) == 0x38;
+    }
+
+    // The counts come from the header, so check that the records could
+    // fit in the rest of the file before making room for them
+    unsigned long const record_size = ply_record_size(el);
+    if (record_size > 0 && (unsigned long)(end - p) / record_size < el.count) {
+      fprintf(stderr, "%s: file is truncated\n", filename);
+      return false;
+    }
+    if (is_vertex)
+      vertices.reserve(el.count);
+    else if (is_face)
+      triangles.reserve(el.count * 3);
+
+    const char *const error =
+      read_ply_element(el, role, p, end, vertices, triangles);
+    if (error) {
+      fprintf(stderr, "%s: %s\n", filename, error);
+      return false;
+    }
+  }
+
+  if (!assign(vertices, triangles, smooth)) {
+    fprintf(stderr, "%s: face refers to a missing vertex\n", filename);
+    return false;
+  }
+  return true;
+}
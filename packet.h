@@ -0,0 +1,76 @@
+#ifndef PATHTRACE_PACKET_H
+#define PATHTRACE_PACKET_H
+
+#include "linalg.h"
+#include "simd.h"
+
+/* Rays stored component by component, for intersecting them together:
+ * four of them in double, eight in the float build. Works best for
+ * coherent rays, like the camera rays of neighbouring pixels. In the
+ * float build the origins are rounded to float as well, so the distances
+ * found are only good for choosing what the rays hit. */
+struct RayPacket {
+  const static int size = RealLanes::size;
+
+  RealLanes ox, oy, oz;
+  RealLanes dx, dy, dz;
+  RealLanes inv_dx, inv_dy, inv_dz;
+  // One bit per lane that holds a ray
+  int active;
+
+  /* Packs count (at most size) rays. The remaining lanes are inactive. */
+  RayPacket(Ray const *rays, int count)
+    : active((1 << count) - 1)
+  {
+    real o[3][size], d[3][size];
+    for (int i = 0 ; i < size ; ++i) {
+      Ray const &r = rays[i < count ? i : 0];
+      o[0][i] = r.origin.x; o[1][i] = r.origin.y; o[2][i] = r.origin.z;
+      d[0][i] = r.direction.x; d[1][i] = r.direction.y; d[2][i] = r.direction.z;
+    }
+    ox = RealLanes::load(o[0]);
+    oy = RealLanes::load(o[1]);
+    oz = RealLanes::load(o[2]);
+    dx = RealLanes::load(d[0]);
+    dy = RealLanes::load(d[1]);
+    dz = RealLanes::load(d[2]);
+    RealLanes one(1.0);
+    inv_dx = one / dx;
+    inv_dy = one / dy;
+    inv_dz = one / dz;
+  }
+
+  Ray ray(int lane) const {
+    real o[3][size], d[3][size];
+    ox.store(o[0]); oy.store(o[1]); oz.store(o[2]);
+    dx.store(d[0]); dy.store(d[1]); dz.store(d[2]);
+    return Ray(Vector3d(o[0][lane], o[1][lane], o[2][lane]),
+	       Vector3(d[0][lane], d[1][lane], d[2][lane]));
+  }
+
+  /* The lanes whose rays hit the box closer than max_distance. Same test
+   * as Box::hit. */
+  int hits(Box const &box, RealLanes const &max_distance) const {
+    RealLanes t0 = (RealLanes(box.min.x) - ox) * inv_dx;
+    RealLanes t1 = (RealLanes(box.max.x) - ox) * inv_dx;
+    RealLanes tmin = RealLanes::min(t0, t1), tmax = RealLanes::max(t0, t1);
+    t0 = (RealLanes(box.min.y) - oy) * inv_dy;
+    t1 = (RealLanes(box.max.y) - oy) * inv_dy;
+    tmin = RealLanes::max(RealLanes::min(t0, t1), tmin);
+    tmax = RealLanes::min(RealLanes::max(t0, t1), tmax);
+    t0 = (RealLanes(box.min.z) - oz) * inv_dz;
+    t1 = (RealLanes(box.max.z) - oz) * inv_dz;
+    tmin = RealLanes::max(RealLanes::min(t0, t1), tmin);
+    tmax = RealLanes::min(RealLanes::max(t0, t1), tmax);
+    tmax = tmax * RealLanes(Box::robust_scale());
+    return RealLanes::bits((tmax >= RealLanes::max(tmin, RealLanes(0.0))) &
+			   (tmin <= max_distance)) & active;
+  }
+};
+
+/*
+Local Variables:
+mode:c++
+End:
+*/
+#endif /* PATHTRACE_PACKET_H */
@@ -0,0 +1,59 @@
+#ifndef PATHTRACE_RANDOM_H
+#define PATHTRACE_RANDOM_H
+
+#include <stdint.h>
+
+/* PCG32 random number generator (O'Neill, pcg-random.org). Each
+ * generator is one independent stream: generators seeded with the same
+ * seed but different streams don't overlap. There is no shared state, so
+ * every render thread should have its own. */
+class Random {
+private:
+  uint64_t state;
+  uint64_t increment;
+
+public:
+  Random(uint64_t seed = 0x853c49e6748fea9bULL, uint64_t stream = 0)
+  {
+    this->seed(seed, stream);
+  }
+
+  void seed(uint64_t seed, uint64_t stream) {
+    state = 0;
+    increment = (stream << 1) | 1;
+    next();
+    state += seed;
+    next();
+  }
+
+  uint32_t next() {
+    uint64_t old = state;
+    state = old * 6364136223846793005ULL + increment;
+    uint32_t xorshifted = ((old >> 18) ^ old) >> 27;
+    uint32_t rot = old >> 59;
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+  }
+
+  /* Uniform in [0, 1) */
+  double uniform() {
+    return next() * (1.0 / 4294967296.0);
+  }
+
+  /* Uniform in (0, 1], safe to take a logarithm of */
+  double uniform_open() {
+    return (next() + 1.0) * (1.0 / 4294967296.0);
+  }
+
+  /* Two uniform numbers in [0, 1), like Sampler::uniform2() */
+  void uniform2(double &u, double &v) {
+    u = uniform();
+    v = uniform();
+  }
+};
+
+/*
+Local Variables:
+mode:c++
+End:
+*/
+#endif /* PATHTRACE_RANDOM_H */
@@ -0,0 +1,493 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <csignal>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "tracer.h"
+#include "image.h"
+#include "renderer.h"
+#include "demo.h"
+#include "scenefile.h"
+#include "distributed.h"
+#include "denoise.h"
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Seconds between checkpoints
+static const double default_interval = 60;
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void interrupt(int) {
+  interrupted = 1;
+}
+
+static bool write_images(Image const &img, std::string const &basename,
+			 double exposure) {
+  std::string pfm = basename + ".pfm";
+  std::string ppm = basename + ".ppm";
+  if (!img.write_pfm(pfm.c_str())) {
+    perror(pfm.c_str());
+    return false;
+  }
+  if (!img.write_ppm(ppm.c_str(), exposure)) {
+    perror(ppm.c_str());
+    return false;
+  }
+  return true;
+}
+
+/* Writes the render, and with denoise also a denoised copy of it as
+ * BASENAME-denoised */
+static bool write_images(Image const &img, std::string const &basename,
+			 double exposure, bool denoise, int threads) {
+  if (!write_images(img, basename, exposure))
+    return false;
+  if (!denoise)
+    return true;
+  double const start_time = now();
+  Image denoised(img.width, img.height);
+  Denoiser().run(img, denoised, threads);
+  fprintf(stderr, "denoised in %.3f seconds\n", now() - start_time);
+  return write_images(denoised, basename + "-denoised", exposure);
+}
+
+static bool write_checkpoint(Image const &img, std::string const &filename,
+			     std::vector<uint64_t> const &seeds) {
+  if (img.write_checkpoint(filename.c_str(), seeds))
+    return true;
+  perror(filename.c_str());
+  return false;
+}
+
+/* Sums the checkpoints, which must be of the same size, into one */
+static Image* merge(char **filenames, int count,
+		    std::vector<uint64_t> &seeds) {
+  Image *sum = Image::read_checkpoint(filenames[0], seeds);
+  for (int i = 1 ; sum && i < count ; ++i) {
+    std::vector<uint64_t> more;
+    Image *img = Image::read_checkpoint(filenames[i], more);
+    if (img && (img->width != sum->width || img->height != sum->height)) {
+      fprintf(stderr, "%s: size %ux%u differs from %ux%u\n", filenames[i],
+	      img->width, img->height, sum->width, sum->height);
+      delete img;
+      img = 0;
+    }
+    if (!img) {
+      delete sum;
+      return 0;
+    }
+    for (unsigned int j = 0 ; j < more.size() ; ++j) {
+      if (std::find(seeds.begin(), seeds.end(), more[j]) != seeds.end()) {
+	fprintf(stderr, "%s: warning: seed %llu was used before, so its "
+		"samples repeat earlier ones\n", filenames[i],
+		(unsigned long long)more[j]);
+      }
+      seeds.push_back(more[j]);
+    }
+    sum->add(*img);
+    delete img;
+  }
+  return sum;
+}
+
+/* Sums the renders of the workers until there are enough passes or the
+ * time is up, and writes the sum like a render */
+static int run_coordinator(Coordinator &coordinator, const char *address,
+			   int width, int height, int passes, double seconds,
+			   std::string const &checkpoint, double interval,
+			   std::string const &basename, double exposure,
+			   bool denoise, int threads) {
+  if (!coordinator.listen(address))
+    return EXIT_FAILURE;
+  signal(SIGINT, interrupt);
+  signal(SIGTERM, interrupt);
+  fprintf(stderr, "%s: waiting for workers\n", address);
+  coordinator.start();
+
+  double const start_time = now();
+  double next_checkpoint = start_time + interval;
+  Image img(width, height);
+  std::vector<uint64_t> seeds;
+  while (!interrupted && (passes <= 0 || coordinator.get_passes() < passes) &&
+	 (seconds <= 0 || now() - start_time < seconds)) {
+    if (!checkpoint.empty() && now() >= next_checkpoint) {
+      if (coordinator.snapshot(img, seeds))
+	write_checkpoint(img, checkpoint, seeds);
+      next_checkpoint = now() + interval;
+    }
+    usleep(100000);
+  }
+  coordinator.stop();
+  coordinator.snapshot(img, seeds);
+
+  if (!checkpoint.empty() && !write_checkpoint(img, checkpoint, seeds))
+    return EXIT_FAILURE;
+  fprintf(stderr, "%d passes of %dx%d in %.1f seconds from %u renders\n",
+	  img.get_paints_started(), width, height, now() - start_time,
+	  (unsigned int)seeds.size());
+  if (img.get_paints_started() == 0) {
+    fprintf(stderr, "%s: no passes finished\n", address);
+    return EXIT_FAILURE;
+  }
+  return write_images(img, basename, exposure, denoise, threads) ?
+    EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void print_help(const char* name) {
+  fprintf(stderr,
+	  "Usage: %s [-t COUNT] [-s WIDTHxHEIGHT] [-n PASSES] [-l SECONDS]\n"
+	  "          [-a THRESHOLD] [-e EXPOSURE] [-r SEED] [-d DEPTH] [-L]\n"
+	  "          [-S SAMPLER] [-w] [-o BASENAME] [-D] [-c] [-k CHECKPOINT]\n"
+	  "          [-K SECONDS] [-R CHECKPOINT] [SCENE]\n"
+	  "       %s -m [-t COUNT] [-e EXPOSURE] [-o BASENAME] [-D]\n"
+	  "          [-k CHECKPOINT] CHECKPOINT...\n"
+	  "       %s -C ADDRESS [-s WIDTHxHEIGHT] [-n PASSES] [-l SECONDS]\n"
+	  "          [-e EXPOSURE] [-r SEED] [-d DEPTH] [-L] [-S SAMPLER] [-w]\n"
+	  "          [-o BASENAME] [-D] [-k CHECKPOINT] [-K SECONDS]\n"
+	  "          [-R CHECKPOINT] [SCENE]\n"
+	  "       %s -W ADDRESS [-t COUNT] [-c] [SCENE]\n"
+	  "    -t: set thread count\n"
+	  "    -s: set image size (e.g. 640x480)\n"
+	  "    -n: stop after this many passes (samples per pixel)\n"
+	  "    -l: stop after this many seconds\n"
+	  "    -a: sample adaptively and stop once the relative error of every\n"
+	  "        pixel is below this (e.g. 0.02)\n"
+	  "    -e: exposure used for the 8-bit output (default 1.0)\n"
+	  "    -r: seed for the random number generators (default 0)\n"
+	  "    -d: bounces before paths may be ended at random (default %d)\n"
+	  "    -L: sample lights directly as well as finding them by bouncing\n"
+	  "    -S: where the numbers of the samples come from: \"sobol\" for\n"
+	  "        low-discrepancy samples or \"random\" (default \"%s\")\n"
+	  "    -w: carry light at sampled wavelengths instead of as red, green\n"
+	  "        and blue, for the colours of thin films and dispersive glass\n"
+	  "    -o: write BASENAME.pfm and BASENAME.ppm (default \"render\")\n"
+	  "    -D: also write a denoised copy as BASENAME-denoised.pfm and\n"
+	  "        BASENAME-denoised.ppm\n"
+	  "    -c: keep the built scene in SCENE.cache for the next render\n"
+	  "    -k: save the render to CHECKPOINT regularly and at the end\n"
+	  "    -K: seconds between checkpoints (default %g)\n"
+	  "    -R: resume the render saved in CHECKPOINT, and keep saving to it\n"
+	  "        unless -k is given. The result is statistically the same as\n"
+	  "        a render that wasn't stopped, but not bitwise the same.\n"
+	  "    -m: merge the renders of the same scene saved in the CHECKPOINTs\n"
+	  "    -C: coordinate workers connecting to ADDRESS, which is host:port\n"
+	  "        or the path of a Unix domain socket, and sum their renders\n"
+	  "    -W: render for the coordinator at ADDRESS until it has enough\n"
+	  "SCENE is a scene description file; without one, the built-in\n"
+	  "example scene is rendered.\n",
+	  name, name, name, name, Tracer::default_roulette_depth,
+	  Sampler::name(Tracer::default_sampler), default_interval);
+}
+
+int main(int argc, char **argv) {
+  int width = 640;
+  int height = 480;
+  int threads = 1;
+  int passes = 0;
+  double seconds = 0;
+  double threshold = 0;
+  double exposure = 1.0;
+  unsigned long seed = 0;
+  int depth = Tracer::default_roulette_depth;
+  bool light_sampling = false;
+  Sampler::Kind sampler = Tracer::default_sampler;
+  bool spectral = false;
+  bool use_cache = false;
+  bool denoise = false;
+  bool size_given = false, merging = false;
+  std::string basename = "render";
+  std::string checkpoint, resume;
+  double interval = default_interval;
+  const char *coordinate = 0, *work = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:s:n:l:a:e:r:d:LS:wo:Dck:K:R:mC:W:h")) != -1) {
+    switch (opt) {
+    case 's': {
+      int r = sscanf(optarg, "%dx%d", &width, &height);
+      size_given = true;
+      if (r == 2 && width > 0 && height > 0)
+        break;
+      print_help(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    case 't': {
+      int r = sscanf(optarg, "%d", &threads);
+      if (r == 1 && threads > 0)
+        break;
+      print_help(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    case 'n': {
+      int r = sscanf(optarg, "%d", &passes);
+      if (r == 1 && passes > 0)
+        break;
+      print_help(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    case 'l': {
+      int r = sscanf(optarg, "%lf", &seconds);
+      if (r == 1 && seconds > 0)
+        break;
+      print_help(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    case 'a': {
+      int r = sscanf(optarg, "%lf", &threshold);
+      if (r == 1 && threshold > 0)
+        break;
+      print_help(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    case 'e': {
+      int r = sscanf(optarg, "%lf", &exposure);
+      if (r == 1)
+        break;
+      print_help(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    case 'r': {
+      int r = sscanf(optarg, "%lu", &seed);
+      if (r == 1)
+        break;
+      print_help(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    case 'd': {
+      int r = sscanf(optarg, "%d", &depth);
+      if (r == 1 && depth >= 0)
+        break;
+      print_help(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    case 'L':
+      light_sampling = true;
+      break;
+    case 'S':
+      if (Sampler::parse(optarg, sampler))
+        break;
+      print_help(argv[0]);
+      exit(EXIT_FAILURE);
+    case 'w':
+      spectral = true;
+      break;
+    case 'o':
+      basename = optarg;
+      break;
+    case 'D':
+      denoise = true;
+      break;
+    case 'c':
+      use_cache = true;
+      break;
+    case 'k':
+      checkpoint = optarg;
+      break;
+    case 'K': {
+      int r = sscanf(optarg, "%lf", &interval);
+      if (r == 1 && interval > 0)
+        break;
+      print_help(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    case 'R':
+      resume = optarg;
+      break;
+    case 'm':
+      merging = true;
+      break;
+    case 'C':
+      coordinate = optarg;
+      break;
+    case 'W':
+      work = optarg;
+      break;
+    case 'h':
+      print_help(argv[0]);
+      exit(EXIT_SUCCESS);
+    default:
+      print_help(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (merging) {
+    if (optind == argc) {
+      print_help(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    std::vector<uint64_t> seeds;
+    Image *img = merge(argv + optind, argc - optind, seeds);
+    if (!img)
+      return EXIT_FAILURE;
+    fprintf(stderr, "%d passes of %ux%u from %u renders\n",
+	    img->get_paints_started(), img->width, img->height,
+	    (unsigned int)seeds.size());
+    bool const ok = (checkpoint.empty() ||
+		     write_checkpoint(*img, checkpoint, seeds)) &&
+      write_images(*img, basename, exposure, denoise, threads);
+    delete img;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if ((coordinate && work) || (coordinate && threshold > 0)) {
+    print_help(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  if (passes <= 0 && seconds <= 0 && threshold <= 0 && !work) {
+    fprintf(stderr, "%s: need a pass count (-n), a time limit (-l) or a "
+	    "noise threshold (-a)\n", argv[0]);
+    print_help(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  if (optind < argc - 1 || (use_cache && optind == argc)) {
+    print_help(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  // Workers must render the same scene as their coordinator
+  uint64_t fingerprint = 0;
+  if ((coordinate || work) &&
+      !scene_fingerprint(optind < argc ? argv[optind] : 0, fingerprint))
+    return EXIT_FAILURE;
+
+  Scene s;
+  Camera cam = demo_camera();
+  if (coordinate) {
+    // Only the workers need the scene
+  }
+  else if (optind < argc) {
+    double const load_start = now();
+    if (!SceneFile::load(argv[optind], s, cam, use_cache))
+      return EXIT_FAILURE;
+    fprintf(stderr, "%s: %u objects loaded in %.3f seconds\n",
+	    argv[optind], (unsigned int)s.objects.size(), now() - load_start);
+  }
+  else {
+    demo_scene(s);
+  }
+
+  if (work) {
+    signal(SIGINT, interrupt);
+    signal(SIGTERM, interrupt);
+    return Worker::run(work, s, cam, fingerprint, threads, &interrupted) ?
+      EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  // The seeds of the renders already in the checkpoint. This one must
+  // use another, or it would only repeat their samples.
+  std::vector<uint64_t> seeds;
+  Image *resumed = 0;
+  if (!resume.empty()) {
+    resumed = Image::read_checkpoint(resume.c_str(), seeds);
+    if (!resumed)
+      return EXIT_FAILURE;
+    if (size_given && (resumed->width != (unsigned int)width ||
+		       resumed->height != (unsigned int)height)) {
+      fprintf(stderr, "%s: checkpoint is %ux%u, not %dx%d\n", resume.c_str(),
+	      resumed->width, resumed->height, width, height);
+      return EXIT_FAILURE;
+    }
+    width = resumed->width;
+    height = resumed->height;
+    unsigned long const requested = seed;
+    while (std::find(seeds.begin(), seeds.end(), seed) != seeds.end())
+      seed++;
+    if (seed != requested)
+      fprintf(stderr, "%s: seed %lu already used, using %lu\n",
+	      resume.c_str(), requested, seed);
+    if (checkpoint.empty())
+      checkpoint = resume;
+  }
+
+  if (coordinate) {
+    Coordinator coordinator(width, height, fingerprint, seed, depth,
+			    light_sampling, sampler, spectral);
+    if (resumed) {
+      coordinator.add(*resumed, seeds);
+      delete resumed;
+    }
+    return run_coordinator(coordinator, coordinate, width, height, passes,
+			   seconds, checkpoint, interval, basename, exposure,
+			   denoise, threads);
+  }
+  seeds.push_back(seed);
+
+  Tracer tr(s, cam, seed);
+  tr.set_depth(depth, Tracer::default_max_bounces);
+  tr.set_light_sampling(light_sampling);
+  tr.set_sampler(sampler);
+  tr.set_spectral(spectral);
+
+  // A pass count includes the passes of the resumed render
+  int const done = resumed ? resumed->get_paints_started() : 0;
+  bool const finished = passes > 0 && done >= passes;
+  Renderer renderer(tr, width, height, threads,
+		    passes > done ? passes - done : 0);
+  renderer.set_noise_threshold(threshold);
+  if (resumed) {
+    renderer.image().add(*resumed);
+    renderer.touch();
+    delete resumed;
+  }
+
+  if (!checkpoint.empty()) {
+    // Stop cleanly and save what has been rendered when killed
+    signal(SIGINT, interrupt);
+    signal(SIGTERM, interrupt);
+  }
+  double const start_time = now();
+  if (!finished) {
+    // Checkpoints are written from a snapshot, so the render threads
+    // only wait for the copy to be made
+    Image snapshot(width, height);
+    double next_checkpoint = start_time + interval;
+    renderer.start();
+    while (renderer.is_running() && !interrupted &&
+	   (seconds <= 0 || now() - start_time < seconds)) {
+      if (!checkpoint.empty() && now() >= next_checkpoint) {
+	if (renderer.snapshot(snapshot))
+	  write_checkpoint(snapshot, checkpoint, seeds);
+	next_checkpoint = now() + interval;
+      }
+      usleep(10000);
+    }
+    renderer.stop();
+  }
+
+  Image const &img = renderer.image();
+  if (!checkpoint.empty() && !write_checkpoint(img, checkpoint, seeds))
+    return EXIT_FAILURE;
+  unsigned long samples = 0;
+  for (int y = 0 ; y < height ; ++y) {
+    for (int x = 0 ; x < width ; ++x)
+      samples += img.sample_count(x, y);
+  }
+  double const render_time = now() - start_time;
+  fprintf(stderr, "%d passes of %dx%d in %.1f seconds, "
+	  "%.1f samples per pixel%s\n",
+	  img.get_paints_started(), width, height, render_time,
+	  (double)samples / (width * height),
+	  renderer.is_converged() ? ", converged" : "");
+  if (!finished) {
+    fputc('\n', stderr);
+    renderer.get_stats().report(stderr, render_time);
+  }
+  if (img.get_paints_started() == 0) {
+    fprintf(stderr, "%s: no passes finished\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  return write_images(img, basename, exposure, denoise, threads) ?
+    EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,183 @@
+#include <cstdio>
+#include <cmath>
+#include <pthread.h>
+#include <errno.h>
+
+#include "renderer.h"
+#include "image.h"
+#include "tracer.h"
+#include "scheduler.h"
+
+Renderer::Renderer(Tracer &tracer, unsigned int width, unsigned int height,
+		   int threads, int max_passes, unsigned int tile_size)
+  : buf(width, height), tracer(tracer),
+    scheduler(width, height, tile_size, threads, max_passes),
+    tile_size(tile_size), noise_threshold(0), converged(false),
+    thread_count(threads), threads_running(0),
+    generation(0), snapshot_generation(0)
+{
+  pthread_mutex_init(&buf_mutex, 0);
+  this->threads = new Thread[thread_count];
+  for (int i = 0 ; i < thread_count ; ++i) {
+    this->threads[i].renderer = this;
+    this->threads[i].index = i;
+    this->threads[i].started = false;
+  }
+}
+
+Renderer::~Renderer() {
+  stop();
+  delete [] threads;
+  pthread_mutex_destroy(&buf_mutex);
+}
+
+void* Renderer::run_renderer(void *thread_void) {
+  Thread *th = static_cast<Thread*>(thread_void);
+  Renderer *r = th->renderer;
+  // Stream 0 is left for the main tracer
+  Tracer tracer(r->tracer, th->index + 1);
+  PixelSamples *tile_buf = new PixelSamples[r->tile_size * r->tile_size];
+  unsigned int *counts = new unsigned int[r->tile_size * r->tile_size];
+  unsigned int *firsts = new unsigned int[r->tile_size * r->tile_size];
+  Tile tile;
+  int pass;
+  while (r->scheduler.next(th->index, tile, pass)) {
+    pthread_mutex_lock(&r->buf_mutex);
+    // Settings changed while rendering apply from the next tile on
+    tracer.set_light_sampling(r->tracer.get_light_sampling());
+    unsigned int *c = counts, *f = firsts;
+    for (unsigned int y = tile.y0 ; y < tile.y1 ; ++y) {
+      for (unsigned int x = tile.x0 ; x < tile.x1 ; ++x) {
+	unsigned int &issued = r->issued[y * r->buf.width + x];
+	*c = r->samples_wanted(x, y);
+	*f++ = issued;
+	issued += *c++;
+      }
+    }
+    pthread_mutex_unlock(&r->buf_mutex);
+
+    tracer.traceTile(tile, r->buf.width, r->buf.height, counts, firsts,
+		     tile_buf);
+    pthread_mutex_lock(&r->buf_mutex);
+    r->buf.add(tile, tile_buf);
+    r->generation++;
+    r->stats += tracer.get_stats();
+    tracer.clear_stats();
+    bool const finished_pass = r->scheduler.finish(pass);
+    if (finished_pass) {
+      r->buf.paint_start();
+      if (r->noise_threshold > 0 && r->is_image_converged()) {
+	r->converged = true;
+	r->scheduler.stop();
+      }
+    }
+    pthread_mutex_unlock(&r->buf_mutex);
+    if (finished_pass)
+      r->pass_done();
+  }
+  delete [] tile_buf;
+  delete [] counts;
+  delete [] firsts;
+
+  pthread_mutex_lock(&r->buf_mutex);
+  r->threads_running--;
+  pthread_mutex_unlock(&r->buf_mutex);
+  pthread_exit(0);
+  return 0;
+}
+
+unsigned int Renderer::samples_wanted(unsigned int x, unsigned int y) const {
+  if (noise_threshold <= 0 || buf.sample_count(x, y) < min_samples)
+    return 1;
+  double const error = buf.relative_error(x, y) / noise_threshold;
+  if (error <= 1.0)
+    return 0;
+  if (error >= max_samples_per_pass)
+    return max_samples_per_pass;
+  return ceil(error);
+}
+
+bool Renderer::is_image_converged() const {
+  for (unsigned int y = 0 ; y < buf.height ; ++y) {
+    for (unsigned int x = 0 ; x < buf.width ; ++x) {
+      if (samples_wanted(x, y) > 0)
+	return false;
+    }
+  }
+  return true;
+}
+
+bool Renderer::is_converged() {
+  pthread_mutex_lock(&buf_mutex);
+  bool const ret = converged;
+  pthread_mutex_unlock(&buf_mutex);
+  return ret;
+}
+
+void Renderer::start() {
+  // The image may have been added to since, like with a resumed render
+  issued.resize(buf.width * buf.height);
+  for (unsigned int y = 0 ; y < buf.height ; ++y) {
+    for (unsigned int x = 0 ; x < buf.width ; ++x)
+      issued[y * buf.width + x] = buf.sample_count(x, y);
+  }
+  for (int i = 0 ; i < thread_count ; ++i) {
+    pthread_mutex_lock(&buf_mutex);
+    threads_running++;
+    pthread_mutex_unlock(&buf_mutex);
+    int ret = pthread_create(&threads[i].thread, 0, run_renderer,
+			     static_cast<void*>(&threads[i]));
+    if (ret != 0) {
+      errno = ret;
+      perror("Failed to create thread");
+      pthread_mutex_lock(&buf_mutex);
+      threads_running--;
+      pthread_mutex_unlock(&buf_mutex);
+    }
+    else {
+      threads[i].started = true;
+    }
+  }
+}
+
+void Renderer::stop() {
+  scheduler.stop();
+  wait();
+}
+
+void Renderer::wait() {
+  for (int i = 0 ; i < thread_count ; ++i) {
+    if (!threads[i].started) continue;
+    errno = pthread_join(threads[i].thread, 0);
+    if (errno != 0)
+      perror("Failed to join thread");
+    threads[i].started = false;
+  }
+}
+
+bool Renderer::is_running() {
+  pthread_mutex_lock(&buf_mutex);
+  bool const ret = threads_running > 0;
+  pthread_mutex_unlock(&buf_mutex);
+  return ret;
+}
+
+bool Renderer::snapshot(Image &dest) {
+  bool changed = false;
+  pthread_mutex_lock(&buf_mutex);
+  if (generation != snapshot_generation) {
+    dest.copy_from(buf);
+    snapshot_generation = generation;
+    changed = true;
+  }
+  pthread_mutex_unlock(&buf_mutex);
+  return changed;
+}
+
+RenderStats Renderer::get_stats() {
+  pthread_mutex_lock(&buf_mutex);
+  RenderStats ret = stats;
+  ret += tracer.get_stats();
+  pthread_mutex_unlock(&buf_mutex);
+  return ret;
+}
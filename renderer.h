@@ -0,0 +1,142 @@
+#ifndef PATHTRACE_RENDERER_H
+#define PATHTRACE_RENDERER_H
+
+#include <vector>
+#include <pthread.h>
+
+#include "image.h"
+#include "tracer.h"
+#include "scheduler.h"
+
+/* Renders an image progressively on a number of threads. The image is
+ * split into tiles handed out by a TileScheduler, and every thread adds
+ * its finished tiles straight into the one shared image. */
+class Renderer {
+private:
+  struct Thread {
+    Renderer *renderer;
+    int index;
+    pthread_t thread;
+    bool started;
+  };
+
+  Image buf;
+  Tracer &tracer;
+  TileScheduler scheduler;
+  unsigned int tile_size;
+  // Target relative error for adaptive sampling, zero when it is off
+  double noise_threshold;
+  bool converged;
+  Thread *threads;
+  int thread_count;
+  int threads_running;
+  // Counts the tiles added to buf, to tell whether snapshots are current
+  unsigned int generation;
+  unsigned int snapshot_generation;
+  // Work done by the threads, added with each tile
+  RenderStats stats;
+  // Samples of each pixel handed out to the threads, which numbers the
+  // samples of a tile while an earlier pass over it may still be running
+  std::vector<unsigned int> issued;
+  pthread_mutex_t buf_mutex;
+
+  Renderer(Renderer const &);
+  Renderer& operator=(Renderer const &);
+
+  static void* run_renderer(void *thread_void);
+
+  /* Adaptive sampling: how many samples a pixel gets in this pass. Must
+   * be called with the lock held. */
+  unsigned int samples_wanted(unsigned int x, unsigned int y) const;
+  bool is_image_converged() const;
+
+protected:
+  /* Called from a render thread whenever a full pass worth of tiles has
+   * been added to the image. The image is not locked. */
+  virtual void pass_done() { }
+
+public:
+  const static unsigned int default_tile_size = 32;
+  // Adaptive sampling starts judging a pixel after this many samples
+  const static unsigned int min_samples = 16;
+  // and gives it at most this many samples in one pass
+  const static unsigned int max_samples_per_pass = 4;
+
+  /* max_passes of zero renders until stop() is called */
+  Renderer(Tracer &tracer, unsigned int width, unsigned int height,
+	   int threads, int max_passes = 0,
+	   unsigned int tile_size = default_tile_size);
+  virtual ~Renderer();
+
+  /* Turns on adaptive sampling: pixels whose relative error (see
+   * Image::relative_error) is above the threshold get up to
+   * max_samples_per_pass samples per pass, and pixels below it get none.
+   * The render ends once every pixel is below the threshold. Zero turns
+   * adaptive sampling off. Call before start(). */
+  void set_noise_threshold(double threshold) {
+    noise_threshold = threshold;
+  }
+
+  /* Whether adaptive sampling has ended the render */
+  bool is_converged();
+
+  void start();
+  /* Lets the threads finish their current tiles and waits for them */
+  void stop();
+  /* Waits until the pass limit has been reached */
+  void wait();
+  bool is_running();
+
+  int get_passes_finished() {
+    return scheduler.get_passes_finished();
+  }
+
+  /* The image may only be accessed with the lock held while the threads
+   * are running */
+  void lock() {
+    pthread_mutex_lock(&buf_mutex);
+  }
+
+  void unlock() {
+    pthread_mutex_unlock(&buf_mutex);
+  }
+
+  Image& image() {
+    return buf;
+  }
+
+  /* Copies the image into dest if tiles have been added since the last
+   * snapshot. Holds the lock only for the copy, so that the caller can
+   * take its time converting the copy for display. Returns true if dest
+   * was updated. */
+  bool snapshot(Image &dest);
+
+  /* Marks the image as changed after modifying it outside the threads */
+  void touch() {
+    generation++;
+  }
+
+  Tracer& get_tracer() {
+    return tracer;
+  }
+
+  /* Turns sampling lights directly on or off for the tiles started from
+   * now on. Both ways find the same light on average, so the passes
+   * before and after can be summed. */
+  void set_light_sampling(bool enabled) {
+    lock();
+    tracer.set_light_sampling(enabled);
+    unlock();
+  }
+
+  /* The work done by the threads for the tiles added so far, and by the
+   * tracer given to the constructor */
+  RenderStats get_stats();
+};
+
+/*
+Local Variables:
+mode:c++
+End:
+*/
+#endif /* PATHTRACE_RENDERER_H */
@@ -0,0 +1,131 @@
+#include <cstring>
+
+#include "sampler.h"
+#include "random.h"
+
+namespace {
+  // Integer hash by Chris Wellons (lowbias32)
+  uint32_t hash(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+  }
+
+  uint32_t hash_combine(uint32_t seed, uint32_t v) {
+    return hash(seed ^ (v + 0x9e3779b9U + (seed << 6) + (seed >> 2)));
+  }
+
+  uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555U) | ((x & 0x55555555U) << 1);
+    x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fU) | ((x & 0x0f0f0f0fU) << 4);
+    x = ((x >> 8) & 0x00ff00ffU) | ((x & 0x00ff00ffU) << 8);
+    return (x >> 16) | (x << 16);
+  }
+
+  /* A random permutation of the bits where every bit only depends on
+   * the bits below it, with the constants of Nathan Vegdahl's
+   * improvement of the Laine-Karras hash */
+  uint32_t laine_karras(uint32_t x, uint32_t seed) {
+    x ^= x * 0x3d20adeaU;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526c56U;
+    x ^= x * 0x53a22864U;
+    return x;
+  }
+
+  /* Owen scrambling of a 32-bit fraction: every digit is flipped or not
+   * depending on all the digits before it */
+  uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+    return reverse_bits(laine_karras(reverse_bits(x), seed));
+  }
+
+  /* The first two dimensions of the Sobol sequence. The first is the
+   * van der Corput sequence, and the second has the direction numbers
+   * of the polynomial x + 1. */
+  uint32_t sobol0(uint32_t index) {
+    return reverse_bits(index);
+  }
+
+  uint32_t sobol1(uint32_t index) {
+    uint32_t result = 0;
+    for (uint32_t v = 0x80000000U ; index ; index >>= 1, v ^= v >> 1) {
+      if (index & 1)
+	result ^= v;
+    }
+    return result;
+  }
+
+  const char *const kind_names[Sampler::sampler_kinds] = {
+    "random", "sobol"
+  };
+}
+
+Sampler* Sampler::create(Kind kind, uint64_t seed, uint64_t stream) {
+  if (kind == sobol_sampler)
+    return new SobolSampler(seed, stream);
+  return new RandomSampler(seed, stream);
+}
+
+const char* Sampler::name(Kind kind) {
+  return kind_names[kind];
+}
+
+bool Sampler::parse(const char *name, Kind &kind) {
+  for (int k = 0 ; k < sampler_kinds ; ++k) {
+    if (strcmp(name, kind_names[k]) == 0) {
+      kind = (Kind)k;
+      return true;
+    }
+  }
+  return false;
+}
+
+SobolSampler::SobolSampler(uint64_t seed, uint64_t stream)
+  : rng(seed, stream), seed(hash((uint32_t)seed ^ hash(seed >> 32))),
+    pixel_seed(0), index(0), dimension(0)
+{
+  pair[0] = pair[1] = 0;
+}
+
+void SobolSampler::start(unsigned int x, unsigned int y, uint32_t index,
+			 unsigned int dimension) {
+  pixel_seed = hash_combine(hash_combine(seed, x), y);
+  this->index = index;
+  this->dimension = dimension;
+  if (dimension % 2 && dimension < max_dimensions) {
+    this->dimension--;
+    make_pair();
+    this->dimension++;
+  }
+}
+
+void SobolSampler::make_pair() {
+  uint32_t const pair_seed = hash_combine(pixel_seed, dimension / 2);
+  uint32_t const shuffled = owen_scramble(index, pair_seed);
+  uint32_t const u = owen_scramble(sobol0(shuffled),
+				   hash_combine(pair_seed, 1));
+  uint32_t const v = owen_scramble(sobol1(shuffled),
+				   hash_combine(pair_seed, 2));
+  pair[0] = u * (1.0 / 4294967296.0);
+  pair[1] = v * (1.0 / 4294967296.0);
+}
+
+double SobolSampler::uniform() {
+  if (dimension >= max_dimensions)
+    return rng.uniform();
+  if (dimension % 2 == 0)
+    make_pair();
+  return pair[dimension++ % 2];
+}
+
+void SobolSampler::uniform2(double &u, double &v) {
+  if (dimension % 2)
+    dimension++;
+  u = uniform();
+  v = uniform();
+}
@@ -0,0 +1,126 @@
+#ifndef PATHTRACE_SAMPLER_H
+#define PATHTRACE_SAMPLER_H
+
+#include <stdint.h>
+
+#include "random.h"
+
+/* Where the random numbers of a path come from.
+ *
+ * A sample of a pixel is a point in a cube of many dimensions, one for
+ * every number used along its path: first the position within the pixel
+ * and on the lens, then for every bounce the free path, the direction of
+ * the bounce and so on. start() begins a sample, and uniform() and
+ * uniform2() hand out its coordinates in order.
+ *
+ * Like Random, a sampler belongs to one thread, and samplers made with
+ * the same seed and different streams don't repeat each other. */
+class Sampler {
+public:
+  enum Kind { random_sampler, sobol_sampler, sampler_kinds };
+
+  virtual ~Sampler() { }
+
+  /* A new sampler of the kind */
+  static Sampler* create(Kind kind, uint64_t seed, uint64_t stream);
+
+  /* The name of a kind, as it is given on the command line */
+  static const char* name(Kind kind);
+  /* The kind with the name. Returns false if there is none. */
+  static bool parse(const char *name, Kind &kind);
+
+  virtual Kind kind() const = 0;
+
+  /* Starts the sample number index of pixel (x, y) at the dimension, or
+   * goes back to it after taking numbers for other samples in between */
+  virtual void start(unsigned int x, unsigned int y, uint32_t index,
+		     unsigned int dimension = 0) = 0;
+
+  /* The next coordinate, uniform in [0, 1) */
+  virtual double uniform() = 0;
+
+  /* Uniform in (0, 1], safe to take a logarithm of */
+  virtual double uniform_open() {
+    return 1.0 - uniform();
+  }
+
+  /* The next two coordinates, for a choice made of two numbers, like a
+   * point on the lens, so that they can be spread out together */
+  virtual void uniform2(double &u, double &v) = 0;
+};
+
+/* Independent random numbers from a Random stream, which just goes on
+ * from one sample to the next */
+class RandomSampler : public Sampler {
+private:
+  Random rng;
+
+public:
+  RandomSampler(uint64_t seed = 0x853c49e6748fea9bULL, uint64_t stream = 0)
+    : rng(seed, stream)
+  { }
+
+  virtual Kind kind() const {
+    return random_sampler;
+  }
+
+  virtual void start(unsigned int, unsigned int, uint32_t, unsigned int) { }
+
+  virtual double uniform() {
+    return rng.uniform();
+  }
+
+  virtual double uniform_open() {
+    return rng.uniform_open();
+  }
+
+  virtual void uniform2(double &u, double &v) {
+    u = rng.uniform();
+    v = rng.uniform();
+  }
+};
+
+/* Low-discrepancy samples: the dimensions are taken in pairs, and each
+ * pair of each pixel is a two-dimensional Sobol sequence with Owen
+ * scrambling and a shuffled order (Burley, "Practical Hash-based Owen
+ * Scrambling", 2020). The scrambling and the shuffle are seeded from the
+ * seed, the pixel and the pair, so that every pair of dimensions is
+ * spread evenly over the samples of a pixel, while the pairs are
+ * independent of each other and of other pixels. The samples of a pixel
+ * depend only on their numbers, not on the thread that renders them.
+ *
+ * A one-dimensional choice takes half of a pair, and uniform2() starts
+ * a new pair if needed. Dimensions past max_dimensions come from a
+ * Random stream. */
+class SobolSampler : public Sampler {
+private:
+  Random rng;
+  uint32_t seed;
+  uint32_t pixel_seed;
+  uint32_t index;
+  unsigned int dimension;
+  double pair[2];
+
+  void make_pair();
+
+public:
+  const static unsigned int max_dimensions = 64;
+
+  SobolSampler(uint64_t seed, uint64_t stream);
+
+  virtual Kind kind() const {
+    return sobol_sampler;
+  }
+
+  virtual void start(unsigned int x, unsigned int y, uint32_t index,
+		     unsigned int dimension = 0);
+  virtual double uniform();
+  virtual void uniform2(double &u, double &v);
+};
+
+/*
+Local Variables:
+mode:c++
+End:
+*/
+#endif /* PATHTRACE_SAMPLER_H */
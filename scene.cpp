@@ -0,0 +1,413 @@
+#include <vector>
+#include <set>
+
+#include <assert.h>
+
+#include "scene.h"
+#include "shapes.h"
+#include "bvh.h"
+#include "simd.h"
+#include "packet.h"
+#include "material.h"
+
+void Scene::build() {
+  std::vector<Box> boxes;
+  for (unsigned int i = 0 ; i < objects.size() ; ++i) {
+    Box box;
+    if (objects[i].shape->bounds(box))
+      boxes.push_back(box);
+  }
+  bvh.build(boxes);
+  compile();
+}
+
+bool Scene::build(Bvh const &prebuilt) {
+  unsigned int count = 0;
+  for (unsigned int i = 0 ; i < objects.size() ; ++i) {
+    Box box;
+    if (objects[i].shape->bounds(box))
+      count++;
+  }
+  if (!prebuilt.fits(count)) {
+    built = false;
+    return false;
+  }
+  bvh = prebuilt;
+  compile();
+  return true;
+}
+
+void Scene::compile() {
+  std::vector<unsigned int> bounded;
+  bounded_object.clear();
+  bounded_generic.clear();
+  compiled.clear();
+  spheres = SphereSet();
+  planes = PlaneSet();
+  plane_object.clear();
+  unbounded_generic.clear();
+  emitters.clear();
+  object_emitter.assign(objects.size(), -1);
+  std::vector<Vector3> plane_points, plane_normals;
+
+  // Materials are often shared, and only need compiling once
+  std::set<Material*> materials;
+  for (unsigned int i = 0 ; i < objects.size() ; ++i) {
+    if (materials.insert(objects[i].material).second)
+      objects[i].material->compile();
+  }
+
+  for (unsigned int i = 0 ; i < objects.size() ; ++i) {
+    Shape const *shape = objects[i].shape;
+    Box box;
+    if (shape->bounds(box)) {
+      bounded.push_back(i);
+    }
+    else if (Plane const *p = dynamic_cast<Plane const*>(shape)) {
+      planes.push_back(p->get_normal(), p->get_point());
+      plane_object.push_back(i);
+      plane_points.push_back(p->get_point());
+      plane_normals.push_back(p->get_normal());
+    }
+    else {
+      unbounded_generic.push_back(i);
+    }
+  }
+
+  for (unsigned int i = 0 ; i < bvh.indices.size() ; ++i) {
+    unsigned int const object = bounded[bvh.indices[i]];
+    Shape const *shape = objects[object].shape;
+    bounded_object.push_back(object);
+    if (Sphere const *s = dynamic_cast<Sphere const*>(shape)) {
+      spheres.push_back(s->get_center(), s->get_radius());
+      bounded_generic.push_back(0);
+    }
+    else {
+      spheres.push_back(Vector3(), 0.0);
+      bounded_generic.push_back(shape->clone(compiled));
+    }
+  }
+
+  // Tag the emitters. Planes are clipped by all the other planes.
+  for (unsigned int i = 0 ; i < objects.size() ; ++i) {
+    if (objects[i].material->emission.is_zero())
+      continue;
+    Shape const *shape = objects[i].shape;
+    if (Sphere const *s = dynamic_cast<Sphere const*>(shape)) {
+      object_emitter[i] = emitters.size();
+      emitters.push_back(Emitter::make_sphere(i, s->get_center(),
+					      s->get_radius()));
+    }
+    else if (Plane const *p = dynamic_cast<Plane const*>(shape)) {
+      std::vector<Vector3> points, normals;
+      for (unsigned int j = 0 ; j < plane_object.size() ; ++j) {
+	if (plane_object[j] == i) continue;
+	points.push_back(plane_points[j]);
+	normals.push_back(plane_normals[j]);
+      }
+      Emitter e;
+      if (Emitter::make_plane(i, p->get_point(), p->get_normal(),
+			      points, normals, e)) {
+	object_emitter[i] = emitters.size();
+	emitters.push_back(e);
+      }
+    }
+  }
+  built = true;
+}
+
+struct Scene::ClosestHit {
+  Scene const &scene;
+  Ray const &ray;
+  double distance;
+  Kind kind;
+  unsigned int index;
+  // The primitive hit within a generic shape
+  unsigned int primitive;
+  // Shapes tested in the leaves, spheres and others
+  unsigned int sphere_tests, generic_tests;
+
+  ClosestHit(Scene const &scene, Ray const &ray)
+    : scene(scene), ray(ray), distance(INFINITY), kind(none), index(0),
+      primitive(0), sphere_tests(0), generic_tests(0)
+  { }
+
+  double max_distance() const {
+    return distance;
+  }
+
+  void found(double const t, Kind const k, unsigned int const i) {
+    distance = t;
+    kind = k;
+    index = i;
+  }
+
+  bool leaf(unsigned int const first, unsigned int const count) {
+    SphereSet const &s = scene.spheres;
+    for (unsigned int i = first ; i < first + count ; ++i) {
+      if (Shape const *shape = scene.bounded_generic[i]) {
+	generic_tests++;
+	HitRecord record;
+	if (shape->closest(ray, distance, record)) {
+	  found(record.distance, generic_shape, i);
+	  primitive = record.primitive;
+	}
+      }
+      else {
+	sphere_tests++;
+	double t = Sphere::distance(s.cx[i], s.cy[i], s.cz[i], s.radius2[i],
+				    ray);
+	if (t > 0 && t < distance)
+	  found(t, sphere, i);
+      }
+    }
+    return false;
+  }
+
+  void unbounded() {
+    PlaneSet const &p = scene.planes;
+    for (unsigned int i = 0 ; i < p.size() ; ++i) {
+      double t = Plane::distance(p.nx[i], p.ny[i], p.nz[i], p.offset[i], ray);
+      if (t > 0 && t < distance)
+	found(t, plane, i);
+    }
+    for (unsigned int i = 0 ; i < scene.unbounded_generic.size() ; ++i) {
+      Shape const *shape = scene.objects[scene.unbounded_generic[i]].shape;
+      HitRecord record;
+      if (shape->closest(ray, distance, record)) {
+	// Marked by an index past the bounded shapes
+	found(record.distance, generic_shape, scene.bounded_object.size() + i);
+	primitive = record.primitive;
+      }
+    }
+  }
+};
+
+void Scene::count_tests(RenderStats &stats, unsigned int rays,
+			unsigned int sphere_tests,
+			unsigned int generic_tests) const {
+  stats.tests[RenderStats::sphere] += (uint64_t)rays * sphere_tests;
+  stats.tests[RenderStats::plane] += (uint64_t)rays * planes.size();
+  stats.tests[RenderStats::other_shape] +=
+    (uint64_t)rays * (generic_tests + unbounded_generic.size());
+}
+
+Object const* Scene::object(Kind kind, unsigned int index) const {
+  switch (kind) {
+  case sphere:
+    return &objects[bounded_object[index]];
+  case plane:
+    return &objects[plane_object[index]];
+  case generic_shape:
+    if (index < bounded_object.size())
+      return &objects[bounded_object[index]];
+    return &objects[unbounded_generic[index - bounded_object.size()]];
+  default:
+    return 0;
+  }
+}
+
+Object const* Scene::closest(Ray const &ray, HitRecord &record,
+			     RenderStats *stats) const {
+  assert(built);
+  ClosestHit closest(*this, ray);
+  // The unbounded objects first, they often limit the search distance
+  closest.unbounded();
+  bvh.traverse(ray, closest);
+  if (stats)
+    count_tests(*stats, 1, closest.sphere_tests, closest.generic_tests);
+
+  if (closest.kind == none)
+    return 0;
+  record = HitRecord(closest.distance,
+		     closest.kind == generic_shape ? closest.primitive : 0);
+  return object(closest.kind, closest.index);
+}
+
+Object const* Scene::intersect(Ray const &ray, Hit &hit,
+			       RenderStats *stats) const {
+  HitRecord record;
+  Object const *o = closest(ray, record, stats);
+  if (o)
+    hit = Hit(record.distance, normal(ray, *o, record));
+  return o;
+}
+
+struct Scene::PacketClosestHit {
+  Scene const &scene;
+  RayPacket const &packet;
+  RealLanes distance;
+  Kind kind[RayPacket::size];
+  unsigned int index[RayPacket::size];
+  unsigned int sphere_tests, generic_tests;
+
+  PacketClosestHit(Scene const &scene, RayPacket const &packet)
+    : scene(scene), packet(packet), distance(INFINITY), sphere_tests(0),
+      generic_tests(0)
+  {
+    for (int lane = 0 ; lane < RayPacket::size ; ++lane)
+      kind[lane] = none;
+  }
+
+  RealLanes const& max_distance() const {
+    return distance;
+  }
+
+  void found(int changed, Kind const k, unsigned int const i) {
+    for (int lane = 0 ; changed ; ++lane, changed >>= 1) {
+      if (changed & 1) {
+	kind[lane] = k;
+	index[lane] = i;
+      }
+    }
+  }
+
+  bool leaf(unsigned int const first, unsigned int const count) {
+    SphereSet const &s = scene.spheres;
+    for (unsigned int i = first ; i < first + count ; ++i) {
+      if (Shape const *shape = scene.bounded_generic[i]) {
+	generic_tests++;
+	found(shape->intersect(packet, distance), generic_shape, i);
+      }
+      else {
+	sphere_tests++;
+	found(Sphere::distance(RealLanes(s.cx[i]), RealLanes(s.cy[i]),
+			       RealLanes(s.cz[i]), RealLanes(s.radius2[i]),
+			       packet, distance), sphere, i);
+      }
+    }
+    return false;
+  }
+
+  void unbounded() {
+    PlaneSet const &p = scene.planes;
+    for (unsigned int i = 0 ; i < p.size() ; ++i) {
+      found(Plane::distance(RealLanes(p.nx[i]), RealLanes(p.ny[i]),
+			    RealLanes(p.nz[i]), RealLanes(p.offset[i]),
+			    packet, distance), plane, i);
+    }
+    for (unsigned int i = 0 ; i < scene.unbounded_generic.size() ; ++i) {
+      Shape const *shape = scene.objects[scene.unbounded_generic[i]].shape;
+      found(shape->intersect(packet, distance), generic_shape,
+	    scene.bounded_object.size() + i);
+    }
+  }
+};
+
+void Scene::closest(RayPacket const &packet, Ray const *rays,
+		    Object const **objects, HitRecord *records,
+		    RenderStats *stats) const {
+  assert(built);
+  PacketClosestHit closest(*this, packet);
+  closest.unbounded();
+  bvh.traverse(packet, closest);
+  if (stats) {
+    unsigned int lanes = 0;
+    for (int lane = 0 ; lane < RayPacket::size ; ++lane)
+      lanes += (packet.active >> lane) & 1;
+    count_tests(*stats, lanes, closest.sphere_tests, closest.generic_tests);
+  }
+
+  real distance[RayPacket::size];
+  closest.distance.store(distance);
+  for (int lane = 0 ; lane < RayPacket::size ; ++lane) {
+    if (!(packet.active & (1 << lane))) continue;
+    Kind const kind = closest.kind[lane];
+    unsigned int const i = closest.index[lane];
+    objects[lane] = object(kind, i);
+#ifdef PATHTRACE_FLOAT
+    // Float lanes only choose the sphere or plane, whose distance is
+    // solved again in double like for single rays. Otherwise the point
+    // hit could be on the wrong side of the surface.
+    if (kind == sphere || kind == plane) {
+      double const t = kind == sphere ?
+	Sphere::distance(spheres.cx[i], spheres.cy[i], spheres.cz[i],
+			 spheres.radius2[i], rays[lane]) :
+	Plane::distance(planes.nx[i], planes.ny[i], planes.nz[i],
+			planes.offset[i], rays[lane]);
+      if (t > 0)
+	records[lane] = HitRecord(t);
+      else
+	objects[lane] = this->closest(rays[lane], records[lane], stats);
+      continue;
+    }
+#endif
+    if (kind != generic_shape) {
+      records[lane] = HitRecord(distance[lane]);
+      continue;
+    }
+    // The packet test only finds the distance, the primitive needs the
+    // shape's own query
+    Ray const &ray = rays[lane];
+    if (stats)
+      stats->tests[RenderStats::other_shape]++;
+    if (!objects[lane]->shape->closest(ray, INFINITY, records[lane])) {
+      // Rounding differences between the packet and single ray versions
+      objects[lane] = this->closest(ray, records[lane], stats);
+    }
+  }
+}
+
+struct Scene::AnyHit {
+  Scene const &scene;
+  Ray const &ray;
+  double distance;
+  bool hit;
+  unsigned int sphere_tests, generic_tests;
+
+  AnyHit(Scene const &scene, Ray const &ray, double max_distance)
+    : scene(scene), ray(ray), distance(max_distance), hit(false),
+      sphere_tests(0), generic_tests(0)
+  { }
+
+  double max_distance() const {
+    return distance;
+  }
+
+  bool leaf(unsigned int const first, unsigned int const count) {
+    SphereSet const &s = scene.spheres;
+    for (unsigned int i = first ; i < first + count ; ++i) {
+      if (Shape const *shape = scene.bounded_generic[i]) {
+	generic_tests++;
+	hit = shape->occludes(ray, distance);
+      }
+      else {
+	sphere_tests++;
+	double t = Sphere::distance(s.cx[i], s.cy[i], s.cz[i], s.radius2[i],
+				    ray);
+	hit = t > 0 && t < distance;
+      }
+      if (hit)
+	return true;
+    }
+    return false;
+  }
+};
+
+bool Scene::occluded(Ray const &ray, double max_distance,
+		     RenderStats *stats) const {
+  assert(built);
+  for (unsigned int i = 0 ; i < planes.size() ; ++i) {
+    double t = Plane::distance(planes.nx[i], planes.ny[i], planes.nz[i],
+			       planes.offset[i], ray);
+    if (t > 0 && t < max_distance) {
+      if (stats)
+	stats->tests[RenderStats::plane] += i + 1;
+      return true;
+    }
+  }
+  for (unsigned int i = 0 ; i < unbounded_generic.size() ; ++i) {
+    if (objects[unbounded_generic[i]].shape->occludes(ray, max_distance)) {
+      if (stats) {
+	stats->tests[RenderStats::plane] += planes.size();
+	stats->tests[RenderStats::other_shape] += i + 1;
+      }
+      return true;
+    }
+  }
+  AnyHit any(*this, ray, max_distance);
+  bvh.traverse(ray, any);
+  if (stats)
+    count_tests(*stats, 1, any.sphere_tests, any.generic_tests);
+  return any.hit;
+}
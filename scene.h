@@ -0,0 +1,218 @@
+#ifndef PATHTRACE_SCENE_H
+#define PATHTRACE_SCENE_H
+
+#include <vector>
+#include <math.h>
+
+#include "linalg.h"
+#include "material.h"
+#include "shapes.h"
+#include "bvh.h"
+#include "packet.h"
+#include "emitter.h"
+#include "stats.h"
+#include "arena.h"
+
+/* A shape and its material. Neither is owned by the object, they live in
+ * the arena of a Scene, and objects may share a material. */
+class Object {
+public:
+  Shape *shape;
+  Material *material;
+  // Whether shape and material are the caller's, still to be copied into
+  // the arena of the scene the object is added to
+  bool borrowed;
+
+  Object(Shape *shape, Material *material)
+    : shape(shape), material(material), borrowed(false)
+  { }
+
+  /* Refers to the shape and the material only until the object is added
+   * to a scene, which copies them, as in
+   * scene.add(Object(Sphere(...), Material(...))) */
+  Object(Shape const &shape, Material const &material)
+    : shape(const_cast<Shape*>(&shape)),
+      material(const_cast<Material*>(&material)), borrowed(true)
+  { }
+};
+
+/* Spheres of a compiled scene, stored component by component */
+struct SphereSet {
+  std::vector<real> cx, cy, cz, radius2;
+
+  void push_back(Vector3 const &center, double radius) {
+    cx.push_back(center.x);
+    cy.push_back(center.y);
+    cz.push_back(center.z);
+    radius2.push_back(radius * radius);
+  }
+};
+
+/* Planes of a compiled scene, as normals and offsets along them */
+struct PlaneSet {
+  std::vector<real> nx, ny, nz, offset;
+
+  void push_back(Vector3 const &normal, Vector3 const &point) {
+    nx.push_back(normal.x);
+    ny.push_back(normal.y);
+    nz.push_back(normal.z);
+    offset.push_back(normal.dot(point));
+  }
+
+  unsigned int size() const {
+    return offset.size();
+  }
+};
+
+/* The objects of a scene, and a compiled form of them for tracing.
+ *
+ * Objects are added as instances of the Shape classes, but build() copies
+ * spheres and planes into flat arrays which are intersected in tight
+ * loops without virtual calls. Bounded shapes are stored in the order
+ * of the leaves of the bounding volume hierarchy, so that each leaf
+ * covers a contiguous range of them. Only shapes that aren't spheres or
+ * planes are intersected through their Shape, and build() copies those
+ * into an arena of their own in hierarchy order, so that the shapes of a
+ * leaf are next to each other in memory.
+ *
+ * The scene owns the shapes and materials of its objects, which live in
+ * its arena and go away with the scene all at once. */
+class Scene {
+private:
+  struct ClosestHit;
+  struct PacketClosestHit;
+  struct AnyHit;
+  enum Kind { none, sphere, plane, generic_shape };
+
+  // The shapes and materials of the objects
+  Arena arena;
+  // Copies of the bounded shapes that aren't spheres, made by compile()
+  Arena compiled;
+  Bvh bvh;
+  // Bounded shapes, in hierarchy order. For each one, the index of its
+  // object, and the copy of its Shape if it isn't a sphere. Spheres go in
+  // spheres at the same index.
+  std::vector<unsigned int> bounded_object;
+  std::vector<Shape const*> bounded_generic;
+  SphereSet spheres;
+  // Unbounded shapes
+  PlaneSet planes;
+  std::vector<unsigned int> plane_object;
+  std::vector<unsigned int> unbounded_generic;
+  // Emissive objects, and the index of each object's emitter or -1
+  std::vector<Emitter> emitters;
+  std::vector<int> object_emitter;
+  bool built;
+
+  Scene(Scene const &);
+  Scene& operator=(Scene const &);
+
+  /* The part of build() after the hierarchy is ready */
+  void compile();
+
+  /* Adds the shapes tested for the rays of one query to stats: the
+   * spheres and other shapes tested in the hierarchy, and every
+   * unbounded shape */
+  void count_tests(RenderStats &stats, unsigned int rays,
+		   unsigned int sphere_tests, unsigned int generic_tests) const;
+
+  /* The object of a shape found by the queries, or 0 for none */
+  Object const* object(Kind kind, unsigned int index) const;
+
+public:
+  std::vector<Object> objects;
+  double mean_free_path;
+
+  Scene()
+    : built(false), mean_free_path(INFINITY)
+  { }
+
+  /* Adds an object made of copies of the shape and the material */
+  void add(Shape const &shape, Material const &material) {
+    add(Object(shape.clone(arena), material.clone(arena)));
+  }
+
+  /* Adds an object whose shape and material are in get_arena() already,
+   * such as one sharing the material of another object, or copies them
+   * there if the object borrows them */
+  void add(Object const &o) {
+    if (o.borrowed) {
+      add(*o.shape, *o.material);
+      return;
+    }
+    objects.push_back(o);
+    built = false;
+  }
+
+  Arena& get_arena() {
+    return arena;
+  }
+
+  /* Compiles the objects for tracing. Needs to be called after the
+   * objects have been added and before intersect(). */
+  void build();
+
+  /* Like build(), but uses a hierarchy built earlier for the same
+   * objects, such as one saved from get_bvh(). Returns false and leaves
+   * the scene unbuilt if the hierarchy doesn't fit the objects. */
+  bool build(Bvh const &prebuilt);
+
+  Bvh const& get_bvh() const {
+    return bvh;
+  }
+
+  bool is_built() const {
+    return built;
+  }
+
+  /* Finds the nearest object hit by the ray. Returns 0 if nothing is hit,
+   * otherwise sets record to the distance to the hit and the primitive
+   * hit within the object's shape. Nothing else about the hit is found
+   * until normal() is asked for it. The shapes tested are counted in
+   * stats, if it isn't 0, here and in the other queries below. */
+  Object const* closest(Ray const &ray, HitRecord &record,
+			RenderStats *stats = 0) const;
+
+  /* The normal at a hit on the object found by closest() */
+  Vector3 normal(Ray const &ray, Object const &object,
+		 HitRecord const &record) const {
+    return object.shape->normal_at(ray, record);
+  }
+
+  /* closest() and normal() together, for when the normal is needed
+   * anyway */
+  Object const* intersect(Ray const &ray, Hit &hit,
+			  RenderStats *stats = 0) const;
+
+  /* Finds the nearest objects hit by the rays of a packet, which was
+   * made from the given rays. For each active lane, sets objects[i] and
+   * records[i] like closest() above. */
+  void closest(RayPacket const &packet, Ray const *rays,
+	       Object const **objects, HitRecord *records,
+	       RenderStats *stats = 0) const;
+
+  /* Whether anything is hit by the ray closer than max_distance. Stops at
+   * the first hit found, which makes it faster than intersect() for
+   * shadow rays. */
+  bool occluded(Ray const &ray, double max_distance,
+		RenderStats *stats = 0) const;
+
+  /* Emissive spheres and planes, which lights can be sampled from. Found
+   * by build(). */
+  std::vector<Emitter> const& get_emitters() const {
+    return emitters;
+  }
+
+  /* The emitter made from the object, or 0 if there isn't one */
+  Emitter const* emitter(Object const *object) const {
+    int const i = object_emitter[object - &objects[0]];
+    return i < 0 ? 0 : &emitters[i];
+  }
+};
+
+/*
+Local Variables:
+mode:c++
+End:
+*/
+#endif /* PATHTRACE_SCENE_H */
@@ -0,0 +1,498 @@
+#include <map>
+#include <string>
+#include <vector>
+#include <typeinfo>
+#include <cstdio>
+#include <cstring>
+
+#include <stdint.h>
+
+#include "scenefile.h"
+#include "mappedfile.h"
+#include "scene.h"
+#include "shapes.h"
+#include "mesh.h"
+#include "material.h"
+#include "camera.h"
+#include "bvh.h"
+#include "linalg.h"
+
+/* The cache is written in the native byte order and layout, and the
+ * header records enough of them that a cache from a different machine or
+ * build is rejected instead of misread:
+ *
+ *   magic, version, byte order mark, sizeof(Vertex), sizeof(BvhNode)
+ *   source files: name, size and modification time of each
+ *   camera corners, focus and aperture; mean free path
+ *   materials: kind and all fields of each
+ *   meshes: smooth flag, vertices, triangles and hierarchy nodes of each
+ *   objects: material index and shape tree of each
+ *   hierarchy nodes and indices of the scene
+ *
+ * Arrays are a 64-bit count followed by the elements, which are padded
+ * to start at a multiple of array_alignment from the start of the file.
+ * The mapping is page aligned, so the reader can copy them straight out
+ * of it. */
+
+namespace {
+  const char magic[8] = { 'p', 't', 's', 'c', 'e', 'n', 'e', '\n' };
+  const uint32_t version = 2;
+  const uint32_t byte_order = 0x01020304;
+  const size_t array_alignment = 16;
+
+  enum ShapeKind {
+    sphere_shape, plane_shape, difference_shape, mesh_shape, union_shape,
+    intersection_shape
+  };
+
+  enum MaterialKind {
+    diffuse_material, chrome_material, glass_material, film_material
+  };
+}
+
+struct SceneFile::Writer {
+  FILE *f;
+  bool ok;
+  size_t position;
+  std::map<Material const*, uint32_t> materials;
+  std::vector<Material const*> material_list;
+  // Copies of a mesh share their vertex array, which identifies them
+  std::map<void const*, uint32_t> meshes;
+  std::vector<TriangleMesh const*> mesh_list;
+
+  Writer(FILE *f)
+    : f(f), ok(true), position(0)
+  { }
+
+  void put_bytes(void const *data, size_t size) {
+    ok = ok && (size == 0 || fwrite(data, size, 1, f) == 1);
+    position += size;
+  }
+
+  void align() {
+    static const char zeros[array_alignment] = { 0 };
+    put_bytes(zeros, (array_alignment - position % array_alignment) %
+	      array_alignment);
+  }
+
+  template <class T>
+  void put(T const &value) {
+    put_bytes(&value, sizeof(T));
+  }
+
+  template <class T>
+  void put(std::vector<T> const &v) {
+    put((uint64_t)v.size());
+    align();
+    if (!v.empty())
+      put_bytes(&v[0], v.size() * sizeof(T));
+  }
+
+  void put(std::string const &s) {
+    put((uint64_t)s.size());
+    put_bytes(s.data(), s.size());
+  }
+
+  /* Numbers the materials and meshes of the object. Returns false if it
+   * has a shape or material the cache doesn't know. */
+  bool collect(Object const &o) {
+    Material const *m = o.material;
+    std::type_info const &type = typeid(*m);
+    if (type != typeid(Material) && type != typeid(Chrome) &&
+	type != typeid(Glass) && type != typeid(Film))
+      return false;
+    if (!materials.count(m)) {
+      materials[m] = material_list.size();
+      material_list.push_back(m);
+    }
+    return collect(o.shape);
+  }
+
+  bool collect(Shape const *s) {
+    if (typeid(*s) == typeid(Sphere) || typeid(*s) == typeid(Plane))
+      return true;
+    if (Csg const *csg = dynamic_cast<Csg const*>(s)) {
+      return (typeid(*s) == typeid(Union) ||
+	      typeid(*s) == typeid(Intersection) ||
+	      typeid(*s) == typeid(Difference)) &&
+	collect(&csg->get_left()) && collect(&csg->get_right());
+    }
+    if (typeid(*s) == typeid(TriangleMesh)) {
+      TriangleMesh const *m = static_cast<TriangleMesh const*>(s);
+      void const *key = &m->get_vertices();
+      if (!meshes.count(key)) {
+	meshes[key] = mesh_list.size();
+	mesh_list.push_back(m);
+      }
+      return true;
+    }
+    return false;
+  }
+
+  void material(Material const *m) {
+    uint8_t kind = diffuse_material;
+    double ior = 0, thickness = 0, abbe = 0;
+    if (Film const *film = dynamic_cast<Film const*>(m)) {
+      kind = film_material;
+      ior = film->ior;
+      thickness = film->thickness;
+    }
+    else if (Glass const *glass = dynamic_cast<Glass const*>(m)) {
+      kind = glass_material;
+      ior = glass->ior;
+      abbe = glass->abbe;
+    }
+    else if (dynamic_cast<Chrome const*>(m)) {
+      kind = chrome_material;
+    }
+    put(kind);
+    put(m->colour);
+    put(m->emission);
+    put(m->roughness);
+    put(ior);
+    put(thickness);
+    put(abbe);
+  }
+
+  void mesh(TriangleMesh const *m) {
+    put((uint8_t)m->is_smooth());
+    put(m->get_vertices());
+    put(m->get_triangles());
+    put(m->get_nodes());
+  }
+
+  void shape(Shape const *s) {
+    if (Sphere const *sphere = dynamic_cast<Sphere const*>(s)) {
+      put((uint8_t)sphere_shape);
+      put(sphere->get_center());
+      put(sphere->get_radius());
+    }
+    else if (Plane const *plane = dynamic_cast<Plane const*>(s)) {
+      put((uint8_t)plane_shape);
+      put(plane->get_point());
+      put(plane->get_normal());
+    }
+    else if (Csg const *csg = dynamic_cast<Csg const*>(s)) {
+      switch (csg->get_operation()) {
+      case Csg::union_op:
+	put((uint8_t)union_shape);
+	break;
+      case Csg::intersection_op:
+	put((uint8_t)intersection_shape);
+	break;
+      default:
+	put((uint8_t)difference_shape);
+      }
+      shape(&csg->get_left());
+      shape(&csg->get_right());
+    }
+    else {
+      TriangleMesh const *m = static_cast<TriangleMesh const*>(s);
+      put((uint8_t)mesh_shape);
+      put(meshes[&m->get_vertices()]);
+    }
+  }
+};
+
+bool SceneFile::write_cache(std::string const &name, Scene const &scene,
+			    Camera const &camera,
+			    std::vector<Source> const &sources) {
+  // Written under another name and renamed when done, so that nobody
+  // reads a half written cache
+  std::string const temp = name + ".tmp";
+  FILE *f = fopen(temp.c_str(), "wb");
+  if (!f)
+    return false;
+
+  Writer out(f);
+  for (unsigned int i = 0 ; i < scene.objects.size() ; ++i) {
+    if (!out.collect(scene.objects[i])) {
+      fclose(f);
+      remove(temp.c_str());
+      return false;
+    }
+  }
+
+  out.put(magic);
+  out.put(version);
+  out.put(byte_order);
+  out.put((uint32_t)sizeof(Vertex));
+  out.put((uint32_t)sizeof(BvhNode));
+
+  out.put((uint32_t)sources.size());
+  for (unsigned int i = 0 ; i < sources.size() ; ++i) {
+    out.put(sources[i].name);
+    out.put(sources[i].size);
+    out.put(sources[i].mtime_sec);
+    out.put(sources[i].mtime_nsec);
+  }
+
+  out.put(camera.get_origin());
+  out.put(camera.get_topleft());
+  out.put(camera.get_topright());
+  out.put(camera.get_bottomleft());
+  out.put(camera.get_focus());
+  out.put(camera.get_aperture());
+  out.put(scene.mean_free_path);
+
+  out.put((uint32_t)out.material_list.size());
+  for (unsigned int i = 0 ; i < out.material_list.size() ; ++i)
+    out.material(out.material_list[i]);
+  out.put((uint32_t)out.mesh_list.size());
+  for (unsigned int i = 0 ; i < out.mesh_list.size() ; ++i)
+    out.mesh(out.mesh_list[i]);
+  out.put((uint32_t)scene.objects.size());
+  for (unsigned int i = 0 ; i < scene.objects.size() ; ++i) {
+    out.put(out.materials[scene.objects[i].material]);
+    out.shape(scene.objects[i].shape);
+  }
+
+  out.put(scene.get_bvh().nodes);
+  out.put(scene.get_bvh().indices);
+
+  bool const ok = fclose(f) == 0 && out.ok;
+  if (!ok || rename(temp.c_str(), name.c_str()) != 0) {
+    remove(temp.c_str());
+    return false;
+  }
+  return true;
+}
+
+/* Reads the cache from the mapping. Arrays are copied straight out of
+ * it, so that nothing needs to be built or parsed. Everything read goes
+ * in the arena, which is handed over to the scene if the whole cache can
+ * be read. */
+struct SceneFile::Reader {
+  const char *start, *p, *end;
+  bool ok;
+  Arena arena;
+  std::vector<Material*> materials;
+  std::vector<TriangleMesh*> meshes;
+  std::vector<Object> objects;
+
+  Reader(MappedFile const &file)
+    : start(file.data()), p(file.data()), end(file.end()), ok(true)
+  { }
+
+  void get_bytes(void *data, size_t size) {
+    if (ok && size <= (size_t)(end - p)) {
+      memcpy(data, p, size);
+      p += size;
+    }
+    else {
+      ok = false;
+    }
+  }
+
+  template <class T>
+  void get(T &value) {
+    get_bytes(&value, sizeof(T));
+  }
+
+  template <class T>
+  void get(std::vector<T> &v) {
+    uint64_t n = 0;
+    get(n);
+    size_t const pad = (array_alignment - (p - start) % array_alignment) %
+      array_alignment;
+    if (!ok || pad > (size_t)(end - p) ||
+	n > (uint64_t)(end - p - pad) / sizeof(T)) {
+      ok = false;
+      return;
+    }
+    p += pad;
+    T const *first = reinterpret_cast<T const*>(p);
+    v.assign(first, first + n);
+    p += n * sizeof(T);
+  }
+
+  void get(std::string &s) {
+    uint64_t n = 0;
+    get(n);
+    if (!ok || n > (uint64_t)(end - p)) {
+      ok = false;
+      return;
+    }
+    s.assign(p, n);
+    p += n;
+  }
+
+  bool material() {
+    uint8_t kind = 0;
+    Colour colour, emission;
+    double roughness = 0, ior = 0, thickness = 0, abbe = 0;
+    get(kind);
+    get(colour);
+    get(emission);
+    get(roughness);
+    get(ior);
+    get(thickness);
+    get(abbe);
+    if (!ok)
+      return false;
+
+    Material *m;
+    switch (kind) {
+    case diffuse_material: m = arena.make<Material>(colour); break;
+    case chrome_material: m = arena.make<Chrome>(colour); break;
+    case glass_material:
+      m = arena.make<Glass>(colour, ior, roughness, abbe);
+      break;
+    case film_material:
+      m = arena.make<Film>(thickness, ior, roughness);
+      break;
+    default: return false;
+    }
+    m->roughness = roughness;
+    m->emission = emission;
+    materials.push_back(m);
+    return true;
+  }
+
+  bool mesh() {
+    uint8_t smooth = 0;
+    std::vector<Vertex> vertices;
+    std::vector<unsigned int> triangles;
+    std::vector<BvhNode> nodes;
+    get(smooth);
+    get(vertices);
+    get(triangles);
+    get(nodes);
+    TriangleMesh *m = arena.make<TriangleMesh>();
+    if (!ok || !m->assign_built(vertices, triangles, smooth, nodes))
+      return false;
+    meshes.push_back(m);
+    return true;
+  }
+
+  /* The next shape, or 0 if it's invalid */
+  Shape* shape(int depth) {
+    uint8_t kind = 0;
+    get(kind);
+    if (!ok || depth >= max_shape_depth)
+      return 0;
+    switch (kind) {
+    case sphere_shape: {
+      Vector3 center;
+      double radius = 0;
+      get(center);
+      get(radius);
+      return ok ? arena.make<Sphere>(center, radius) : 0;
+    }
+    case plane_shape: {
+      Vector3 point, normal;
+      get(point);
+      get(normal);
+      return ok ? arena.make<Plane>(point, normal) : 0;
+    }
+    case union_shape:
+    case intersection_shape:
+    case difference_shape: {
+      Shape *a = shape(depth + 1);
+      Shape *b = a ? shape(depth + 1) : 0;
+      if (!b)
+	return 0;
+      if (kind == union_shape)
+	return arena.make<Union>(a, b);
+      if (kind == intersection_shape)
+	return arena.make<Intersection>(a, b);
+      return arena.make<Difference>(a, b);
+    }
+    case mesh_shape: {
+      uint32_t index = 0;
+      get(index);
+      if (!ok || index >= meshes.size())
+	return 0;
+      return arena.copy(*meshes[index]);
+    }
+    default:
+      return 0;
+    }
+  }
+};
+
+bool SceneFile::read_cache(std::string const &name, Scene &scene,
+			   Camera &camera) {
+  MappedFile file;
+  if (!file.open(name.c_str()))
+    return false;
+  Reader in(file);
+
+  char file_magic[sizeof(magic)];
+  uint32_t file_version = 0, file_order = 0, vertex_size = 0, node_size = 0;
+  in.get(file_magic);
+  in.get(file_version);
+  in.get(file_order);
+  in.get(vertex_size);
+  in.get(node_size);
+  if (!in.ok || memcmp(file_magic, magic, sizeof(magic)) != 0 ||
+      file_version != version || file_order != byte_order ||
+      vertex_size != sizeof(Vertex) || node_size != sizeof(BvhNode))
+    return false;
+
+  // Stale if any of the files the scene was made from has changed
+  uint32_t count = 0;
+  in.get(count);
+  for (uint32_t i = 0 ; i < count && in.ok ; ++i) {
+    Source cached, current;
+    in.get(cached.name);
+    in.get(cached.size);
+    in.get(cached.mtime_sec);
+    in.get(cached.mtime_nsec);
+    if (!in.ok || !stamp(cached.name, current) || !(current == cached))
+      return false;
+  }
+
+  Vector3 origin, topleft, topright, bottomleft;
+  double focus = 0, aperture = 0, mean_free_path = 0;
+  in.get(origin);
+  in.get(topleft);
+  in.get(topright);
+  in.get(bottomleft);
+  in.get(focus);
+  in.get(aperture);
+  in.get(mean_free_path);
+
+  in.get(count);
+  for (uint32_t i = 0 ; i < count && in.ok ; ++i) {
+    if (!in.material())
+      return false;
+  }
+  in.get(count);
+  for (uint32_t i = 0 ; i < count && in.ok ; ++i) {
+    if (!in.mesh())
+      return false;
+  }
+  in.get(count);
+  if (!in.ok || count > (uint64_t)(in.end - in.p))
+    return false;
+  in.objects.reserve(count);
+  for (uint32_t i = 0 ; i < count ; ++i) {
+    uint32_t material = 0;
+    in.get(material);
+    if (!in.ok || material >= in.materials.size())
+      return false;
+    Shape *s = in.shape(0);
+    if (!s)
+      return false;
+    in.objects.push_back(Object(s, in.materials[material]));
+  }
+
+  Bvh bvh;
+  in.get(bvh.nodes);
+  in.get(bvh.indices);
+  if (!in.ok || in.p != in.end)
+    return false;
+
+  unsigned int const first = scene.objects.size();
+  scene.objects.insert(scene.objects.end(), in.objects.begin(),
+		       in.objects.end());
+  if (!scene.build(bvh)) {
+    scene.objects.erase(scene.objects.begin() + first, scene.objects.end());
+    return false;
+  }
+  scene.get_arena().take(in.arena);
+  camera = Camera(origin, topleft, topright, bottomleft, focus, aperture);
+  scene.mean_free_path = mean_free_path;
+  return true;
+}
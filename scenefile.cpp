@@ -0,0 +1,357 @@
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cctype>
+
+#include <sys/stat.h>
+
+#include "scenefile.h"
+#include "mappedfile.h"
+#include "scene.h"
+#include "shapes.h"
+#include "mesh.h"
+#include "material.h"
+#include "camera.h"
+#include "linalg.h"
+
+/* Parses the mapped scene file in place. Words are pointers into the
+ * mapping, which isn't nul-terminated. */
+struct SceneFile::Parser {
+  struct Word {
+    const char *begin, *end;
+
+    Word()
+      : begin(0), end(0)
+    { }
+
+    bool is(const char *s) const {
+      size_t const n = strlen(s);
+      return (size_t)(end - begin) == n && memcmp(begin, s, n) == 0;
+    }
+
+    std::string str() const {
+      return std::string(begin, end);
+    }
+  };
+
+  const char *filename;
+  std::string directory;
+  const char *p, *end;
+  unsigned int line;
+  Word peeked;
+  bool has_peeked;
+
+  // Everything made while parsing, handed over to the scene at the end
+  Arena arena;
+  std::map<std::string, Material*> materials;
+  std::map<std::string, TriangleMesh*> meshes;
+  std::vector<Object> objects;
+  std::vector<Source> &sources;
+
+  Parser(const char *filename, MappedFile const &file,
+	 std::vector<Source> &sources)
+    : filename(filename), p(file.data()), end(file.end()), line(1),
+      has_peeked(false), sources(sources)
+  {
+    std::string const name(filename);
+    std::string::size_type const slash = name.rfind('/');
+    if (slash != std::string::npos)
+      directory = name.substr(0, slash + 1);
+  }
+
+  bool fail(const char *message) {
+    fprintf(stderr, "%s:%u: %s\n", filename, line, message);
+    return false;
+  }
+
+  /* Reads the next word, or a string in double quotes. Returns false at
+   * the end of the file. */
+  bool next(Word &w) {
+    if (has_peeked) {
+      has_peeked = false;
+      w = peeked;
+      return true;
+    }
+    for (;;) {
+      while (p < end && isspace((unsigned char)*p)) {
+	if (*p == '\n') line++;
+	++p;
+      }
+      if (p == end)
+	return false;
+      if (*p != '#')
+	break;
+      while (p < end && *p != '\n') ++p;
+    }
+    if (*p == '"') {
+      w.begin = ++p;
+      while (p < end && *p != '"' && *p != '\n') ++p;
+      w.end = p;
+      if (p < end && *p == '"') ++p;
+      return true;
+    }
+    w.begin = p;
+    while (p < end && !isspace((unsigned char)*p) && *p != '#') ++p;
+    w.end = p;
+    return true;
+  }
+
+  /* next(), failing with the message at the end of the file */
+  bool expect(Word &w, const char *message) {
+    return next(w) || fail(message);
+  }
+
+  bool peek(Word &w) {
+    if (!has_peeked && next(peeked))
+      has_peeked = true;
+    w = peeked;
+    return has_peeked;
+  }
+
+  bool number(double &value) {
+    Word w;
+    if (!next(w))
+      return fail("expected a number, found the end of the file");
+    char buf[64];
+    size_t const n = w.end - w.begin;
+    if (n >= sizeof(buf))
+      return fail("expected a number");
+    memcpy(buf, w.begin, n);
+    buf[n] = '\0';
+    char *stop;
+    value = strtod(buf, &stop);
+    if (n == 0 || stop != buf + n)
+      return fail("expected a number");
+    return true;
+  }
+
+  bool vector(Vector3 &v) {
+    double x, y, z;
+    if (!number(x) || !number(y) || !number(z))
+      return false;
+    v.set(x, y, z);
+    return true;
+  }
+
+  bool colour(Colour &c) {
+    return vector(c);
+  }
+
+  bool camera(Camera &cam) {
+    Vector3 origin, topleft, topright, bottomleft;
+    double focus, aperture;
+    if (!vector(origin) || !vector(topleft) || !vector(topright) ||
+	!vector(bottomleft) || !number(focus) || !number(aperture))
+      return false;
+    cam = Camera(origin, topleft, topright, bottomleft, focus, aperture);
+    return true;
+  }
+
+  bool material() {
+    Word name, type;
+    if (!next(name) || !next(type))
+      return fail("expected a material name and type");
+    if (materials.count(name.str()))
+      return fail("material defined twice");
+    bool const diffuse = type.is("diffuse"), chrome = type.is("chrome");
+    bool const glass = type.is("glass"), film = type.is("film");
+    if (!diffuse && !chrome && !glass && !film)
+      return fail("unknown material type");
+
+    Colour col(1.0, 1.0, 1.0), emission;
+    double roughness = diffuse ? Material::default_roughness :
+      chrome ? 0.1 : 0.0;
+    double ior = 1.5, thickness = -1, abbe = 0;
+    Word w;
+    while (peek(w)) {
+      bool ok;
+      if (w.is("colour") && !film)
+	ok = next(w) && colour(col);
+      else if (w.is("emission"))
+	ok = next(w) && colour(emission);
+      else if (w.is("roughness"))
+	ok = next(w) && number(roughness);
+      else if (w.is("ior") && (glass || film))
+	ok = next(w) && number(ior);
+      else if (w.is("thickness") && film)
+	ok = next(w) && number(thickness);
+      else if (w.is("abbe") && glass)
+	ok = next(w) && number(abbe);
+      else
+	break;
+      if (!ok)
+	return false;
+    }
+    if (film && thickness <= 0)
+      return fail("film needs a thickness");
+    if (abbe < 0)
+      return fail("negative Abbe number");
+
+    Material *m;
+    if (film)
+      m = arena.make<Film>(thickness, ior, roughness);
+    else if (glass)
+      m = arena.make<Glass>(col, ior, roughness, abbe);
+    else if (chrome)
+      m = arena.make<Chrome>(col);
+    else
+      m = arena.make<Material>(col);
+    m->roughness = roughness;
+    m->emission = emission;
+    materials[name.str()] = m;
+    return true;
+  }
+
+  TriangleMesh* mesh() {
+    Word w;
+    if (!expect(w, "expected a mesh file name"))
+      return 0;
+    std::string name = w.str();
+    if (name.empty() || name[0] != '/')
+      name = directory + name;
+    std::map<std::string, TriangleMesh*>::iterator i = meshes.find(name);
+    if (i != meshes.end())
+      return arena.copy(*i->second);
+
+    Source source;
+    TriangleMesh *m = arena.make<TriangleMesh>();
+    if (!stamp(name, source) || !m->load(name.c_str())) {
+      fail("can't load the mesh");
+      return 0;
+    }
+    sources.push_back(source);
+    meshes[name] = m;
+    return arena.copy(*m);
+  }
+
+  /* The shape starting with the word, nested depth deep in other shapes,
+   * or 0 on failure */
+  Shape* shape(Word const &w, int depth) {
+    if (depth >= max_shape_depth) {
+      fail("shapes are nested too deeply");
+      return 0;
+    }
+    if (w.is("sphere")) {
+      Vector3 center;
+      double radius;
+      if (!vector(center) || !number(radius))
+	return 0;
+      return arena.make<Sphere>(center, radius);
+    }
+    if (w.is("plane")) {
+      Vector3 point, normal;
+      if (!vector(point) || !vector(normal))
+	return 0;
+      if (normal.is_zero()) {
+	fail("plane without a normal");
+	return 0;
+      }
+      return arena.make<Plane>(point, normal);
+    }
+    bool const is_union = w.is("union");
+    bool const is_intersection = w.is("intersection");
+    if (is_union || is_intersection || w.is("difference")) {
+      Word word;
+      Shape *a =
+	expect(word, "expected a shape") ? shape(word, depth + 1) : 0;
+      if (!a)
+	return 0;
+      Shape *b =
+	expect(word, "expected a shape") ? shape(word, depth + 1) : 0;
+      if (!b)
+	return 0;
+      if (is_union)
+	return arena.make<Union>(a, b);
+      if (is_intersection)
+	return arena.make<Intersection>(a, b);
+      return arena.make<Difference>(a, b);
+    }
+    if (w.is("mesh"))
+      return mesh();
+    fail("expected a shape or a statement");
+    return 0;
+  }
+
+  bool parse(Scene &scene, Camera &cam) {
+    Word w;
+    while (next(w)) {
+      if (w.is("camera")) {
+	if (!camera(cam))
+	  return false;
+      }
+      else if (w.is("mean_free_path")) {
+	if (!number(scene.mean_free_path))
+	  return false;
+      }
+      else if (w.is("material")) {
+	if (!material())
+	  return false;
+      }
+      else {
+	Shape *s = shape(w, 0);
+	if (!s)
+	  return false;
+	Word name;
+	std::map<std::string, Material*>::iterator m = materials.end();
+	if (next(name))
+	  m = materials.find(name.str());
+	if (m == materials.end())
+	  return fail("expected the name of a defined material");
+	objects.push_back(Object(s, m->second));
+      }
+    }
+
+    // Hand everything over, including the meshes the objects were copied
+    // from, which the copies share their triangles with
+    scene.get_arena().take(arena);
+    scene.objects.reserve(scene.objects.size() + objects.size());
+    for (unsigned int i = 0 ; i < objects.size() ; ++i)
+      scene.add(objects[i]);
+    return true;
+  }
+};
+
+bool SceneFile::stamp(std::string const &name, Source &source) {
+  struct stat st;
+  if (stat(name.c_str(), &st) != 0)
+    return false;
+  source.name = name;
+  source.size = st.st_size;
+  source.mtime_sec = st.st_mtim.tv_sec;
+  source.mtime_nsec = st.st_mtim.tv_nsec;
+  return true;
+}
+
+bool SceneFile::parse(const char *filename, Scene &scene, Camera &camera,
+		      std::vector<Source> &sources) {
+  Source source;
+  MappedFile file;
+  if (!stamp(filename, source) || !file.open(filename)) {
+    perror(filename);
+    return false;
+  }
+  sources.push_back(source);
+  Parser parser(filename, file, sources);
+  return parser.parse(scene, camera);
+}
+
+bool SceneFile::load(const char *filename, Scene &scene, Camera &camera,
+		     bool use_cache) {
+  std::string const cache = cache_name(filename);
+  if (use_cache && read_cache(cache, scene, camera))
+    return true;
+
+  std::vector<Source> sources;
+  if (!parse(filename, scene, camera, sources))
+    return false;
+  if (use_cache) {
+    scene.build();
+    if (!write_cache(cache, scene, camera, sources))
+      fprintf(stderr, "%s: can't write the scene cache\n", cache.c_str());
+  }
+  return true;
+}
@@ -0,0 +1,108 @@
+#ifndef PATHTRACE_SCENEFILE_H
+#define PATHTRACE_SCENEFILE_H
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "scene.h"
+#include "camera.h"
+
+/* Scene description files. A scene file is a list of statements made of
+ * words separated by white space, with comments running from # to the
+ * end of the line:
+ *
+ *   camera ORIGIN TOPLEFT TOPRIGHT BOTTOMLEFT FOCUS APERTURE
+ *   mean_free_path DISTANCE
+ *   material NAME TYPE [PROPERTY VALUE...]
+ *   SHAPE MATERIAL
+ *
+ * where the corners are three numbers each. The material types and
+ * properties, with their defaults, are
+ *
+ *   diffuse  colour 1 1 1, emission 0 0 0, roughness 1
+ *   chrome   colour 1 1 1, emission 0 0 0, roughness 0.1
+ *   glass    colour 1 1 1, emission 0 0 0, roughness 0, ior 1.5, abbe 0
+ *   film     emission 0 0 0, roughness 0, ior 1.5, thickness (required)
+ *
+ * and a shape is one of
+ *
+ *   sphere CENTER RADIUS
+ *   plane POINT NORMAL
+ *   union SHAPE SHAPE
+ *   intersection SHAPE SHAPE
+ *   difference SHAPE SHAPE
+ *   mesh FILENAME
+ *
+ * The Abbe number of glass makes it dispersive in spectral mode, the
+ * smaller the more: about 64 for crown glass and 36 for flint glass.
+ * Zero, the default, is no dispersion.
+ *
+ * The solid of a plane is the half-space behind it, and a difference is
+ * the first shape without the second. Meshes in unions, intersections
+ * and differences should be closed, with their normals pointing out.
+ *
+ * Materials must be defined before they are used, and objects using the
+ * same material share it. Mesh files are OBJ or PLY files, relative to
+ * the scene file, and may be put in quotes. A mesh used many times is
+ * only loaded once. See demo.scene for an example.
+ *
+ * Building a large scene takes much longer than reading it, so the built
+ * scene can be cached in a binary file next to the scene file. The cache
+ * holds the objects and the bounding volume hierarchies of the scene and
+ * its meshes, and is read by mapping it into memory. It is used as long
+ * as the scene file and the mesh files haven't changed since it was
+ * written. */
+class SceneFile {
+private:
+  /* A file the scene was made from, as it was when it was read */
+  struct Source {
+    std::string name;
+    int64_t size, mtime_sec, mtime_nsec;
+
+    bool operator== (Source const &other) const {
+      return name == other.name && size == other.size &&
+	mtime_sec == other.mtime_sec && mtime_nsec == other.mtime_nsec;
+    }
+  };
+
+  struct Parser;
+  struct Writer;
+  struct Reader;
+
+  // Shapes in scene files and caches are nested no deeper than this
+  const static int max_shape_depth = 64;
+
+  static bool stamp(std::string const &name, Source &source);
+  static bool parse(const char *filename, Scene &scene, Camera &camera,
+		    std::vector<Source> &sources);
+  static bool write_cache(std::string const &name, Scene const &scene,
+			  Camera const &camera,
+			  std::vector<Source> const &sources);
+  static bool read_cache(std::string const &name, Scene &scene,
+			 Camera &camera);
+
+public:
+  /* Adds the objects of the scene file to scene, which should be empty,
+   * and sets camera if the file has a camera. Prints what went wrong and
+   * returns false on failure.
+   *
+   * With use_cache, the scene is also built, and read from or written to
+   * the cache file filename.cache. A cache that can't be written is only
+   * warned about. */
+  static bool load(const char *filename, Scene &scene, Camera &camera,
+		   bool use_cache = false);
+
+  /* Name of the cache file of a scene file */
+  static std::string cache_name(const char *filename) {
+    return std::string(filename) + ".cache";
+  }
+};
+
+/*
+Local Variables:
+mode:c++
+End:
+*/
+#endif /* PATHTRACE_SCENEFILE_H */
@@ -0,0 +1,143 @@
+#include <vector>
+#include <deque>
+#include <pthread.h>
+
+#include "scheduler.h"
+#include "image.h"
+
+TileScheduler::TileScheduler(unsigned int width, unsigned int height,
+			     unsigned int tile_size, int queue_count,
+			     int max_passes)
+  : queue_count(queue_count), max_passes(max_passes), passes_started(0),
+    passes_finished(0), stopped(false)
+{
+  for (unsigned int y = 0 ; y < height ; y += tile_size) {
+    for (unsigned int x = 0 ; x < width ; x += tile_size) {
+      tiles.push_back(Tile(x, y, x + tile_size < width ? x + tile_size : width,
+			   y + tile_size < height ? y + tile_size : height));
+    }
+  }
+
+  pthread_mutex_init(&pass_mutex, 0);
+  queues = new Queue[queue_count];
+  for (int i = 0 ; i < queue_count ; ++i)
+    pthread_mutex_init(&queues[i].mutex, 0);
+}
+
+TileScheduler::~TileScheduler() {
+  for (int i = 0 ; i < queue_count ; ++i)
+    pthread_mutex_destroy(&queues[i].mutex);
+  delete [] queues;
+  pthread_mutex_destroy(&pass_mutex);
+}
+
+/* The owner takes tiles from the front, so that its part of the image
+ * fills in from top to bottom */
+bool TileScheduler::pop(int queue, Dealt &dealt) {
+  Queue &q = queues[queue];
+  bool found = false;
+  pthread_mutex_lock(&q.mutex);
+  if (!q.tiles.empty()) {
+    dealt = q.tiles.front();
+    q.tiles.pop_front();
+    found = true;
+  }
+  pthread_mutex_unlock(&q.mutex);
+  return found;
+}
+
+/* Thieves take from the back, away from where the owner is working */
+bool TileScheduler::steal(int thief, Dealt &dealt) {
+  for (int i = 1 ; i < queue_count ; ++i) {
+    Queue &q = queues[(thief + i) % queue_count];
+    bool found = false;
+    pthread_mutex_lock(&q.mutex);
+    if (!q.tiles.empty()) {
+      dealt = q.tiles.back();
+      q.tiles.pop_back();
+      found = true;
+    }
+    pthread_mutex_unlock(&q.mutex);
+    if (found) return true;
+  }
+  return false;
+}
+
+/* Deals the tiles of a new pass to the queues, if all of them are empty.
+ * Neighbouring tiles go to different threads, so that an expensive part
+ * of the image is shared from the start. Returns false if the pass limit
+ * has been reached. */
+bool TileScheduler::start_pass() {
+  bool ret = true;
+  pthread_mutex_lock(&pass_mutex);
+  bool empty = true;
+  for (int i = 0 ; i < queue_count && empty ; ++i) {
+    pthread_mutex_lock(&queues[i].mutex);
+    empty = queues[i].tiles.empty();
+    pthread_mutex_unlock(&queues[i].mutex);
+  }
+  if (empty) {
+    if (stopped || (max_passes > 0 && passes_started >= max_passes)) {
+      ret = false;
+    }
+    else {
+      for (int i = 0 ; i < queue_count ; ++i) {
+	Queue &q = queues[i];
+	pthread_mutex_lock(&q.mutex);
+	for (unsigned int t = i ; t < tiles.size() ; t += queue_count)
+	  q.tiles.push_back(Dealt(t, passes_started));
+	pthread_mutex_unlock(&q.mutex);
+      }
+      unfinished.push_back(tiles.size());
+      passes_started++;
+    }
+  }
+  pthread_mutex_unlock(&pass_mutex);
+  return ret;
+}
+
+bool TileScheduler::is_stopped() {
+  pthread_mutex_lock(&pass_mutex);
+  bool const ret = stopped;
+  pthread_mutex_unlock(&pass_mutex);
+  return ret;
+}
+
+bool TileScheduler::next(int queue, Tile &tile, int &pass) {
+  Dealt dealt(0, 0);
+  for (;;) {
+    if (is_stopped()) return false;
+    if (pop(queue, dealt) || steal(queue, dealt)) {
+      tile = tiles[dealt.tile];
+      pass = dealt.pass;
+      return true;
+    }
+    if (!start_pass()) return false;
+  }
+}
+
+bool TileScheduler::finish(int pass) {
+  pthread_mutex_lock(&pass_mutex);
+  unfinished[pass - passes_finished]--;
+  bool pass_done = false;
+  while (!unfinished.empty() && unfinished.front() == 0) {
+    unfinished.pop_front();
+    passes_finished++;
+    pass_done = true;
+  }
+  pthread_mutex_unlock(&pass_mutex);
+  return pass_done;
+}
+
+void TileScheduler::stop() {
+  pthread_mutex_lock(&pass_mutex);
+  stopped = true;
+  pthread_mutex_unlock(&pass_mutex);
+}
+
+int TileScheduler::get_passes_finished() {
+  pthread_mutex_lock(&pass_mutex);
+  int const ret = passes_finished;
+  pthread_mutex_unlock(&pass_mutex);
+  return ret;
+}
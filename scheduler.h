@@ -0,0 +1,82 @@
+#ifndef PATHTRACE_SCHEDULER_H
+#define PATHTRACE_SCHEDULER_H
+
+#include <vector>
+#include <deque>
+#include <pthread.h>
+
+#include "image.h"
+
+/* Hands out the tiles of an image to render threads, one pass over the
+ * image after another. Every thread has its own queue of tiles, and a
+ * thread whose queue is empty steals from the others, so that threads
+ * that got cheap tiles help with the expensive ones. A new pass is only
+ * started once all the queues have run dry, which can be while the last
+ * tiles of the previous pass are still being rendered, so every tile
+ * carries the number of its pass. */
+class TileScheduler {
+private:
+  /* A tile dealt to a queue, and the pass it belongs to */
+  struct Dealt {
+    unsigned int tile;
+    int pass;
+
+    Dealt(unsigned int tile, int pass)
+      : tile(tile), pass(pass)
+    { }
+  };
+
+  struct Queue {
+    pthread_mutex_t mutex;
+    std::deque<Dealt> tiles;
+  };
+
+  std::vector<Tile> tiles;
+  Queue *queues;
+  int queue_count;
+  int max_passes;
+
+  // The rest is guarded by pass_mutex
+  pthread_mutex_t pass_mutex;
+  int passes_started;
+  int passes_finished;
+  // Tiles still to finish of each pass from passes_finished on. A new pass
+  // is dealt while the last tiles of the previous ones are rendered.
+  std::deque<unsigned int> unfinished;
+  bool stopped;
+
+  TileScheduler(TileScheduler const &);
+  TileScheduler& operator=(TileScheduler const &);
+
+  bool pop(int queue, Dealt &dealt);
+  bool steal(int thief, Dealt &dealt);
+  bool start_pass();
+  bool is_stopped();
+
+public:
+  /* max_passes of zero means no limit */
+  TileScheduler(unsigned int width, unsigned int height,
+		unsigned int tile_size, int queue_count, int max_passes = 0);
+  ~TileScheduler();
+
+  /* Gets the next tile for the thread owning the given queue, and the
+   * pass it belongs to. Returns false when there is no more work. */
+  bool next(int queue, Tile &tile, int &pass);
+
+  /* Marks a tile of the given pass as done. Returns true if that
+   * finished a pass and every pass before it, so that the image holds
+   * whole passes. */
+  bool finish(int pass);
+
+  /* Makes next() return false from now on */
+  void stop();
+
+  int get_passes_finished();
+};
+
+/*
+Local Variables:
+mode:c++
+End:
+*/
+#endif /* PATHTRACE_SCHEDULER_H */
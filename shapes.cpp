@@ -1,72 +1,342 @@
 #include <cmath>
+#include <algorithm>
 
 #include "shapes.h"
 #include "linalg.h"
+#include "simd.h"
+#include "packet.h"
 
-Hit Sphere::intersect(Ray const &ray) const {
-  Vector3 dist = ray.origin - center;
-  double a = ray.direction.dot(ray.direction);
-  double b = 2 * dist.dot(ray.direction);
-  double c = dist.dot(dist) - radius * radius;
-  double discr = b * b - 4 * a * c;
-  if (discr > 0.0) {
-    double distance;
-    if ((-b - sqrt(discr)) / (2 * a) < 1e-10)
-      distance = (-b + sqrt(discr)) / (2 * a);
-    else
-      distance = (-b - sqrt(discr)) / (2 * a);
-    Vector3 n = ray.origin + ray.direction * distance - center;
-    n.normalize();
-    return Hit(ray, distance, n);
+int Shape::intersect(RayPacket const &packet, RealLanes &distance) const {
+  real d[RayPacket::size];
+  distance.store(d);
+  int changed = 0;
+  for (int i = 0 ; i < RayPacket::size ; ++i) {
+    if (!(packet.active & (1 << i))) continue;
+    Hit h = intersect(packet.ray(i));
+    if (h.is_hit() && h.distance < d[i]) {
+      d[i] = h.distance;
+      changed |= 1 << i;
+    }
   }
-  return Hit();
+  if (changed)
+    distance = RealLanes::load(d);
+  return changed;
+}
+
+bool Shape::occludes(Ray const &ray, double max_distance) const {
+  Hit h = intersect(ray);
+  return h.is_hit() && h.distance < max_distance;
+}
+
+bool Shape::closest(Ray const &ray, double max_distance,
+		    HitRecord &record) const {
+  Hit h = intersect(ray);
+  if (!h.is_hit() || h.distance >= max_distance)
+    return false;
+  record = HitRecord(h.distance);
+  return true;
+}
+
+Vector3 Shape::normal_at(Ray const &ray, HitRecord const &) const {
+  return intersect(ray).normal;
+}
+
+void Shape::spans(Ray const &ray, SpanList &spans) const {
+  // Each search starts a little past the last hit, so that it doesn't
+  // find the same one again
+  const static double nudge = 1e-9;
+  const static int max_hits = 2 * SpanList::capacity;
+  double t = 0;
+  double enter = -INFINITY;
+  Vector3 enter_normal;
+  bool inside = false;
+  for (int i = 0 ; i < max_hits ; ++i) {
+    Hit h = intersect(Ray(ray.at(t), ray.direction));
+    if (!h.is_hit())
+      break;
+    t += h.distance;
+    if (ray.direction.dot(h.normal) < 0) {
+      enter = t;
+      enter_normal = h.normal;
+      inside = true;
+    }
+    else {
+      // An exit without an entry started inside
+      spans.add(inside ? enter : -INFINITY, enter_normal, t, h.normal);
+      inside = false;
+    }
+    t += nudge;
+  }
+  if (inside)
+    spans.add(enter, enter_normal, INFINITY, Vector3());
+}
+
+Hit Sphere::intersect(Ray const &ray) const {
+  HitRecord record;
+  if (!closest(ray, INFINITY, record))
+    return Hit();
+  return Hit(record.distance, normal_at(ray, record));
+}
+
+bool Sphere::closest(Ray const &ray, double max_distance,
+		     HitRecord &record) const {
+  double distance = Sphere::distance(center.x, center.y, center.z,
+				     radius * radius, ray);
+  if (distance <= 0 || distance >= max_distance)
+    return false;
+  record = HitRecord(distance);
+  return true;
+}
+
+Vector3 Sphere::normal_at(Ray const &ray, HitRecord const &record) const {
+  Vector3 n(ray.at(record.distance) - Vector3d(center));
+  n.normalize();
+  return n;
+}
+
+int Sphere::intersect(RayPacket const &packet, RealLanes &distance) const {
+  return Sphere::distance(RealLanes(center.x), RealLanes(center.y),
+			  RealLanes(center.z), RealLanes(radius * radius),
+			  packet, distance);
+}
+
+void Sphere::spans(Ray const &ray, SpanList &spans) const {
+  Vector3d const dist(ray.origin - Vector3d(center));
+  Vector3d const direction(ray.direction);
+  double const a = direction.dot(direction);
+  double const b = 2 * dist.dot(direction);
+  double const c = dist.dot(dist) - radius * radius;
+  double const discr = b * b - 4 * a * c;
+  if (discr <= 0)
+    return;
+  double const root = sqrt(discr);
+  double const enter = (-b - root) / (2 * a);
+  double const exit = (-b + root) / (2 * a);
+  Vector3 enter_normal(ray.at(enter) - Vector3d(center));
+  Vector3 exit_normal(ray.at(exit) - Vector3d(center));
+  enter_normal.normalize();
+  exit_normal.normalize();
+  spans.add(enter, enter_normal, exit, exit_normal);
+}
+
+bool Sphere::occludes(Ray const &ray, double max_distance) const {
+  double distance = Sphere::distance(center.x, center.y, center.z,
+				     radius * radius, ray);
+  return distance > 0 && distance < max_distance;
 }
 
 Sphere* Sphere::clone() const {
   return new Sphere(center, radius);
 }
 
+Sphere* Sphere::clone(Arena &arena) const {
+  return arena.copy(*this);
+}
+
+bool Sphere::bounds(Box &box) const {
+  Vector3 r(radius, radius, radius);
+  box = Box(center - r, center + r);
+  return true;
+}
+
 Hit Plane::intersect(Ray const &ray) const {
-  double plane_angle = ray.direction.dot(normal);
-  if (plane_angle >= 0)
+  double dist = Plane::distance(normal.x, normal.y, normal.z,
+				normal.dot(point), ray);
+  if (dist <= 0)
     return Hit();
-  Vector3 start_diff = point - ray.origin;
-  double dist = normal.dot(start_diff) / plane_angle;
-  return Hit(ray, dist, normal);
+  return Hit(dist, normal);
+}
+
+bool Plane::closest(Ray const &ray, double max_distance,
+		    HitRecord &record) const {
+  double dist = Plane::distance(normal.x, normal.y, normal.z,
+				normal.dot(point), ray);
+  if (dist <= 0 || dist >= max_distance)
+    return false;
+  record = HitRecord(dist);
+  return true;
+}
+
+Vector3 Plane::normal_at(Ray const &, HitRecord const &) const {
+  return normal;
+}
+
+int Plane::intersect(RayPacket const &packet, RealLanes &distance) const {
+  return Plane::distance(RealLanes(normal.x), RealLanes(normal.y),
+			 RealLanes(normal.z), RealLanes(normal.dot(point)),
+			 packet, distance);
+}
+
+bool Plane::occludes(Ray const &ray, double max_distance) const {
+  double dist = Plane::distance(normal.x, normal.y, normal.z,
+				normal.dot(point), ray);
+  return dist > 0 && dist < max_distance;
+}
+
+void Plane::spans(Ray const &ray, SpanList &spans) const {
+  // The solid is the half-space behind the plane
+  double const angle = ray.direction.dot(normal);
+  double const depth = normal.dot(point) - Vector3d(normal).dot(ray.origin);
+  if (angle == 0) {
+    if (depth > 0)
+      spans.add(-INFINITY, Vector3(), INFINITY, Vector3());
+    return;
+  }
+  double const t = depth / angle;
+  if (angle < 0)
+    spans.add(t, normal, INFINITY, Vector3());
+  else
+    spans.add(-INFINITY, Vector3(), t, normal);
 }
 
 Plane* Plane::clone() const {
   return new Plane(point, normal);
 }
 
-Hit Difference::intersect(Ray const &ray) const {
-  // TODO: Translucent shapes won't work.
-  Hit base_d = base->intersect(ray);
-  if (base_d.is_hit()) {
-    Hit cut_d = cut->intersect(ray);
-    if (!cut_d.is_hit()) {
-      return base_d;
+Plane* Plane::clone(Arena &arena) const {
+  return arena.copy(*this);
+}
+
+bool Plane::bounds(Box &) const {
+  return false;
+}
+
+const double Csg::min_distance = 1e-10;
+
+void Csg::combine(SpanList const &a, SpanList const &b, Operation operation,
+		  SpanList &out) {
+  // Walks through the entries and exits of both in order along the ray.
+  // Event 2k of a list is the entry of span k, and 2k + 1 its exit.
+  unsigned int const a_events = 2 * a.size(), b_events = 2 * b.size();
+  unsigned int i = 0, j = 0;
+  bool in_a = false, in_b = false, inside = false;
+  // A span that ended is only added once the next one doesn't start
+  // where it ended, so that spans that touch, like where one solid of a
+  // union ends and the other begins, become one
+  bool ended = false;
+  Span span;
+  while (i < a_events || j < b_events) {
+    double const ta = i < a_events ?
+      (i & 1 ? a[i / 2].exit : a[i / 2].enter) : INFINITY;
+    double const tb = j < b_events ?
+      (j & 1 ? b[j / 2].exit : b[j / 2].enter) : INFINITY;
+    double t;
+    Vector3 normal;
+    if (j >= b_events || (i < a_events && ta <= tb)) {
+      t = ta;
+      normal = i & 1 ? a[i / 2].exit_normal : a[i / 2].enter_normal;
+      in_a = !(i & 1);
+      i++;
     }
     else {
-      Ray inray(ray.origin + ray.direction * base_d.distance,
-		ray.direction);
-      Hit base_d2 = base->intersect(inray);
-      Hit cut_d2 = cut->intersect(inray);
-      if (!base_d2.is_hit()) {
-	return Hit();
-      } else if (base_d.distance >= cut_d.distance) {
-	if (!cut_d2.is_hit())
-	  return base_d;
-	if (base_d2.distance >= cut_d2.distance)
-	  return Hit(ray, base_d.distance + cut_d2.distance, -cut_d2.normal);
-      } else {
-	return base_d;
+      t = tb;
+      normal = j & 1 ? b[j / 2].exit_normal : b[j / 2].enter_normal;
+      if (operation == difference_op)
+	normal = -normal;
+      in_b = !(j & 1);
+      j++;
+    }
+
+    bool const now_inside =
+      operation == union_op ? in_a || in_b :
+      operation == intersection_op ? in_a && in_b :
+      in_a && !in_b;
+    if (now_inside && !inside) {
+      if (ended && span.exit == t) {
+	ended = false;
+      }
+      else {
+	if (ended)
+	  out.add(span.enter, span.enter_normal, span.exit, span.exit_normal);
+	ended = false;
+	span.enter = t;
+	span.enter_normal = normal;
       }
     }
+    else if (!now_inside && inside) {
+      span.exit = t;
+      span.exit_normal = normal;
+      ended = true;
+    }
+    inside = now_inside;
+  }
+  if (ended)
+    out.add(span.enter, span.enter_normal, span.exit, span.exit_normal);
+}
+
+void Csg::spans(Ray const &ray, SpanList &spans) const {
+  SpanList a, b;
+  left->spans(ray, a);
+  // Nothing can come of a difference or an intersection without a
+  if (a.size() == 0 && operation != union_op)
+    return;
+  right->spans(ray, b);
+  combine(a, b, operation, spans);
+}
+
+Hit Csg::intersect(Ray const &ray) const {
+  SpanList s;
+  spans(ray, s);
+  for (unsigned int i = 0 ; i < s.size() ; ++i) {
+    if (s[i].enter > min_distance)
+      return Hit(s[i].enter, s[i].enter_normal);
+    if (s[i].exit > min_distance && s[i].exit != INFINITY)
+      return Hit(s[i].exit, s[i].exit_normal);
   }
   return Hit();
 }
 
+bool Csg::bounds(Box &box) const {
+  Box a, b;
+  bool const a_bounded = left->bounds(a);
+  bool const b_bounded = right->bounds(b);
+  switch (operation) {
+  case union_op:
+    a.extend(b);
+    box = a;
+    return a_bounded && b_bounded;
+  case intersection_op:
+    if (a_bounded && b_bounded) {
+      box = Box(Vector3(std::max(a.min.x, b.min.x), std::max(a.min.y, b.min.y),
+			std::max(a.min.z, b.min.z)),
+		Vector3(std::min(a.max.x, b.max.x), std::min(a.max.y, b.max.y),
+			std::min(a.max.z, b.max.z)));
+      // Apart, the shapes have nothing in common, but the hierarchy
+      // needs a box that isn't empty
+      if (box.is_empty())
+	box = a;
+    }
+    else {
+      box = a_bounded ? a : b;
+    }
+    return a_bounded || b_bounded;
+  default:
+    // Cutting can only make the base smaller
+    box = a;
+    return a_bounded;
+  }
+}
+
+Union* Union::clone() const {
+  return new Union(*this);
+}
+
+Union* Union::clone(Arena &arena) const {
+  return arena.make<Union>(*this, &arena);
+}
+
+Intersection* Intersection::clone() const {
+  return new Intersection(*this);
+}
+
+Intersection* Intersection::clone(Arena &arena) const {
+  return arena.make<Intersection>(*this, &arena);
+}
+
 Difference* Difference::clone() const {
-  return new Difference(*base, *cut);
+  return new Difference(*this);
+}
+
+Difference* Difference::clone(Arena &arena) const {
+  return arena.make<Difference>(*this, &arena);
 }
@@ -1,31 +1,141 @@
 #ifndef PATHTRACE_SHAPES_H
 #define PATHTRACE_SHAPES_H
 
+#include <vector>
+#include <math.h>
+
 #include "linalg.h"
+#include "simd.h"
+#include "packet.h"
+#include "arena.h"
 
+/* Where a ray hits a shape: the distance along the ray, and the normal
+ * of the surface there, pointing out of the shape */
 class Hit {
 public:
-  Ray ray;
   double distance;
   Vector3 normal;
 
   Hit()
-    : ray(Vector3(), Vector3()), distance(-1), normal()
+    : distance(-1), normal()
+  { }
+
+  Hit(double const distance, Vector3 const &normal)
+    : distance(distance), normal(normal)
+  { }
+
+  bool is_hit() const {
+    return distance > 0;
+  }
+};
+
+/* The nearest hit found by a closest-hit query, before anything but its
+ * distance is known. The primitive is whatever the shape needs to find
+ * the normal later, like the triangle of a mesh. */
+struct HitRecord {
+  double distance;
+  unsigned int primitive;
+
+  HitRecord()
+    : distance(-1), primitive(0)
   { }
 
-  Hit(Ray const &ray, double const distance, Vector3 const &normal)
-    : ray(ray), distance(distance), normal(normal)
+  HitRecord(double const distance, unsigned int const primitive = 0)
+    : distance(distance), primitive(primitive)
   { }
 
-  bool is_hit() {
+  bool is_hit() const {
     return distance > 0;
   }
 };
 
+/* A stretch of a ray inside a solid, from the distance where the ray
+ * enters it to where it exits, with the normals pointing out of the
+ * solid at both ends. A ray starting inside enters at a negative
+ * distance, and unbounded solids like planes enter at -INFINITY or exit
+ * at INFINITY, where the normal is meaningless. */
+struct Span {
+  double enter, exit;
+  Vector3 enter_normal, exit_normal;
+};
+
+/* The spans of a ray through a solid, in order along the ray and without
+ * overlaps. Spans that end behind the origin of the ray are left out, as
+ * nothing can be hit there. The first few are held in place, so that
+ * constructive solid geometry needs no allocations unless the solids are
+ * complex; the rest go on the heap. */
+class SpanList {
+public:
+  const static unsigned int capacity = 16;
+
+private:
+  Span spans[capacity];
+  unsigned int count;
+  std::vector<Span> more;
+
+public:
+  SpanList()
+    : count(0)
+  { }
+
+  unsigned int size() const {
+    return count;
+  }
+
+  Span const& operator[](unsigned int i) const {
+    return i < capacity ? spans[i] : more[i - capacity];
+  }
+
+  void add(double enter, Vector3 const &enter_normal,
+	   double exit, Vector3 const &exit_normal) {
+    if (exit <= 0)
+      return;
+    Span s;
+    s.enter = enter;
+    s.enter_normal = enter_normal;
+    s.exit = exit;
+    s.exit_normal = exit_normal;
+    if (count < capacity)
+      spans[count] = s;
+    else
+      more.push_back(s);
+    count++;
+  }
+};
+
 class Shape {
 public:
+  virtual ~Shape() { }
   virtual Hit intersect(Ray const &ray) const = 0;
   virtual Shape* clone() const = 0;
+  /* A copy living in the arena. The copy of a shape made of others, like
+   * a Union, puts them in the arena too. */
+  virtual Shape* clone(Arena &arena) const = 0;
+  /* Sets box to the bounds of the shape. Returns false if the shape is
+   * unbounded, like a Plane. */
+  virtual bool bounds(Box &box) const = 0;
+  /* Intersects all rays of the packet. Where a ray hits closer than its
+   * lane of distance, the lane is set to the hit distance. Returns the
+   * lanes that were changed. The default traces the rays one by one. */
+  virtual int intersect(RayPacket const &packet, RealLanes &distance) const;
+  /* Any-hit query for shadow rays: whether the ray hits the shape closer
+   * than max_distance. Cheaper than intersect(), as the normal and the
+   * nearest hit are not needed. */
+  virtual bool occludes(Ray const &ray, double max_distance) const;
+  /* Closest-hit query: sets record to the nearest hit closer than
+   * max_distance and returns true, or returns false if there is none.
+   * Leaves the normal to normal_at(), so that it is only found for the hit
+   * that turns out nearest of all. The default uses intersect(). */
+  virtual bool closest(Ray const &ray, double max_distance,
+		       HitRecord &record) const;
+  /* The normal at a hit found by closest() for the same ray */
+  virtual Vector3 normal_at(Ray const &ray, HitRecord const &record) const;
+  /* Adds the spans of the ray inside the shape, for constructive solid
+   * geometry. A span the origin is in enters at a negative distance. The
+   * default finds them with intersect() again from each hit, taking a
+   * hit where the ray goes against the normal as an entry, which is
+   * right for closed shapes whose normals point out. */
+  virtual void spans(Ray const &ray, SpanList &spans) const;
 };
 
 class Sphere : public Shape {
@@ -36,8 +146,76 @@ public:
   Sphere(Vector3 const &center, double const radius)
     : center(center), radius(radius)
   { }
+
+  Vector3 const& get_center() const { return center; }
+  double get_radius() const { return radius; }
+
+  /* Distance along the ray to a sphere, which is only a hit if it is
+   * positive. Used both here and for the compiled spheres of a Scene.
+   * Solved in double even in a float build, as rays leaving the sphere
+   * would find it again right where they left otherwise. */
+  static double distance(double cx, double cy, double cz, double radius2,
+			 Ray const &ray) {
+    Vector3d dist(ray.origin.x - cx, ray.origin.y - cy, ray.origin.z - cz);
+    Vector3d const direction(ray.direction);
+    double a = direction.dot(direction);
+    double b = 2 * dist.dot(direction);
+    double c = dist.dot(dist) - radius2;
+    double discr = b * b - 4 * a * c;
+    if (discr > 0.0) {
+      double const root = sqrt(discr);
+      if ((-b - root) / (2 * a) < 1e-10)
+	return (-b + root) / (2 * a);
+      else
+	return (-b - root) / (2 * a);
+    }
+    return -1;
+  }
+
+  /* The same for a packet of rays, in real. Lanes of distance where the
+   * ray hits the sphere closer are updated, and those lanes are
+   * returned. */
+  static int distance(RealLanes const &cx, RealLanes const &cy,
+		      RealLanes const &cz, RealLanes const &radius2,
+		      RayPacket const &packet, RealLanes &distance) {
+    RealLanes const distx = packet.ox - cx;
+    RealLanes const disty = packet.oy - cy;
+    RealLanes const distz = packet.oz - cz;
+    RealLanes const a = packet.dx * packet.dx + packet.dy * packet.dy +
+      packet.dz * packet.dz;
+    RealLanes const b = RealLanes(2.0) *
+      (distx * packet.dx + disty * packet.dy + distz * packet.dz);
+    RealLanes const c = distx * distx + disty * disty + distz * distz -
+      radius2;
+    RealLanes const discr = b * b - RealLanes(4.0) * a * c;
+    RealLanes const hit = discr > RealLanes(0.0);
+    if (!(RealLanes::bits(hit) & packet.active))
+      return 0;
+
+    RealLanes const root =
+      RealLanes::sqrt(RealLanes::max(discr, RealLanes(0.0)));
+    RealLanes const two_a = RealLanes(2.0) * a;
+    RealLanes const near = (-b - root) / two_a;
+    RealLanes const far = (-b + root) / two_a;
+    RealLanes const t = RealLanes::select(near < RealLanes(1e-10), far, near);
+    RealLanes const closer = hit & (t > RealLanes(0.0)) & (t < distance);
+    int const changed = RealLanes::bits(closer) & packet.active;
+    if (changed)
+      distance = RealLanes::select(closer, t, distance);
+    return changed;
+  }
+
   virtual Hit intersect(Ray const &ray) const;
+  using Shape::intersect;
   virtual Sphere* clone() const;
+  virtual Sphere* clone(Arena &arena) const;
+  virtual bool bounds(Box &box) const;
+  virtual int intersect(RayPacket const &packet, RealLanes &distance) const;
+  virtual bool occludes(Ray const &ray, double max_distance) const;
+  virtual bool closest(Ray const &ray, double max_distance,
+		       HitRecord &record) const;
+  virtual Vector3 normal_at(Ray const &ray, HitRecord const &record) const;
+  virtual void spans(Ray const &ray, SpanList &spans) const;
 };
 
 class Plane : public Shape {
@@ -50,19 +228,176 @@ public:
   {
     this->normal.normalize();
   }
+
+  Vector3 const& get_point() const { return point; }
+  Vector3 const& get_normal() const { return normal; }
+
+  /* Distance along the ray to a plane given by its normal and offset
+   * (normal . point), which is only a hit if it is positive. Planes are
+   * one-sided: rays going the same way as the normal miss. */
+  static double distance(double nx, double ny, double nz, double offset,
+			 Ray const &ray) {
+    double plane_angle = ray.direction.x * nx + ray.direction.y * ny +
+      ray.direction.z * nz;
+    if (plane_angle >= 0)
+      return -1;
+    return (offset - (ray.origin.x * nx + ray.origin.y * ny +
+		      ray.origin.z * nz)) / plane_angle;
+  }
+
+  /* The same for a packet of rays, updating the lanes of distance where the
+   * plane is closer. Returns the updated lanes. */
+  static int distance(RealLanes const &nx, RealLanes const &ny,
+		      RealLanes const &nz, RealLanes const &offset,
+		      RayPacket const &packet, RealLanes &distance) {
+    RealLanes const plane_angle = packet.dx * nx + packet.dy * ny +
+      packet.dz * nz;
+    RealLanes const facing = plane_angle < RealLanes(0.0);
+    if (!(RealLanes::bits(facing) & packet.active))
+      return 0;
+    RealLanes const t = (offset - (packet.ox * nx + packet.oy * ny +
+				 packet.oz * nz)) / plane_angle;
+    RealLanes const closer = facing & (t > RealLanes(0.0)) & (t < distance);
+    int const changed = RealLanes::bits(closer) & packet.active;
+    if (changed)
+      distance = RealLanes::select(closer, t, distance);
+    return changed;
+  }
   virtual Hit intersect(Ray const &ray) const;
+  using Shape::intersect;
   virtual Plane* clone() const;
+  virtual Plane* clone(Arena &arena) const;
+  virtual bool bounds(Box &box) const;
+  virtual int intersect(RayPacket const &packet, RealLanes &distance) const;
+  virtual bool occludes(Ray const &ray, double max_distance) const;
+  virtual bool closest(Ray const &ray, double max_distance,
+		       HitRecord &record) const;
+  virtual Vector3 normal_at(Ray const &ray, HitRecord const &record) const;
+  virtual void spans(Ray const &ray, SpanList &spans) const;
 };
 
-class Difference : public Shape {
+/* Constructive solid geometry: a solid made of two others, intersected
+ * by combining the spans of the ray through them, so that every shape
+ * in a tree of them is intersected once. Hits where the ray exits the
+ * solid count too, so that it can be made of glass. */
+class Csg : public Shape {
+public:
+  enum Operation { union_op, intersection_op, difference_op };
+
 private:
-  Shape *base, *cut;
+  Shape *left, *right;
+  Operation operation;
+  // Whether the children are deleted with this, which they aren't when
+  // they live in an arena
+  bool owned;
+
+  Csg& operator=(Csg const &);
+
+protected:
+  Csg(Shape const &left, Shape const &right, Operation operation)
+    : left(left.clone()), right(right.clone()), operation(operation),
+      owned(true)
+  { }
+
+  Csg(Csg const &other)
+    : Shape(), left(other.left->clone()), right(other.right->clone()),
+      operation(other.operation), owned(true)
+  { }
+
+  /* Takes the children as they are, without copying or owning them, for
+   * shapes put together in an arena */
+  Csg(Shape *left, Shape *right, Operation operation)
+    : left(left), right(right), operation(operation), owned(false)
+  { }
+
+  /* A copy with its children in the arena */
+  Csg(Csg const &other, Arena *arena)
+    : Shape(), left(other.left->clone(*arena)),
+      right(other.right->clone(*arena)), operation(other.operation),
+      owned(false)
+  { }
+
+public:
+  // Hits closer than this are where the ray left the surface
+  static const double min_distance;
+
+  virtual ~Csg() {
+    if (owned) {
+      delete left;
+      delete right;
+    }
+  }
+
+  Shape const& get_left() const { return *left; }
+  Shape const& get_right() const { return *right; }
+  Operation get_operation() const { return operation; }
+
+  /* Adds the spans inside a, b or both, depending on the operation, to
+   * out. Normals of b's spans are turned around for a difference. */
+  static void combine(SpanList const &a, SpanList const &b,
+		      Operation operation, SpanList &out);
+
+  virtual Hit intersect(Ray const &ray) const;
+  using Shape::intersect;
+  virtual bool bounds(Box &box) const;
+  virtual void spans(Ray const &ray, SpanList &spans) const;
+};
+
+class Union : public Csg {
+public:
+  Union(Shape const &a, Shape const &b)
+    : Csg(a, b, union_op)
+  { }
+
+  Union(Shape *a, Shape *b)
+    : Csg(a, b, union_op)
+  { }
+
+  Union(Union const &other, Arena *arena)
+    : Csg(other, arena)
+  { }
+
+  virtual Union* clone() const;
+  virtual Union* clone(Arena &arena) const;
+};
+
+class Intersection : public Csg {
+public:
+  Intersection(Shape const &a, Shape const &b)
+    : Csg(a, b, intersection_op)
+  { }
+
+  Intersection(Shape *a, Shape *b)
+    : Csg(a, b, intersection_op)
+  { }
+
+  Intersection(Intersection const &other, Arena *arena)
+    : Csg(other, arena)
+  { }
+
+  virtual Intersection* clone() const;
+  virtual Intersection* clone(Arena &arena) const;
+};
+
+class Difference : public Csg {
 public:
   Difference(Shape const &base, Shape const &cut)
-    : base(base.clone()), cut(cut.clone())
+    : Csg(base, cut, difference_op)
   { }
-  virtual Hit intersect(Ray const &ray) const;
+
+  Difference(Shape *base, Shape *cut)
+    : Csg(base, cut, difference_op)
+  { }
+
+  Difference(Difference const &other, Arena *arena)
+    : Csg(other, arena)
+  { }
+
+  Shape const& get_base() const { return get_left(); }
+  Shape const& get_cut() const { return get_right(); }
+
   virtual Difference* clone() const;
+  virtual Difference* clone(Arena &arena) const;
 };
 
 /*
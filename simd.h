@@ -0,0 +1,299 @@
+#ifndef PATHTRACE_SIMD_H
+#define PATHTRACE_SIMD_H
+
+#include <math.h>
+
+/* Four doubles, or eight floats, operated on together. Uses AVX or
+ * SSE2, whichever the compiler has been told the processor supports
+ * (-march=native), and plain loops otherwise. Define PATHTRACE_NO_SIMD to
+ * force the plain version.
+ *
+ * Comparisons return masks with all bits of a lane set or cleared, to be
+ * used with select(), any() and bits(). */
+
+#if defined(__AVX__) && !defined(PATHTRACE_NO_SIMD)
+#include <immintrin.h>
+
+struct Double4 {
+  const static int size = 4;
+
+  __m256d v;
+
+  Double4() { }
+  Double4(__m256d v) : v(v) { }
+  Double4(double a) : v(_mm256_set1_pd(a)) { }
+  Double4(double a, double b, double c, double d)
+    : v(_mm256_setr_pd(a, b, c, d)) { }
+
+  /* Which of the implementations this is */
+  static const char* name() { return "AVX"; }
+
+  static Double4 load(double const *from) { return _mm256_loadu_pd(from); }
+  void store(double *to) const { _mm256_storeu_pd(to, v); }
+
+  Double4 operator+ (Double4 const &o) const { return _mm256_add_pd(v, o.v); }
+  Double4 operator- (Double4 const &o) const { return _mm256_sub_pd(v, o.v); }
+  Double4 operator* (Double4 const &o) const { return _mm256_mul_pd(v, o.v); }
+  Double4 operator/ (Double4 const &o) const { return _mm256_div_pd(v, o.v); }
+  Double4 operator- () const { return _mm256_sub_pd(_mm256_setzero_pd(), v); }
+  Double4 operator& (Double4 const &o) const { return _mm256_and_pd(v, o.v); }
+  Double4 operator| (Double4 const &o) const { return _mm256_or_pd(v, o.v); }
+
+  Double4 operator< (Double4 const &o) const { return _mm256_cmp_pd(v, o.v, _CMP_LT_OQ); }
+  Double4 operator> (Double4 const &o) const { return _mm256_cmp_pd(v, o.v, _CMP_GT_OQ); }
+  Double4 operator<= (Double4 const &o) const { return _mm256_cmp_pd(v, o.v, _CMP_LE_OQ); }
+  Double4 operator>= (Double4 const &o) const { return _mm256_cmp_pd(v, o.v, _CMP_GE_OQ); }
+
+  static Double4 sqrt(Double4 const &a) { return _mm256_sqrt_pd(a.v); }
+  static Double4 min(Double4 const &a, Double4 const &b) { return _mm256_min_pd(a.v, b.v); }
+  static Double4 max(Double4 const &a, Double4 const &b) { return _mm256_max_pd(a.v, b.v); }
+  /* mask ? a : b, lane by lane */
+  static Double4 select(Double4 const &mask, Double4 const &a, Double4 const &b) {
+    return _mm256_blendv_pd(b.v, a.v, mask.v);
+  }
+  /* One bit per lane of a mask, lane 0 in the lowest bit */
+  static int bits(Double4 const &mask) { return _mm256_movemask_pd(mask.v); }
+};
+
+struct Float8 {
+  const static int size = 8;
+
+  __m256 v;
+
+  Float8() { }
+  Float8(__m256 v) : v(v) { }
+  Float8(float a) : v(_mm256_set1_ps(a)) { }
+
+  static Float8 load(float const *from) { return _mm256_loadu_ps(from); }
+  void store(float *to) const { _mm256_storeu_ps(to, v); }
+
+  Float8 operator+ (Float8 const &o) const { return _mm256_add_ps(v, o.v); }
+  Float8 operator- (Float8 const &o) const { return _mm256_sub_ps(v, o.v); }
+  Float8 operator* (Float8 const &o) const { return _mm256_mul_ps(v, o.v); }
+  Float8 operator/ (Float8 const &o) const { return _mm256_div_ps(v, o.v); }
+  Float8 operator- () const { return _mm256_sub_ps(_mm256_setzero_ps(), v); }
+  Float8 operator& (Float8 const &o) const { return _mm256_and_ps(v, o.v); }
+  Float8 operator| (Float8 const &o) const { return _mm256_or_ps(v, o.v); }
+
+  Float8 operator< (Float8 const &o) const { return _mm256_cmp_ps(v, o.v, _CMP_LT_OQ); }
+  Float8 operator> (Float8 const &o) const { return _mm256_cmp_ps(v, o.v, _CMP_GT_OQ); }
+  Float8 operator<= (Float8 const &o) const { return _mm256_cmp_ps(v, o.v, _CMP_LE_OQ); }
+  Float8 operator>= (Float8 const &o) const { return _mm256_cmp_ps(v, o.v, _CMP_GE_OQ); }
+
+  static Float8 sqrt(Float8 const &a) { return _mm256_sqrt_ps(a.v); }
+  static Float8 min(Float8 const &a, Float8 const &b) { return _mm256_min_ps(a.v, b.v); }
+  static Float8 max(Float8 const &a, Float8 const &b) { return _mm256_max_ps(a.v, b.v); }
+  static Float8 select(Float8 const &mask, Float8 const &a, Float8 const &b) {
+    return _mm256_blendv_ps(b.v, a.v, mask.v);
+  }
+  static int bits(Float8 const &mask) { return _mm256_movemask_ps(mask.v); }
+};
+
+#elif defined(__SSE2__) && !defined(PATHTRACE_NO_SIMD)
+#include <emmintrin.h>
+
+struct Double4 {
+  const static int size = 4;
+
+  __m128d lo, hi;
+
+  Double4() { }
+  Double4(__m128d lo, __m128d hi) : lo(lo), hi(hi) { }
+  Double4(double a) : lo(_mm_set1_pd(a)), hi(_mm_set1_pd(a)) { }
+  Double4(double a, double b, double c, double d)
+    : lo(_mm_setr_pd(a, b)), hi(_mm_setr_pd(c, d)) { }
+
+  static const char* name() { return "SSE2"; }
+
+  static Double4 load(double const *from) { return Double4(_mm_loadu_pd(from), _mm_loadu_pd(from + 2)); }
+  void store(double *to) const { _mm_storeu_pd(to, lo); _mm_storeu_pd(to + 2, hi); }
+
+  Double4 operator+ (Double4 const &o) const { return Double4(_mm_add_pd(lo, o.lo), _mm_add_pd(hi, o.hi)); }
+  Double4 operator- (Double4 const &o) const { return Double4(_mm_sub_pd(lo, o.lo), _mm_sub_pd(hi, o.hi)); }
+  Double4 operator* (Double4 const &o) const { return Double4(_mm_mul_pd(lo, o.lo), _mm_mul_pd(hi, o.hi)); }
+  Double4 operator/ (Double4 const &o) const { return Double4(_mm_div_pd(lo, o.lo), _mm_div_pd(hi, o.hi)); }
+  Double4 operator- () const { return Double4(0.0) - *this; }
+  Double4 operator& (Double4 const &o) const { return Double4(_mm_and_pd(lo, o.lo), _mm_and_pd(hi, o.hi)); }
+  Double4 operator| (Double4 const &o) const { return Double4(_mm_or_pd(lo, o.lo), _mm_or_pd(hi, o.hi)); }
+
+  Double4 operator< (Double4 const &o) const { return Double4(_mm_cmplt_pd(lo, o.lo), _mm_cmplt_pd(hi, o.hi)); }
+  Double4 operator> (Double4 const &o) const { return Double4(_mm_cmpgt_pd(lo, o.lo), _mm_cmpgt_pd(hi, o.hi)); }
+  Double4 operator<= (Double4 const &o) const { return Double4(_mm_cmple_pd(lo, o.lo), _mm_cmple_pd(hi, o.hi)); }
+  Double4 operator>= (Double4 const &o) const { return Double4(_mm_cmpge_pd(lo, o.lo), _mm_cmpge_pd(hi, o.hi)); }
+
+  static Double4 sqrt(Double4 const &a) { return Double4(_mm_sqrt_pd(a.lo), _mm_sqrt_pd(a.hi)); }
+  static Double4 min(Double4 const &a, Double4 const &b) { return Double4(_mm_min_pd(a.lo, b.lo), _mm_min_pd(a.hi, b.hi)); }
+  static Double4 max(Double4 const &a, Double4 const &b) { return Double4(_mm_max_pd(a.lo, b.lo), _mm_max_pd(a.hi, b.hi)); }
+  static Double4 select(Double4 const &mask, Double4 const &a, Double4 const &b) {
+    return Double4(_mm_or_pd(_mm_and_pd(mask.lo, a.lo), _mm_andnot_pd(mask.lo, b.lo)),
+		   _mm_or_pd(_mm_and_pd(mask.hi, a.hi), _mm_andnot_pd(mask.hi, b.hi)));
+  }
+  static int bits(Double4 const &mask) {
+    return _mm_movemask_pd(mask.lo) | (_mm_movemask_pd(mask.hi) << 2);
+  }
+};
+
+struct Float8 {
+  const static int size = 8;
+
+  __m128 lo, hi;
+
+  Float8() { }
+  Float8(__m128 lo, __m128 hi) : lo(lo), hi(hi) { }
+  Float8(float a) : lo(_mm_set1_ps(a)), hi(_mm_set1_ps(a)) { }
+
+  static Float8 load(float const *from) { return Float8(_mm_loadu_ps(from), _mm_loadu_ps(from + 4)); }
+  void store(float *to) const { _mm_storeu_ps(to, lo); _mm_storeu_ps(to + 4, hi); }
+
+  Float8 operator+ (Float8 const &o) const { return Float8(_mm_add_ps(lo, o.lo), _mm_add_ps(hi, o.hi)); }
+  Float8 operator- (Float8 const &o) const { return Float8(_mm_sub_ps(lo, o.lo), _mm_sub_ps(hi, o.hi)); }
+  Float8 operator* (Float8 const &o) const { return Float8(_mm_mul_ps(lo, o.lo), _mm_mul_ps(hi, o.hi)); }
+  Float8 operator/ (Float8 const &o) const { return Float8(_mm_div_ps(lo, o.lo), _mm_div_ps(hi, o.hi)); }
+  Float8 operator- () const { return Float8(0.0f) - *this; }
+  Float8 operator& (Float8 const &o) const { return Float8(_mm_and_ps(lo, o.lo), _mm_and_ps(hi, o.hi)); }
+  Float8 operator| (Float8 const &o) const { return Float8(_mm_or_ps(lo, o.lo), _mm_or_ps(hi, o.hi)); }
+
+  Float8 operator< (Float8 const &o) const { return Float8(_mm_cmplt_ps(lo, o.lo), _mm_cmplt_ps(hi, o.hi)); }
+  Float8 operator> (Float8 const &o) const { return Float8(_mm_cmpgt_ps(lo, o.lo), _mm_cmpgt_ps(hi, o.hi)); }
+  Float8 operator<= (Float8 const &o) const { return Float8(_mm_cmple_ps(lo, o.lo), _mm_cmple_ps(hi, o.hi)); }
+  Float8 operator>= (Float8 const &o) const { return Float8(_mm_cmpge_ps(lo, o.lo), _mm_cmpge_ps(hi, o.hi)); }
+
+  static Float8 sqrt(Float8 const &a) { return Float8(_mm_sqrt_ps(a.lo), _mm_sqrt_ps(a.hi)); }
+  static Float8 min(Float8 const &a, Float8 const &b) { return Float8(_mm_min_ps(a.lo, b.lo), _mm_min_ps(a.hi, b.hi)); }
+  static Float8 max(Float8 const &a, Float8 const &b) { return Float8(_mm_max_ps(a.lo, b.lo), _mm_max_ps(a.hi, b.hi)); }
+  static Float8 select(Float8 const &mask, Float8 const &a, Float8 const &b) {
+    return Float8(_mm_or_ps(_mm_and_ps(mask.lo, a.lo), _mm_andnot_ps(mask.lo, b.lo)),
+		  _mm_or_ps(_mm_and_ps(mask.hi, a.hi), _mm_andnot_ps(mask.hi, b.hi)));
+  }
+  static int bits(Float8 const &mask) {
+    return _mm_movemask_ps(mask.lo) | (_mm_movemask_ps(mask.hi) << 4);
+  }
+};
+
+#else
+#include <string.h>
+#include <stdint.h>
+
+/* N lanes of T, with Bits the unsigned integer of the same size as T */
+template <class T, class Bits, int N>
+struct PlainLanes {
+  const static int size = N;
+
+  T v[N];
+
+private:
+  static T from_bool(bool b) {
+    Bits bits = b ? ~(Bits)0 : 0;
+    T d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+  }
+
+  static bool to_bool(T d) {
+    Bits bits;
+    memcpy(&bits, &d, sizeof(d));
+    return bits != 0;
+  }
+
+  static T and_bits(T a, T b) {
+    Bits x, y;
+    memcpy(&x, &a, sizeof(a));
+    memcpy(&y, &b, sizeof(b));
+    x &= y;
+    memcpy(&a, &x, sizeof(a));
+    return a;
+  }
+
+  static T or_bits(T a, T b) {
+    Bits x, y;
+    memcpy(&x, &a, sizeof(a));
+    memcpy(&y, &b, sizeof(b));
+    x |= y;
+    memcpy(&a, &x, sizeof(a));
+    return a;
+  }
+
+public:
+  PlainLanes() { }
+  PlainLanes(T a) { for (int i = 0 ; i < N ; ++i) v[i] = a; }
+  PlainLanes(T a, T b, T c, T d) {
+    v[0] = a; v[1] = b; v[2] = c; v[3] = d;
+  }
+
+  static const char* name() { return "plain"; }
+
+  static PlainLanes load(T const *from) {
+    PlainLanes r;
+    for (int i = 0 ; i < N ; ++i) r.v[i] = from[i];
+    return r;
+  }
+  void store(T *to) const { for (int i = 0 ; i < N ; ++i) to[i] = v[i]; }
+
+#define PATHTRACE_LANES_OP(op, expr)				\
+  PlainLanes operator op (PlainLanes const &o) const {		\
+    PlainLanes r;						\
+    for (int i = 0 ; i < N ; ++i) r.v[i] = (expr);		\
+    return r;							\
+  }
+  PATHTRACE_LANES_OP(+, v[i] + o.v[i])
+  PATHTRACE_LANES_OP(-, v[i] - o.v[i])
+  PATHTRACE_LANES_OP(*, v[i] * o.v[i])
+  PATHTRACE_LANES_OP(/, v[i] / o.v[i])
+  PATHTRACE_LANES_OP(&, and_bits(v[i], o.v[i]))
+  PATHTRACE_LANES_OP(|, or_bits(v[i], o.v[i]))
+  PATHTRACE_LANES_OP(<, from_bool(v[i] < o.v[i]))
+  PATHTRACE_LANES_OP(>, from_bool(v[i] > o.v[i]))
+  PATHTRACE_LANES_OP(<=, from_bool(v[i] <= o.v[i]))
+  PATHTRACE_LANES_OP(>=, from_bool(v[i] >= o.v[i]))
+#undef PATHTRACE_LANES_OP
+
+  PlainLanes operator- () const { return PlainLanes(T(0)) - *this; }
+
+  static PlainLanes sqrt(PlainLanes const &a) {
+    PlainLanes r;
+    for (int i = 0 ; i < N ; ++i) r.v[i] = ::sqrt(a.v[i]);
+    return r;
+  }
+  static PlainLanes min(PlainLanes const &a, PlainLanes const &b) {
+    PlainLanes r;
+    for (int i = 0 ; i < N ; ++i) r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i];
+    return r;
+  }
+  static PlainLanes max(PlainLanes const &a, PlainLanes const &b) {
+    PlainLanes r;
+    for (int i = 0 ; i < N ; ++i) r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i];
+    return r;
+  }
+  static PlainLanes select(PlainLanes const &mask, PlainLanes const &a,
+			   PlainLanes const &b) {
+    PlainLanes r;
+    for (int i = 0 ; i < N ; ++i) r.v[i] = to_bool(mask.v[i]) ? a.v[i] : b.v[i];
+    return r;
+  }
+  static int bits(PlainLanes const &mask) {
+    int r = 0;
+    for (int i = 0 ; i < N ; ++i) if (to_bool(mask.v[i])) r |= 1 << i;
+    return r;
+  }
+};
+
+typedef PlainLanes<double, uint64_t, 4> Double4;
+typedef PlainLanes<float, uint32_t, 8> Float8;
+
+#endif
+
+/* The lanes of packets of rays: as many of the scalar type real as fit
+ * in a vector register, so that the float build traces twice as many
+ * rays at once */
+#ifdef PATHTRACE_FLOAT
+typedef Float8 RealLanes;
+#else
+typedef Double4 RealLanes;
+#endif
+
+/*
+Local Variables:
+mode:c++
+End:
+*/
+#endif /* PATHTRACE_SIMD_H */
@@ -0,0 +1,149 @@
+#include <cmath>
+
+#include "spectrum.h"
+
+const double Wavelengths::min_wavelength = 380e-9;
+const double Wavelengths::max_wavelength = 720e-9;
+
+namespace {
+  // The tables have an entry for every nanometre of the range
+  const int first_nm = 380;
+  const int entries = 720 - 380 + 1;
+
+  /* A gaussian with different widths on either side of the peak */
+  double lobe(double nm, double peak, double below, double above) {
+    double const t = (nm - peak) / (nm < peak ? below : above);
+    return exp(-t * t / 2);
+  }
+
+  /* The CIE 1931 colour matching functions converted to linear sRGB */
+  void matching_rgb(double nm, double rgb[3]) {
+    double const x = 1.056 * lobe(nm, 599.8, 37.9, 31.0) +
+      0.362 * lobe(nm, 442.0, 16.0, 26.7) -
+      0.065 * lobe(nm, 501.1, 20.4, 26.2);
+    double const y = 0.821 * lobe(nm, 568.8, 46.9, 40.5) +
+      0.286 * lobe(nm, 530.9, 16.3, 31.1);
+    double const z = 1.217 * lobe(nm, 437.0, 11.8, 36.0) +
+      0.681 * lobe(nm, 459.0, 26.0, 13.8);
+    rgb[0] = 3.2406 * x - 1.5372 * y - 0.4986 * z;
+    rgb[1] = -0.9689 * x + 1.8758 * y + 0.0415 * z;
+    rgb[2] = 0.0557 * x - 0.2040 * y + 1.0570 * z;
+  }
+
+  double smoothstep(double from, double to, double x) {
+    if (x <= from) return 0;
+    if (x >= to) return 1;
+    double const t = (x - from) / (to - from);
+    return t * t * (3 - 2 * t);
+  }
+
+  /* Blue up to about 490 nm, red from about 590 nm and green between */
+  void basis_rgb(double nm, double rgb[3]) {
+    rgb[2] = 1 - smoothstep(460, 520, nm);
+    rgb[0] = smoothstep(560, 620, nm);
+    rgb[1] = 1 - rgb[0] - rgb[2];
+  }
+
+  struct Tables {
+    double basis[entries][3];
+    double weights[entries][3];
+
+    Tables() {
+      double matching[entries][3], sum[3] = { 0, 0, 0 };
+      for (int i = 0 ; i < entries ; ++i) {
+	matching_rgb(first_nm + i, matching[i]);
+	// The integral over the range, by the trapezoid rule
+	double const edge = i == 0 || i == entries - 1 ? 0.5 : 1.0;
+	for (int c = 0 ; c < 3 ; ++c)
+	  sum[c] += matching[i][c] * edge;
+      }
+      // Each lane stands for 1 / lanes of the range
+      for (int i = 0 ; i < entries ; ++i) {
+	for (int c = 0 ; c < 3 ; ++c)
+	  weights[i][c] = matching[i][c] / sum[c] * (entries - 1) /
+	    Wavelengths::lanes;
+      }
+
+      // The colours of the plain basis spectra, and their inverse, which
+      // mixes the basis spectra into ones that come back as pure red,
+      // green and blue
+      double m[3][3] = { { 0 } };
+      for (int i = 0 ; i < entries ; ++i) {
+	double b[3];
+	basis_rgb(first_nm + i, b);
+	double const edge = i == 0 || i == entries - 1 ? 0.5 : 1.0;
+	for (int c = 0 ; c < 3 ; ++c) {
+	  for (int d = 0 ; d < 3 ; ++d)
+	    m[c][d] += matching[i][c] / sum[c] * b[d] * edge;
+	}
+      }
+      double inv[3][3];
+      double const det =
+	m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+	m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+	m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+      for (int r = 0 ; r < 3 ; ++r) {
+	for (int c = 0 ; c < 3 ; ++c) {
+	  int const r1 = (c + 1) % 3, r2 = (c + 2) % 3;
+	  int const c1 = (r + 1) % 3, c2 = (r + 2) % 3;
+	  inv[r][c] = (m[r1][c1] * m[r2][c2] - m[r1][c2] * m[r2][c1]) / det;
+	}
+      }
+      for (int i = 0 ; i < entries ; ++i) {
+	double b[3];
+	basis_rgb(first_nm + i, b);
+	for (int c = 0 ; c < 3 ; ++c) {
+	  basis[i][c] = 0;
+	  for (int d = 0 ; d < 3 ; ++d)
+	    basis[i][c] += b[d] * inv[d][c];
+	}
+      }
+    }
+  };
+
+  const Tables tables;
+}
+
+Wavelengths::Wavelengths()
+  : spectral(false), hero_only(false), lambda(640e-9, 540e-9, 450e-9, 540e-9)
+{
+  for (int c = 0 ; c < 3 ; ++c) {
+    double unit[lanes] = { 0, 0, 0, 0 };
+    unit[c] = 1;
+    basis[c] = weights[c] = Double4(unit[0], unit[1], unit[2], unit[3]);
+  }
+}
+
+Wavelengths::Wavelengths(double u)
+  : spectral(true), hero_only(false)
+{
+  double nm[lanes], b[3][lanes], w[3][lanes];
+  for (int i = 0 ; i < lanes ; ++i) {
+    double pos = u + (double)i / lanes;
+    if (pos >= 1) pos -= 1;
+    double const x = pos * (entries - 1);
+    int const at = (int)x < entries - 1 ? (int)x : entries - 2;
+    double const f = x - at;
+    nm[i] = first_nm + x;
+    for (int c = 0 ; c < 3 ; ++c) {
+      b[c][i] = tables.basis[at][c] * (1 - f) + tables.basis[at + 1][c] * f;
+      w[c][i] = tables.weights[at][c] * (1 - f) +
+	tables.weights[at + 1][c] * f;
+    }
+  }
+  lambda = Double4(nm[0], nm[1], nm[2], nm[3]) * Double4(1e-9);
+  for (int c = 0 ; c < 3 ; ++c) {
+    basis[c] = Double4(b[c][0], b[c][1], b[c][2], b[c][3]);
+    weights[c] = Double4(w[c][0], w[c][1], w[c][2], w[c][3]);
+  }
+}
+
+Colour Wavelengths::colour(Double4 const &light) const {
+  double rgb[3];
+  for (int c = 0 ; c < 3 ; ++c) {
+    double l[lanes];
+    (light * weights[c]).store(l);
+    rgb[c] = l[0] + l[1] + l[2] + l[3];
+  }
+  return Colour(rgb[0], rgb[1], rgb[2]);
+}
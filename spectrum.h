@@ -0,0 +1,86 @@
+#ifndef PATHTRACE_SPECTRUM_H
+#define PATHTRACE_SPECTRUM_H
+
+#include "linalg.h"
+#include "simd.h"
+
+/* What the four lanes of the light carried along a path stand for.
+ *
+ * In RGB mode, the first three lanes are red, green and blue and the
+ * fourth is unused. In spectral mode, a path carries light at four
+ * wavelengths: a hero wavelength drawn uniformly from the visible range
+ * and three more spaced evenly from it around the range (Wilkie et al.,
+ * "Hero Wavelength Spectral Sampling", 2014). Materials that depend on
+ * the wavelength, like thin films and dispersive glass, work out their
+ * effect on all four lanes together, and since every path covers the
+ * range, their colours converge about as fast as those of RGB.
+ *
+ * The colours of the scene become spectra that are mixes of three
+ * smooth basis spectra summing to one, so that white is flat, and the
+ * light of a path becomes a colour through the CIE 1931 colour matching
+ * functions, in the analytic fit of Wyman, Sloan and Shirley (2013),
+ * scaled so that a flat spectrum is white. The mixes are chosen so that
+ * a colour turned into a spectrum and back is itself again, unless the
+ * spectrum would have to go negative somewhere. */
+class Wavelengths {
+private:
+  bool spectral;
+  // Whether the hero goes on alone
+  bool hero_only;
+  // In metres
+  Double4 lambda;
+  // The spectra of red, green and blue at the lanes
+  Double4 basis[3];
+  // How much red, green and blue the light of each lane adds to the
+  // colour of the path
+  Double4 weights[3];
+
+public:
+  const static int lanes = 4;
+  // The range the wavelengths of spectral mode are drawn from, in metres
+  const static double min_wavelength, max_wavelength;
+
+  /* RGB mode. The lanes have the wavelengths 640, 540 and 450 nm for
+   * materials that need one. */
+  Wavelengths();
+  /* Spectral mode, with the hero wavelength at u, in [0, 1), along the
+   * range */
+  explicit Wavelengths(double u);
+
+  bool is_spectral() const {
+    return spectral;
+  }
+
+  /* The wavelengths of the lanes, in metres. The first is the hero. */
+  Double4 const& get() const {
+    return lambda;
+  }
+
+  /* A colour of the scene, such as a reflectance or an emission, in the
+   * lanes */
+  Double4 spectrum(Colour const &c) const {
+    Double4 const s = basis[0] * Double4(c.r()) + basis[1] * Double4(c.g()) +
+      basis[2] * Double4(c.b());
+    return Double4::max(s, Double4(0.0));
+  }
+
+  /* Leaves the hero wavelength to go on alone, for when the wavelengths
+   * would go different ways. Returns what to multiply the light of the
+   * lanes with: zero for the others, and the number of lanes for the
+   * hero the first time, so that it stands for them all. */
+  Double4 terminate_secondary() {
+    Double4 const factor(hero_only ? 1 : lanes, 0, 0, 0);
+    hero_only = true;
+    return factor;
+  }
+
+  /* The colour of the light in the lanes */
+  Colour colour(Double4 const &light) const;
+};
+
+/*
+Local Variables:
+mode:c++
+End:
+*/
+#endif /* PATHTRACE_SPECTRUM_H */
@@ -0,0 +1,99 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "stats.h"
+
+void RenderStats::clear() {
+  primary_rays = 0;
+  secondary_rays = 0;
+  shadow_rays = 0;
+  for (int k = 0 ; k < shape_kinds ; ++k)
+    tests[k] = 0;
+  valid_bounces = 0;
+  invalid_bounces = 0;
+  for (unsigned int n = 0 ; n <= max_path_length ; ++n)
+    paths[n] = 0;
+}
+
+RenderStats& RenderStats::operator+=(RenderStats const &other) {
+  primary_rays += other.primary_rays;
+  secondary_rays += other.secondary_rays;
+  shadow_rays += other.shadow_rays;
+  for (int k = 0 ; k < shape_kinds ; ++k)
+    tests[k] += other.tests[k];
+  valid_bounces += other.valid_bounces;
+  invalid_bounces += other.invalid_bounces;
+  for (unsigned int n = 0 ; n <= max_path_length ; ++n)
+    paths[n] += other.paths[n];
+  return *this;
+}
+
+double RenderStats::mean_path_length() const {
+  // Counts the longest paths as max_path_length bounces
+  double count = 0, sum = 0;
+  for (unsigned int n = 0 ; n <= max_path_length ; ++n) {
+    count += paths[n];
+    sum += (double)n * paths[n];
+  }
+  return count > 0 ? sum / count : 0;
+}
+
+namespace {
+  double rate(uint64_t count, double seconds) {
+    return seconds > 0 ? count / seconds : 0;
+  }
+}
+
+std::string RenderStats::summary(double seconds) const {
+  uint64_t const rays = primary_rays + secondary_rays + shadow_rays;
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+	   "%.0f samples/s\n%.0f rays/s\n%.2f bounces per path\n"
+	   "%.1f%% bounces absorbed",
+	   rate(primary_rays, seconds), rate(rays, seconds),
+	   mean_path_length(),
+	   valid_bounces + invalid_bounces ?
+	   100.0 * invalid_bounces / (valid_bounces + invalid_bounces) : 0.0);
+  return buf;
+}
+
+void RenderStats::report(FILE *f, double seconds) const {
+  static const char *const kind_names[shape_kinds] = {
+    "spheres", "planes", "other shapes"
+  };
+  uint64_t const rays = primary_rays + secondary_rays + shadow_rays;
+  fprintf(f, "%-24s %16s %16s\n", "", "count", "per second");
+  fprintf(f, "%-24s %16llu %16.0f\n", "primary rays",
+	  (unsigned long long)primary_rays, rate(primary_rays, seconds));
+  fprintf(f, "%-24s %16llu %16.0f\n", "secondary rays",
+	  (unsigned long long)secondary_rays, rate(secondary_rays, seconds));
+  fprintf(f, "%-24s %16llu %16.0f\n", "shadow rays",
+	  (unsigned long long)shadow_rays, rate(shadow_rays, seconds));
+  fprintf(f, "%-24s %16llu %16.0f\n", "all rays",
+	  (unsigned long long)rays, rate(rays, seconds));
+  for (int k = 0 ; k < shape_kinds ; ++k) {
+    std::string const name = std::string("tests of ") + kind_names[k];
+    fprintf(f, "%-24s %16llu %16.0f\n", name.c_str(),
+	    (unsigned long long)tests[k], rate(tests[k], seconds));
+  }
+  fprintf(f, "%-24s %16llu %16.0f\n", "bounces",
+	  (unsigned long long)valid_bounces, rate(valid_bounces, seconds));
+  fprintf(f, "%-24s %16llu %16.0f\n", "absorbed bounces",
+	  (unsigned long long)invalid_bounces, rate(invalid_bounces, seconds));
+
+  uint64_t path_count = 0;
+  for (unsigned int n = 0 ; n <= max_path_length ; ++n)
+    path_count += paths[n];
+  fprintf(f, "\npath length %.2f bounces on average:\n", mean_path_length());
+  for (unsigned int n = 0 ; n <= max_path_length ; ++n) {
+    double const share = path_count ? (double)paths[n] / path_count : 0;
+    char bar[41];
+    unsigned int const length = share * 40 + 0.5;
+    memset(bar, '#', length);
+    bar[length] = '\0';
+    fprintf(f, "%3u%s %16llu %6.2f%% %s\n", n,
+	    n == max_path_length ? "+" : " ", (unsigned long long)paths[n],
+	    100 * share, bar);
+  }
+}
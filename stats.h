@@ -0,0 +1,62 @@
+#ifndef PATHTRACE_STATS_H
+#define PATHTRACE_STATS_H
+
+#include <cstdio>
+#include <string>
+
+#include <stdint.h>
+
+/* Counts of the work done by a renderer. Every render thread counts into
+ * the RenderStats of its own Tracer, which the thread adds to the total
+ * of the Renderer when it adds a tile to the image, so that counting
+ * never waits for another thread. */
+struct RenderStats {
+  // The shapes intersections are counted for. Spheres and planes are
+  // tested by the scene itself, other shapes like differences and meshes
+  // through their Shape.
+  enum ShapeKind { sphere, plane, other_shape, shape_kinds };
+  // Paths of this many bounces or more are counted together
+  const static unsigned int max_path_length = 16;
+
+  // Rays from the camera, one for every sample
+  uint64_t primary_rays;
+  // Rays after a bounce or scattering in the medium
+  uint64_t secondary_rays;
+  // Rays towards lights, testing whether they are in view
+  uint64_t shadow_rays;
+  // Rays tested against a shape, by kind of shape. A ray in a packet
+  // counts once for every shape tested against the packet.
+  uint64_t tests[shape_kinds];
+  // Rays sent on by Material::bounce(), and rays it absorbed
+  uint64_t valid_bounces;
+  uint64_t invalid_bounces;
+  // paths[n] is the number of paths with n bounces, including scattering
+  uint64_t paths[max_path_length + 1];
+
+  RenderStats() {
+    clear();
+  }
+
+  void clear();
+
+  RenderStats& operator+=(RenderStats const &other);
+
+  void add_path(unsigned int bounces) {
+    paths[bounces < max_path_length ? bounces : max_path_length]++;
+  }
+
+  double mean_path_length() const;
+
+  /* A few lines for a display, with rates over the seconds */
+  std::string summary(double seconds) const;
+
+  /* All the counts, with rates over the seconds */
+  void report(FILE *f, double seconds) const;
+};
+
+/*
+Local Variables:
+mode:c++
+End:
+*/
+#endif /* PATHTRACE_STATS_H */
@@ -1,7 +1,33 @@
 #include <cstdio>
 #include <cmath>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <unistd.h>
+#include <csignal>
+#include <sys/wait.h>
 
 #include "linalg.h"
+#include "random.h"
+#include "material.h"
+#include "mesh.h"
+#include "shapes.h"
+#include "scene.h"
+#include "scenefile.h"
+#include "camera.h"
+#include "image.h"
+#include "tonemap.h"
+#include "tracer.h"
+#include "renderer.h"
+#include "scheduler.h"
+#include "demo.h"
+#include "stats.h"
+#include "distributed.h"
+#include "arena.h"
+#include "sampler.h"
+#include "denoise.h"
+#include "bvh.h"
+#include "spectrum.h"
 
 class Histogram {
   struct Bucket {
@@ -52,14 +78,36 @@ public:
   }
 };
 
+void test_random() {
+  Random a(0, 1), b(0, 2);
+  Histogram ha = Histogram(0, 1, 25);
+  double sum_ab = 0, sum_a = 0, sum_b = 0;
+  int const n = 256 * 256;
+  for (int i = 0 ; i < n ; ++i) {
+    double va = a.uniform();
+    double vb = b.uniform();
+    ha.add(va, 1);
+    sum_a += va;
+    sum_b += vb;
+    sum_ab += va * vb;
+  }
+  ha.print();
+  // Independent uniform streams: mean 0.5, correlation near zero
+  double mean_a = sum_a / n, mean_b = sum_b / n;
+  double cov = sum_ab / n - mean_a * mean_b;
+  printf("stream means %6.4f %6.4f, correlation %7.4f\n\n",
+	 mean_a, mean_b, cov * 12);
+}
+
 void test_gaussian() {
+  Random rng;
   Histogram x = Histogram(-1, 1, 25);
   Histogram y = Histogram(-1, 1, 25);
   Histogram z = Histogram(-1, 1, 25);
   Histogram len = Histogram(0, 1, 25);
 
   for (int i = 0 ; i < 256 * 256 ; ++i) {
-    Vector3 v = Vector3::gaussian(0, 0.5);
+    Vector3 v = Vector3::gaussian(rng, 0, 0.5);
     x.add(v.x, 1);
     y.add(v.y, 1);
     z.add(v.z, 1);
@@ -72,6 +120,62 @@ void test_gaussian() {
   len.print();
 }
 
+/* The first 2^k Sobol samples of a pair of dimensions hit every
+ * elementary interval of area 2^-k once, and they estimate a smooth
+ * integral with less error than random samples do */
+void test_sampler() {
+  SobolSampler sobol(0, 0);
+  int unstratified = 0;
+  for (unsigned int pixel = 0 ; pixel < 256 ; ++pixel) {
+    for (unsigned int dim = 0 ; dim < 8 ; dim += 2) {
+      // Intervals of 1x16, 2x8, 4x4, 8x2 and 16x1 cells
+      for (int xbits = 0 ; xbits <= 4 ; ++xbits) {
+	int cells[16] = { 0 };
+	for (uint32_t i = 0 ; i < 16 ; ++i) {
+	  double u, v;
+	  sobol.start(pixel, 0, i, dim);
+	  sobol.uniform2(u, v);
+	  int const cx = (int)(u * (1 << xbits));
+	  int const cy = (int)(v * (1 << (4 - xbits)));
+	  cells[(cx << (4 - xbits)) | cy]++;
+	}
+	if (std::count(cells, cells + 16, 1) != 16)
+	  unstratified++;
+      }
+    }
+  }
+  printf("%d of %d pixels and pairs of dimensions not stratified\n",
+	 unstratified, 256 * 4 * 5);
+
+  // A disc in the first pair and a smooth function of the second, whose
+  // product integrates to pi/4 * 1/4
+  double const exact = M_PI / 16;
+  for (int k = 0 ; k < Sampler::sampler_kinds ; ++k) {
+    Sampler *sampler = Sampler::create((Sampler::Kind)k, 0, 0);
+    int const pixels = 1024, samples = 64;
+    double error = 0, sum = 0;
+    for (int pixel = 0 ; pixel < pixels ; ++pixel) {
+      double estimate = 0;
+      for (int i = 0 ; i < samples ; ++i) {
+	double x, y, a, b;
+	sampler->start(pixel, 1, i);
+	sampler->uniform2(x, y);
+	sampler->uniform2(a, b);
+	if (x * x + y * y < 1)
+	  estimate += a * b;
+      }
+      estimate /= samples;
+      sum += estimate;
+      error += (estimate - exact) * (estimate - exact);
+    }
+    printf("%-6s %d samples: mean %8.6f (exact %8.6f), rms error %8.6f\n",
+	   Sampler::name((Sampler::Kind)k), samples, sum / pixels, exact,
+	   sqrt(error / pixels));
+    delete sampler;
+  }
+  printf("\n");
+}
+
 void test_fresnel() {
   double external_index = 1.0;
   double internal_index = 1.33;
@@ -92,8 +196,991 @@ void test_fresnel() {
   }
 }
 
+/* Reflectance of unpolarized light from index n1 into n2 at cosine c */
+static double fresnel(double n1, double n2, double c) {
+  double const eta = n1 / n2;
+  double const t2 = 1.0 - eta * eta * (1.0 - c * c);
+  if (t2 <= 0)
+    return 1.0;
+  double const t = sqrt(t2);
+  double const rs = (n1 * c - n2 * t) / (n1 * c + n2 * t);
+  double const rp = (n2 * c - n1 * t) / (n2 * c + n1 * t);
+  return (rs * rs + rp * rp) / 2;
+}
+
+/* The tables glass and films look things up in against the functions
+ * they tabulate. Glass is compared with the Fresnel equations for light
+ * going in and coming out, and films bounce rays with and without their
+ * tables, and with the interference worked out with cos(). */
+void test_material_tables() {
+  double const iors[] = { 1.33, 1.5, 2.4 };
+  int const n = 100000;
+  double worst = 0;
+  for (unsigned int k = 0 ; k < sizeof(iors) / sizeof(iors[0]) ; ++k) {
+    Glass glass(Colour(1, 1, 1), iors[k], 0);
+    glass.compile();
+    for (int i = 0 ; i <= n ; ++i) {
+      double const c = (double)i / n;
+      double e = fabs(glass.reflectance(c) - fresnel(1.0, iors[k], c));
+      if (e > worst) worst = e;
+      // Coming out at the cosine inside that refracts to c outside
+      double const inside = sqrt(1 - (1 - c * c) / (iors[k] * iors[k]));
+      e = fabs(glass.reflectance(c) - fresnel(iors[k], 1.0, inside));
+      if (e > worst) worst = e;
+    }
+  }
+  printf("material tables: glass reflectance off by %.2g at most\n", worst);
+
+  Film const exact(400e-9, 1.33, 0.01);
+  Film film(exact);
+  film.compile();
+  Random rng(9, 0);
+  Vector3 const normal(0, 0, 1);
+  int other_way = 0;
+  double layers_off = 0, table_off = 0, fringes_off = 0;
+  for (int i = 0 ; i < n ; ++i) {
+    double const c = rng.uniform_open();
+    Ray const ray(Vector3(0, 0, 1), Vector3(sqrt(1 - c * c), 0, -c));
+    Wavelengths w(rng.uniform()), w_exact = w;
+    Double4 filter(1.0), filter_exact(1.0);
+    RandomSampler a(i, 0), b(i, 0);
+    Ray const out = film.bounce(ray, normal, 1.0, a, w, filter);
+    Ray const out_exact = exact.bounce(ray, normal, 1.0, b, w_exact,
+				       filter_exact);
+
+    Film::Layers const l = film.layers(c), e = exact.layers(c);
+    double const off[4] = {
+      fabs(l.reflect - e.reflect), fabs(l.inside - e.inside),
+      fabs(l.cosine - e.cosine), fabs(l.distance - e.distance) / e.distance
+    };
+    for (int j = 0 ; j < 4 ; ++j)
+      layers_off = std::max(layers_off, off[j]);
+
+    bool const reflected = out_exact.direction.z > 0;
+    if (reflected != (out.direction.z > 0)) {
+      other_way++;
+      continue;
+    }
+    double lambda[Wavelengths::lanes], f[Wavelengths::lanes];
+    double f_exact[Wavelengths::lanes];
+    w.get().store(lambda);
+    filter.store(f);
+    filter_exact.store(f_exact);
+    double const amount = reflected ? e.inside : e.inside * e.inside;
+    for (int j = 0 ; j < Wavelengths::lanes ; ++j) {
+      double const fringe =
+	(1 + cos(e.distance / lambda[j] * 2 * M_PI)) / 2;
+      double const expected = 1 - amount + amount * fringe;
+      table_off = std::max(table_off, fabs(f[j] - expected));
+      fringes_off = std::max(fringes_off, fabs(f_exact[j] - expected));
+    }
+  }
+  printf("film layers off by %.2g at most, %d of %d bounces went another "
+	 "way\n", layers_off, other_way, n);
+  printf("film filter off by %.2g at most, %.2g without the tables\n\n",
+	 table_off, fringes_off);
+}
+
+/* Material::pdf() should match where Material::bounce() sends rays:
+ * compare the bounced directions with uniformly random directions
+ * weighted by the pdf, bucketed by the angle from the normal */
+void test_material_pdf(double roughness) {
+  RandomSampler rng;
+  Material m(Colour(1, 1, 1), roughness);
+  Vector3 const normal(0, 0, 1);
+  Vector3 in(1, 0, -1);
+  in.normalize();
+  Ray const ray(Vector3(0, 0, 1), in);
+  int const n = 256 * 256, buckets = 8;
+  double bounced[buckets] = { 0 }, weighted[buckets] = { 0 };
+
+  for (int i = 0 ; i < n ; ++i) {
+    Ray out = m.bounce(ray, normal, 1.0, rng);
+    if (out.valid) {
+      int b = (out.direction.z + 1) / 2 * buckets;
+      bounced[b < buckets ? b : buckets - 1] += 1.0 / n;
+    }
+    Vector3 dir = Vector3::uniform_random(rng);
+    int b = (dir.z + 1) / 2 * buckets;
+    weighted[b < buckets ? b : buckets - 1] +=
+      4 * M_PI * m.pdf(ray, normal, dir) / n;
+  }
+
+  printf("roughness %4.2f: cos(angle) bounced pdf\n", roughness);
+  double sum_b = 0, sum_w = 0;
+  for (int b = 0 ; b < buckets ; ++b) {
+    printf("%22.2f %7.4f %7.4f\n", (b + 0.5) * 2.0 / buckets - 1,
+	   bounced[b], weighted[b]);
+    sum_b += bounced[b];
+    sum_w += weighted[b];
+  }
+  printf("%22s %7.4f %7.4f\n\n", "total", sum_b, sum_w);
+}
+
+/* Whether a point is inside a solid of spheres, planes and their
+ * combinations */
+static bool inside(Shape const &s, Vector3d const &p) {
+  if (Sphere const *sphere = dynamic_cast<Sphere const*>(&s))
+    return (p - Vector3d(sphere->get_center())).length() <
+      sphere->get_radius();
+  if (Plane const *plane = dynamic_cast<Plane const*>(&s))
+    return Vector3d(plane->get_normal()).dot(p - Vector3d(plane->get_point())) <
+      0;
+  Csg const &csg = dynamic_cast<Csg const&>(s);
+  bool const a = inside(csg.get_left(), p), b = inside(csg.get_right(), p);
+  switch (csg.get_operation()) {
+  case Csg::union_op:
+    return a || b;
+  case Csg::intersection_op:
+    return a && b;
+  default:
+    return a && !b;
+  }
+}
+
+/* Distances where the ray crosses the surface of a sphere or a plane
+ * of the solid */
+static void crossings(Shape const &s, Ray const &ray,
+		      std::vector<double> &ts) {
+  if (Csg const *csg = dynamic_cast<Csg const*>(&s)) {
+    crossings(csg->get_left(), ray, ts);
+    crossings(csg->get_right(), ray, ts);
+    return;
+  }
+  SpanList spans;
+  s.spans(ray, spans);
+  for (unsigned int i = 0 ; i < spans.size() ; ++i) {
+    ts.push_back(spans[i].enter);
+    ts.push_back(spans[i].exit);
+  }
+}
+
+/* Intersections with a tree of unions, intersections and differences
+ * against the first crossing of a surface where being inside the solid
+ * changes. The normal must point out of the solid there. Rays start
+ * both outside and inside, as they do in glass. */
+void test_csg() {
+  Sphere const a(Vector3(-0.3, 0, 0), 0.6), b(Vector3(0.3, 0, 0), 0.6);
+  Sphere const c(Vector3(0, 0.2, 0.1), 0.4), d(Vector3(0, -0.5, 0), 0.3);
+  Plane const floor(Vector3(0, 0, -0.2), Vector3(0, 0, 1));
+  Difference const solid(Union(Intersection(a, b), Difference(d, a)),
+			 Union(c, Intersection(Sphere(Vector3(0, 0, -1), 2),
+					       floor)));
+  Random rng(6, 0);
+  int const count = 100000;
+  int hits = 0, misses = 0, exits = 0, wrong = 0, normals = 0;
+  for (int i = 0 ; i < count ; ++i) {
+    Vector3 const from = Vector3::uniform_random(rng) * (i % 2 ? 2.0 : 0.6);
+    Vector3 direction = Vector3::uniform_random(rng) * 0.5 - from;
+    direction.normalize();
+    Ray const ray(from, direction);
+
+    std::vector<double> ts;
+    crossings(solid, ray, ts);
+    std::sort(ts.begin(), ts.end());
+    double expected = -1;
+    for (unsigned int j = 0 ; j < ts.size() && expected < 0 ; ++j) {
+      double const t = ts[j];
+      if (t > 1e-6 && t != INFINITY &&
+	  inside(solid, ray.at(t - 1e-7)) != inside(solid, ray.at(t + 1e-7)))
+	expected = t;
+    }
+
+    Hit hit = solid.intersect(ray);
+    if (!hit.is_hit()) {
+      if (expected > 0) wrong++;
+      misses++;
+      continue;
+    }
+    hits++;
+    bool const leaving = inside(solid, ray.at(hit.distance * (1 - 1e-7)));
+    if (leaving) exits++;
+    if (fabs(hit.distance - expected) > 1e-6)
+      wrong++;
+    else if ((ray.direction.dot(hit.normal) > 0) != leaving)
+      normals++;
+  }
+  printf("csg: %d hits, %d of them exits, %d misses, %d wrong, "
+	 "%d normals the wrong way\n", hits, exits, misses, wrong, normals);
+
+  // A cut made of more spans than a SpanList holds in place, on both
+  // sides of the origin, whose last span cuts into the base
+  Arena arena;
+  Shape *cut = arena.make<Sphere>(Vector3(20, 0, 0), 0.5);
+  for (int k = 1 ; k <= 16 ; ++k) {
+    cut = arena.make<Union>(cut, arena.make<Sphere>(Vector3(k, 0, 0), 0.2));
+    cut = arena.make<Union>(cut, arena.make<Sphere>(Vector3(-k, 0, 0), 0.2));
+  }
+  Difference const many(arena.make<Sphere>(Vector3(21, 0, 0), 1), cut);
+  Hit const far = many.intersect(Ray(Vector3(), Vector3(1, 0, 0)));
+  printf("csg with many spans: hit at %g (should be 20.5)\n\n",
+	 far.distance);
+}
+
+/* The split queries of a scene against each other and against the shapes
+ * intersected one by one: closest() with normal() must find what
+ * intersect() on every shape finds, the packet query what the single
+ * ray one finds, and occluded() must see the hit just past its distance
+ * but nothing before it. */
+void test_hit_queries() {
+  Random rng(7, 0);
+  Scene scene;
+  Material const matte(Colour(0.5, 0.5, 0.5), Colour(), 1.0);
+  for (int i = 0 ; i < 20 ; ++i) {
+    scene.add(Sphere(Vector3::uniform_random(rng) * 3.0, 0.3), matte);
+  }
+  scene.add(Plane(Vector3(0, 0, -3), Vector3(0, 0, 1)), matte);
+  scene.add(Difference(Sphere(Vector3(1, 1, 1), 0.8),
+		       Sphere(Vector3(1.5, 1, 1), 0.6)), matte);
+  // An octahedron with the normals of a sphere at its corners
+  std::vector<Vertex> vertices;
+  for (int k = 0 ; k < 6 ; ++k) {
+    double const s = k < 3 ? 1 : -1;
+    Vector3 const corner(k % 3 == 0 ? s : 0, k % 3 == 1 ? s : 0,
+			 k % 3 == 2 ? s : 0);
+    vertices.push_back(Vertex(corner + Vector3(-1, -1, 0), corner));
+  }
+  std::vector<unsigned int> triangles;
+  for (unsigned int k = 0 ; k < 8 ; ++k) {
+    unsigned int const x = k & 1 ? 3 : 0, y = k & 2 ? 4 : 1;
+    unsigned int const z = k & 4 ? 5 : 2;
+    // Counterclockwise seen from outside
+    bool const flip = ((k & 1) != 0) ^ ((k & 2) != 0) ^ ((k & 4) != 0);
+    unsigned int const tri[3] = { x, flip ? z : y, flip ? y : z };
+    triangles.insert(triangles.end(), tri, tri + 3);
+  }
+  TriangleMesh mesh;
+  mesh.assign(vertices, triangles, true);
+  scene.add(mesh, matte);
+  scene.build();
+
+  int const count = 20000;
+  int hits = 0, wrong = 0, packet_wrong = 0, occlusion_wrong = 0;
+  std::vector<Ray> rays;
+  for (int i = 0 ; i < count ; ++i) {
+    Vector3 direction = Vector3::uniform_random(rng);
+    direction.normalize();
+    rays.push_back(Ray(Vector3::uniform_random(rng) * 4.0, direction));
+  }
+  std::vector<Object const*> single(count);
+  std::vector<HitRecord> records(count);
+  for (int i = 0 ; i < count ; ++i) {
+    Ray const &ray = rays[i];
+    Object const *expected = 0;
+    Hit best;
+    for (unsigned int k = 0 ; k < scene.objects.size() ; ++k) {
+      Hit const h = scene.objects[k].shape->intersect(ray);
+      if (h.is_hit() && (!expected || h.distance < best.distance)) {
+	expected = &scene.objects[k];
+	best = h;
+      }
+    }
+
+    single[i] = scene.closest(ray, records[i]);
+    if (single[i] != expected) {
+      wrong++;
+      continue;
+    }
+    if (!expected)
+      continue;
+    hits++;
+    double const d = records[i].distance;
+    Vector3 const n = scene.normal(ray, *single[i], records[i]);
+    if (fabs(d - best.distance) > 1e-9 || (n - best.normal).length() > 1e-6)
+      wrong++;
+    if (!scene.occluded(ray, d * (1 + 1e-6)) ||
+	scene.occluded(ray, d * (1 - 1e-6)))
+      occlusion_wrong++;
+  }
+  for (int i = 0 ; i < count ; i += RayPacket::size) {
+    RayPacket packet(&rays[i], RayPacket::size);
+    Object const *objects[RayPacket::size];
+    HitRecord packed[RayPacket::size];
+    scene.closest(packet, &rays[i], objects, packed);
+    for (int lane = 0 ; lane < RayPacket::size ; ++lane) {
+      if (objects[lane] != single[i + lane] ||
+	  (objects[lane] &&
+	   (fabs(packed[lane].distance - records[i + lane].distance) > 1e-9 ||
+	    packed[lane].primitive != records[i + lane].primitive)))
+	packet_wrong++;
+    }
+  }
+  printf("hit queries: %d of %d rays hit, %d wrong, %d wrong in packets, "
+	 "%d wrong occlusions\n\n", hits, count, wrong, packet_wrong,
+	 occlusion_wrong);
+}
+
+namespace {
+  /* Counts the copies alive, and checks that each one is where it was
+   * made when it is destroyed */
+  struct Counted {
+    static int alive;
+    static int misplaced;
+    Counted *self;
+    double value;
+
+    Counted(double value)
+      : self(this), value(value)
+    {
+      alive++;
+    }
+
+    Counted(Counted const &other)
+      : self(this), value(other.value)
+    {
+      alive++;
+    }
+
+    ~Counted() {
+      if (self != this) misplaced++;
+      alive--;
+    }
+  };
+
+  int Counted::alive = 0;
+  int Counted::misplaced = 0;
+}
+
+/* Objects of an arena stay where they are and are destroyed once, when
+ * the arena that has them is cleared, also after being taken over by
+ * another arena. Objects larger than a block get one of their own. */
+void test_arena() {
+  int const count = 100000;
+  int misaligned = 0, wrong = 0;
+  std::vector<Counted*> made;
+  Arena scene_arena;
+  {
+    Arena parse_arena;
+    for (int i = 0 ; i < count ; ++i) {
+      Arena &arena = i % 2 ? scene_arena : parse_arena;
+      if (i % 1000 == 0)
+	arena.allocate(Arena::block_size + i, 1);
+      else
+	arena.allocate(i % 7, 1);
+      made.push_back(arena.make<Counted>(i));
+      if ((size_t)made.back() % __alignof__(Counted) != 0)
+	misaligned++;
+      if ((size_t)arena.allocate(8, Arena::max_alignment) %
+	  Arena::max_alignment != 0)
+	misaligned++;
+    }
+    scene_arena.take(parse_arena);
+  }
+  int const alive = Counted::alive;
+  for (int i = 0 ; i < count ; ++i) {
+    if (made[i]->value != i)
+      wrong++;
+  }
+  scene_arena.clear();
+  printf("arena: %d of %d alive after taking over, %d misaligned, %d wrong, "
+	 "%d left after clearing, %d destroyed in the wrong place\n",
+	 alive, count, misaligned, wrong, Counted::alive, Counted::misplaced);
+
+  // Plain values need no destructor to be run
+  Arena plain;
+  for (int i = 0 ; i < 1000 ; ++i)
+    plain.make<double>(i);
+  // Objects made of temporaries are copied into the arena of the scene
+  Scene scene;
+  scene.add(Object(Sphere(Vector3(0, 0, 0), 1), Material(Colour(1, 1, 1))));
+  scene.build();
+  Hit hit;
+  bool const found =
+    scene.intersect(Ray(Vector3(0, 0, 3), Vector3(0, 0, -1)), hit) != 0;
+  printf("arena: %u bytes for 1000 doubles, object of temporaries %s\n\n",
+	 (unsigned int)plain.used(), found && hit.distance == 2 ?
+	 "hit at 2" : "missed");
+}
+
+/* Rays aimed exactly at the shared edges and corners of a grid of
+ * triangles must hit one of them. With a non-watertight test some slip
+ * through the cracks. */
+void test_watertight() {
+  int const n = 16;
+  std::vector<Vertex> vertices;
+  std::vector<unsigned int> triangles;
+  for (int y = 0 ; y <= n ; ++y) {
+    for (int x = 0 ; x <= n ; ++x)
+      vertices.push_back(Vertex(Vector3(x * 0.1, y * 0.1, 0), Vector3()));
+  }
+  for (int y = 0 ; y < n ; ++y) {
+    for (int x = 0 ; x < n ; ++x) {
+      unsigned int const i = y * (n + 1) + x;
+      unsigned int const quad[6] = { i, i + 1, i + n + 2, i, i + n + 2, i + n + 1 };
+      triangles.insert(triangles.end(), quad, quad + 6);
+    }
+  }
+  TriangleMesh mesh;
+  mesh.assign(vertices, triangles, false);
+
+  Random rng;
+  int rays = 0, misses = 0;
+  for (int y = 1 ; y < 2 * n ; ++y) {
+    for (int x = 1 ; x < 2 * n ; ++x) {
+      // Corners, edge midpoints and diagonal midpoints of the grid
+      Vector3 target(x * 0.05, y * 0.05, 0);
+      for (int i = 0 ; i < 4 ; ++i) {
+	Vector3 origin = target + Vector3::uniform_random(rng);
+	if (origin.z == 0) continue;
+	Vector3 dir = target - origin;
+	dir.normalize();
+	rays++;
+	if (!mesh.intersect(Ray(origin, dir)).is_hit())
+	  misses++;
+      }
+    }
+  }
+  printf("watertight: %d of %d rays through edges and corners missed\n\n",
+	 misses, rays);
+}
+
+/* Boxes that shrink so fast that every split of the surface area
+ * heuristic peels off only the biggest, which would make a hierarchy
+ * deeper than the traversal stack */
+void test_bvh_depth() {
+  int const n = 200;
+  std::vector<Box> boxes(n);
+  for (int i = 0 ; i < n ; ++i) {
+    double const x = ldexp(1.0, -4 * i);
+    boxes[i].extend(Vector3(x, 0, 0));
+    boxes[i].extend(Vector3(x * 1.01, x * 0.01, x * 0.01));
+  }
+  Bvh bvh;
+  bvh.build(boxes);
+
+  std::vector<int> depth(bvh.nodes.size(), 0);
+  int deepest = 0;
+  for (unsigned int i = 0 ; i < bvh.nodes.size() ; ++i) {
+    deepest = std::max(deepest, depth[i]);
+    if (bvh.nodes[i].count == 0)
+      depth[i + 1] = depth[bvh.nodes[i].offset] = depth[i] + 1;
+  }
+  printf("bvh: %d boxes, %d levels deep (at most %d), %s\n\n", n, deepest,
+	 Bvh::max_depth - 1, bvh.fits(n) ? "fits" : "doesn't fit");
+}
+
+/* Loads the same cube from an OBJ file and a binary PLY file */
+void test_mesh_load() {
+  static const float corners[8][3] = {
+    { 0, 0, 0 }, { 1, 0, 0 }, { 1, 1, 0 }, { 0, 1, 0 },
+    { 0, 0, 1 }, { 1, 0, 1 }, { 1, 1, 1 }, { 0, 1, 1 }
+  };
+  static const int faces[6][4] = {
+    { 0, 3, 2, 1 }, { 4, 5, 6, 7 }, { 0, 1, 5, 4 },
+    { 1, 2, 6, 5 }, { 2, 3, 7, 6 }, { 3, 0, 4, 7 }
+  };
+  char obj_name[64], ply_name[64];
+  snprintf(obj_name, sizeof(obj_name), "/tmp/pathtrace-test-%d.obj", getpid());
+  snprintf(ply_name, sizeof(ply_name), "/tmp/pathtrace-test-%d.ply", getpid());
+
+  FILE *f = fopen(obj_name, "w");
+  fprintf(f, "# cube\n");
+  for (int i = 0 ; i < 8 ; ++i)
+    fprintf(f, "v %g %g %g\n", corners[i][0], corners[i][1], corners[i][2]);
+  fprintf(f, "vn 0 0 1\n");
+  for (int i = 0 ; i < 6 ; ++i) {
+    // Negative indices count back from the last vertex
+    fprintf(f, "f %d %d/1 %d//1 -%d\n", faces[i][0] + 1, faces[i][1] + 1,
+	    faces[i][2] + 1, 8 - faces[i][3]);
+  }
+  fclose(f);
+
+  f = fopen(ply_name, "wb");
+  fprintf(f, "ply\nformat binary_little_endian 1.0\ncomment cube\n"
+	  "element vertex 8\nproperty float x\nproperty float y\n"
+	  "property float z\nproperty uchar red\n"
+	  "element face 6\nproperty list uchar int vertex_indices\n"
+	  "end_header\n");
+  for (int i = 0 ; i < 8 ; ++i) {
+    fwrite(corners[i], sizeof(float), 3, f);
+    fputc(255, f);
+  }
+  for (int i = 0 ; i < 6 ; ++i) {
+    fputc(4, f);
+    fwrite(faces[i], sizeof(int), 4, f);
+  }
+  fclose(f);
+
+  TriangleMesh obj, ply;
+  bool const obj_ok = obj.load(obj_name);
+  bool const ply_ok = ply.load(ply_name);
+  unlink(obj_name);
+  unlink(ply_name);
+  Ray ray(Vector3(0.3, 0.6, 3), Vector3(0, 0, -1));
+  Hit a = obj.intersect(ray), b = ply.intersect(ray);
+  printf("obj: %s, %u triangles, hit at %g, normal z %g\n",
+	 obj_ok ? "loaded" : "failed", obj.triangle_count(), a.distance,
+	 a.normal.z);
+  printf("ply: %s, %u triangles, hit at %g, normal z %g\n",
+	 ply_ok ? "loaded" : "failed", ply.triangle_count(), b.distance,
+	 b.normal.z);
+
+  // Two faces that share an edge but give its corners different normals,
+  // like a hard edge
+  f = fopen(obj_name, "w");
+  fprintf(f, "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\n"
+	  "vn 0 0 1\nvn 0 0.6 0.8\n"
+	  "f 1//1 2//1 3//1\nf 1//2 3//2 4//2\n");
+  fclose(f);
+  TriangleMesh split;
+  bool const split_ok = split.load(obj_name);
+  unlink(obj_name);
+  Hit c = split.intersect(Ray(Vector3(0.7, 0.2, 1), Vector3(0, 0, -1)));
+  Hit d = split.intersect(Ray(Vector3(0.2, 0.7, 1), Vector3(0, 0, -1)));
+  printf("split normals: %s, %u vertices, normal z %g and %g "
+	 "(should be 1 and 0.8)\n", split_ok ? "loaded" : "failed",
+	 split.vertex_count(), c.normal.z, d.normal.z);
+
+  // A header that claims far more records than the file holds, and a face
+  // with a negative index
+  f = fopen(ply_name, "wb");
+  fprintf(f, "ply\nformat binary_little_endian 1.0\n"
+	  "element vertex 4000000000000000000\nproperty float x\n"
+	  "property float y\nproperty float z\nend_header\n");
+  fclose(f);
+  TriangleMesh huge;
+  bool const huge_ok = huge.load(ply_name);
+  f = fopen(ply_name, "wb");
+  fprintf(f, "ply\nformat binary_little_endian 1.0\n"
+	  "element vertex 3\nproperty float x\nproperty float y\n"
+	  "property float z\nelement face 1\n"
+	  "property list uchar int vertex_indices\nend_header\n");
+  for (int i = 0 ; i < 3 ; ++i)
+    fwrite(corners[i], sizeof(float), 3, f);
+  static const int negative[3] = { 0, -1, 2 };
+  fputc(3, f);
+  fwrite(negative, sizeof(int), 3, f);
+  fclose(f);
+  TriangleMesh bad_index;
+  bool const bad_index_ok = bad_index.load(ply_name);
+  unlink(ply_name);
+  printf("huge ply count: %s, negative ply index: %s\n\n",
+	 huge_ok ? "loaded" : "failed", bad_index_ok ? "loaded" : "failed");
+}
+
+/* Rays that find different objects or distances in the two scenes */
+static int compare_scenes(Scene const &a, Scene const &b, int count) {
+  Random rng(7, 0);
+  int differ = 0;
+  for (int i = 0 ; i < count ; ++i) {
+    Vector3 origin(rng.uniform() * 4 - 2, rng.uniform() * 4 - 2,
+		   rng.uniform() * 4 - 2);
+    Ray ray(origin, Vector3::uniform_random(rng));
+    Hit ha, hb;
+    Object const *oa = a.intersect(ray, ha), *ob = b.intersect(ray, hb);
+    if ((oa ? oa - &a.objects[0] : -1) != (ob ? ob - &b.objects[0] : -1) ||
+	(oa && ha.distance != hb.distance))
+      differ++;
+  }
+  return differ;
+}
+
+void test_scene_file() {
+  char scene_name[64], mesh_name[64];
+  snprintf(scene_name, sizeof(scene_name), "/tmp/pathtrace-test-%d.scene",
+	   getpid());
+  snprintf(mesh_name, sizeof(mesh_name), "pathtrace-test-%d.obj", getpid());
+  std::string const mesh_path = std::string("/tmp/") + mesh_name;
+  std::string const cache = SceneFile::cache_name(scene_name);
+
+  FILE *f = fopen(mesh_path.c_str(), "w");
+  fprintf(f, "v -0.5 -0.5 0\nv 0.5 -0.5 0\nv 0 0.5 0\nv 0 0 0.5\n"
+	  "f 1 3 2\nf 1 2 4\nf 2 3 4\nf 3 1 4\n");
+  fclose(f);
+  f = fopen(scene_name, "w");
+  fprintf(f, "# test scene\n"
+	  "camera 0 -1 0  -1 0 1  1 0 1  -1 0 -1  2 0.01\n"
+	  "mean_free_path 5\n"
+	  "material white diffuse colour 0.9 0.9 0.9\n"
+	  "material light diffuse colour 0 0 0 emission 4 4 4\n"
+	  "material glass glass colour 0.5 0.9 0.99 ior 1.52\n"
+	  "material bubble film thickness 400e-9 ior 1.33 roughness 0.01\n"
+	  "sphere 1 1 0 0.5 glass\n"
+	  "sphere -1 1 0 0.5 bubble   # comment\n"
+	  "difference sphere 0 1 1 0.5 sphere 0 0.8 1 0.4 white\n"
+	  "mesh \"%s\" white\n"
+	  "mesh %s white\n"
+	  "plane 0 0 -2  0 0 1 white\n"
+	  "plane 0 0 2  0 0 -1 light\n", mesh_name, mesh_name);
+  fclose(f);
+  unlink(cache.c_str());
+
+  Camera cam(Vector3(), Vector3(), Vector3(), Vector3(), 1, 0);
+  Scene plain, written, read;
+  bool const plain_ok = SceneFile::load(scene_name, plain, cam);
+  plain.build();
+  bool const written_ok = SceneFile::load(scene_name, written, cam, true);
+  bool const cache_made = access(cache.c_str(), R_OK) == 0;
+  bool const read_ok = SceneFile::load(scene_name, read, cam, true);
+  printf("scene file: %s, %u objects, mean free path %g, camera focus %g\n",
+	 plain_ok ? "loaded" : "failed", (unsigned int)plain.objects.size(),
+	 plain.mean_free_path, cam.get_focus());
+  printf("scene cache: %s, %s, read %s, %d of 10000 rays differ\n",
+	 written_ok ? "loaded" : "failed",
+	 cache_made ? "written" : "not written",
+	 read_ok && read.objects.size() == plain.objects.size() ?
+	 "back" : "wrong", compare_scenes(plain, read, 10000));
+
+  // A changed scene file makes the cache stale
+  f = fopen(scene_name, "a");
+  fprintf(f, "sphere 0 1 -1 0.25 white\n");
+  fclose(f);
+  Scene changed;
+  SceneFile::load(scene_name, changed, cam, true);
+  printf("changed scene: %u objects\n", (unsigned int)changed.objects.size());
+
+  // Errors name the line
+  f = fopen(scene_name, "w");
+  fprintf(f, "material white diffuse\n\nsphere 0 0 0 x white\n");
+  fclose(f);
+  Scene broken;
+  printf("broken scene (should complain about line 3): ");
+  fflush(stdout);
+  bool const broken_ok = SceneFile::load(scene_name, broken, cam);
+  printf("%s\n", broken_ok ? "loaded" : "failed");
+
+  // Nesting deep enough to run out of stack is refused
+  f = fopen(scene_name, "w");
+  fprintf(f, "material white diffuse\n");
+  for (int i = 0 ; i < 100000 ; ++i)
+    fprintf(f, "union sphere 0 0 0 1 ");
+  fprintf(f, "sphere 0 0 0 1 white\n");
+  fclose(f);
+  Scene nested;
+  printf("nested scene (should complain about line 2): ");
+  fflush(stdout);
+  bool const nested_ok = SceneFile::load(scene_name, nested, cam);
+  printf("%s\n\n", nested_ok ? "loaded" : "failed");
+
+  unlink(scene_name);
+  unlink(mesh_path.c_str());
+  unlink(cache.c_str());
+}
+
+/* Writes an image with random samples to a checkpoint and reads it
+ * back, and checks that merging two checkpoints sums them */
+void test_checkpoint() {
+  char name[64];
+  snprintf(name, sizeof(name), "/tmp/pathtrace-test-%d.ckpt", getpid());
+  Random rng(3, 0);
+  Image a(37, 23), b(37, 23);
+  for (int i = 0 ; i < 5000 ; ++i) {
+    Image &img = i % 3 ? a : b;
+    Features f;
+    f.albedo = Colourd(rng.uniform(), rng.uniform(), rng.uniform());
+    f.normal = Vector3d(rng.uniform(), rng.uniform(), rng.uniform());
+    f.depth = rng.uniform();
+    img.add(rng.uniform() * 37, rng.uniform() * 23,
+	    Colour(rng.uniform(), rng.uniform(), rng.uniform()), f);
+  }
+  a.paint_start();
+  b.paint_start();
+  b.paint_start();
+
+  std::vector<uint64_t> seeds(1, 42), read_seeds;
+  bool const written = a.write_checkpoint(name, seeds);
+  Image *read = Image::read_checkpoint(name, read_seeds);
+  unlink(name);
+  int differ = 0;
+  if (read) {
+    for (unsigned int y = 0 ; y < a.height ; ++y) {
+      for (unsigned int x = 0 ; x < a.width ; ++x) {
+	Features const f = read->mean_features(x, y);
+	Features const g = a.mean_features(x, y);
+	if (read->sample_count(x, y) != a.sample_count(x, y) ||
+	    !(read->mean(x, y) - a.mean(x, y)).is_zero() ||
+	    !(f.albedo - g.albedo).is_zero() ||
+	    !(f.normal - g.normal).is_zero() || f.depth != g.depth ||
+	    (read->variance(x, y) != a.variance(x, y) &&
+	     a.variance(x, y) != INFINITY))
+	  differ++;
+      }
+    }
+  }
+  printf("checkpoint: %s, %s, %d pixels differ, seeds %s\n",
+	 written ? "written" : "not written", read ? "read" : "not read",
+	 differ, read_seeds == seeds ? "kept" : "lost");
+
+  // Merging is the same as adding the images
+  Image sum(37, 23);
+  sum.add(a);
+  sum.add(b);
+  b.write_checkpoint(name, seeds);
+  Image *merged = Image::read_checkpoint(name, read_seeds);
+  unlink(name);
+  double worst = 0;
+  if (read && merged) {
+    merged->add(*read);
+    for (unsigned int y = 0 ; y < sum.height ; ++y) {
+      for (unsigned int x = 0 ; x < sum.width ; ++x) {
+	double const v = sum.variance(x, y), w = merged->variance(x, y);
+	if (v != INFINITY)
+	  worst = std::max(worst, fabs(v - w) / v);
+	worst = std::max(worst, (sum.mean(x, y) - merged->mean(x, y)).length());
+	worst = std::max(worst, fabs(sum.mean_features(x, y).depth -
+				     merged->mean_features(x, y).depth));
+      }
+    }
+  }
+  printf("merged: %d passes, largest difference from the sum %g\n\n",
+	 merged ? merged->get_paints_started() : 0, worst);
+  delete read;
+  delete merged;
+}
+
+/* Two walls meeting in the middle of the image, lit differently and
+ * rendered with a few noisy samples: the denoiser should take out most
+ * of the noise without blurring light from one wall onto the other */
+void test_denoise() {
+  unsigned int const width = 64, height = 48, samples = 4;
+  Image img(width, height), out(width, height);
+  Random rng(5, 0);
+  Colour const albedo[2] = { Colour(0.8, 0.3, 0.2), Colour(0.2, 0.3, 0.8) };
+  double const light[2] = { 0.5, 2.0 };
+  for (unsigned int y = 0 ; y < height ; ++y) {
+    for (unsigned int x = 0 ; x < width ; ++x) {
+      int const wall = x < width / 2 ? 0 : 1;
+      Features f;
+      f.albedo = Colourd(albedo[wall]);
+      f.normal = wall ? Vector3d(-1, 0, 0) : Vector3d(0, 0, -1);
+      f.depth = wall ? 5 + 0.1 * x : 2;
+      for (unsigned int i = 0 ; i < samples ; ++i)
+	img.add(x, y, albedo[wall] * (light[wall] * -log(rng.uniform_open())),
+		f);
+    }
+  }
+  Denoiser().run(img, out, 2);
+
+  double before = 0, after = 0, edge = 0;
+  for (unsigned int y = 0 ; y < height ; ++y) {
+    for (unsigned int x = 0 ; x < width ; ++x) {
+      int const wall = x < width / 2 ? 0 : 1;
+      Colourd const truth = Colourd(albedo[wall]) * light[wall];
+      double const a = (img.mean(x, y) - truth).length();
+      double const b = (out.mean(x, y) - truth).length();
+      before += a * a;
+      after += b * b;
+      if (x == width / 2 - 1 || x == width / 2)
+	edge += b * b;
+    }
+  }
+  printf("denoise: rms error %.4f before, %.4f after, %.4f at the edge\n\n",
+	 sqrt(before / (width * height)), sqrt(after / (width * height)),
+	 sqrt(edge / (2 * height)));
+}
+
+/* Colours turned into spectra and back, averaged over wavelengths
+ * spread evenly over the range, should come back as themselves. Then
+ * the demo scene, with its thin-film bubble, rendered with both kinds of
+ * light: a short render of each against a long one of the same kind. */
+void test_spectrum() {
+  Colour const colours[] = {
+    Colour(1, 1, 1), Colour(0.5, 0.5, 0.5), Colour(0.8, 0.3, 0.2),
+    Colour(0.2, 0.3, 0.8), Colour(0.96, 0.65, 0.55), Colour(126, 116, 102)
+  };
+  int const count = sizeof(colours) / sizeof(colours[0]), n = 1024;
+  double worst = 0;
+  for (int k = 0 ; k < count ; ++k) {
+    Colourd sum(0, 0, 0);
+    for (int i = 0 ; i < n ; ++i) {
+      Wavelengths const w((i + 0.5) / n);
+      sum += Colourd(w.colour(w.spectrum(colours[k])));
+    }
+    sum /= n;
+    double const error = (sum - Colourd(colours[k])).length() /
+      Colourd(colours[k]).length();
+    if (error > worst)
+      worst = error;
+  }
+  printf("spectrum: colours come back with relative error %.6f at most\n",
+	 worst);
+
+  Scene s;
+  demo_scene(s);
+  unsigned int const width = 48, height = 32;
+  for (int spectral = 0 ; spectral < 2 ; ++spectral) {
+    Image img[2] = { Image(width, height), Image(width, height) };
+    int const passes[2] = { 8, 256 };
+    for (int i = 0 ; i < 2 ; ++i) {
+      Tracer tracer(s, demo_camera(), i);
+      tracer.set_spectral(spectral);
+      Renderer renderer(tracer, width, height, 2, passes[i], 16);
+      renderer.start();
+      renderer.wait();
+      renderer.snapshot(img[i]);
+    }
+    double error = 0, mean = 0;
+    for (unsigned int y = 0 ; y < height ; ++y) {
+      for (unsigned int x = 0 ; x < width ; ++x) {
+	double const e = (img[0].mean(x, y) - img[1].mean(x, y)).length();
+	error += e * e;
+	mean += img[1].mean(x, y).luminance();
+      }
+    }
+    printf("%-8s light: mean luminance %.4f, rms error %.4f after %d "
+	   "passes\n", spectral ? "spectral" : "rgb", mean / (width * height),
+	   sqrt(error / (width * height)), passes[0]);
+  }
+  printf("\n");
+}
+
+/* The tone curve table against exp and pow, for products of radiance
+ * and exposure spread evenly over their logarithm, and the special
+ * values. A float product differs from the double one by a rounding,
+ * which may land on the other side of a step. */
+void test_tone_curve() {
+  ToneCurve const &curve = ToneCurve::get();
+  Random rng(5, 0);
+  int const count = 1000000;
+  int off_by_one = 0, worse = 0;
+  for (int i = 0 ; i < count ; ++i) {
+    double const x = exp(rng.uniform() * 24 - 16);
+    int const expected = Colourd(x, x, x).expose(1.0).to_srgb().to_byte().r();
+    int const diff = abs(curve(x) - expected);
+    if (diff == 1) off_by_one++;
+    if (diff > 1) worse++;
+  }
+  printf("tone curve: %d of %d off by one, %d off by more\n", off_by_one,
+	 count, worse);
+  printf("0 -> %d, -1 -> %d, NaN -> %d, infinity -> %d\n", curve(0.0f),
+	 curve(-1.0f), curve(NAN), curve(INFINITY));
+
+  // Splitting the image between threads changes nothing
+  Image img(613, 487);
+  for (int i = 0 ; i < 1000000 ; ++i) {
+    img.add(rng.uniform() * img.width, rng.uniform() * img.height,
+	    Colour(rng.uniform(), rng.uniform(), rng.uniform()) * 2.0);
+  }
+  std::vector<unsigned char> one(img.width * img.height * 3);
+  std::vector<unsigned char> many(one.size());
+  img.blit_to(&one[0], img.width * 3, 1.5, 1);
+  img.blit_to(&many[0], img.width * 3, 1.5, 8);
+  bool same = one == many;
+  img.blit_variance(&one[0], img.width * 3, 1.5, 1);
+  img.blit_variance(&many[0], img.width * 3, 1.5, 8);
+  same = same && one == many;
+  printf("threads: %s\n\n", same ? "same image" : "DIFFERENT");
+}
+
+/* A pass is only finished once all of its own tiles are, even when the
+ * tiles of the next pass, dealt out while the last ones of the previous
+ * were still rendering, come in first */
+void test_scheduler() {
+  TileScheduler scheduler(16, 16, 8, 1);
+  Tile tile;
+  int pass, early = 0;
+  int first[4];
+  for (int i = 0 ; i < 4 ; ++i)
+    scheduler.next(0, tile, first[i]);
+  for (int i = 0 ; i < 3 ; ++i)
+    early += scheduler.finish(first[i]);
+  for (int i = 0 ; i < 4 ; ++i) {
+    scheduler.next(0, tile, pass);
+    early += scheduler.finish(pass);
+  }
+  bool const done = scheduler.finish(first[3]);
+  printf("scheduler: %d passes reported early, %s, %d passes finished\n\n",
+	 early, done ? "reported when the last tile came in" : "never reported",
+	 scheduler.get_passes_finished());
+}
+
+/* The counts of a render on several threads, which must have one
+ * primary ray and one path for every sample however the tiles were
+ * shared out */
+void test_render_stats() {
+  Scene s;
+  demo_scene(s);
+  Tracer tracer(s, demo_camera(), 0);
+  unsigned int const width = 64, height = 48;
+  int const passes = 3;
+  Renderer renderer(tracer, width, height, 3, passes, 16);
+  renderer.start();
+  renderer.wait();
+  RenderStats const stats = renderer.get_stats();
+  uint64_t paths = 0;
+  for (unsigned int n = 0 ; n <= RenderStats::max_path_length ; ++n)
+    paths += stats.paths[n];
+  printf("render stats: %llu primary rays and %llu paths for %u samples\n",
+	 (unsigned long long)stats.primary_rays, (unsigned long long)paths,
+	 width * height * passes);
+  printf("%llu secondary rays, %llu bounces, %llu absorbed, "
+	 "%.2f bounces per path\n\n", (unsigned long long)stats.secondary_rays,
+	 (unsigned long long)stats.valid_bounces,
+	 (unsigned long long)stats.invalid_bounces, stats.mean_path_length());
+}
+
+/* A coordinator and two worker processes on a Unix domain socket. The
+ * sum must have the passes of both workers, each with a seed of its
+ * own. */
+void test_distributed() {
+  char address[64];
+  snprintf(address, sizeof(address), "/tmp/pathtrace-test-%d.sock",
+	   getpid());
+  uint64_t fingerprint;
+  scene_fingerprint(0, fingerprint);
+  unsigned int const width = 48, height = 32;
+  Coordinator coordinator(width, height, fingerprint, 7,
+			  Tracer::default_roulette_depth, true,
+			  Tracer::default_sampler, false);
+  if (!coordinator.listen(address))
+    return;
+
+  // Forked before the coordinator starts its threads
+  pid_t workers[2];
+  for (int i = 0 ; i < 2 ; ++i) {
+    workers[i] = fork();
+    if (workers[i] == 0) {
+      static volatile sig_atomic_t const never = 0;
+      Scene s;
+      demo_scene(s);
+      bool const ok = Worker::run(address, s, demo_camera(), fingerprint, 1,
+				  &never);
+      _exit(ok ? 0 : 1);
+    }
+  }
+  coordinator.start();
+  for (int i = 0 ; i < 300 && coordinator.get_passes() < 8 ; ++i)
+    usleep(100000);
+  coordinator.stop();
+
+  int exited_ok = 0;
+  for (int i = 0 ; i < 2 ; ++i) {
+    int status;
+    if (workers[i] > 0 && waitpid(workers[i], &status, 0) == workers[i] &&
+	WIFEXITED(status) && WEXITSTATUS(status) == 0)
+      exited_ok++;
+  }
+  Image img(width, height);
+  std::vector<uint64_t> seeds;
+  coordinator.snapshot(img, seeds);
+  bool const distinct = seeds.size() == 2 && seeds[0] != seeds[1];
+  printf("distributed: %d passes from %u workers with %s seeds, "
+	 "%d workers exited cleanly\n\n", img.get_paints_started(),
+	 (unsigned int)seeds.size(), distinct ? "distinct" : "SHARED",
+	 exited_ok);
+}
+
 int main() {
+  test_random();
   test_gaussian();
+  test_sampler();
   test_fresnel();
+  test_material_tables();
+  test_material_pdf(1.0);
+  test_material_pdf(0.3);
+  test_csg();
+  test_hit_queries();
+  test_arena();
+  test_watertight();
+  test_bvh_depth();
+  test_mesh_load();
+  test_scene_file();
+  test_checkpoint();
+  test_denoise();
+  test_spectrum();
+  test_tone_curve();
+  test_scheduler();
+  test_render_stats();
+  test_distributed();
   return 0;
 }
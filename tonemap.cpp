@@ -0,0 +1,108 @@
+#include <cmath>
+#include <cstring>
+
+#include <assert.h>
+#include <stdint.h>
+
+#include "tonemap.h"
+#include "linalg.h"
+
+namespace {
+  uint32_t float_bits(float x) {
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits;
+  }
+
+  float bits_float(uint32_t bits) {
+    float x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+  }
+}
+
+unsigned char ToneCurve::exact(float x) {
+  Colourd const c = Colourd(x, x, x).expose(1.0).to_srgb().to_byte();
+  return (unsigned char)c.r();
+}
+
+ToneCurve::ToneCurve()
+  : min_range(float_bits(ldexpf(1.0f, min_exponent)) >> shift)
+{
+  uint32_t const min_bits = float_bits(ldexpf(1.0f, min_exponent));
+  uint32_t const max_bits = float_bits(ldexpf(1.0f, min_exponent + octaves));
+  assert(exact(bits_float(min_bits)) == 0);
+  assert(exact(bits_float(max_bits)) == 255);
+
+  // Positive floats are ordered the same as their bits, so the start of
+  // each step can be found by bisecting the bits
+  starts[0] = 0;
+  for (int k = 1 ; k < 256 ; ++k) {
+    uint32_t low = min_bits, high = max_bits;
+    while (low < high) {
+      uint32_t const middle = low + (high - low) / 2;
+      if (exact(bits_float(middle)) >= k)
+	high = middle;
+      else
+	low = middle + 1;
+    }
+    starts[k] = bits_float(low);
+  }
+  starts[256] = NAN;
+
+  for (int i = 0 ; i < ranges ; ++i) {
+    uint32_t const begin = min_bits + ((uint32_t)i << shift);
+    uint32_t const end = begin + (1u << shift);
+    unsigned char const k = exact(bits_float(begin));
+    first[i] = k;
+    // The range must not reach the step after the next one
+    assert(k >= 254 || float_bits(starts[k + 2]) >= end);
+    (void)end;
+  }
+}
+
+// Without __restrict, the compiler has to assume that writing a byte
+// may change the table, and doesn't vectorize
+void ToneCurve::map(float const * __restrict x,
+		    unsigned char * __restrict bytes,
+		    unsigned int count) const {
+  for (unsigned int i = 0 ; i < count ; ++i)
+    bytes[i] = (*this)(x[i]);
+}
+
+// Works through the pixels in blocks that stay in the first level cache,
+// with loops free of branches over float planes: the scales of the
+// pixels, the products of their channels and the bytes of those
+void ToneCurve::map_means(Colourd const * __restrict sums,
+			  unsigned int const * __restrict counts,
+			  double exposure, unsigned char * __restrict bytes,
+			  unsigned int count) const {
+  const static unsigned int block = 256;
+  float scale[block], products[3 * block];
+  float const e = exposure;
+  for (unsigned int begin = 0 ; begin < count ; begin += block) {
+    unsigned int const n = count - begin < block ? count - begin : block;
+    for (unsigned int i = 0 ; i < n ; ++i) {
+      unsigned int const samples = counts[begin + i];
+      // A pixel without samples divides by one and is then zeroed
+      scale[i] = e / (float)(samples + (samples == 0)) * (samples != 0);
+    }
+    Colourd const *s = sums + begin;
+    for (unsigned int i = 0 ; i < n ; ++i) {
+      products[3 * i] = (float)s[i].x * scale[i];
+      products[3 * i + 1] = (float)s[i].y * scale[i];
+      products[3 * i + 2] = (float)s[i].z * scale[i];
+    }
+    map(products, bytes + 3 * begin, 3 * n);
+  }
+}
+
+ToneCurve const& ToneCurve::get() {
+  static ToneCurve const curve;
+  return curve;
+}
+
+namespace {
+  // Build it before main(), so that the first image shown doesn't wait
+  ToneCurve const &built = ToneCurve::get();
+}
@@ -0,0 +1,78 @@
+#ifndef PATHTRACE_TONEMAP_H
+#define PATHTRACE_TONEMAP_H
+
+#include <cstring>
+
+#include <stdint.h>
+
+#include "linalg.h"
+
+/* The curve from linear radiance to 8-bit sRGB of Colour::expose(),
+ * to_srgb() and to_byte(), as a table instead of an exp and a pow for
+ * every channel of every pixel.
+ *
+ * The curve is a staircase over radiance times exposure, so the table
+ * splits that product by the bits of its float representation into
+ * ranges small enough to hold at most one step each. A range gives the
+ * byte at its start, and one comparison with the product where the next
+ * byte starts gives the exact byte of the float product. */
+class ToneCurve {
+private:
+  // The ranges cover the products from 2^min_exponent, below which the
+  // byte is zero, to 2^(min_exponent + octaves), above which it is 255
+  const static int min_exponent = -14;
+  const static int octaves = 17;
+  // Ranges per octave, as a number of bits of the mantissa
+  const static int range_bits = 8;
+  const static int ranges = octaves << range_bits;
+  const static int shift = 23 - range_bits;
+
+  int32_t min_range;
+  // The byte at the start of each range. int instead of char, so that
+  // vectorized loops can gather them.
+  int32_t first[ranges];
+  // starts[k] is the smallest product that gives byte k. starts[256] is
+  // NaN, which no product is above, not even infinity.
+  float starts[257];
+
+  static unsigned char exact(float x);
+
+  ToneCurve();
+  ToneCurve(ToneCurve const &);
+  ToneCurve& operator=(ToneCurve const &);
+
+public:
+  /* The table, built when the program starts */
+  static ToneCurve const& get();
+
+  /* The byte of radiance times exposure. Negative products and NaN give
+   * zero. Free of branches, so that loops over it can be vectorized. */
+  unsigned char operator()(float x) const {
+    int32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    // Negative numbers have the sign bit set and end up in the first
+    // range, and NaNs are above infinity in the last one
+    int32_t range = (bits >> shift) - min_range;
+    range = range < 0 ? 0 : range;
+    range = range < ranges - 1 ? range : ranges - 1;
+    int32_t const k = first[range];
+    return (k + (x >= starts[k + 1])) & -(int32_t)(x == x);
+  }
+
+  /* Maps count products to bytes */
+  void map(float const *x, unsigned char *bytes, unsigned int count) const;
+
+  /* Maps the means of count pixels, given as sums of samples and sample
+   * counts, times exposure to three bytes each. Pixels without samples
+   * are black. */
+  void map_means(Colourd const *sums, unsigned int const *counts,
+		 double exposure, unsigned char *bytes,
+		 unsigned int count) const;
+};
+
+/*
+Local Variables:
+mode:c++
+End:
+*/
+#endif /* PATHTRACE_TONEMAP_H */
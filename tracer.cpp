@@ -1,5 +1,4 @@
 #include <vector>
-#include <cstdlib>
 
 #include <assert.h>
 
@@ -7,114 +6,244 @@
 #include "linalg.h"
 #include "material.h"
 #include "shapes.h"
+#include "scene.h"
+#include "emitter.h"
 
-void Image::blit_to(Glib::RefPtr<Gdk::Pixbuf> &pb, double exposure) {
-  assert(width == (unsigned)pb->get_width());
-  assert(height == (unsigned)pb->get_height());
-
-  guint8 *pixels = pb->get_pixels();
-
-  for (unsigned int y = 0 ; y < height ; ++y) {
-    unsigned int row = y * pb->get_rowstride();
-    for (unsigned int x = 0 ; x < width ; ++x) {
-      Colour col = data[y * width + x];
-      col /= paints_started;
-      col = col.expose(exposure).to_srgb().to_byte();
-      pixels[row + x * 3] = col.r();
-      pixels[row + x * 3 + 1] = col.g();
-      pixels[row + x * 3 + 2] = col.b();
-    }
-  }
+Colour Tracer::trace(Ray const &ray, Features *features) {
+  HitRecord hit;
+  stats.primary_rays++;
+  Object const *hitobj = scene.closest(ray, hit, &stats);
+  return trace(ray, hitobj, hit, features);
 }
 
-void Image::blit_variance(Glib::RefPtr<Gdk::Pixbuf> &pb) {
-  assert(width == (unsigned)pb->get_width());
-  assert(height == (unsigned)pb->get_height());
-
-  guint8 *pixels = pb->get_pixels();
-
-  for (unsigned int y = 0 ; y < height ; ++y) {
-    unsigned int row = y * pb->get_rowstride();
-    for (unsigned int x = 0 ; x < width ; ++x) {
-      double v = variance(x, y);
-      Colour col(v, v, v);
-      Colour col2 = col.to_srgb();
-      col = col2.to_byte();
-      pixels[row + x * 3] = col.r();
-      pixels[row + x * 3 + 1] = col.g();
-      pixels[row + x * 3 + 2] = col.b();
-    }
-  }
+/* Multiple importance sampling weight for a sample drawn with density
+ * pdf, when other_pdf is the density of the other way to find it */
+static double power_heuristic(double pdf, double other_pdf) {
+  double const a = pdf * pdf;
+  double const b = other_pdf * other_pdf;
+  return a + b > 0 ? a / (a + b) : 0;
 }
 
-Colour Tracer::trace(Ray &ray, int bounces, int maxbounces) {
-  //const static int maxbounces = 6;
-  if (bounces >= maxbounces) {
-    Colour ret(0, 0, 0);
-    return ret;
-  }
+Double4 Tracer::sample_light(Ray const &ray, Hit const &hit,
+			     Material const &material, Wavelengths const &w) {
+  Double4 light(0.0);
+  std::vector<Emitter> const &emitters = scene.get_emitters();
+  if (emitters.empty())
+    return light;
+  unsigned int pick = sampler->uniform() * emitters.size();
+  if (pick >= emitters.size())
+    pick = emitters.size() - 1;
+  Emitter const &emitter = emitters[pick];
+
+  Vector3d const point = ray.at(hit.distance);
+  EmitterSample s;
+  if (!emitter.sample(point, *sampler, s))
+    return light;
+  double const light_pdf = s.pdf / emitters.size();
+  double const bounce_pdf = material.pdf(ray, hit.normal, s.direction);
+  if (bounce_pdf <= 0 || light_pdf <= 0)
+    return light;
+  // Stop short of the emitter itself
+  stats.shadow_rays++;
+  if (scene.occluded(Ray(point, s.direction), s.distance * (1 - 1e-6),
+		     &stats))
+    return light;
 
-  Hit hitdist;
-  Object const *hitobj = 0;
-  for (std::vector<Object>::const_iterator i = scene.objects.begin() ;
-       i != scene.objects.end() ; ++i) {
-    Hit dist = (*i).shape->intersect(ray);
-    if (dist.is_hit() && (!hitobj || dist.distance < hitdist.distance)) {
-      hitdist = dist;
-      hitobj = &(*i);
+  light = w.spectrum(scene.objects[emitter.object].material->emission) *
+    w.spectrum(material.colour);
+  return light * Double4(bounce_pdf / light_pdf / (M_PI * M_PI) *
+			 power_heuristic(light_pdf, bounce_pdf) *
+			 exp(-s.distance / scene.mean_free_path));
+}
+
+Colour Tracer::trace(Ray const &first_ray, Object const *hitobj,
+		     HitRecord const &first_hit, Features *features) {
+  if (features) {
+    *features = Features();
+    if (hitobj) {
+      Material const &material = *hitobj->material;
+      Vector3 normal = scene.normal(first_ray, *hitobj, first_hit);
+      if (normal.dot(first_ray.direction) > 0)
+	normal = -normal;
+      // Lights have no colour of their own, but they aren't black either
+      features->albedo = material.colour.is_zero() ? Colourd(1, 1, 1) :
+	Colourd(material.colour);
+      features->normal = normal;
+      features->depth = first_hit.distance;
+    }
+    else {
+      features->normal = -first_ray.direction;
     }
   }
 
-  if (!hitobj) {
-    Colour ret(0, 0, 0);
-    return ret;
-  }
+  // The wavelengths are the first number of the path after the camera
+  // ray
+  Wavelengths w = spectral ? Wavelengths(sampler->uniform()) :
+    Wavelengths();
+  // Light found so far, and the fraction of light at the current vertex
+  // that makes it back to the start of the path, in the lanes of w
+  Double4 radiance(0.0);
+  Double4 throughput = w.spectrum(Colour(1, 1, 1));
+  Ray ray = first_ray;
+  HitRecord hitdist = first_hit;
+  // Where the last bounce was from, if lights were sampled there. Its
+  // density is only needed if it hits an emitter.
+  Material const *bounce_material = 0;
+  Ray bounce_ray = Ray::InvalidRay();
+  Vector3 bounce_normal;
 
-  Colour ret;
-  double free_distance = -scene.mean_free_path * log(((double)random() + 1) / RAND_MAX);
-  if (free_distance < hitdist.distance) {
-    Ray newray(ray, free_distance, Vector3::uniform_random());
-    ret = trace(newray, bounces + 1, maxbounces);
-  } else {
-    if (!hitobj->material->colour.is_zero()) {
-      Ray newray = hitobj->material->bounce(ray, hitdist.normal, hitdist.distance);
-      if (newray.valid) ret = trace(newray, bounces + 1, maxbounces);
-      if (hitobj->material->opaque)
-	ret *= hitobj->material->colour;
+  int bounces = 0;
+  while (hitobj) {
+    Material const &material = *hitobj->material;
+    double free_distance =
+      -scene.mean_free_path * log(sampler->uniform_open());
+    if (free_distance < hitdist.distance) {
+      ray = Ray(ray, free_distance, Vector3::uniform_random(*sampler));
+      bounce_material = 0;
     }
-    ret *= ray.filter;
-    ret += hitobj->material->emission / (M_PI * M_PI);
-    if (!hitobj->material->opaque) {
-      double const d = hitdist.distance;
-      ret *= Colour(exp(-ray.opacity.r() * d), exp(-ray.opacity.g() * d), exp(-ray.opacity.b() * d));
+    else {
+      if (!material.opaque && !ray.opacity.is_zero()) {
+	double o[Wavelengths::lanes];
+	(w.spectrum(ray.opacity) * Double4(-hitdist.distance)).store(o);
+	throughput = throughput * Double4(exp(o[0]), exp(o[1]), exp(o[2]),
+					  exp(o[3]));
+      }
+      if (!material.emission.is_zero()) {
+	Double4 emitted = w.spectrum(material.emission) * throughput *
+	  Double4(1 / (M_PI * M_PI));
+	Emitter const *emitter = scene.emitter(hitobj);
+	if (bounce_material && emitter) {
+	  double const bounce_pdf =
+	    bounce_material->pdf(bounce_ray, bounce_normal, ray.direction);
+	  double const light_pdf =
+	    emitter->pdf(ray.origin, ray.direction, hitdist.distance) /
+	    scene.get_emitters().size();
+	  emitted = emitted * Double4(power_heuristic(bounce_pdf, light_pdf));
+	}
+	radiance = radiance + emitted;
+      }
+      if (material.colour.is_zero())
+	break;
+
+      // Only now that the ray bounces off the surface is its normal needed
+      Hit const hit(hitdist.distance, scene.normal(ray, *hitobj, hitdist));
+      bounce_material = 0;
+      if (light_sampling && material.opaque && !material.is_specular()) {
+	radiance = radiance + sample_light(ray, hit, material, w) * throughput;
+	bounce_material = &material;
+	bounce_ray = ray;
+	bounce_normal = hit.normal;
+      }
+      Double4 filter(1.0);
+      Ray newray = material.bounce(ray, hit.normal, hit.distance, *sampler,
+				   w, filter);
+      if (!newray.valid) {
+	stats.invalid_bounces++;
+	break;
+      }
+      stats.valid_bounces++;
+      throughput = throughput * filter;
+      if (material.opaque)
+	throughput = throughput * w.spectrum(material.colour);
+      ray = newray;
     }
+
+    if (++bounces >= max_bounces)
+      break;
+    if (bounces > roulette_depth) {
+      double t[Wavelengths::lanes];
+      throughput.store(t);
+      double survival = t[0];
+      for (int i = 1 ; i < Wavelengths::lanes ; ++i)
+	if (t[i] > survival) survival = t[i];
+      if (survival < 1.0) {
+	if (sampler->uniform() >= survival)
+	  break;
+	throughput = throughput / Double4(survival);
+      }
+    }
+    stats.secondary_rays++;
+    hitobj = scene.closest(ray, hitdist, &stats);
   }
-  return ret;
+  stats.add_path(bounces);
+  return w.colour(radiance);
 }
 
-void Tracer::traceImage(Image &img) {
-  double dx = (double)random() / RAND_MAX;
-  double dy = (double)random() / RAND_MAX;
+void Tracer::traceTile(Tile const &tile, unsigned int width,
+		       unsigned int height, unsigned int const *counts,
+		       unsigned int const *firsts, PixelSamples *out) {
+  unsigned int const tile_width = tile.width();
+  for (unsigned int i = 0 ; i < tile.size() ; ++i)
+    out[i] = PixelSamples();
+  // Camera rays of blocks of two rows of pixels, 2x2 or 4x2 as packets
+  // are wide, go through the scene as one packet
+  unsigned int const block_width = RayPacket::size / 2;
+  std::vector<Ray> rays(RayPacket::size, Ray::InvalidRay());
+  for (unsigned int y = tile.y0 ; y < tile.y1 ; y += 2) {
+    for (unsigned int x = tile.x0 ; x < tile.x1 ; x += block_width) {
+      unsigned int block[RayPacket::size];
+      int block_size = 0;
+      unsigned int most = 0;
+      for (unsigned int py = y ; py < y + 2 && py < tile.y1 ; ++py) {
+	for (unsigned int px = x ; px < x + block_width && px < tile.x1 ;
+	     ++px) {
+	  unsigned int const p = (py - tile.y0) * tile_width + (px - tile.x0);
+	  block[block_size++] = p;
+	  if (counts[p] > most)
+	    most = counts[p];
+	}
+      }
 
-  img.paint_start();
-  camera.paint_start();
+      for (unsigned int sample = 0 ; sample < most ; ++sample) {
+	unsigned int pos[RayPacket::size];
+	int count = 0;
+	for (int b = 0 ; b < block_size ; ++b) {
+	  unsigned int const p = block[b];
+	  if (counts[p] <= sample) continue;
+	  unsigned int const px = tile.x0 + p % tile_width;
+	  unsigned int const py = tile.y0 + p / tile_width;
+	  double dx, dy, lens_u, lens_v;
+	  sampler->start(px, py, firsts[p] + sample);
+	  sampler->uniform2(dx, dy);
+	  sampler->uniform2(lens_u, lens_v);
+	  rays[count] = camera.get_ray((px + dx) / width, (py + dy) / height,
+				       lens_u, lens_v);
+	  pos[count] = p;
+	  count++;
+	}
+
+	RayPacket packet(&rays[0], count);
+	Object const *objects[RayPacket::size];
+	HitRecord hits[RayPacket::size];
+	stats.primary_rays += count;
+	scene.closest(packet, &rays[0], objects, hits, &stats);
+	for (int i = 0 ; i < count ; ++i) {
+	  // Back to the sample of the pixel, after its camera ray
+	  unsigned int const p = pos[i];
+	  sampler->start(tile.x0 + p % tile_width, tile.y0 + p / tile_width,
+			 firsts[p] + sample, camera_dimensions);
+	  Features f;
+	  Colour const col = trace(rays[i], objects[i], hits[i], &f);
+	  out[p].add(col, f);
+	}
+      }
+    }
+  }
+}
+
+void Tracer::traceImage(Image &img) {
   for (unsigned int y = 0 ; y < img.height ; ++y) {
     for (unsigned int x = 0 ; x < img.width ; ++x) {
-      /*
-      double variance = img.variance(x, y);
+      double dx, dy, lens_u, lens_v;
+      sampler->start(x, y, img.sample_count(x, y));
+      sampler->uniform2(dx, dy);
+      sampler->uniform2(lens_u, lens_v);
       Ray ray = camera.get_ray((x + dx) / img.width,
-			       (y + dy) / img.height);
-      Colour col;
-      int num_steps = variance * 16 + 1;
-      for (int i = 0 ; i < num_steps ; ++i)
-	col += trace(ray, 0);
-      col /= num_steps;
-      img.add(x, y, col);
-      */
-      Ray ray = camera.get_ray((x + dx) / img.width,
-			       (y + dy) / img.height);
-      Colour col = trace(ray, 0, 8);
-      img(x, y) = col;
+			       (y + dy) / img.height, lens_u, lens_v);
+      Features f;
+      Colour col = trace(ray, &f);
+      img.add(x, y, col, f);
     }
   }
+  img.paint_start();
 }
@@ -1,117 +1,149 @@
 #ifndef PATHTRACE_TRACER_H
 #define PATHTRACE_TRACER_H
 
-#include <gtkmm.h>
-#include <assert.h>
+#include <vector>
 #include <math.h>
 
 #include "linalg.h"
+#include "image.h"
 #include "material.h"
 #include "shapes.h"
 #include "camera.h"
-
-class Image {
+#include "scene.h"
+#include "sampler.h"
+#include "spectrum.h"
+#include "stats.h"
+
+/* A Tracer holds the per-thread state of rendering: its own copy of the
+ * camera, its own Sampler and its own counts of the work done. Give each
+ * render thread a copy made with a different stream number. */
+class Tracer {
 private:
-  Colour *data;
-  double *variance_t;
-  int paints_started;
+  Scene &scene;
+  Camera camera;
+  uint64_t seed;
+  Sampler *sampler;
+  int roulette_depth;
+  int max_bounces;
+  bool light_sampling;
+  bool spectral;
+  RenderStats stats;
+
+  // A plain copy would repeat the random numbers of the original
+  Tracer(Tracer const &);
+
+  /* Light arriving at the hit directly from a randomly picked emitter and
+   * reflected back along the ray, weighted for combining with the light
+   * found by bouncing */
+  Double4 sample_light(Ray const &ray, Hit const &hit,
+		       Material const &material, Wavelengths const &w);
 
 public:
-  unsigned int width, height;
-
-  void blit_to(Glib::RefPtr<Gdk::Pixbuf> &pb, double exposure);
-  void blit_variance(Glib::RefPtr<Gdk::Pixbuf> &pb);
-
-  Image(unsigned int width, unsigned int height)
-    : paints_started(0), width(width), height(height)
+  const static int default_roulette_depth = 3;
+  const static int default_max_bounces = 64;
+  const static Sampler::Kind default_sampler = Sampler::sobol_sampler;
+  // Numbers of a sample taken for the camera ray: the position within
+  // the pixel and on the lens
+  const static unsigned int camera_dimensions = 4;
+
+  Tracer(Scene &scene, Camera const &camera, uint64_t seed = 0)
+    : scene(scene), camera(camera), seed(seed),
+      sampler(Sampler::create(default_sampler, seed, 0)),
+      roulette_depth(default_roulette_depth),
+      max_bounces(default_max_bounces), light_sampling(false),
+      spectral(false)
   {
-    data = new Colour[width * height];
-    variance_t = new double[width * height];
-    for (unsigned int i = 0 ; i < width * height ; ++i)
-      variance_t[i] = 1.0;
+    if (!scene.is_built())
+      scene.build();
   }
 
-  const Colour& operator()(unsigned int x, unsigned int y) const {
-    assert(x < width && y < height);      
-    return data[y * width + x];
-  }
+  Tracer(Tracer const &other, uint64_t stream)
+    : scene(other.scene), camera(other.camera), seed(other.seed),
+      sampler(Sampler::create(other.sampler->kind(), other.seed, stream)),
+      roulette_depth(other.roulette_depth),
+      max_bounces(other.max_bounces), light_sampling(other.light_sampling),
+      spectral(other.spectral)
+  { }
 
-  Colour& operator()(unsigned int x, unsigned int y) {
-    assert(x < width && y < height);
-    return data[y * width + x];
+  ~Tracer() {
+    delete sampler;
   }
 
-  void add(unsigned int x, unsigned int y, Colour const &col) {
-    this->operator()(x, y) += col;
-    /*
-    Colour diff = this->operator()(x, y);
-    diff /= paints_started;
-    diff -= col;
-    variance_t[y * width + x] += fmax(fabs(diff.r()), fmax(fabs(diff.g()), fabs(diff.b())));
-    */
+  /* Paths of more than roulette_depth bounces are ended at random with
+   * Russian roulette, and the survivors weighted up to keep the result
+   * unbiased. max_bounces is a hard limit for paths that never lose
+   * energy, like those caught inside clear glass. */
+  void set_depth(int roulette_depth, int max_bounces) {
+    this->roulette_depth = roulette_depth;
+    this->max_bounces = max_bounces;
   }
 
-  void add(Image const &other) {
-    for (unsigned int y = 0 ; y < height ; ++y) {
-      for (unsigned int x = 0 ; x < width ; ++x) {
-	data[y * width + x] += other.data[y * width + x];
-      }
-    }
-    paints_started++;
+  /* With light sampling on, every bounce off a non-specular surface also
+   * sends a shadow ray towards a random point on an emitter, and the two
+   * ways of finding light are combined with multiple importance
+   * sampling. Off, the default, lights are only found by bouncing into
+   * them. In the example scene, light sampling takes about twice as long
+   * per pass for about a third less variance, so it only pays off for
+   * scenes with small lights. */
+  void set_light_sampling(bool enabled) {
+    light_sampling = enabled;
   }
 
-  double variance(unsigned int x, unsigned int y) const {
-    return variance_t[y * width + x] / paints_started;
+  bool get_light_sampling() const {
+    return light_sampling;
   }
 
-  void paint_start() {
-    paints_started++;
+  /* Where the random numbers of the paths come from. Low-discrepancy
+   * sampling reaches the same noise in fewer passes than random
+   * sampling, and by default the pixel position, the lens and the first
+   * bounces are sampled that way. Tracers copied from this one use the
+   * same kind. */
+  void set_sampler(Sampler::Kind kind) {
+    delete sampler;
+    sampler = Sampler::create(kind, seed, 0);
   }
 
-  int get_paints_started() {
-    return paints_started;
+  Sampler::Kind get_sampler() const {
+    return sampler->kind();
   }
-};
-
-class Object {
-public:
-  Shape *shape;
-  Material *material;
 
-  Object(Shape const &shape, Material const &material)
-    : shape(shape.clone()), material(material.clone())
-  { }
-};
-
-class Scene {
-public:
-  std::vector<Object> objects;
-  double mean_free_path;
-
-  Scene()
-    : mean_free_path(INFINITY)
-  { }
-
-  void add(Object const &o) {
-    objects.push_back(o);
+  /* In spectral mode, every path carries light at four wavelengths
+   * instead of red, green and blue (see Wavelengths), so that thin
+   * films and dispersive glass get their colours right. It costs a
+   * little more per path and changes the colours of coloured light
+   * bouncing off coloured surfaces a little. */
+  void set_spectral(bool enabled) {
+    spectral = enabled;
   }
-};
 
-class Tracer {
-private:
-  Scene &scene;
-  Camera &camera;
+  bool is_spectral() const {
+    return spectral;
+  }
 
-public:
-  Tracer(Scene &scene, Camera &camera)
-    : scene(scene), camera(camera)
-  { }
+  /* The work done since the counts were last cleared */
+  RenderStats const& get_stats() const {
+    return stats;
+  }
 
-  Tracer(Tracer const &other)
-    : scene(other.scene), camera(other.camera)
-  { }
+  void clear_stats() {
+    stats.clear();
+  }
 
-  Colour trace(Ray &ray, int bounces, int maxbounces);
+  /* Follows a path starting with the ray and returns the light it brings
+   * back to the ray's origin. If features isn't 0, it is set to the
+   * features of the first hit. */
+  Colour trace(Ray const &ray, Features *features = 0);
+  /* The same for a ray whose first intersection with the scene is
+   * already known. hitobj is 0 if the ray didn't hit anything. */
+  Colour trace(Ray const &ray, Object const *hitobj, HitRecord const &hit,
+	       Features *features = 0);
+  /* Traces counts[i] samples for each pixel of the tile of a width x
+   * height image, numbered from firsts[i] on among the samples of the
+   * pixel. Counts, firsts and out all go row by row over the tile. */
+  void traceTile(Tile const &tile, unsigned int width, unsigned int height,
+		 unsigned int const *counts, unsigned int const *firsts,
+		 PixelSamples *out);
+  /* Adds one sample to every pixel of the image */
   void traceImage(Image &img);
 };
 